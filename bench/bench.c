@@ -0,0 +1,535 @@
+// Front-end throughput benchmarks.
+//
+//   make bench
+//   ./mycc_bench lexer [input.c | --synthetic MB | --commented MB] [iterations]
+//   ./mycc_bench compile [input.c | --synthetic MB] [iterations]
+//   ./mycc_bench lexer-scaling [input.c | --synthetic MB] [max_threads]
+//   ./mycc_bench parse-scaling [input.c | --synthetic MB] [max_threads]
+//   ./mycc_bench preprocess [sources] [header_KB]
+//   ./mycc_bench parse-function [statements] [iterations]
+//   ./mycc_bench flat-ast [nodes] [iterations]
+//   ./mycc_bench reparse [functions] [edits]
+//
+// Without an input file a synthetic translation unit of the requested size is
+// generated in memory so runs are reproducible. --commented prefixes every
+// function with a vendor-header style doc block, so most bytes are comments.
+// MYCC_SCAN=avx2|sse2|scalar forces the blank/comment scanner implementation.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lexer.h"
+#include "scan.h"
+#include "intern.h"
+#include "parser.h"
+#include "preproc.h"
+#include "codegen.h"
+#include "utils.h"
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Appends one synthetic function (roughly 600 bytes) to buf.
+static size_t emit_function(char *buf, size_t cap, int n) {
+    return (size_t)snprintf(buf, cap,
+        "// helper %d: sums a window of values\n"
+        "int helper_%d(int a, int b, int c) {\n"
+        "    int total = 0; /* running sum */\n"
+        "    int i;\n"
+        "    for (i = 0; i < a; i++) {\n"
+        "        total = total + (b * i) - c / 3 + %d;\n"
+        "        if (total >= 1000 && b != 0 || c <= -1) {\n"
+        "            total = total >> 1;\n"
+        "        }\n"
+        "    }\n"
+        "    char *name = \"helper_%d\";\n"
+        "    char tag = 'x';\n"
+        "    while (total > 10) { total = total - 7; }\n"
+        "    return total + sizeof(int) + 3.25;\n"
+        "}\n\n",
+        n, n, n % 97, n);
+}
+
+// Appends a doc comment of roughly 1.2 KB, indented like vendor headers.
+static size_t emit_doc_comment(char *buf, size_t cap, int n) {
+    size_t len = (size_t)snprintf(buf, cap, "/**\n * helper_%d\n *\n", n);
+    for (int i = 0; i < 14 && len < cap; i++) {
+        len += (size_t)snprintf(buf + len, cap - len,
+            " *   Licensed under the terms of the accompanying notice; line %d.\n", i);
+    }
+    len += (size_t)snprintf(buf + len, cap - len,
+        " *\n *   @param a  window length\n *   @return  the clamped total\n */\n");
+    return len;
+}
+
+// Appends a function the whole pipeline accepts, with many locals so that
+// codegen's name lookups dominate.
+static size_t emit_compile_function(char *buf, size_t cap, int n) {
+    size_t len = (size_t)snprintf(buf, cap, "int f_%d(int a, int b, int c) {\n", n);
+    for (int i = 0; i < 24 && len < cap; i++) {
+        len += (size_t)snprintf(buf + len, cap - len,
+            "    int v%d = a + %d - (b << 1) + c;\n", i, i);
+    }
+    len += (size_t)snprintf(buf + len, cap - len,
+        "    while (v0 < a) { v0 = v0 + v23 - v12; v5 = v5 ^ v7; }\n"
+        "    if (v3 > v4 && v9 != 0) { v1 = v2 | v3; } else { v1 = v2 & v3; }\n"
+        "    return v0 + v1 + v5 + v22;\n"
+        "}\n\n");
+    return len;
+}
+
+static char *gen_compile_input(size_t bytes) {
+    char *buf = malloc(bytes + 4096);
+    if (!buf) return NULL;
+    size_t len = 0;
+    for (int n = 0; len < bytes; n++) {
+        len += emit_compile_function(buf + len, bytes + 4096 - len, n);
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+static char *gen_synthetic(size_t bytes, int commented) {
+    char *buf = malloc(bytes + 1024);
+    if (!buf) return NULL;
+    size_t len = 0;
+    for (int n = 0; len < bytes; n++) {
+        if (commented) len += emit_doc_comment(buf + len, bytes + 1024 - len, n);
+        len += emit_function(buf + len, bytes + 1024 - len, n);
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+static void bench_lexer(char *input, int iterations) {
+    size_t bytes = strlen(input);
+    size_t tokens = 0;
+    double best = 1e30;
+    for (int it = 0; it < iterations; it++) {
+        double t0 = now_sec();
+        TokenStream ts = lexer(input);
+        double dt = now_sec() - t0;
+        tokens = (size_t)ts.count;
+        freeTokenStream(&ts);
+        if (dt < best) best = dt;
+    }
+    printf("lexer (%s scanner): %zu bytes, %zu tokens, best of %d: %.3f ms\n",
+           scanImplName(), bytes, tokens, iterations, best * 1e3);
+    printf("lexer: %.2f Mtokens/sec, %.2f MB/sec\n",
+           (double)tokens / best / 1e6, (double)bytes / best / (1024.0 * 1024.0));
+}
+
+// Lexes the same input with 1, 2, 4, ... max_threads threads. Speedup is
+// bounded by the cores actually available.
+static void bench_lexer_scaling(char *input, int max_threads) {
+    size_t bytes = strlen(input);
+    double base = 0;
+    printf("lexer scaling: %zu bytes, %ld cores online\n", bytes, sysconf(_SC_NPROCESSORS_ONLN));
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double best = 1e30;
+        int tokens = 0;
+        for (int it = 0; it < 3; it++) {
+            double t0 = now_sec();
+            TokenStream ts = lexerParallel(input, bytes, threads);
+            double dt = now_sec() - t0;
+            tokens = ts.count;
+            freeTokenStream(&ts);
+            if (dt < best) best = dt;
+        }
+        if (threads == 1) base = best;
+        printf("  %2d threads: %9.3f ms, %7.2f MB/sec, %d tokens, speedup %.2fx\n",
+               threads, best * 1e3, (double)bytes / best / (1024.0 * 1024.0), tokens,
+               base / best);
+    }
+}
+
+// Parses one token list with parse_program_parallel at 1, 2, 4... threads.
+static void bench_parse_scaling(char *input, int max_threads) {
+    TokenStream ts = lexer(input);
+    double base = 0;
+    printf("parse scaling: %d tokens, %ld cores online\n", ts.count, sysconf(_SC_NPROCESSORS_ONLN));
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double best = 1e30;
+        size_t nodes = 0;
+        for (int it = 0; it < 3; it++) {
+            double t0 = now_sec();
+            ASTNode *root = parse_program_parallel(&ts, threads);
+            double dt = now_sec() - t0;
+            nodes = parser_arena()->allocs;
+            if (parser_error_count()) {
+                fprintf(stderr, "input has syntax errors\n");
+                exit(1);
+            }
+            free_ast(root);
+            if (dt < best) best = dt;
+        }
+        if (threads == 1) base = best;
+        printf("  %2d threads: %9.3f ms, %zu allocations, speedup %.2fx\n",
+               threads, best * 1e3, nodes, base / best);
+    }
+    freeTokenStream(&ts);
+}
+
+// Times each front-end phase separately; best of `iterations` per phase.
+static void bench_compile(char *input, int iterations) {
+    double best_lex = 1e30, best_parse = 1e30, best_gen = 1e30, best_pull = 1e30;
+    for (int it = 0; it < iterations; it++) {
+        double t0 = now_sec();
+        TokenStream ts = lexer(input);
+        double t1 = now_sec();
+        ASTNode *root = parse_program(&ts);
+        double t2 = now_sec();
+        char *out = codegen(root);
+        double t3 = now_sec();
+        if (t1 - t0 < best_lex) best_lex = t1 - t0;
+        if (t2 - t1 < best_parse) best_parse = t2 - t1;
+        if (t3 - t2 < best_gen) best_gen = t3 - t2;
+        free(out);
+        free_ast(root);
+        freeTokenStream(&ts);
+
+        // Lexing and parsing fused through a reader, with no token list.
+        TokenReader reader;
+        tokenReaderInit(&reader, input, strlen(input));
+        t0 = now_sec();
+        root = parse_program_reader(&reader);
+        t1 = now_sec();
+        if (t1 - t0 < best_pull) best_pull = t1 - t0;
+        tokenReaderFree(&reader);
+        free_ast(root);
+    }
+    printf("compile: %zu bytes, best of %d\n", strlen(input), iterations);
+    printf("  lexer   %9.3f ms\n", best_lex * 1e3);
+    printf("  parser  %9.3f ms\n", best_parse * 1e3);
+    printf("  codegen %9.3f ms\n", best_gen * 1e3);
+    printf("  pulled  %9.3f ms  (lexer + parser through a TokenReader)\n", best_pull * 1e3);
+    printf("  atoms   %zu (%zu bytes)\n", intern_count(), intern_bytes());
+}
+
+// Parses one function with `statements` statements and calls of growing
+// arity, the worst case for child lists.
+static void bench_parse_function(int statements, int iterations) {
+    size_t cap = (size_t)statements * 96 + 256, len = 0;
+    char *input = malloc(cap);
+    len += (size_t)snprintf(input, cap, "int big(int a, int b) {\n    int x = 0;\n");
+    for (int i = 0; i < statements; i++) {
+        if (i % 4 == 3) {
+            len += (size_t)snprintf(input + len, cap - len,
+                                    "    x = f(x, a, b, %d, x + 1, a * b, %d);\n", i, i % 7);
+        } else {
+            len += (size_t)snprintf(input + len, cap - len,
+                                    "    x = x + (a * %d - b) / 3;\n", i % 97);
+        }
+    }
+    snprintf(input + len, cap - len, "    return x;\n}\n");
+
+    double best = 1e30;
+    size_t allocs = 0, bytes = 0;
+    for (int it = 0; it < iterations; it++) {
+        TokenStream ts = lexer(input);
+        size_t mallocs = parser_arena()->mallocs;
+        double t0 = now_sec();
+        ASTNode *root = parse_program(&ts);
+        double dt = now_sec() - t0;
+        if (dt < best) best = dt;
+        allocs = parser_arena()->allocs;
+        bytes = parser_arena()->bytes;
+        if (it == iterations - 1) {
+            printf("parse-function: %d statements, %zu bytes, best of %d: %.3f ms\n",
+                   statements, strlen(input), iterations, best * 1e3);
+            printf("  arena: %zu allocations, %zu bytes, %zu chunks malloc'd this run\n",
+                   allocs, bytes, parser_arena()->mallocs - mallocs);
+        }
+        free_ast(root);
+        freeTokenStream(&ts);
+    }
+    free(input);
+}
+
+// Memory per node of the parser's tree and of its flat form, and the time
+// to flatten and to generate code, on synthetic functions totalling about
+// `nodes` nodes.
+static size_t emit_codegen_function(char *buf, size_t cap, int n) {
+    return (size_t)snprintf(buf, cap,
+        "int fn_%d(int a, int b, int c) {\n"
+        "    int total = 0;\n"
+        "    int i;\n"
+        "    for (i = 0; i < a; i++) {\n"
+        "        total = total + (b * i) - c / 3 + %d;\n"
+        "        if (total >= 1000 && b != 0 || c <= -1) {\n"
+        "            total = total >> 1;\n"
+        "        }\n"
+        "    }\n"
+        "    char *name = \"fn_%d\";\n"
+        "    char tag = 'x';\n"
+        "    while (total > 10) { total = total - 7; }\n"
+        "    return total + fn_%d(a - 1, b, tag);\n"
+        "}\n\n",
+        n, n % 97, n, n > 0 ? n - 1 : 0);
+}
+
+static void bench_flat_ast(int nodes, int iterations) {
+    FlatAST flat;
+    char one[1024];
+    emit_codegen_function(one, sizeof(one), 0);
+    TokenStream ts = lexer(one);
+    ASTNode *root = parse_program(&ts);
+    flat_build(&flat, root);
+    int per_function = (int)flat.node_count - 2;  // less the null node and the root
+    flat_free(&flat);
+    free_ast(root);
+    freeTokenStream(&ts);
+
+    int functions = nodes / per_function + 1;
+    size_t cap = (size_t)functions * 700 + 64, len = 0;
+    char *input = malloc(cap);
+    for (int i = 0; i < functions; i++) len += emit_codegen_function(input + len, cap - len, i);
+    snprintf(input + len, cap - len, "int main() { return fn_0(3, 4, 5); }\n");
+
+    ts = lexer(input);
+    root = parse_program(&ts);
+    size_t tree_bytes = parser_arena()->bytes;
+    double best_flatten = 1e30, best_gen = 1e30;
+    for (int it = 0; it < iterations; it++) {
+        double t0 = now_sec();
+        flat_build(&flat, root);
+        double t1 = now_sec();
+        char *out = codegen_flat(&flat);
+        double t2 = now_sec();
+        if (t1 - t0 < best_flatten) best_flatten = t1 - t0;
+        if (t2 - t1 < best_gen) best_gen = t2 - t1;
+        free(out);
+        if (it < iterations - 1) flat_free(&flat);
+    }
+    double n = (double)(flat.node_count - 1);
+    printf("flat-ast: %u nodes in %d functions, best of %d\n", flat.node_count - 1, functions, iterations);
+    printf("  tree    %9.1f MB  %5.1f bytes/node (ASTNode is %zu bytes)\n",
+           tree_bytes / 1048576.0, tree_bytes / n, sizeof(ASTNode));
+    printf("  flat    %9.1f MB  %5.1f bytes/node (%zu per node, %u words of extra, %u atoms)\n",
+           flat_bytes(&flat) / 1048576.0, flat_bytes(&flat) / n, sizeof(FlatNode),
+           flat.extra_count, flat.atom_count);
+    printf("  flatten %9.3f ms\n", best_flatten * 1e3);
+    printf("  codegen %9.3f ms\n", best_gen * 1e3);
+    flat_free(&flat);
+    free_ast(root);
+    freeTokenStream(&ts);
+    free(input);
+}
+
+// Builds the file with each function whose versions[] entry is set changed
+// in one constant, as edits in an editor would.
+static size_t emit_edited_file(char *buf, size_t cap, int functions, const int *versions) {
+    size_t len = 0;
+    for (int i = 0; i < functions; i++) {
+        size_t at = len;
+        len += emit_codegen_function(buf + len, cap - len, i);
+        if (versions[i]) {
+            char *plus = strstr(buf + at, " + ");
+            plus = strstr(plus + 3, " + ");  // "... - c / 3 + <n>;"
+            len = at + (size_t)(plus - (buf + at));
+            len += (size_t)snprintf(buf + len, cap - len, " + %d;\n", 1000 + versions[i]);
+            char rest[1024];
+            emit_codegen_function(rest, sizeof(rest), i);
+            len += (size_t)snprintf(buf + len, cap - len, "%s", strstr(rest, "        if"));
+        }
+    }
+    len += (size_t)snprintf(buf + len, cap - len, "int main() { return fn_0(3, 4, 5); }\n");
+    return len;
+}
+
+static void bench_reparse(int functions, int edits) {
+    size_t cap = (size_t)functions * 700 + 64;
+    char *input = malloc(cap);
+    int *versions = calloc((size_t)functions, sizeof(int));
+    size_t len = emit_edited_file(input, cap, functions, versions);
+    int lines = 0;
+    for (size_t i = 0; i < len; i++) lines += input[i] == '\n';
+
+    ParseSession *s = parse_session_new();
+    double t0 = now_sec();
+    parse_session_update(s, input, len);
+    double first = now_sec() - t0;
+    double incremental = 0, full = 0;
+    size_t lexed = 0;
+    srand(1);
+    for (int e = 0; e < edits; e++) {
+        versions[rand() % functions] = e + 1;
+        len = emit_edited_file(input, cap, functions, versions);
+        t0 = now_sec();
+        ASTNode *root = parse_session_update(s, input, len);
+        incremental += now_sec() - t0;
+        ParseSessionStats st = parse_session_stats(s);
+        if (st.full || st.parsed != 1 || !root) {
+            fprintf(stderr, "edit %d was not incremental\n", e);
+            exit(1);
+        }
+        lexed += st.bytes_lexed;
+    }
+    parse_session_free(s);
+    for (int e = 0; e < edits; e++) {
+        versions[rand() % functions] = edits + e + 1;
+        len = emit_edited_file(input, cap, functions, versions);
+        t0 = now_sec();
+        TokenStream ts = lexer(input);
+        ASTNode *root = parse_program(&ts);
+        full += now_sec() - t0;
+        free_ast(root);
+        freeTokenStream(&ts);
+    }
+    printf("reparse: %d functions, %d lines, %zu bytes, %d one-function edits\n",
+           functions, lines, len, edits);
+    printf("  first parse  %9.3f ms\n", first * 1e3);
+    printf("  full         %9.3f ms/edit\n", full / edits * 1e3);
+    printf("  incremental  %9.3f ms/edit (%zu bytes lexed per edit)\n",
+           incremental / edits * 1e3, lexed / (size_t)edits);
+    free(versions);
+    free(input);
+}
+
+static void write_text(const char *path, const char *text) {
+    FILE *f = fopen(path, "wb");
+    if (!f) { perror(path); exit(1); }
+    fputs(text, f);
+    fclose(f);
+}
+
+// Preprocesses `sources` small files in one process, each including the
+// same guarded header several times, the way a build compiles a project.
+static void bench_preprocess(int sources, int header_kb) {
+    char dir[] = "/tmp/mycc_benchXXXXXX";
+    if (!mkdtemp(dir)) { perror("mkdtemp"); exit(1); }
+    char path[256];
+    snprintf(path, sizeof(path), "%s/common.h", dir);
+    size_t cap = (size_t)header_kb * 1024 + 4096, len = 0;
+    char *text = malloc(cap);
+    len += (size_t)snprintf(text, cap, "#ifndef COMMON_H\n#define COMMON_H\n"
+                            "#define MAX(a, b) ((a) > (b) ? (a) : (b))\n");
+    for (int n = 0; len < (size_t)header_kb * 1024; n++) {
+        len += emit_function(text + len, cap - len, n);
+    }
+    snprintf(text + len, cap - len, "#endif\n");
+    write_text(path, text);
+    for (int i = 0; i < sources; i++) {
+        snprintf(path, sizeof(path), "%s/src%d.c", dir, i);
+        snprintf(text, cap, "#include \"common.h\"\n#include \"common.h\"\n#include \"common.h\"\n"
+                 "int f%d(int x) { return MAX(x, %d) + MAX(x * 2, 7); }\n", i, i);
+        write_text(path, text);
+    }
+
+    long tokens = 0;
+    double first = 0, t0 = now_sec();
+    for (int i = 0; i < sources; i++) {
+        snprintf(path, sizeof(path), "%s/src%d.c", dir, i);
+        Preprocessor *pp = ppOpen(path, 1);
+        if (!pp) exit(1);
+        Token tok;
+        do {
+            ppNext(pp, &tok);
+            tokens++;
+        } while (tok.kind != EOT);
+        ppClose(pp);
+        if (i == 0) first = now_sec() - t0;
+    }
+    double total = now_sec() - t0;
+    PPStats s = ppStats();
+    printf("preprocess: %d sources, %d KB guarded header included 3x each\n", sources, header_kb);
+    printf("  total   %9.3f ms, %ld tokens out\n", total * 1e3, tokens);
+    printf("  first   %9.3f ms  (reads and lexes the header)\n", first * 1e3);
+    if (sources > 1) printf("  others  %9.3f ms each\n", (total - first) / (sources - 1) * 1e3);
+    printf("  files read %d, headers lexed %d, includes %d, skipped by guard %d\n",
+           s.files_read, s.files_lexed, s.includes, s.includes_skipped);
+
+    for (int i = 0; i < sources; i++) {
+        snprintf(path, sizeof(path), "%s/src%d.c", dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/common.h", dir);
+    unlink(path);
+    rmdir(dir);
+    free(text);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s lexer [input.c | --synthetic MB | --commented MB] [iterations]\n", prog);
+    fprintf(stderr, "       %s compile [input.c | --synthetic MB] [iterations]\n", prog);
+    fprintf(stderr, "       %s lexer-scaling [input.c | --synthetic MB] [max_threads]\n", prog);
+    fprintf(stderr, "       %s parse-scaling [input.c | --synthetic MB] [max_threads]\n", prog);
+    fprintf(stderr, "       %s preprocess [sources] [header_KB]\n", prog);
+    fprintf(stderr, "       %s parse-function [statements] [iterations]\n", prog);
+    fprintf(stderr, "       %s flat-ast [nodes] [iterations]\n", prog);
+    fprintf(stderr, "       %s reparse [functions] [edits]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) { usage(argv[0]); return 1; }
+
+    const char *impl = getenv("MYCC_SCAN");
+    if (impl && !scanSetImpl(impl)) {
+        fprintf(stderr, "scanner '%s' is not available on this CPU\n", impl);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "preprocess") == 0) {
+        bench_preprocess(argc > 2 ? atoi(argv[2]) : 200, argc > 3 ? atoi(argv[3]) : 256);
+        return 0;
+    }
+    if (strcmp(argv[1], "parse-function") == 0) {
+        bench_parse_function(argc > 2 ? atoi(argv[2]) : 200000, argc > 3 ? atoi(argv[3]) : 5);
+        return 0;
+    }
+    if (strcmp(argv[1], "flat-ast") == 0) {
+        bench_flat_ast(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 3);
+        return 0;
+    }
+    if (strcmp(argv[1], "reparse") == 0) {
+        bench_reparse(argc > 2 ? atoi(argv[2]) : 1400, argc > 3 ? atoi(argv[3]) : 50);
+        return 0;
+    }
+
+    char *input = NULL;
+    int argi = 2;
+    int compile = strcmp(argv[1], "compile") == 0;
+    int scaling = strcmp(argv[1], "lexer-scaling") == 0;
+    int parse_scaling = strcmp(argv[1], "parse-scaling") == 0;
+    if (argi < argc && strcmp(argv[argi], "--synthetic") == 0 && argi + 1 < argc) {
+        size_t bytes = (size_t)(atof(argv[argi + 1]) * 1024 * 1024);
+        input = compile || parse_scaling ? gen_compile_input(bytes) : gen_synthetic(bytes, 0);
+        argi += 2;
+    } else if (argi < argc && strcmp(argv[argi], "--commented") == 0 && argi + 1 < argc) {
+        input = gen_synthetic((size_t)atof(argv[argi + 1]) * 1024 * 1024, 1);
+        argi += 2;
+    } else if (argi < argc) {
+        input = readSampleInput(argv[argi]);
+        argi++;
+    } else {
+        input = compile ? gen_compile_input((size_t)1024 * 1024)
+              : parse_scaling ? gen_compile_input((size_t)16 * 1024 * 1024)
+              : gen_synthetic((size_t)(scaling ? 64 : 16) * 1024 * 1024, 0);
+    }
+    if (!input) return 1;
+    // For the scaling modes the trailing number is the thread limit instead.
+    int iterations = argi < argc ? atoi(argv[argi]) : scaling || parse_scaling ? 8 : 5;
+    if (iterations < 1) iterations = 1;
+
+    if (strcmp(argv[1], "lexer") == 0) {
+        bench_lexer(input, iterations);
+    } else if (compile) {
+        bench_compile(input, iterations);
+    } else if (scaling) {
+        bench_lexer_scaling(input, iterations);
+    } else if (parse_scaling) {
+        bench_parse_scaling(input, iterations);
+    } else {
+        usage(argv[0]);
+        free(input);
+        return 1;
+    }
+    free(input);
+    return 0;
+}
@@ -48,8 +48,12 @@ typedef struct ASTNode ASTNode;
 struct ASTNode {
     ASTNodeType type;
     union {
-        struct { char *value; } number;
-        struct { char *name; } identifier;
+        struct {
+            const char *value;  // spelling, as written
+            int flags;          // NUM_* from the literal's token
+            union { unsigned long long ival; double fval; };
+        } number;
+        struct { const char *name; } identifier;
         struct { TokenKind op; ASTNode *left, *right; } binary;
         struct { ASTNode *left, *right; } assign;
         struct {
@@ -59,7 +63,7 @@ struct ASTNode {
         } type_node;
         struct {
             ASTNode *var_type;
-            char *name;
+            const char *name;
             ASTNode *init;
         } var_decl;
         
@@ -70,7 +74,7 @@ struct ASTNode {
 
         struct {
             ASTNode *src_type;
-            char *alias;
+            const char *alias;
         } typedef_stmt;
         
         struct { TokenKind op; ASTNode *operand; } unary;
@@ -80,17 +84,17 @@ struct ASTNode {
         struct { ASTNode **stmts; int count; } block;
         struct { 
             ASTNode *ret_type;
-            char *name;
+            const char *name;
             ASTNode **params;
             int param_count;
             ASTNode *body;
         } fundef;
         struct {
             ASTNode *type;
-            char *name;
+            const char *name;
         } param;
         struct {
-            char *name;
+            const char *name;
             ASTNode **args;
             int arg_count;
         } call;
@@ -112,36 +116,36 @@ struct ASTNode {
         } for_stmt;
         
         struct {
-            char *name;
+            const char *name;
             ASTNode **members;
             int member_count;
         } struct_stmt;
         
         struct {
-            char *type;
-            char *name;
+            const char *type;
+            const char *name;
         } struct_member;
 
         struct {
-            char *struct_name;
+            const char *struct_name;
             ASTNode **members;
             int member_count;
-            char *typedef_name;
+            const char *typedef_name;
         } typedef_struct;
         struct {
-            char *value;
+            const char *value;
         } char_literal;
 
-        struct { char *value; } string_literal;
+        struct { const char *value; } string_literal;
 
         struct {
             ASTNode *lhs;
-            char *member; // member name
+            const char *member; // member name
         } member_access;
 
         struct {
             ASTNode *lhs;
-            char *member; // member name
+            const char *member; // member name
         } arrow_access;
         struct {
             ASTNode **elements;
@@ -0,0 +1,35 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for data that dies all at once, like a compilation's AST.
+// Memory comes from chunks of ARENA_CHUNK bytes (larger requests get a chunk
+// of their own); nothing is freed individually. arena_reset releases
+// everything but the first chunk, so the next compilation starts without a
+// trip to malloc.
+#define ARENA_CHUNK (64 * 1024)
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+    ArenaChunk *chunks;  // most recent first
+    char *ptr;           // free space in the current chunk
+    char *end;
+    size_t allocs;       // allocations served since the last reset
+    size_t bytes;        // bytes handed out since the last reset
+    size_t mallocs;      // chunks obtained from malloc, ever
+} Arena;
+
+void arena_init(Arena *a);
+// Uninitialized memory, aligned for any object type.
+void *arena_alloc(Arena *a, size_t size);
+void *arena_zalloc(Arena *a, size_t size);
+void *arena_memdup(Arena *a, const void *src, size_t size);
+void arena_reset(Arena *a);
+// Moves everything src holds into dst, which keeps allocating from its
+// current chunk; src is left empty.
+void arena_adopt(Arena *dst, Arena *src);
+void arena_free(Arena *a);
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef ASTCACHE_H
+#define ASTCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flatast.h"
+#include "preproc.h"
+
+// On-disk cache of parsed translation units, so an unchanged input is
+// compiled without lexing or parsing it.
+//
+// An entry is a FlatAST written out as its three arrays plus a string table,
+// with every reference an offset from the start of the file. Loading maps
+// the file read-only and uses the node and extra arrays in place; only the
+// atom table is rebuilt, by interning each string once.
+//
+// Entries are named by a key hashed from the main file's text, its resolved
+// path and the #include search path. Each also records every file the unit
+// included with a hash of its text, and is used only while all of those
+// still match. The header carries a format version and a checksum of the
+// rest of the file; an entry that fails either check is a miss.
+//
+// File layout (native byte order, sections 8-byte aligned):
+//   AstCacheHeader
+//   deps     dep_count x { u64 text hash, u32 path (string offset), u32 0 }
+//   nodes    node_count x FlatNode
+//   extra    extra_count x u32
+//   atoms    atom_count x u32 string offsets (atoms[0] is NULL: offset 0)
+//   strings  NUL-terminated, strings[0] is ""
+#define ASTCACHE_MAGIC "myccAST"
+// Bump when FlatNode, the per-kind layout in flatast.h or ASTNodeType
+// changes.
+#define ASTCACHE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;     // 0x01020304 as written
+    uint64_t checksum;       // of every byte after the header
+    uint64_t key;
+    uint32_t dep_count, dep_offset;
+    uint32_t node_count, node_offset;
+    uint32_t extra_count, extra_offset;
+    uint32_t atom_count, atom_offset;
+    uint32_t strings_size, strings_offset;
+    uint32_t root;
+    uint32_t file_size;
+} AstCacheHeader;
+
+// A loaded entry. ast is read-only; its arrays point into the mapping.
+typedef struct {
+    FlatAST ast;
+    void *map;
+    size_t map_size;
+} CachedAST;
+
+// Looks up the unit rooted at path in dir. Returns 1 and fills out on a hit,
+// 0 on a miss (no entry, a stale or corrupt one, or path is "-").
+int astcache_lookup(const char *dir, const char *path, CachedAST *out);
+// Saves ast as the entry for the unit pp has just read. Returns 0, or -1
+// after printing an error. The entry is written under a temporary name and
+// renamed, so readers never see half of one.
+int astcache_store(const char *dir, Preprocessor *pp, const FlatAST *ast);
+void astcache_release(CachedAST *c);
+
+#endif
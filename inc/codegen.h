@@ -6,7 +6,13 @@
 #include "AST.h"
 #include "parser.h"
 #include "stringBuilder.h"
+#include "flatast.h"
 
+// Flattens the tree and generates code from the flat form.
 char *codegen(ASTNode *root);
+char *codegen_flat(const FlatAST *ast);
+// Also sets *ir to the text of every function's IR as lowered, before it is
+// legalized; the caller frees it.
+char *codegen_flat_with_ir(const FlatAST *ast, char **ir);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,132 @@
+#ifndef FLATAST_H
+#define FLATAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "AST.h"
+#include "symtab.h"
+
+// Compact form of a parsed tree for the passes after parsing. Nodes live in
+// one array and refer to each other by 32-bit index; names are 32-bit
+// indices into an atom table. A node is 12 bytes: its kind, one byte of
+// flags and two words. Kinds that need more (a child list, a third child, a
+// 64-bit value) keep it in `extra`, a shared array of words, so child lists
+// are contiguous and the whole tree is three flat arrays with no pointers.
+//
+// Layout per kind (a, b; [..] is in extra starting at the given word):
+//   NUMBER          spelling, [ival lo, ival hi]; flags NUM_*
+//   IDENTIFIER, STRING_LITERAL, CHAR_LITERAL   name
+//   BINARY, ASSIGN  left, right; BINARY flags operator
+//   UNARY           operand; flags operator
+//   TYPE            base type node, pointer level; flags TYPEMOD_*
+//   TYPE_ARRAY      element type, size
+//   VAR_DECL        name, [type, init]
+//   PARAM           name, type
+//   TYPEDEF         alias, source type
+//   STRUCT_MEMBER   name, type name
+//   MEMBER_ACCESS, ARROW_ACCESS   lhs, member name
+//   EXPR_STMT, RETURN, SIZEOF     expr
+//   IF, TERNARY     cond, [then, else]
+//   WHILE, DO_WHILE cond, body
+//   FOR             [init, cond, inc, body]
+//   BLOCK, INIT_LIST              -, [count, items...]
+//   CALL, STRUCT    name, [count, items...]
+//   FUNDEF          name, [return type, body, count, params...]
+//   TYPEDEF_STRUCT  typedef name, [struct name, count, members...]
+typedef uint32_t NodeRef;  // 0: no node
+
+typedef struct {
+    uint8_t kind;   // ASTNodeType
+    uint8_t flags;
+    uint16_t unused;
+    uint32_t a, b;
+} FlatNode;
+
+typedef struct {
+    FlatNode *nodes;  // nodes[0] is the null node
+    uint32_t node_count, node_cap;
+    uint32_t *extra;
+    uint32_t extra_count, extra_cap;
+    const char **atoms;  // atoms[0] is NULL
+    uint32_t atom_count, atom_cap;
+    SymTab atom_ids;     // atom -> index + 1, while building
+    NodeRef root;
+} FlatAST;
+
+// Flattens a tree from the parser; the tree may be freed afterwards. Nodes
+// are numbered in pre-order, so a subtree follows its root.
+void flat_build(FlatAST *f, const ASTNode *root);
+void flat_free(FlatAST *f);
+// Bytes held by the three arrays.
+size_t flat_bytes(const FlatAST *f);
+
+static inline ASTNodeType flat_kind(const FlatAST *f, NodeRef n) { return (ASTNodeType)f->nodes[n].kind; }
+static inline const char *flat_atom(const FlatAST *f, uint32_t id) { return f->atoms[id]; }
+
+// BINARY and UNARY operators.
+static inline TokenKind flat_op(const FlatAST *f, NodeRef n) { return (TokenKind)f->nodes[n].flags; }
+static inline NodeRef flat_left(const FlatAST *f, NodeRef n) { return f->nodes[n].a; }
+static inline NodeRef flat_right(const FlatAST *f, NodeRef n) { return f->nodes[n].b; }
+static inline NodeRef flat_operand(const FlatAST *f, NodeRef n) { return f->nodes[n].a; }
+
+// Identifier, declaration or callee name; string and char literal text.
+static inline const char *flat_name(const FlatAST *f, NodeRef n) { return f->atoms[f->nodes[n].a]; }
+
+static inline const char *flat_number_value(const FlatAST *f, NodeRef n) { return f->atoms[f->nodes[n].a]; }
+static inline int flat_number_flags(const FlatAST *f, NodeRef n) { return f->nodes[n].flags; }
+static inline unsigned long long flat_number_ival(const FlatAST *f, NodeRef n) {
+    const uint32_t *w = &f->extra[f->nodes[n].b];
+    return (unsigned long long)w[0] | (unsigned long long)w[1] << 32;
+}
+
+static inline NodeRef flat_type_base(const FlatAST *f, NodeRef n) { return f->nodes[n].a; }
+static inline int flat_type_pointer_level(const FlatAST *f, NodeRef n) { return (int)f->nodes[n].b; }
+static inline int flat_type_modifiers(const FlatAST *f, NodeRef n) { return f->nodes[n].flags; }
+static inline NodeRef flat_array_element(const FlatAST *f, NodeRef n) { return f->nodes[n].a; }
+static inline int flat_array_size(const FlatAST *f, NodeRef n) { return (int)f->nodes[n].b; }
+
+static inline NodeRef flat_var_type(const FlatAST *f, NodeRef n) { return f->extra[f->nodes[n].b]; }
+static inline NodeRef flat_var_init(const FlatAST *f, NodeRef n) { return f->extra[f->nodes[n].b + 1]; }
+static inline NodeRef flat_param_type(const FlatAST *f, NodeRef n) { return f->nodes[n].b; }
+static inline NodeRef flat_typedef_source(const FlatAST *f, NodeRef n) { return f->nodes[n].b; }
+static inline const char *flat_struct_member_type(const FlatAST *f, NodeRef n) { return f->atoms[f->nodes[n].b]; }
+
+static inline NodeRef flat_lhs(const FlatAST *f, NodeRef n) { return f->nodes[n].a; }
+static inline const char *flat_member(const FlatAST *f, NodeRef n) { return f->atoms[f->nodes[n].b]; }
+
+static inline NodeRef flat_expr(const FlatAST *f, NodeRef n) { return f->nodes[n].a; }
+
+static inline NodeRef flat_cond(const FlatAST *f, NodeRef n) {
+    const FlatNode *node = &f->nodes[n];
+    return node->kind == AST_FOR ? f->extra[node->a + 1] : node->a;
+}
+static inline NodeRef flat_then(const FlatAST *f, NodeRef n) { return f->extra[f->nodes[n].b]; }
+static inline NodeRef flat_else(const FlatAST *f, NodeRef n) { return f->extra[f->nodes[n].b + 1]; }
+static inline NodeRef flat_for_init(const FlatAST *f, NodeRef n) { return f->extra[f->nodes[n].a]; }
+static inline NodeRef flat_for_inc(const FlatAST *f, NodeRef n) { return f->extra[f->nodes[n].a + 2]; }
+static inline NodeRef flat_body(const FlatAST *f, NodeRef n) {
+    const FlatNode *node = &f->nodes[n];
+    switch (node->kind) {
+    case AST_FOR: return f->extra[node->a + 3];
+    case AST_FUNDEF: return f->extra[node->b + 1];
+    default: return node->b;
+    }
+}
+static inline NodeRef flat_return_type(const FlatAST *f, NodeRef n) { return f->extra[f->nodes[n].b]; }
+static inline const char *flat_struct_name(const FlatAST *f, NodeRef n) {
+    return f->atoms[f->extra[f->nodes[n].b]];
+}
+
+// Children of a BLOCK, INIT_LIST, CALL (arguments), STRUCT or TYPEDEF_STRUCT
+// (members) or FUNDEF (parameters), in order.
+static inline const NodeRef *flat_list(const FlatAST *f, NodeRef n, int *count) {
+    const FlatNode *node = &f->nodes[n];
+    uint32_t at = node->b;
+    if (node->kind == AST_FUNDEF) at += 2;
+    else if (node->kind == AST_TYPEDEF_STRUCT) at += 1;
+    *count = (int)f->extra[at];
+    return &f->extra[at + 1];
+}
+
+#endif
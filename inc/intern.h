@@ -0,0 +1,32 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+
+// Global atom table. Every distinct string is stored once and lives until
+// the process exits, so two atoms are equal exactly when their pointers are,
+// and atoms can be kept anywhere without copying or freeing.
+//
+// Identifiers, type names, literals and struct members all go through here;
+// code that compares names should compare the pointers, never strcmp.
+
+const char *intern(const char *s, size_t len);
+const char *intern_cstr(const char *s);
+
+// intern() may be called from several threads only between
+// intern_set_concurrent(1) and intern_set_concurrent(0), both made while no
+// other thread is interning.
+void intern_set_concurrent(int on);
+
+// Atoms for names the compiler itself looks for. intern() returns these very
+// pointers for the matching spellings.
+extern const char ATOM_EMPTY[];  // ""
+extern const char ATOM_CHAR[];   // "char"
+extern const char ATOM_INT[];    // "int"
+extern const char ATOM_MAIN[];   // "main"
+
+// Number of distinct atoms and bytes of string storage, for benchmarks.
+size_t intern_count(void);
+size_t intern_bytes(void);
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef IR_H
+#define IR_H
+
+#include <stdint.h>
+
+#include "arena.h"
+#include "stringBuilder.h"
+
+// Three-address code between the tree and masm.
+//
+// A function is a list of basic blocks. Each block is a run of instructions
+// that ends in exactly one terminator (jmp, br or ret); the terminators'
+// targets are the CFG's edges, and ir_finish fills in each block's
+// predecessors. Values live in virtual registers numbered from 1 (0 means
+// "none"). A vreg may be assigned in more than one place, as the value of
+// a && b or of a loop counter is; it is given a machine register or a frame
+// home only when masm is emitted.
+//
+// Memory the function owns, its locals and arrays, is a table of frame
+// slots, reached through `frame` instructions. Stack parameters are fixed
+// slots in the caller's frame; the rest are laid out below bp on emission.
+//
+// The machine has no multiply, divide, variable shift or unsigned compare.
+// Lowering emits them anyway and ir_legalize expands them into shifts, adds,
+// loops and signed compares before emission.
+//
+// Text form, as ir_print writes it:
+//   func f_sum
+//     slot 0 n 4
+//   b0:
+//     v1 = param 0
+//     v2 = &n
+//     store v2, v1
+//     jmp b2
+//   b1:  ; preds b2
+//     ...
+//   b2:  ; preds b0, b1
+//     v3 = load v2
+//     br gt v3, 0, b1, b3
+typedef enum {
+    IR_CONST,   // dst = imm
+    IR_COPY,    // dst = a
+    IR_PARAM,   // dst = register parameter imm (0-2); first in the entry block
+    IR_FRAME,   // dst = address of slot `slot`, plus imm
+    IR_SYM,     // dst = sym: a label, or a float literal as written
+    // dst = a op b; with b 0, the second operand is imm
+    IR_ADD, IR_SUB, IR_MUL,
+    IR_DIV, IR_MOD,     // truncate toward zero, as C does
+    IR_UDIV, IR_UMOD,   // unsigned
+    IR_AND, IR_OR, IR_XOR,
+    IR_SHL, IR_SHR,     // shr shifts in zeros
+    IR_SET,     // dst = a `cond` b (or imm) ? 1 : 0
+    IR_LOAD,    // dst = [a], `width` bytes
+    IR_STORE,   // [a] = b, `width` bytes
+    IR_CALL,    // dst (0: unused) = sym(args)
+    // Terminators
+    IR_JMP,     // goto target[0]
+    IR_BR,      // if a `cond` b (or imm) goto target[0] else target[1]
+    IR_RET,     // return a (0: nothing)
+} IROp;
+
+// Comparisons: signed, as cmp makes them, then the unsigned ones in the
+// same order.
+typedef enum { IR_EQ, IR_NE, IR_LT, IR_GT, IR_LE, IR_GE, IR_ULT, IR_UGT, IR_ULE, IR_UGE } IRCond;
+
+typedef uint32_t VReg;
+
+typedef struct {
+    uint8_t op;         // IROp
+    uint8_t cond;       // IRCond: SET, BR
+    uint8_t width;      // 1 or 4: LOAD, STORE
+    VReg dst, a, b;
+    int32_t imm;
+    int slot;           // FRAME
+    int target[2];      // JMP, BR: block indices
+    const char *sym;    // SYM; CALL: the callee's label
+    VReg *args;         // CALL
+    int arg_count;
+} IRInst;
+
+typedef struct {
+    IRInst *insts;
+    int count, cap;
+    int *preds;         // set by ir_finish
+    int pred_count;
+} IRBlock;
+
+typedef struct {
+    const char *name;   // for the printer; may be NULL
+    int size;           // bytes
+    int offset;         // from bp: fixed for stack parameters, else laid out on emission
+    uint8_t fixed;      // a stack parameter
+} IRSlot;
+
+typedef struct {
+    const char *name;   // as in the source; block labels are b_<name>_<n>
+    const char *label;  // __START__ or f_<name>
+    int is_main;        // returns with halt
+    IRBlock *blocks;    // blocks[0] is the entry
+    int block_count, block_cap;
+    // The block instructions are being added to, and the order blocks were
+    // started in, which ir_finish makes their order in the function.
+    int cur;
+    int *started;
+    int started_count;
+    IRSlot *slots;
+    int slot_count, slot_cap;
+    VReg vreg_count;
+    Arena arena;        // call argument lists
+} IRFunc;
+
+void ir_func_init(IRFunc *f, const char *name, int is_main);
+void ir_func_free(IRFunc *f);
+
+int ir_slot(IRFunc *f, const char *name, int size);
+int ir_fixed_slot(IRFunc *f, const char *name, int offset);
+VReg ir_new_vreg(IRFunc *f);
+
+// Building. Instructions go to the end of the current block. A new block
+// is started with ir_start_block, which first ends the current one with a
+// jump to it if nothing else has; code following a terminator goes to a
+// fresh block of its own, which ir_finish drops when nothing reaches it.
+int ir_new_block(IRFunc *f);
+void ir_start_block(IRFunc *f, int block);
+IRInst *ir_add(IRFunc *f, IROp op);
+VReg ir_const(IRFunc *f, int32_t value);
+void ir_copy(IRFunc *f, VReg dst, VReg src);
+VReg ir_param(IRFunc *f, int index);
+VReg ir_frame(IRFunc *f, int slot, int32_t offset);
+VReg ir_sym(IRFunc *f, const char *sym);
+VReg ir_binop(IRFunc *f, IROp op, VReg a, VReg b);
+VReg ir_binop_imm(IRFunc *f, IROp op, VReg a, int32_t imm);
+VReg ir_set(IRFunc *f, IRCond cond, VReg a, VReg b, int32_t imm);
+VReg ir_load(IRFunc *f, VReg addr, int width);
+void ir_store(IRFunc *f, VReg addr, VReg value, int width);
+VReg ir_call(IRFunc *f, const char *sym, const VReg *args, int arg_count);
+void ir_jmp(IRFunc *f, int target);
+void ir_br(IRFunc *f, IRCond cond, VReg a, VReg b, int32_t imm, int if_true, int if_false);
+void ir_ret(IRFunc *f, VReg value);
+
+// Puts the blocks in the order they were started, drops those nothing
+// reaches from the entry and fills in predecessors.
+void ir_finish(IRFunc *f);
+// Expands what the machine cannot do in one instruction. Leaves the
+// function finished.
+void ir_legalize(IRFunc *f);
+// Checks f is well formed: every block ends in its one terminator, targets,
+// slots and vregs exist, parameters come first, and every use of a vreg is
+// reached by a definition on every path. Describes each problem in errors
+// and returns how many there were. f must be finished.
+int ir_verify(const IRFunc *f, StringBuilder *errors);
+void ir_print(const IRFunc *f, StringBuilder *sb);
+// Allocates machine registers by linear scan over live intervals, giving
+// frame homes to what does not fit, lays out the frame and writes f as
+// masm.
+void ir_emit_masm(IRFunc *f, StringBuilder *sb);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef TOKEN_H
 #define TOKEN_H
 
+#include <stddef.h>
+
 typedef int symbol;
 
 typedef enum {
@@ -95,20 +97,141 @@ typedef enum {
 
 typedef struct Token Token;
 
+// Flags describing the decoded value of a NUMBER token.
+enum {
+  NUM_FLOAT    = 1 << 0,  // value is in fval; otherwise in ival
+  NUM_UNSIGNED = 1 << 1,  // u suffix
+  NUM_LONG     = 1 << 2,  // l suffix
+  NUM_LONGLONG = 1 << 3,  // ll suffix
+  NUM_FLOAT32  = 1 << 4,  // f suffix
+  NUM_INVALID  = 1 << 5,  // malformed spelling or out of range
+};
+
 struct Token{
   TokenKind kind;
-  char *value;
-  int line;
-  int col;
-  Token *next;
+  int offset;     // byte offset of the lexeme in the source buffer
+  int len;        // lexeme length in bytes
+  int num_flags;  // NUM_* for NUMBER tokens, 0 otherwise
+  union {
+    const char *atom;        // IDENTIFIER: interned spelling
+    unsigned long long ival; // NUMBER: integer value (decimal, 0x, 0b or octal)
+    double fval;             // NUMBER with NUM_FLOAT
+  };
 };
 
+// One file of a SourceMap. Offsets in [base, base + size) refer to
+// text[offset - base].
+typedef struct {
+  const char *name;   // atom
+  const char *text;   // NUL-terminated
+  int base;
+  int size;
+  int *line_starts;   // relative to text, built on demand
+  int line_count;
+} SourceFile;
+
+// Several source buffers laid out in one offset space, so a token's int
+// offset still names its text when tokens from different files are mixed,
+// as in the preprocessor's output.
+typedef struct {
+  SourceFile **files;  // ordered by base
+  int count;
+  int cap;
+} SourceMap;
+
+// All tokens of one source buffer, stored contiguously and terminated by an
+// EOT token. Tokens refer to their text by offset, so the source buffer must
+// outlive the stream. A stream with a map resolves offsets through it
+// instead of src.
+//
+// Lines and columns are not tracked while lexing. The first position query
+// builds an index of line-start offsets, and each query binary-searches it.
+typedef struct {
+  Token *data;
+  int count;
+  int cap;
+  const char *src;
+  int *line_starts;  // offset of each line's first byte, built on demand
+  int line_count;
+  SourceMap *map;
+} TokenStream;
+
 typedef struct {
   char *str;
   symbol kind;
 } StringTokenKindMap;
 
-Token *lexer(char *input);
+TokenStream lexer(const char *input);
+// Same result as lexer() for input[0, size), lexed by up to `threads` threads
+// on chunks split at line starts outside comments and literals. Small inputs
+// are lexed on the calling thread. Asking for more threads than there are
+// cores only adds overhead; callers pick the count.
+TokenStream lexerParallel(const char *input, size_t size, int threads);
+void freeTokenStream(TokenStream *ts);
+
+// Returns the token's text inside the source buffer and its length in *len.
+// String literals are returned without their quotes.
+const char *tokenSpelling(const TokenStream *ts, const Token *tok, int *len);
+// The token's text exactly as written, tok->len bytes.
+const char *tokenText(const TokenStream *ts, const Token *tok);
+// Returns a malloc'd, NUL-terminated copy of the token's value: the spelling,
+// except that char literals are decoded to the character they denote.
+char *tokenStrdup(const TokenStream *ts, const Token *tok);
+
+// 1-based line and byte column of the token's first byte, within its file.
+void tokenPosition(TokenStream *ts, const Token *tok, int *line, int *col);
+// Returns the text of the line holding the token, without its line ending.
+const char *tokenLine(TokenStream *ts, const Token *tok, int *len);
+// Name of the file holding the token, or NULL for single-buffer streams.
+const char *tokenFileName(const TokenStream *ts, const Token *tok);
+
+// Adds a file to the map at the next free offset and returns it. text must
+// be NUL-terminated and outlive the map; name should be an atom.
+SourceFile *sourceMapAdd(SourceMap *map, const char *name, const char *text, int size);
+
+// Pull-based token access. A reader either lexes the source as tokens are
+// asked for, or walks a stream that was lexed up front (e.g. in parallel).
+// Only a small ring of tokens is live either way, so memory does not grow
+// with the file: up to TOKEN_LOOKAHEAD tokens from the current one on, and
+// TOKEN_HISTORY consumed ones kept for diagnostics. Token pointers from a
+// reader stay valid for TOKEN_HISTORY further calls to nextToken().
+#define TOKEN_LOOKAHEAD 4
+#define TOKEN_HISTORY 2
+#define TOKEN_RING 8  // power of two > TOKEN_LOOKAHEAD + TOKEN_HISTORY
+
+typedef struct {
+  TokenStream *stream;  // source and line index; also the tokens, if pre-lexed
+  TokenStream own;      // backs `stream` when lexing on demand; holds no tokens
+  const char *pos;      // next byte to lex when lexing on demand
+  const char *end;
+  void (*pull)(void *ctx, Token *out);
+  void *ctx;
+  Token ring[TOKEN_RING];
+  unsigned head;        // tokens consumed; ring[head % TOKEN_RING] is current
+  unsigned filled;      // tokens placed in the ring so far
+} TokenReader;
+
+// Readers point into themselves and must not be copied once initialized.
+void tokenReaderInit(TokenReader *r, const char *src, size_t size);
+void tokenReaderInitStream(TokenReader *r, TokenStream *ts);
+// Same, starting at ts->data[index]; also repositions a stream reader.
+void tokenReaderInitStreamAt(TokenReader *r, TokenStream *ts, unsigned index);
+// Tokens come from pull(ctx, out), e.g. the preprocessor; `stream` holds no
+// tokens, only what is needed to resolve theirs.
+void tokenReaderInitPull(TokenReader *r, TokenStream *stream,
+                         void (*pull)(void *ctx, Token *out), void *ctx);
+void tokenReaderFree(TokenReader *r);
+// The k-th token from the current one, 0 <= k < TOKEN_LOOKAHEAD. Past the
+// end every position reads as the EOT token.
+Token *peekToken(TokenReader *r, int k);
+// The k-th consumed token back, 1 <= k <= TOKEN_HISTORY, or NULL.
+Token *prevToken(TokenReader *r, int k);
+// Consumes the current token and returns it. The EOT token is never consumed.
+Token *nextToken(TokenReader *r);
+
+// If ptr starts a char literal, stores the character it denotes in buffer[0]
+// (NUL-terminated) and returns the literal's length; otherwise returns 0.
+int isCharLiteral(const char *ptr, char *buffer);
 
 char *tokenkind2str(TokenKind kind);
 
@@ -3,12 +3,85 @@
 
 #include "lexer.h"
 #include "AST.h"
+#include "arena.h"
 
-ASTNode* parse_program(Token **cur);
+ASTNode* parse_program(TokenStream *ts);
+// Same, pulling tokens from a reader, so the token list is never built.
+ASTNode* parse_program_reader(TokenReader *reader);
+// Same, parsing function bodies on up to `threads` threads. The top level
+// is parsed first, in order, with each body skipped to its closing brace;
+// the bodies are then split into runs of about equal size, one per thread,
+// each thread allocating from an arena of its own that is merged into the
+// parse arena afterwards. The tree, registries and errors are those of
+// parse_program: if any part fails, the whole stream is parsed again
+// serially so diagnostics come out as usual.
+ASTNode* parse_program_parallel(TokenStream *ts, int threads);
 void parser_set_filename(const char *name);
+
+// Syntax errors do not stop a parse: each is printed to stderr and recorded,
+// the parser skips to the next statement or declaration, and the tree it
+// returns holds whatever parsed. Check parser_error_count() before using it.
+typedef struct {
+    const char *msg;
+    const char *file;
+    int line, col;
+} ParseDiag;
+
+// Stops the parse after `max` errors (default 20); 0 means no limit.
+void parser_set_max_errors(int max);
+// Errors of the last parse, valid until the next one starts. File names
+// point into the token stream that was parsed.
+int parser_error_count(void);
+const ParseDiag *parser_errors(void);
 void print_ast(ASTNode *node, int indent);
 // Writes the AST to a FILE* instead of stdout.
 void fprint_ast(FILE *out, ASTNode *node, int indent);
+// Releases a tree from parse_program along with everything else parsed
+// since: nodes are bump-allocated from one arena, which this resets.
 void free_ast(ASTNode *node);
+// The parse arena, for allocation statistics.
+const Arena *parser_arena(void);
+
+// Incremental parsing of one file that is edited and rebuilt over and over.
+// A session remembers where each top-level declaration of the last update
+// lay and a hash of its text. The next update compares the texts: only the
+// region around the edit is re-lexed and re-parsed, and unchanged function
+// definitions, including ones that merely moved, keep their nodes. The
+// registries end up as a full parse would leave them.
+//
+// An edit that touches anything but function definitions, a region that
+// does not end cleanly, or a previous update with errors makes the update a
+// full parse. Sessions work on source text, without preprocessing.
+//
+// The tree returned lives in the parse arena: free_ast() invalidates it and
+// makes the session's next update a full parse.
+typedef struct ParseSession ParseSession;
+
+typedef struct {
+    int full;            // the update parsed everything
+    int reused;          // top-level declarations kept from the last update
+    int parsed;          // top-level declarations parsed
+    size_t bytes_lexed;
+} ParseSessionStats;
+
+ParseSession *parse_session_new(void);
+ASTNode *parse_session_update(ParseSession *s, const char *src, size_t size);
+// Of the last update.
+ParseSessionStats parse_session_stats(const ParseSession *s);
+void parse_session_free(ParseSession *s);
+
+// Registries of what the last parse declared, for the parser's own lookups
+// and for later passes. Names must be atoms; lookups are O(1). Results point
+// into the parse arena and are valid until the next parse.
+typedef struct StructDef {
+    const char *name;  // typedef name if any, else the tag
+    ASTNode **members;
+    int member_count;
+} StructDef;
+
+ASTNode *find_function(const char *name);
+int is_user_typename(const char *name);
+// By tag or typedef name.
+const StructDef *find_structdef(const char *name);
 
 #endif
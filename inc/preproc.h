@@ -0,0 +1,54 @@
+#ifndef PREPROC_H
+#define PREPROC_H
+
+#include "lexer.h"
+
+// Preprocessor between the lexer and the parser: #include, #define (object-
+// and function-like, with # and ##), #undef, #if/#ifdef/#ifndef/#elif/#else/
+// #endif, #pragma once and #error. Expanded tokens are produced on demand.
+//
+// Files are read and lexed once per process. The cache keeps each file's
+// text and tokens, and remembers headers wrapped in an #ifndef guard or
+// marked #pragma once, so including one again once its guard is defined is a
+// table lookup: the file is not opened, lexed or scanned.
+//
+// Output token offsets are global: they resolve through ppStream(), whose
+// source map holds every file read, plus the text of tokens made by # and ##.
+
+typedef struct Preprocessor Preprocessor;
+
+// Adds a directory searched by #include. "name" is looked up next to the
+// including file first, <name> only here. Applies to later ppOpen calls.
+void ppAddIncludeDir(const char *dir);
+const char *const *ppIncludeDirs(int *count);
+
+// Starts a translation unit at path ("-" reads stdin). The main file is
+// lexed as it is read, or up front on `threads` threads when threads > 1.
+// Returns NULL after printing an error if the file cannot be opened.
+Preprocessor *ppOpen(const char *path, int threads);
+void ppClose(Preprocessor *pp);
+
+// Next fully expanded token; EOT, repeatedly, at the end of the main file.
+void ppNext(Preprocessor *pp, Token *out);
+// Resolves the text and position of output tokens; holds no tokens.
+TokenStream *ppStream(Preprocessor *pp);
+// Reads the translation unit through r. The reader must be freed before pp.
+void ppReaderInit(TokenReader *r, Preprocessor *pp);
+
+// Files the unit has included so far, the main file first, each once: its
+// resolved path ("-" for stdin) and its text. Headers skipped by a guard
+// are listed too.
+int ppDependencyCount(Preprocessor *pp);
+const char *ppDependency(Preprocessor *pp, int i, const char **text, size_t *size);
+
+// Process-wide cache counters, for tests and benchmarks.
+typedef struct {
+    int files_read;        // distinct files loaded
+    int files_lexed;       // headers whose tokens were built
+    int includes;          // #include directives executed
+    int includes_skipped;  // of those, skipped by a guard or #pragma once
+} PPStats;
+
+PPStats ppStats(void);
+
+#endif
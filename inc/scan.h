@@ -0,0 +1,25 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+// Bulk scanners the lexer uses to step over blanks and comments without
+// looking at them one byte at a time. Input must be NUL-terminated.
+
+// Skips ' ', \t, \n, \v, \f, \r. Returns the first other byte (possibly NUL).
+const char *scanBlanks(const char *p);
+
+// Returns the '\n' that ends the line containing p, or the terminating NUL.
+const char *scanLineEnd(const char *p);
+
+// p points just after "/*". Returns the byte after the closing "*/", or the
+// terminating NUL if the comment is unterminated.
+const char *scanBlockComment(const char *p);
+
+// Implementation in use: "avx2", "sse2" or "scalar". The best one the CPU
+// supports is picked on first use, without locking: threads that scan at
+// once must call this before they start.
+const char *scanImplName(void);
+// Forces an implementation by name; returns 0 if it is unknown or the CPU
+// lacks it. Intended for tests and benchmarks.
+int scanSetImpl(const char *name);
+
+#endif
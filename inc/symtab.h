@@ -0,0 +1,29 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+// Symbol registry: a hash map from names to pointers. Names must be atoms
+// (see intern.h); they are hashed and compared by pointer, never by text.
+//
+// Open addressing with linear probing. The capacity is a power of two, kept
+// at most half full and doubled when an insert would pass that, so inserts
+// are amortized O(1). Entries are never removed: putting NULL makes a name
+// read as absent.
+typedef struct {
+    const char *name;
+    void *value;
+} SymSlot;
+
+typedef struct {
+    SymSlot *slots;
+    int cap;
+    int count;  // names with a slot, including any set to NULL
+} SymTab;
+
+// A zeroed SymTab is empty and ready to use.
+void *symtab_get(const SymTab *t, const char *name);
+void symtab_put(SymTab *t, const char *name, void *value);
+// Empties the table but keeps its capacity.
+void symtab_clear(SymTab *t);
+void symtab_free(SymTab *t);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -8,6 +9,30 @@
 // Caller is responsible for freeing the returned buffer.
 char *readSampleInput(const char *filePath);
 
+typedef enum {
+    SOURCE_STATIC,  // empty input, points at a string literal
+    SOURCE_MMAP,    // read-only file mapping
+    SOURCE_HEAP,    // streamed into a malloc'd buffer
+} SourceKind;
+
+// Read-only source text, always followed by a NUL byte.
+typedef struct {
+    const char *data;
+    size_t size;       // bytes before the NUL
+    SourceKind kind;
+    size_t map_size;   // length of the mapping for SOURCE_MMAP
+} SourceBuffer;
+
+// Opens a source for lexing without copying it when possible: regular files
+// are mapped read-only; "-" (stdin), pipes and other unseekable inputs are
+// streamed in chunks. Returns 0 on success, -1 after printing an error.
+int openSource(const char *path, SourceBuffer *out);
+void closeSource(SourceBuffer *src);
+
+// 64-bit FNV-1a of data, continuing from h; start with HASH64_SEED.
+#define HASH64_SEED 0xcbf29ce484222325ULL
+uint64_t hash64(uint64_t h, const void *data, size_t size);
+
 // Saves content to filePath, creating the tests/outputs directory if needed.
 void saveOutput(const char *filePath, const char *content);
 
@@ -0,0 +1,103 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;
+    alignas(max_align_t) char data[];
+};
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+void arena_init(Arena *a) {
+    memset(a, 0, sizeof(*a));
+}
+
+static void *alloc_slow(Arena *a, size_t size) {
+    size_t chunk_size = size > ARENA_CHUNK / 4 ? size : ARENA_CHUNK;
+    ArenaChunk *c = malloc(sizeof(ArenaChunk) + chunk_size);
+    if (!c) abort();
+    c->size = chunk_size;
+    a->mallocs++;
+    if (chunk_size != ARENA_CHUNK && a->chunks) {
+        // Oversized blocks go behind the current chunk, whose free space
+        // stays in use.
+        c->next = a->chunks->next;
+        a->chunks->next = c;
+        return c->data;
+    }
+    c->next = a->chunks;
+    a->chunks = c;
+    a->ptr = c->data + size;
+    a->end = c->data + chunk_size;
+    return c->data;
+}
+
+void *arena_alloc(Arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    a->allocs++;
+    a->bytes += size;
+    if ((size_t)(a->end - a->ptr) >= size) {
+        void *p = a->ptr;
+        a->ptr += size;
+        return p;
+    }
+    return alloc_slow(a, size);
+}
+
+void *arena_zalloc(Arena *a, size_t size) {
+    void *p = arena_alloc(a, size);
+    memset(p, 0, size);
+    return p;
+}
+
+void *arena_memdup(Arena *a, const void *src, size_t size) {
+    void *p = arena_alloc(a, size);
+    if (size) memcpy(p, src, size);
+    return p;
+}
+
+void arena_reset(Arena *a) {
+    ArenaChunk *keep = NULL;
+    for (ArenaChunk *c = a->chunks; c; ) {
+        ArenaChunk *next = c->next;
+        // The oldest regular chunk is last in the list; keep it.
+        if (!next && c->size == ARENA_CHUNK) keep = c;
+        else free(c);
+        c = next;
+    }
+    a->chunks = keep;
+    a->ptr = keep ? keep->data : NULL;
+    a->end = keep ? keep->data + keep->size : NULL;
+    a->allocs = 0;
+    a->bytes = 0;
+}
+
+void arena_adopt(Arena *dst, Arena *src) {
+    if (!src->chunks) return;
+    if (!dst->chunks) {
+        dst->chunks = src->chunks;
+        dst->ptr = src->ptr;
+        dst->end = src->end;
+    } else {
+        ArenaChunk *last = src->chunks;
+        while (last->next) last = last->next;
+        last->next = dst->chunks->next;
+        dst->chunks->next = src->chunks;
+    }
+    dst->allocs += src->allocs;
+    dst->bytes += src->bytes;
+    dst->mallocs += src->mallocs;
+    arena_init(src);
+}
+
+void arena_free(Arena *a) {
+    arena_reset(a);
+    free(a->chunks);
+    size_t mallocs = a->mallocs;
+    arena_init(a);
+    a->mallocs = mallocs;
+}
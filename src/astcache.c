@@ -0,0 +1,284 @@
+#include "astcache.h"
+#include "intern.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define BYTE_ORDER_MARK 0x01020304u
+
+typedef struct {
+    uint64_t hash;
+    uint32_t path;
+    uint32_t unused;
+} CacheDep;
+
+#ifndef _WIN32
+
+static uint64_t align8(uint64_t n) {
+    return (n + 7u) & ~(uint64_t)7u;
+}
+
+// The key covers what decides which files the unit reads: its text, where
+// it is (quoted includes are found next to it) and the search path.
+static uint64_t unit_key(const char *resolved, const char *text, size_t size) {
+    uint32_t version = ASTCACHE_VERSION;
+    uint64_t h = hash64(HASH64_SEED, &version, sizeof(version));
+    h = hash64(h, resolved, strlen(resolved) + 1);
+    int dir_count;
+    const char *const *dirs = ppIncludeDirs(&dir_count);
+    for (int i = 0; i < dir_count; i++) h = hash64(h, dirs[i], strlen(dirs[i]) + 1);
+    return hash64(h, text, size);
+}
+
+static void entry_path(char *out, size_t cap, const char *dir, uint64_t key) {
+    snprintf(out, cap, "%s/%016llx.ast", dir, (unsigned long long)key);
+}
+
+// Maps a whole file read-only. A missing file is not an error here: it is a
+// cache miss, so nothing is printed.
+static void *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void *base = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) base = NULL;
+        else *size = (size_t)st.st_size;
+    }
+    close(fd);
+    return base;
+}
+
+static uint64_t file_hash(const char *path, int *ok) {
+    size_t size = 0;
+    void *data = map_file(path, &size);
+    *ok = data != NULL;
+    if (!data) {
+        // An empty file cannot be mapped but still has a hash.
+        struct stat st;
+        *ok = stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 0;
+        return HASH64_SEED;
+    }
+    uint64_t h = hash64(HASH64_SEED, data, size);
+    munmap(data, size);
+    return h;
+}
+
+static int section_fits(uint32_t offset, uint32_t count, size_t item, size_t file_size) {
+    return offset <= file_size && (uint64_t)count * item <= file_size - offset;
+}
+
+// Everything but the dependencies: is this a whole, uncorrupted entry for key?
+static int entry_valid(const unsigned char *base, size_t size, uint64_t key) {
+    const AstCacheHeader *h = (const AstCacheHeader *)base;
+    if (size < sizeof(AstCacheHeader)) return 0;
+    if (memcmp(h->magic, ASTCACHE_MAGIC, sizeof(h->magic)) != 0) return 0;
+    if (h->version != ASTCACHE_VERSION || h->byte_order != BYTE_ORDER_MARK) return 0;
+    if (h->file_size != size || h->key != key) return 0;
+    if (!section_fits(h->dep_offset, h->dep_count, sizeof(CacheDep), size) ||
+        !section_fits(h->node_offset, h->node_count, sizeof(FlatNode), size) ||
+        !section_fits(h->extra_offset, h->extra_count, sizeof(uint32_t), size) ||
+        !section_fits(h->atom_offset, h->atom_count, sizeof(uint32_t), size) ||
+        !section_fits(h->strings_offset, h->strings_size, 1, size))
+        return 0;
+    if (h->dep_count == 0 || h->node_count == 0 || h->atom_count == 0 ||
+        h->strings_size == 0 || h->root >= h->node_count)
+        return 0;
+    const char *strings = (const char *)base + h->strings_offset;
+    if (strings[h->strings_size - 1] != '\0') return 0;
+    uint64_t sum = hash64(HASH64_SEED, base + sizeof(AstCacheHeader),
+                                 size - sizeof(AstCacheHeader));
+    if (sum != h->checksum) return 0;
+    const uint32_t *atoms = (const uint32_t *)(base + h->atom_offset);
+    for (uint32_t i = 0; i < h->atom_count; i++)
+        if (atoms[i] >= h->strings_size) return 0;
+    const CacheDep *deps = (const CacheDep *)(base + h->dep_offset);
+    for (uint32_t i = 0; i < h->dep_count; i++)
+        if (deps[i].path >= h->strings_size) return 0;
+    return 1;
+}
+
+int astcache_lookup(const char *dir, const char *path, CachedAST *out) {
+    memset(out, 0, sizeof(*out));
+    if (strcmp(path, "-") == 0) return 0;
+    char resolved[PATH_MAX];
+    if (!realpath(path, resolved)) return 0;
+    size_t size = 0;
+    void *text = map_file(resolved, &size);
+    uint64_t main_hash = text ? hash64(HASH64_SEED, text, size) : HASH64_SEED;
+    uint64_t key = unit_key(resolved, text ? text : "", size);
+    if (text) munmap(text, size);
+
+    char file[PATH_MAX];
+    entry_path(file, sizeof(file), dir, key);
+    size_t map_size = 0;
+    unsigned char *base = map_file(file, &map_size);
+    if (!base) return 0;
+    const AstCacheHeader *h = (const AstCacheHeader *)base;
+    if (!entry_valid(base, map_size, key)) goto miss;
+
+    // The main file was hashed for the key; every header is checked here.
+    const char *strings = (const char *)base + h->strings_offset;
+    const CacheDep *deps = (const CacheDep *)(base + h->dep_offset);
+    if (deps[0].hash != main_hash) goto miss;
+    for (uint32_t i = 1; i < h->dep_count; i++) {
+        int ok;
+        if (file_hash(strings + deps[i].path, &ok) != deps[i].hash || !ok) goto miss;
+    }
+
+    FlatAST *f = &out->ast;
+    f->nodes = (FlatNode *)(base + h->node_offset);
+    f->node_count = h->node_count;
+    f->extra = (uint32_t *)(base + h->extra_offset);
+    f->extra_count = h->extra_count;
+    const uint32_t *atoms = (const uint32_t *)(base + h->atom_offset);
+    f->atoms = malloc(sizeof(const char *) * h->atom_count);
+    f->atom_count = h->atom_count;
+    f->atoms[0] = NULL;
+    for (uint32_t i = 1; i < h->atom_count; i++) f->atoms[i] = intern_cstr(strings + atoms[i]);
+    f->root = h->root;
+    out->map = base;
+    out->map_size = map_size;
+    return 1;
+
+miss:
+    munmap(base, map_size);
+    return 0;
+}
+
+int astcache_store(const char *dir, Preprocessor *pp, const FlatAST *ast) {
+    int dep_count = ppDependencyCount(pp);
+    const char *main_text;
+    size_t main_size;
+    const char *resolved = ppDependency(pp, 0, &main_text, &main_size);
+    if (strcmp(resolved, "-") == 0) return 0;
+
+    // Strings: "" first, then the atoms, then the dependency paths.
+    uint32_t *atom_at = malloc(sizeof(uint32_t) * (ast->atom_count ? ast->atom_count : 1));
+    uint64_t strings_size = 1;
+    for (uint32_t i = 0; i < ast->atom_count; i++) {
+        atom_at[i] = i && ast->atoms[i] ? (uint32_t)strings_size : 0;
+        if (atom_at[i]) strings_size += strlen(ast->atoms[i]) + 1;
+    }
+    for (int i = 0; i < dep_count; i++)
+        strings_size += strlen(ppDependency(pp, i, NULL, NULL)) + 1;
+
+    AstCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, ASTCACHE_MAGIC, sizeof(h.magic));
+    h.version = ASTCACHE_VERSION;
+    h.byte_order = BYTE_ORDER_MARK;
+    h.key = unit_key(resolved, main_text, main_size);
+    uint64_t at = align8(sizeof(AstCacheHeader));
+    h.dep_count = (uint32_t)dep_count;
+    h.dep_offset = (uint32_t)at;
+    at = align8(at + sizeof(CacheDep) * (uint64_t)dep_count);
+    h.node_count = ast->node_count;
+    h.node_offset = (uint32_t)at;
+    at = align8(at + sizeof(FlatNode) * (uint64_t)ast->node_count);
+    h.extra_count = ast->extra_count;
+    h.extra_offset = (uint32_t)at;
+    at = align8(at + sizeof(uint32_t) * (uint64_t)ast->extra_count);
+    h.atom_count = ast->atom_count;
+    h.atom_offset = (uint32_t)at;
+    at += sizeof(uint32_t) * (uint64_t)ast->atom_count;
+    h.strings_size = (uint32_t)strings_size;
+    h.strings_offset = (uint32_t)at;
+    at += strings_size;
+    if (at > UINT32_MAX) {
+        free(atom_at);
+        fprintf(stderr, "%s: error: tree too large to cache\n", resolved);
+        return -1;
+    }
+    h.file_size = (uint32_t)at;
+    h.root = ast->root;
+
+    unsigned char *buf = calloc(1, (size_t)at);
+    CacheDep *deps = (CacheDep *)(buf + h.dep_offset);
+    char *strings = (char *)buf + h.strings_offset;
+    uint32_t s = 1;
+    for (uint32_t i = 1; i < ast->atom_count; i++) {
+        if (!atom_at[i]) continue;
+        size_t len = strlen(ast->atoms[i]) + 1;
+        memcpy(strings + s, ast->atoms[i], len);
+        s += (uint32_t)len;
+    }
+    for (int i = 0; i < dep_count; i++) {
+        const char *text;
+        size_t size;
+        const char *dep = ppDependency(pp, i, &text, &size);
+        size_t len = strlen(dep) + 1;
+        deps[i].hash = hash64(HASH64_SEED, text, size);
+        deps[i].path = s;
+        memcpy(strings + s, dep, len);
+        s += (uint32_t)len;
+    }
+    memcpy(buf + h.node_offset, ast->nodes, sizeof(FlatNode) * ast->node_count);
+    memcpy(buf + h.extra_offset, ast->extra, sizeof(uint32_t) * ast->extra_count);
+    memcpy(buf + h.atom_offset, atom_at, sizeof(uint32_t) * ast->atom_count);
+    free(atom_at);
+    h.checksum = hash64(HASH64_SEED, buf + sizeof(AstCacheHeader),
+                               (size_t)at - sizeof(AstCacheHeader));
+    memcpy(buf, &h, sizeof(h));
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        perror(dir);
+        free(buf);
+        return -1;
+    }
+    char file[PATH_MAX], tmp[PATH_MAX + 32];
+    entry_path(file, sizeof(file), dir, h.key);
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", file, (long)getpid());
+    FILE *fp = fopen(tmp, "wb");
+    int rc = -1;
+    if (fp) {
+        size_t written = fwrite(buf, 1, (size_t)at, fp);
+        if (fclose(fp) == 0 && written == (size_t)at && rename(tmp, file) == 0) rc = 0;
+        else remove(tmp);
+    }
+    if (rc != 0) perror(file);
+    free(buf);
+    return rc;
+}
+
+void astcache_release(CachedAST *c) {
+    if (c->map) munmap(c->map, c->map_size);
+    free((void *)c->ast.atoms);
+    memset(c, 0, sizeof(*c));
+}
+
+#else
+
+// Entries are mapped, so the cache is not available on Windows: every
+// lookup misses and nothing is stored.
+int astcache_lookup(const char *dir, const char *path, CachedAST *out) {
+    (void)dir;
+    (void)path;
+    memset(out, 0, sizeof(*out));
+    return 0;
+}
+
+int astcache_store(const char *dir, Preprocessor *pp, const FlatAST *ast) {
+    (void)dir;
+    (void)pp;
+    (void)ast;
+    return 0;
+}
+
+void astcache_release(CachedAST *c) {
+    memset(c, 0, sizeof(*c));
+}
+
+#endif
@@ -1,95 +1,156 @@
 #include "codegen.h"
+#include "arena.h"
+#include "intern.h"
+#include "symtab.h"
+#include "flatast.h"
+#include "ir.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+
+// ---- Types ----
+// Types are hash-consed: each distinct type is built once per compilation
+// and compared by pointer. Typedef names are resolved as a type is built,
+// so no query walks a typedef chain.
+typedef enum {
+    TYPE_NAMED,     // int, char, a struct: anything with a name
+    TYPE_POINTER,
+    TYPE_ARRAY,
+} TypeKind;
+
+typedef struct Type Type;
+struct Type {
+    TypeKind kind;
+    int modifiers;      // TYPE_NAMED: TypeModifier bitmask from AST
+    int length;         // TYPE_ARRAY: element count (unknown => 0)
+    const char *name;   // TYPE_NAMED: type name (atom)
+    const Type *of;     // TYPE_POINTER: pointee; TYPE_ARRAY: element
+    const Type *named;  // the innermost TYPE_NAMED; its modifiers qualify the whole type
+    int size;           // sizeof, cached on first use (0: not yet)
+};
+
+typedef struct {
+    Type **slots;       // open addressing, at most half full
+    int cap, count;
+    Arena arena;        // the types themselves
+} TypeTable;
 
 // --- Basic struct support scaffolding ---
 typedef struct {
-    const char *name;   // member name
-    int offset;         // byte offset from base (slot-based for now)
-    int size_bytes;     // natural element size (1 for char, SLOT_SIZE for word-sized)
-    int total_size_bytes; // full storage size for the member (arrays etc.)
-    const char *base_type;  // underlying base type name
-    int pointer_level;      // pointer count for the member type
-    int is_array;           // whether member is declared as array
-    int array_length;       // first dimension length if array (0 if unknown)
+    const char *name;   // member name (atom)
+    int offset;         // in bytes, from the start of the struct
+    const Type *type;   // as declared
 } MemberInfo;
 
 typedef struct {
     const char *type_name;   // typedef name or struct name
-    MemberInfo *members;     // flat members (no nesting)
+    MemberInfo *members;
     int member_count;
-    int size_bytes;          // total size in bytes (slot-based approximation)
+    int size_bytes;          // padded to a multiple of align
+    int align;               // the strictest of the members'
 } StructInfo;
 
 typedef struct {
     const char *name;       // variable name
-    const char *base_type;  // type name (typedef/struct)
-    int pointer_level;      // explicit pointer level (excludes array levels)
-    int type_modifiers;     // bitmask of TypeModifier (const etc.)
-    int is_array;           // whether the declaration was an array
-    int array_length;       // first dimension length if array (legacy)
-    int dims[8];            // array dimensions outer->inner (unknown => 0)
-    int dims_count;
+    const Type *type;       // as declared
+    int slot;               // its frame slot in the function's IR; -1 for none
+    VReg vreg;              // the virtual register it lives in instead; 0 if none
+    int param;              // 1 + parameter index; 0 for a local
+    uint8_t addressed;      // its address is taken with &
 } LocalInfo;
 
-typedef struct {
-    const char *base_type;
-    int pointer_level;
-    int type_modifiers; // TypeModifier bitmask from AST
-    int is_array;
-    int dims[8];
-    int dims_count;
-} TypeInfo;
+// What codegen needs to know about an expression, worked out once per node
+// while the function is bound.
+typedef struct {
+    const Type *type;   // as a value (arrays decayed); NULL if not known
+    uint8_t lvalue;     // designates an object
+    uint8_t is_const;   // of const-qualified type
+    uint8_t is_byte;    // loaded and stored a byte at a time
+    uint8_t is_array;   // a struct member of array type: its value is its address
+    uint8_t is_constant; // value is known at compile time
+    int size;           // sizeof, in bytes, when the type is known
+    int32_t value;      // when is_constant
+} ExprInfo;
 
 // ---- String literal pool ----
 typedef struct {
-    char *text;     // NUL-terminated literal contents (without quotes)
+    const char *text;  // literal contents without quotes (atom)
     char *label;    // label name like s_0
 } StrItem;
 
 typedef struct {
     const char *alias;
-    TypeInfo info;
+    const Type *type;   // fully resolved
 } TypedefInfo;
 
+// A name a scope shadowed, with what it meant outside.
+typedef struct {
+    const char *name;
+    void *outer;
+} ScopeEntry;
+
 // ---- Codegen context (keeps state in one place) ----
 typedef struct {
+    const FlatAST *ast;
+    TypeTable type_table;
     StructInfo *structs;
     int struct_count;
     TypedefInfo *typedefs;
     int typedef_count;
-    LocalInfo *locals_info;
-    int locals_count;
+    // Variables of the function being generated, parameters first. Binding
+    // gives each declaration an entry with its type and frame slot, and
+    // points every IDENTIFIER and VAR_DECL node of the body at its entry
+    // (binding[node] = 1 + index; 0 for a global), so no load or store looks
+    // a name up. The same walk fills types[] for each expression.
+    LocalInfo *locals;
+    int local_count, local_cap;
+    uint32_t *binding;      // by NodeRef, for the whole tree
+    ExprInfo *types;        // by NodeRef, for the expressions bound so far
+    IRFunc *fn;             // the function being lowered; binding adds its slots
+    VReg first_temp;        // vregs below it are variables'
+    // While binding: name -> 1 + index of the innermost visible declaration,
+    // and the entries inner scopes replaced, restored when they close.
+    SymTab scope;
+    ScopeEntry *shadowed;
+    int shadowed_count, shadowed_cap;
     StrItem *strings;
     int string_count;
+    // Name -> 1 + index into the arrays above; the first entry for a name wins.
+    SymTab struct_index;
+    SymTab typedef_index;
+    SymTab string_index;
     StringBuilder data_sb; // holds emitted data bytes
     int data_sb_inited;
-    int label_counter;
-    const char *return_label;
 } CompilerContext;
 
 #define cg_structs       (cc->structs)
 #define cg_struct_count  (cc->struct_count)
 #define cg_typedefs      (cc->typedefs)
 #define cg_typedef_count (cc->typedef_count)
-#define cg_locals_info   (cc->locals_info)
-#define cg_locals_count  (cc->locals_count)
 #define cg_strings       (cc->strings)
 #define cg_string_count  (cc->string_count)
 #define cg_data_sb       (cc->data_sb)
 #define cg_data_sb_inited (cc->data_sb_inited)
 
+static void index_add(SymTab *index, const char *name, int i) {
+    if (name && !symtab_get(index, name)) symtab_put(index, name, (void *)(intptr_t)(i + 1));
+}
+
+// -1 when absent.
+static int index_find(const SymTab *index, const char *name) {
+    return (int)(intptr_t)symtab_get(index, name) - 1;
+}
+
 static const char *intern_string_literal(CompilerContext *cc, const char *s)
 {
     // deduplicate
-    for (int i = 0; i < cg_string_count; i++) {
-        if (strcmp(cg_strings[i].text, s) == 0) return cg_strings[i].label;
-    }
+    int found = index_find(&cc->string_index, s);
+    if (found >= 0) return cg_strings[found].label;
     // create new
     char buf[32];
     snprintf(buf, sizeof(buf), "s_%d", cg_string_count);
-    StrItem it = { strdup(s), strdup(buf) };
+    StrItem it = { s, strdup(buf) };
     // ensure data sb
     if (!cg_data_sb_inited) { sb_init(&cg_data_sb); cg_data_sb_inited = 1; }
     // emit data for this string as bytes plus NUL
@@ -108,1971 +169,1264 @@ static const char *intern_string_literal(CompilerContext *cc, const char *s)
 
     // store
     cg_strings = (StrItem*)realloc(cg_strings, sizeof(StrItem) * (cg_string_count + 1));
+    index_add(&cc->string_index, s, cg_string_count);
     cg_strings[cg_string_count++] = it;
     return it.label;
 }
 
 static const TypedefInfo *find_typedef(CompilerContext *cc, const char *alias) {
-    for (int i = 0; i < cg_typedef_count; i++) {
-        if (strcmp(cg_typedefs[i].alias, alias) == 0) return &cg_typedefs[i];
-    }
-    return NULL;
+    int i = index_find(&cc->typedef_index, alias);
+    return i >= 0 ? &cg_typedefs[i] : NULL;
+}
+
+static unsigned type_slot(const Type *t, int cap) {
+    uint64_t h = (uint64_t)(uintptr_t)t->name * 0x9E3779B97F4A7C15ull;
+    h ^= (uint64_t)(uintptr_t)t->of * 0xC2B2AE3D27D4EB4Full;
+    h ^= ((uint64_t)(uint32_t)t->length << 16) ^ ((uint64_t)t->modifiers << 4) ^ (uint64_t)t->kind;
+    h *= 0x9E3779B97F4A7C15ull;
+    return (unsigned)(h >> 32) & (unsigned)(cap - 1);
 }
 
-static void resolve_type(CompilerContext *cc, TypeInfo *ti) {
-    if (!ti || !ti->base_type) return;
-    for (int depth = 0; depth < 10; depth++) {
-        const TypedefInfo *td = find_typedef(cc, ti->base_type);
-        if (!td) break;
-        ti->base_type = td->info.base_type;
-        ti->pointer_level += td->info.pointer_level;
-        ti->type_modifiers |= td->info.type_modifiers;
-        if (td->info.is_array) {
-            ti->is_array = 1;
-            int offset = ti->dims_count;
-            int new_count = ti->dims_count + td->info.dims_count;
-            if (new_count > 8) new_count = 8;
-            for (int k = 0; k < td->info.dims_count && (offset + k) < 8; k++) {
-                ti->dims[offset + k] = td->info.dims[k];
-            }
-            ti->dims_count = new_count;
+static int type_equal(const Type *a, const Type *b) {
+    return a->kind == b->kind && a->modifiers == b->modifiers && a->length == b->length &&
+           a->name == b->name && a->of == b->of;
+}
+
+// The one type equal to key, made on first request.
+static const Type *intern_type(CompilerContext *cc, const Type *key) {
+    TypeTable *tt = &cc->type_table;
+    if ((tt->count + 1) * 2 > tt->cap) {
+        Type **old = tt->slots;
+        int old_cap = tt->cap;
+        tt->cap = old_cap ? old_cap * 2 : 256;
+        tt->slots = calloc((size_t)tt->cap, sizeof(Type *));
+        unsigned mask = (unsigned)tt->cap - 1;
+        for (int i = 0; i < old_cap; i++) {
+            if (!old[i]) continue;
+            unsigned k = type_slot(old[i], tt->cap);
+            while (tt->slots[k]) k = (k + 1) & mask;
+            tt->slots[k] = old[i];
         }
+        free(old);
     }
+    unsigned mask = (unsigned)tt->cap - 1;
+    unsigned i = type_slot(key, tt->cap);
+    for (; tt->slots[i]; i = (i + 1) & mask)
+        if (type_equal(tt->slots[i], key)) return tt->slots[i];
+    Type *t = arena_memdup(&tt->arena, key, sizeof(Type));
+    t->named = t->kind == TYPE_NAMED ? t : t->of->named;
+    t->size = 0;
+    tt->slots[i] = t;
+    tt->count++;
+    return t;
 }
 
-static int next_label(CompilerContext *cc) {
-    return cc->label_counter++;
+static const Type *type_named(CompilerContext *cc, const char *name, int modifiers) {
+    Type key = { .kind = TYPE_NAMED, .modifiers = modifiers, .name = name ? name : ATOM_EMPTY };
+    return intern_type(cc, &key);
 }
 
-// Argument registers for first three args
-static const char *arg_regs[] = {"r5", "r6", "r7"};
+static const Type *type_pointer(CompilerContext *cc, const Type *to) {
+    Type key = { .kind = TYPE_POINTER, .of = to };
+    return intern_type(cc, &key);
+}
 
-// (usually 4)
-#define SLOT_SIZE 4
+static const Type *type_array(CompilerContext *cc, const Type *of, int length) {
+    Type key = { .kind = TYPE_ARRAY, .of = of, .length = length > 0 ? length : 0 };
+    return intern_type(cc, &key);
+}
 
-// Get offset for parameter n (first param: n=0 → bp+4)
-static int param_offset(int n) { return -(4 + n * SLOT_SIZE); }
-// Get offset for local n (first local: n=0 → bp-4)
-static int local_offset(int n) { return -SLOT_SIZE * (n + 1); }
+// t with `modifiers` added to its innermost named type.
+static const Type *type_qualified(CompilerContext *cc, const Type *t, int modifiers) {
+    if ((t->named->modifiers | modifiers) == t->named->modifiers) return t;
+    switch (t->kind) {
+    case TYPE_POINTER: return type_pointer(cc, type_qualified(cc, t->of, modifiers));
+    case TYPE_ARRAY: return type_array(cc, type_qualified(cc, t->of, modifiers), t->length);
+    default: return type_named(cc, t->name, t->modifiers | modifiers);
+    }
+}
 
-// Find param index by name, or -1
-static int param_index(const char *name, char **params, int param_count)
-{
-    for (int i = 0; i < param_count; i++)
-        if (strcmp(name, params[i]) == 0)
-            return i;
-    return -1;
+// Arrays used as values become pointers to their first element.
+static const Type *type_decay(CompilerContext *cc, const Type *t) {
+    return t && t->kind == TYPE_ARRAY ? type_pointer(cc, t->of) : t;
 }
-static int local_index_last(const char *name, char **locals, int local_count)
-{
-    int idx = -1;
-    for (int i = 0; i < local_count; i++) {
-        if (locals[i] && strcmp(name, locals[i]) == 0) idx = i;
-    }
-    return idx;
+
+// A type name as written: a typedef's type, or the named type itself.
+static const Type *type_by_name(CompilerContext *cc, const char *name, int modifiers) {
+    const TypedefInfo *td = find_typedef(cc, name);
+    return td ? type_qualified(cc, td->type, modifiers) : type_named(cc, name, modifiers);
 }
 
-static const LocalInfo *find_local_info(CompilerContext *cc, const char *name);
+// (usually 4)
+#define SLOT_SIZE 4
+
+static const LocalInfo *node_local(CompilerContext *cc, NodeRef node) {
+    uint32_t i = cc->binding[node];
+    return i ? &cc->locals[i - 1] : NULL;
+}
 
 static const StructInfo *find_struct(CompilerContext *cc, const char *type_name);
+static const Type *type_from_ast(CompilerContext *cc, NodeRef type_node);
 
-static void gen_lvalue_addr(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-                            char **params, int param_count,
-                            char **locals, int local_count);
-                            
-static void gen_stmt(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-    char **params, int param_count,
-    char **locals, int local_count);
-
-static void gen_stmt_internal(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-    char **params, int param_count,
-    char **locals, int local_count,
-    const char *break_label,
-    const char *continue_label);
-
-// Internal function prototypes (used before their definitions)
-static void emit_load_var(CompilerContext *cc, StringBuilder *sb, const char *name, const char *target_reg,
-                          char **params, int param_count,
-                          char **locals, int local_count);
-static void emit_store_var(CompilerContext *cc, StringBuilder *sb, const char *name, const char *src_reg,
-                           char **params, int param_count,
-                           char **locals, int local_count);
-static void emit_store_to_addr(StringBuilder *sb, const char *addr_reg, const char *value_reg, int is_byte);
-static void emit_addr_of_var(CompilerContext *cc, StringBuilder *sb, const char *name, const char *target_reg,
-                             char **params, int param_count, char **locals, int local_count);
-static void emit_cond_jump(CompilerContext *cc, ASTNode *left, ASTNode *right, TokenKind op, StringBuilder *sb,
-                           char **params, int param_count, char **locals, int local_count,
-                           const char *trueLabel, const char *falseLabel);
-static void gen_expr(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-                     char **params, int param_count,
-                     char **locals, int local_count);
-static void _gen_expr(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-                      char **params, int param_count,
-                      char **locals, int local_count,
-                      int load_value);
-static void gen_expr_binop(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-                           char **params, int param_count, char **locals, int local_count);
-static void gen_call(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-                     char **params, int param_count, char **locals, int local_count);
-static void gen_if(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-                   char **params, int param_count,
-                   char **locals, int local_count,
-                   const char *break_label,
-                   const char *continue_label);
-static void gen_for(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-                    char **params, int param_count,
-                    char **locals, int local_count,
-                    const char *break_label,
-                    const char *continue_label);
-static void gen_while(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-                      char **params, int param_count,
-                      char **locals, int local_count,
-                      const char *break_label,
-                      const char *continue_label);
-static void set_localinfo_from_type(CompilerContext *cc, LocalInfo *info, ASTNode *type_node);
-static int base_type_is_char(const char *name);
-static int typeinfo_is_byte(const TypeInfo *info);
-static int infer_expr_type(CompilerContext *cc, ASTNode *expr, TypeInfo *out);
-static int pointer_step_bytes(CompilerContext *cc, const TypeInfo *info);
-static int typeinfo_elem_size_bytes(CompilerContext *cc, const TypeInfo *info);
-static int typeinfo_total_size_bytes(CompilerContext *cc, const TypeInfo *info);
-// Char/byte and struct helpers (forward decls)
-static const MemberInfo *find_member_info(CompilerContext *cc, const char *type_name, const char *member);
-static int is_char_scalar_var(CompilerContext *cc, const char *name);
-static int lvalue_is_byte(CompilerContext *cc, ASTNode *node);
-static int lvalue_is_const(CompilerContext *cc, ASTNode *node);
-static void emit_load_from_addr(StringBuilder *sb, const char *target_reg, const char *addr_reg, int is_byte);
-static void emit_store_to_addr(StringBuilder *sb, const char *addr_reg, const char *value_reg, int is_byte);
-static void emit_scale_reg_const(CompilerContext *cc, StringBuilder *sb, const char *reg, long factor);
-
-// Recursively collect all local variable names in the block and its nested statements
-static int slots_for_type(CompilerContext *cc, ASTNode *type_node)
-{
-    if (!type_node) return 1;
-    if (type_node->type == AST_TYPE_ARRAY) {
-        int elem = slots_for_type(cc, type_node->type_array.element_type);
-        int n = type_node->type_array.array_size;
-        if (n <= 0) n = 1;
-        return elem * n;
-    }
-    if (type_node->type == AST_TYPE) {
-        if (type_node->type_node.pointer_level > 0) return 1;
-        ASTNode *bt = type_node->type_node.base_type;
-        if (bt && bt->type == AST_IDENTIFIER) {
-            const StructInfo *si = find_struct(cc, bt->identifier.name);
-            if (si) {
-                if (si->size_bytes > 0)
-                    return (si->size_bytes + SLOT_SIZE - 1) / SLOT_SIZE;
-                return si->member_count > 0 ? si->member_count : 1;
-            }
-        }
-        return 1;
-    }
-    return 1;
+// ---- Struct support helpers ----
+static const StructInfo *find_struct(CompilerContext *cc, const char *type_name) {
+    int i = index_find(&cc->struct_index, type_name);
+    return i >= 0 ? &cg_structs[i] : NULL;
 }
 
-static int collect_locals(CompilerContext *cc, ASTNode *node, char **locals)
-{
-    int count = 0;
-    if (!node)
-        return 0;
-    switch (node->type)
-    {
-    case AST_BLOCK:
-        for (int i = 0; i < node->block.count; i++)
-        {
-            count += collect_locals(cc, node->block.stmts[i], locals + count);
-        }
-        break;
-    case AST_VAR_DECL: {
-        int slots = slots_for_type(cc, node->var_decl.var_type);
-        if (slots < 1) slots = 1;
-        for (int s = 0; s < slots; s++) {
-            locals[count++] = node->var_decl.name;
-        }
-        break; }
-    case AST_FOR:
-        // Collect locals from the init part (e.g. for (int i = ...))
-        if (node->for_stmt.init)
-            count += collect_locals(cc, node->for_stmt.init, locals + count);
-        // Collect from body and inc, just in case there are decls there too
-        if (node->for_stmt.body)
-            count += collect_locals(cc, node->for_stmt.body, locals + count);
-        if (node->for_stmt.inc)
-            count += collect_locals(cc, node->for_stmt.inc, locals + count);
-        break;
-    case AST_IF:
-        if (node->if_stmt.then_stmt)
-            count += collect_locals(cc, node->if_stmt.then_stmt, locals + count);
-        if (node->if_stmt.else_stmt)
-            count += collect_locals(cc, node->if_stmt.else_stmt, locals + count);
-        break;
-    // Add other cases (AST_WHILE, AST_BLOCK, etc.) if needed
-    default:
-        break;
-    }
-    return count;
+static const MemberInfo *find_member_info(CompilerContext *cc, const char *type_name, const char *member) {
+    const StructInfo *si = find_struct(cc, type_name);
+    if (!si) return NULL;
+    for (int i = 0; i < si->member_count; i++)
+        if (si->members[i].name == member) return &si->members[i];
+    return NULL;
 }
 
-// Compute offset for a variable name
-static int find_var_offset(const char *name, char **params, int param_count,
-                    char **locals, int local_count, int *is_param)
-{
-    int idx = param_index(name, params, param_count);
-    if (idx >= 0)
-    {
-        if (is_param)
-            *is_param = 1;
-        if (idx < 3)
-            return param_offset(idx);
-        return 8 + (idx - 3) * SLOT_SIZE;
-    }
-    idx = local_index_last(name, locals, local_count);
-    if (idx >= 0)
-    {
-        if (is_param)
-            *is_param = 0;
-        return local_offset(idx);
-    }
-    if (is_param)
-        *is_param = -1;
-    return 0;
+static int base_type_is_char(const char *name) {
+    return name == ATOM_CHAR;
 }
 
-static void emit_unary_inc_dec(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-                        char **params, int param_count,
-                        char **locals, int local_count)
-{
-    if (!node || node->type != AST_UNARY) {
-        fprintf(stderr, "Codegen error: emit_unary_inc_dec on non-unary node\n");
-        exit(1);
-    }
-    if (lvalue_is_const(cc, node->unary.operand)) {
-        fprintf(stderr, "Codegen error: modifying a const value is not allowed\n");
-        exit(1);
-    }
-
-    // Compute address of operand lvalue into r3
-    gen_lvalue_addr(cc, node->unary.operand, sb, "r3", params, param_count, locals, local_count);
-    int is_byte = lvalue_is_byte(cc, node->unary.operand);
-    // Load current value into r1
-    emit_load_from_addr(sb, "r1", "r3", is_byte);
-
-    int delta = 1;
-    TypeInfo operand_type = (TypeInfo){0};
-    if (infer_expr_type(cc, node->unary.operand, &operand_type) && operand_type.pointer_level > 0) {
-        delta = pointer_step_bytes(cc, &operand_type);
-    }
-
-    switch (node->unary.op) {
-    case POST_INC: {
-        // result is original value
-        if (strcmp(target_reg, "r1") != 0)
-            sb_append(sb, "  mov %s, r1\n", target_reg);
-        sb_append(sb, "  addis r1, %d\n", delta);
-        emit_store_to_addr(sb, "r3", "r1", is_byte);
-        break; }
-    case POST_DEC: {
-        if (strcmp(target_reg, "r1") != 0)
-            sb_append(sb, "  mov %s, r1\n", target_reg);
-        sb_append(sb, "  addis r1, -%d\n", delta);
-        emit_store_to_addr(sb, "r3", "r1", is_byte);
-        break; }
-    case INC: {
-        sb_append(sb, "  addis r1, %d\n", delta);
-        emit_store_to_addr(sb, "r3", "r1", is_byte);
-        if (strcmp(target_reg, "r1") != 0)
-            sb_append(sb, "  mov %s, r1\n", target_reg);
-        break; }
-    case DEC: {
-        sb_append(sb, "  addis r1, -%d\n", delta);
-        emit_store_to_addr(sb, "r3", "r1", is_byte);
-        if (strcmp(target_reg, "r1") != 0)
-            sb_append(sb, "  mov %s, r1\n", target_reg);
-        break; }
-    default:
-        fprintf(stderr, "Codegen error: unknown unary inc/dec op\n");
-        exit(1);
-    }
+static int type_is_char(const Type *t) {
+    return t->kind == TYPE_NAMED && base_type_is_char(t->name);
 }
 
-// Emit code to load variable (param/local/global) to target_reg
-static void emit_load_var(CompilerContext *cc, StringBuilder *sb, const char *name, const char *target_reg,
-                   char **params, int param_count,
-                   char **locals, int local_count)
-{
-    const LocalInfo *li_info = find_local_info(cc, name);
-    if (li_info && li_info->is_array) {
-        // arrays decay to pointers
-        emit_addr_of_var(cc, sb, name, target_reg, params, param_count, locals, local_count);
-        return;
-    }
+static int type_is_const(const Type *t) {
+    return (t->named->modifiers & TYPEMOD_CONST) != 0;
+}
 
-    int idx = param_index(name, params, param_count);
-    int offset;
-    if (idx >= 0)
-    {
-        if (idx < 3)
-        {
-            // bp-4, bp-8, bp-12…
-            offset = -(4 + idx * SLOT_SIZE);
-            sb_append(sb, "  \n; load param '%s' (arg%d, reg) into %s\n", name, idx + 1, target_reg);
-            sb_append(sb, "  mov   r3, bp\n");
-            sb_append(sb, "  addis r3, %d\n", offset);
-            emit_load_from_addr(sb, target_reg, "r3", is_char_scalar_var(cc, name));
-        }
-        else
-        {
-            // bp+N
-            offset = 8 + (idx - 3) * SLOT_SIZE;
-            sb_append(sb, "  \n; load param '%s' (arg%d, stack) into %s\n", name, idx + 1, target_reg);
-            sb_append(sb, "  mov   r3, bp\n");
-            sb_append(sb, "  addis r3, %d\n", offset);
-            emit_load_from_addr(sb, target_reg, "r3", is_char_scalar_var(cc, name));
-        }
-    }
-    else
-    {
-        int local_idx = local_index_last(name, locals, local_count);
-        if (local_idx >= 0)
-        {
-            // bp-4, bp-8, ...
-            offset = -SLOT_SIZE * (local_idx + 1);
-            sb_append(sb, "  \n; load local '%s' into %s\n", name, target_reg);
-            sb_append(sb, "  mov   r3, bp\n");
-            sb_append(sb, "  addis r3, %d\n", offset);
-            emit_load_from_addr(sb, target_reg, "r3", is_char_scalar_var(cc, name));
-        }
-        else
-        {
-            // fallback global
-            sb_append(sb, "  movi  r2, %s\n", name);
-            sb_append(sb, "  load  %s, r2\n", target_reg);
-        }
-    }
+static int type_is_unsigned(const Type *t) {
+    return (t->named->modifiers & TYPEMOD_UNSIGNED) != 0;
 }
 
-// Emit code to store target_reg to variable (param/local/global)
-static void emit_store_var(CompilerContext *cc, StringBuilder *sb, const char *name, const char *src_reg,
-                    char **params, int param_count,
-                    char **locals, int local_count)
-{
-    int is_param = 0;
-    int offset = find_var_offset(name, params, param_count, locals, local_count, &is_param);
-    if (is_param == 1 || is_param == 0)
-    {
-        sb_append(sb, "  \n; store %s to var '%s'\n", src_reg, name);
-        sb_append(sb, "  mov   r3, bp\n");
-        sb_append(sb, "  addis r3, %d\n", offset);
-        emit_store_to_addr(sb, "r3", src_reg, is_char_scalar_var(cc, name));
-    }
-    else
-    {
-        // fallback global
-        sb_append(sb, "  movi  r3, %s\n", name);
-        sb_append(sb, "  store r3, %s\n", src_reg);
-    }
+// Pointers and arrays: what arithmetic scales by the element size.
+static int type_is_indirect(const Type *t) {
+    return t->kind == TYPE_POINTER || t->kind == TYPE_ARRAY;
 }
 
-static void emit_addr_of_var(CompilerContext *cc, StringBuilder *sb, const char *name, const char *target_reg,
-                      char **params, int param_count, char **locals, int local_count)
-{
-    int is_param = 0;
-    int offset = find_var_offset(name, params, param_count, locals, local_count, &is_param);
-    if (is_param == 0) {
-        const LocalInfo *li = find_local_info(cc, name);
-        int occur = 0;
-        for (int i = 0; i < local_count; i++) {
-            if (locals[i] && strcmp(locals[i], name) == 0) occur++;
-        }
-        if ((li && li->is_array) || occur > 1) {
-            int last = local_index_last(name, locals, local_count);
-            if (last >= 0) offset = local_offset(last);
-        }
-    }
-    if (is_param == -1) {
-        sb_append(sb, "  \n; address of global '%s'\n", name);
-        sb_append(sb, "  movi %s, %s\n", target_reg, name);
-        return;
-    }
-    sb_append(sb, "  \n; address of '%s'\n", name);
-    sb_append(sb, "  mov   %s, bp\n", target_reg);
-    sb_append(sb, "  addis %s, %d\n", target_reg, offset);
-}
-
-static int is_comparison_op(TokenKind op) {
-    return op == EQ || op == NEQ || op == LT || op == GT || op == LTE || op == GTE;
-}
-
-// Emit conditional jump based on binary comparison operator
-// If the condition is true, jump to `trueLabel`
-// If the condition is false, jump to `falseLabel` (optional)
-// Supported operators: ==, !=, <, >, <=, >= using basic jz, jnz, jl, jg
-static void emit_cond_jump(CompilerContext *cc, ASTNode *left, ASTNode *right, TokenKind op, StringBuilder *sb,
-                    char **params, int param_count, char **locals, int local_count,
-                    const char *trueLabel, const char *falseLabel)
-{
-    // Generate left and right expressions into r2 and r3
-    gen_expr(cc, left, sb, "r2", params, param_count, locals, local_count);
-    gen_expr(cc, right, sb, "r3", params, param_count, locals, local_count);
-    sb_append(sb, "  cmp r2, r3\n");
+static int local_is_char_scalar(const LocalInfo *li) {
+    return type_is_char(li->type);
+}
 
-    // Emit jump instructions based on operator
-    switch (op)
-    {
-    case EQ: // ==
-        sb_append(sb, "  jz %s\n", trueLabel);
-        if (falseLabel)
-            sb_append(sb, "  jmp %s\n", falseLabel);
-        break;
-    case NEQ: // !=
-        sb_append(sb, "  jnz %s\n", trueLabel);
-        if (falseLabel)
-            sb_append(sb, "  jmp %s\n", falseLabel);
-        break;
-    case LT: // <
-        sb_append(sb, "  jl %s\n", trueLabel);
-        if (falseLabel)
-            sb_append(sb, "  jmp %s\n", falseLabel);
-        break;
-    case GT: // >
-        sb_append(sb, "  jg %s\n", trueLabel);
-        if (falseLabel)
-            sb_append(sb, "  jmp %s\n", falseLabel);
-        break;
-    case LTE: // <= → !(a > b)
-        if (falseLabel)
-            sb_append(sb, "  jg %s\n", falseLabel); // if a > b → jump to false
-        sb_append(sb, "  jmp %s\n", trueLabel);     // else → true
+static int type_size(CompilerContext *cc, const Type *t) {
+    if (t->size) return t->size;
+    int size;
+    switch (t->kind) {
+    case TYPE_POINTER:
+        size = SLOT_SIZE;
         break;
-    case GTE: // >= → !(a < b)
-        if (falseLabel)
-            sb_append(sb, "  jl %s\n", falseLabel); // if a < b → jump to false
-        sb_append(sb, "  jmp %s\n", trueLabel);     // else → true
+    case TYPE_ARRAY:
+        size = (t->length > 0 ? t->length : 1) * type_size(cc, t->of);
         break;
     default:
-        // Fallback: treat nonzero as true
-        sb_append(sb, "  jnz %s\n", trueLabel);
-        if (falseLabel)
-            sb_append(sb, "  jmp %s\n", falseLabel);
+        if (base_type_is_char(t->name)) {
+            size = 1;
+        } else {
+            const StructInfo *si = find_struct(cc, t->name);
+            size = si && si->size_bytes > 0 ? si->size_bytes : SLOT_SIZE;
+        }
         break;
     }
+    ((Type *)t)->size = size;  // the one cached field
+    return size;
 }
 
-// gen_expr: output result to target_reg (should be r5/r6/r7)
-static void gen_expr(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-              char **params, int param_count,
-              char **locals, int local_count);
+// Frame slots a variable of this type takes
+static int slots_for_type(CompilerContext *cc, const Type *t) {
+    return (type_size(cc, t) + SLOT_SIZE - 1) / SLOT_SIZE;
+}
 
-// ---- Struct support helpers ----
-static const StructInfo *find_struct(CompilerContext *cc, const char *type_name) {
-    for (int i = 0; i < cg_struct_count; i++) {
-        if (strcmp(cg_structs[i].type_name, type_name) == 0) return &cg_structs[i];
-    }
-    return NULL;
+static int type_align(CompilerContext *cc, const Type *t) {
+    while (t->kind == TYPE_ARRAY) t = t->of;
+    if (t->kind == TYPE_POINTER) return SLOT_SIZE;
+    if (base_type_is_char(t->name)) return 1;
+    const StructInfo *si = find_struct(cc, t->name);
+    return si ? si->align : SLOT_SIZE;
 }
 
-static const MemberInfo *find_member_info(CompilerContext *cc, const char *type_name, const char *member) {
-    const StructInfo *si = find_struct(cc, type_name);
-    if (!si) return NULL;
-    for (int i = 0; i < si->member_count; i++)
-        if (strcmp(si->members[i].name, member) == 0) return &si->members[i];
-    return NULL;
+// Bytes one step of pointer arithmetic on t moves.
+static int pointer_step_bytes(CompilerContext *cc, const Type *t) {
+    return type_is_indirect(t) ? type_size(cc, t->of) : 1;
 }
 
-static int base_type_is_char(const char *name) {
-    return name && strcmp(name, "char") == 0;
-}
-
-static int ast_type_is_char_scalar(ASTNode *type_node) {
-    if (!type_node || type_node->type != AST_TYPE) return 0;
-    if (type_node->type_node.pointer_level != 0) return 0;
-    ASTNode *bt = type_node->type_node.base_type;
-    if (bt && bt->type == AST_IDENTIFIER)
-        return base_type_is_char(bt->identifier.name);
-    return 0;
-}
-
-static int is_char_scalar_var(CompilerContext *cc, const char *name) {
-    const LocalInfo *li = find_local_info(cc, name);
-    return (li && li->pointer_level == 0 && !li->is_array && base_type_is_char(li->base_type));
-}
-
-static int typeinfo_is_byte(const TypeInfo *info) {
-    return info && info->pointer_level == 0 && info->dims_count == 0 && base_type_is_char(info->base_type);
-}
-
-static int infer_expr_type(CompilerContext *cc, ASTNode *expr, TypeInfo *out) {
-    if (!expr || !out) return 0;
-    out->base_type = "";
-    out->pointer_level = 0;
-    out->type_modifiers = 0;
-    out->is_array = 0;
-    out->dims_count = 0;
-    for (int i = 0; i < 8; i++) out->dims[i] = 0;
-    switch (expr->type) {
-    case AST_IDENTIFIER: {
-        const LocalInfo *li = find_local_info(cc, expr->identifier.name);
-        if (!li) return 0;
-        out->base_type = li->base_type;
-        out->pointer_level = li->pointer_level;
-        out->type_modifiers = li->type_modifiers;
-        out->is_array = li->is_array;
-        out->dims_count = li->dims_count;
-        for (int i = 0; i < li->dims_count && i < 8; i++) out->dims[i] = li->dims[i];
-        // Arrays decay to pointer-to-first-element when used as value
-        if (li->is_array && li->dims_count > 0) {
-            out->pointer_level += 1;
-            // drop the first dimension (array -> pointer to element array)
-            for (int i = 1; i < li->dims_count; i++) out->dims[i-1] = li->dims[i];
-            out->dims_count = li->dims_count - 1;
-            out->is_array = out->dims_count > 0;
-        }
-        return 1;
-    }
-    case AST_NUMBER:
-        out->base_type = "int";
-        out->pointer_level = 0;
-        out->type_modifiers = 0;
-        out->is_array = 0;
-        out->dims_count = 0;
-        return 1;
-    case AST_MEMBER_ACCESS: {
-        TypeInfo lhs = {0};
-        if (!infer_expr_type(cc, expr->member_access.lhs, &lhs)) return 0;
-        if (!lhs.base_type || lhs.base_type[0] == '\0') return 0;
-        const MemberInfo *mi = find_member_info(cc, lhs.base_type, expr->member_access.member);
-        if (!mi) return 0;
-        out->base_type = mi->base_type ? mi->base_type : "";
-        out->pointer_level = mi->pointer_level;
-        out->type_modifiers = lhs.type_modifiers;
-        out->is_array = mi->is_array;
-        if (mi->is_array) out->pointer_level += 1;
-        out->dims_count = 0;
-        return 1;
-    }
-    case AST_ARROW_ACCESS: {
-        TypeInfo lhs = {0};
-        if (!infer_expr_type(cc, expr->arrow_access.lhs, &lhs)) return 0;
-        if (lhs.pointer_level <= 0 || !lhs.base_type || lhs.base_type[0] == '\0') return 0;
-        const MemberInfo *mi = find_member_info(cc, lhs.base_type, expr->arrow_access.member);
-        if (!mi) return 0;
-        out->base_type = mi->base_type ? mi->base_type : "";
-        out->pointer_level = mi->pointer_level;
-        out->type_modifiers = lhs.type_modifiers;
-        out->is_array = mi->is_array;
-        if (mi->is_array) out->pointer_level += 1;
-        out->dims_count = 0;
-        return 1;
-    }
-    case AST_SIZEOF:
-        out->base_type = "int";
-        out->pointer_level = 0;
-        out->type_modifiers = 0;
-        out->is_array = 0;
-        out->dims_count = 0;
-        return 1;
-    case AST_BINARY: {
-        TypeInfo lhs = {0};
-        TypeInfo rhs = {0};
-        if (!infer_expr_type(cc, expr->binary.left, &lhs) ||
-            !infer_expr_type(cc, expr->binary.right, &rhs)) {
-            return 0;
-        }
+// What an array is an array of, through every dimension.
+static const Type *array_scalar(const Type *t) {
+    while (t->kind == TYPE_ARRAY) t = t->of;
+    return t;
+}
 
-        if (expr->binary.op == ADD || expr->binary.op == SUB) {
-            if (lhs.pointer_level > 0 && rhs.pointer_level == 0) {
-                *out = lhs;
-                return 1;
-            }
-            if (expr->binary.op == ADD && rhs.pointer_level > 0 && lhs.pointer_level == 0) {
-                *out = rhs;
-                return 1;
-            }
-            if (expr->binary.op == SUB && lhs.pointer_level > 0 && rhs.pointer_level > 0) {
-                out->base_type = "int";
-                out->pointer_level = 0;
-                out->is_array = 0;
-                out->dims_count = 0;
-                return 1;
-            }
-        }
+// ---- Struct layout ----
 
-        if (lhs.pointer_level == 0 && rhs.pointer_level == 0) {
-            *out = lhs;
-            return 1;
-        }
-        return 0;
-    }
-    case AST_UNARY:
-        if (expr->unary.op == ASTARISK) {
-            TypeInfo inner = {0};
-            if (!infer_expr_type(cc, expr->unary.operand, &inner)) return 0;
-            if (inner.pointer_level <= 0) return 0;
-            out->base_type = inner.base_type;
-            out->pointer_level = inner.pointer_level - 1;
-            out->type_modifiers = inner.type_modifiers;
-            out->dims_count = inner.dims_count;
-            for (int i = 0; i < inner.dims_count; i++) out->dims[i] = inner.dims[i];
-            out->is_array = (out->dims_count > 0);
-            return 1;
-        } else if (expr->unary.op == AMPERSAND) {
-            TypeInfo inner = {0};
-            if (!infer_expr_type(cc, expr->unary.operand, &inner)) return 0;
-            out->base_type = inner.base_type;
-            out->pointer_level = inner.pointer_level + 1;
-            out->type_modifiers = inner.type_modifiers;
-            out->dims_count = inner.dims_count;
-            for (int i = 0; i < inner.dims_count; i++) out->dims[i] = inner.dims[i];
-            out->is_array = inner.is_array;
-            return 1;
-        }
-        return 0;
-    case AST_TERNARY: {
-        TypeInfo t = {0};
-        if (infer_expr_type(cc, expr->ternary.then_expr, &t)) {
-            *out = t;
-            return 1;
-        }
-        if (infer_expr_type(cc, expr->ternary.else_expr, &t)) {
-            *out = t;
-            return 1;
-        }
-        return 0;
-    }
-    default:
-        return 0;
-    }
-}
-
-static int typeinfo_elem_size_bytes(CompilerContext *cc, const TypeInfo *info) {
-    if (!info || !info->base_type) return SLOT_SIZE;
-    if (base_type_is_char(info->base_type)) return 1;
-    const StructInfo *si = find_struct(cc, info->base_type);
-    if (si && si->size_bytes > 0) return si->size_bytes;
-    return SLOT_SIZE;
-}
-
-static int typeinfo_total_size_bytes(CompilerContext *cc, const TypeInfo *info) {
-    if (!info) return SLOT_SIZE;
-    if (info->pointer_level > 0 && info->dims_count == 0) return SLOT_SIZE;
-    long sz = typeinfo_elem_size_bytes(cc, info);
-    for (int i = 0; i < info->dims_count; i++) {
-        int len = info->dims[i] > 0 ? info->dims[i] : 1;
-        sz *= len;
-    }
-    if (sz <= 0) sz = SLOT_SIZE;
-    return (int)sz;
-}
-
-static int pointer_step_bytes(CompilerContext *cc, const TypeInfo *info) {
-    if (!info) return 1;
-    if (info->pointer_level <= 0) {
-        if (info->dims_count > 0) {
-            long sz = typeinfo_elem_size_bytes(cc, info);
-            for (int i = 1; i < info->dims_count; i++) {
-                int len = info->dims[i] > 0 ? info->dims[i] : 1;
-                sz *= len;
-            }
-            if (sz <= 0) sz = SLOT_SIZE;
-            return (int)sz;
-        }
-        return 1;
+static int align_up(int n, int align) {
+    return (n + align - 1) / align * align;
+}
+
+// Lays out a STRUCT or TYPEDEF_STRUCT and adds it to the struct table.
+// Members go in order, each at the first offset its alignment allows: char
+// is byte-aligned, int, pointers and structs of them SLOT_SIZE-aligned. The
+// size is padded to the strictest member alignment, so arrays of the struct
+// keep every element aligned. Structs used as members must come first.
+static void layout_struct(CompilerContext *cc, NodeRef n) {
+    int count;
+    const NodeRef *member_nodes = flat_list(cc->ast, n, &count);
+    // A declaration without members leaves the name to its definition.
+    if (count == 0) return;
+    MemberInfo *members = malloc(sizeof(MemberInfo) * count);
+    int offset = 0, align = 1;
+    for (int m = 0; m < count; m++) {
+        NodeRef mem = member_nodes[m];
+        const Type *mtype = type_named(cc, ATOM_EMPTY, 0);
+        if (flat_kind(cc->ast, mem) == AST_VAR_DECL)
+            mtype = type_from_ast(cc, flat_var_type(cc->ast, mem));
+        else if (flat_kind(cc->ast, mem) == AST_STRUCT_MEMBER && flat_struct_member_type(cc->ast, mem))
+            mtype = type_by_name(cc, flat_struct_member_type(cc->ast, mem), 0);
+        int a = type_align(cc, mtype);
+        offset = align_up(offset, a);
+        members[m].name = flat_name(cc->ast, mem) ? flat_name(cc->ast, mem) : ATOM_EMPTY;
+        members[m].offset = offset;
+        members[m].type = mtype;
+        offset += type_size(cc, mtype);
+        if (a > align) align = a;
     }
-    // pointer_level > 0
-    if (info->dims_count > 0) {
-        return typeinfo_total_size_bytes(cc, info);
+    cg_structs = (StructInfo*)realloc(cg_structs, sizeof(StructInfo) * (cg_struct_count + 1));
+    index_add(&cc->struct_index, flat_name(cc->ast, n), cg_struct_count);
+    cg_structs[cg_struct_count].type_name = flat_name(cc->ast, n);
+    cg_structs[cg_struct_count].members = members;
+    cg_structs[cg_struct_count].member_count = count;
+    cg_structs[cg_struct_count].size_bytes = align_up(offset, align);
+    cg_structs[cg_struct_count].align = align;
+    cg_struct_count++;
+}
+
+// The type a TYPE or TYPE_ARRAY node spells, typedefs resolved.
+static const Type *type_from_ast(CompilerContext *cc, NodeRef type_node) {
+    // TYPE_ARRAY nodes nest the last dimension outermost: int a[3][2] is
+    // [2] of [3] of int. Arrays are built from the element type out.
+    NodeRef node = type_node;
+    while (node && flat_kind(cc->ast, node) == AST_TYPE_ARRAY) node = flat_array_element(cc->ast, node);
+    const Type *t = type_named(cc, ATOM_EMPTY, 0);
+    if (node && flat_kind(cc->ast, node) == AST_TYPE) {
+        NodeRef bt = flat_type_base(cc->ast, node);
+        const char *name = bt && flat_kind(cc->ast, bt) == AST_IDENTIFIER ? flat_name(cc->ast, bt) : ATOM_EMPTY;
+        t = type_by_name(cc, name, flat_type_modifiers(cc->ast, node));
+        for (int i = 0; i < flat_type_pointer_level(cc->ast, node); i++) t = type_pointer(cc, t);
     }
-    if (info->pointer_level > 1) return SLOT_SIZE; // pointer to pointer etc.
-    return typeinfo_elem_size_bytes(cc, info);
+    for (NodeRef dim = type_node; dim != node; dim = flat_array_element(cc->ast, dim))
+        t = type_array(cc, t, flat_array_size(cc->ast, dim));
+    return t;
 }
 
-static int array_element_size_bytes(ASTNode *array_type) {
-    if (!array_type || array_type->type != AST_TYPE_ARRAY) return SLOT_SIZE;
-    ASTNode *elem = array_type->type_array.element_type;
-    if (ast_type_is_char_scalar(elem)) return 1;
-    return SLOT_SIZE;
+// ---- Expression annotations ----
+
+static const ExprInfo *expr_info(CompilerContext *cc, NodeRef node) {
+    return &cc->types[node];
 }
 
-static int array_total_elements(ASTNode *array_type) {
-    if (!array_type || array_type->type != AST_TYPE_ARRAY) return 1;
-    int n = array_type->type_array.array_size > 0 ? array_type->type_array.array_size : 1;
-    return n * array_total_elements(array_type->type_array.element_type);
+// NULL when the type is not known.
+static const Type *expr_type(CompilerContext *cc, NodeRef node) {
+    return cc->types[node].type;
 }
 
-static int lvalue_is_byte(CompilerContext *cc, ASTNode *node) {
-    TypeInfo info = (TypeInfo){0};
-    if (!infer_expr_type(cc, node, &info)) return 0;
-    return typeinfo_is_byte(&info);
-}
-
-static int lvalue_is_const(CompilerContext *cc, ASTNode *node) {
-    TypeInfo info = (TypeInfo){0};
-    if (!infer_expr_type(cc, node, &info)) return 0;
-    return (info.type_modifiers & TYPEMOD_CONST) != 0;
-}
-
-static void emit_load_from_addr(StringBuilder *sb, const char *target_reg, const char *addr_reg, int is_byte) {
-    if (is_byte)
-        sb_append(sb, "  loadb %s, %s\n", target_reg, addr_reg);
-    else
-        sb_append(sb, "  load %s, %s\n", target_reg, addr_reg);
+static int lvalue_is_byte(CompilerContext *cc, NodeRef node) {
+    return cc->types[node].is_byte;
 }
 
-static void emit_store_to_addr(StringBuilder *sb, const char *addr_reg, const char *value_reg, int is_byte) {
-    if (is_byte)
-        sb_append(sb, "  storeb %s, %s\n", addr_reg, value_reg);
-    else
-        sb_append(sb, "  store %s, %s\n", addr_reg, value_reg);
+static int lvalue_is_const(CompilerContext *cc, NodeRef node) {
+    return cc->types[node].is_const;
 }
 
-static void emit_scale_reg_const(CompilerContext *cc, StringBuilder *sb, const char *reg, long factor) {
-    if (factor == 1) return;
-    if (factor <= 0) {
-        sb_append(sb, "  ; unsupported scale factor %ld\n", factor);
-        return;
-    }
-    sb_append(sb, "  ; scale %s by %ld\n", reg, factor);
-    sb_append(sb, "  mov r4, %s\n", reg);
-    sb_append(sb, "  movi %s, 0\n", reg);
-    sb_append(sb, "  movi r5, %ld\n", factor);
-    int lbl = next_label(cc);
-    sb_append(sb, "b_idx_mul_%d:\n", lbl);
-    sb_append(sb, "  cmp r5, 0\n");
-    sb_append(sb, "  jz b_idx_mul_end_%d\n", lbl);
-    sb_append(sb, "  add %s, r4\n", reg);
-    sb_append(sb, "  addis r5, -1\n");
-    sb_append(sb, "  jmp b_idx_mul_%d\n", lbl);
-    sb_append(sb, "b_idx_mul_end_%d:\n", lbl);
-}
-
-static const LocalInfo *find_local_info(CompilerContext *cc, const char *name) {
-    for (int i = 0; i < cg_locals_count; i++) {
-        if (strcmp(cg_locals_info[i].name, name) == 0) return &cg_locals_info[i];
-    }
-    return NULL;
+// Member `member` of a struct type, or NULL.
+static const MemberInfo *member_of(CompilerContext *cc, const Type *record, const char *member) {
+    if (!record || record->kind != TYPE_NAMED || record->name[0] == '\0') return NULL;
+    return find_member_info(cc, record->name, member);
+}
+
+// The struct a MEMBER_ACCESS or ARROW_ACCESS reads from, or NULL.
+static const Type *accessed_record(CompilerContext *cc, NodeRef node) {
+    const Type *lhs = expr_type(cc, flat_lhs(cc->ast, node));
+    if (lhs && flat_kind(cc->ast, node) == AST_ARROW_ACCESS)
+        lhs = lhs->kind == TYPE_POINTER ? lhs->of : NULL;
+    return lhs && lhs->kind == TYPE_NAMED && lhs->name[0] != '\0' ? lhs : NULL;
 }
 
-static void set_localinfo_from_type(CompilerContext *cc, LocalInfo *info, ASTNode *type_node) {
-    if (!info) return;
-    info->base_type = "";
-    info->pointer_level = 0;
-    info->type_modifiers = 0;
-    info->is_array = 0;
-    info->array_length = 0;
-    info->dims_count = 0;
-    for (int i = 0; i < 8; i++) info->dims[i] = 0;
-    if (!type_node) return;
-
-    // Collect array dimensions from inner-most to outer-most then reverse
-    int tmp_dims[8] = {0};
-    int tmp_count = 0;
-    ASTNode *node = type_node;
-    while (node && node->type == AST_TYPE_ARRAY && tmp_count < 8) {
-        tmp_dims[tmp_count++] = node->type_array.array_size;
-        node = node->type_array.element_type;
+// Annotates an expression from the annotations of its operands, which are
+// already in place: bind_node calls this on the way back up.
+static void annotate_expr(CompilerContext *cc, NodeRef expr) {
+    const FlatAST *ast = cc->ast;
+    ExprInfo *e = &cc->types[expr];
+    const Type *t = NULL;
+    memset(e, 0, sizeof(*e));
+    switch (flat_kind(ast, expr)) {
+    case AST_IDENTIFIER: {
+        e->lvalue = 1;
+        const LocalInfo *li = node_local(cc, expr);
+        if (!li) return;
+        // sizeof sees the array itself
+        e->size = type_size(cc, li->type);
+        t = type_decay(cc, li->type);
+        break;
     }
-    if (tmp_count > 0) info->is_array = 1;
-    for (int i = 0; i < tmp_count; i++) {
-        int dim = tmp_dims[tmp_count - 1 - i]; // reverse so dims[0] is outer-most
-        info->dims[i] = dim;
-        if (i == 0 && info->array_length == 0 && dim > 0) {
-            info->array_length = dim;
-        }
-        info->dims_count++;
+    case AST_NUMBER:
+        t = type_named(cc, ATOM_INT, (flat_number_flags(ast, expr) & NUM_UNSIGNED) ? TYPEMOD_UNSIGNED : 0);
+        break;
+    case AST_CHAR_LITERAL:
+        t = type_named(cc, ATOM_INT, 0);
+        break;
+    case AST_MEMBER_ACCESS:
+    case AST_ARROW_ACCESS: {
+        e->lvalue = 1;
+        const Type *record = accessed_record(cc, expr);
+        const MemberInfo *mi = member_of(cc, record, flat_member(ast, expr));
+        if (!mi) return;
+        e->is_array = mi->type->kind == TYPE_ARRAY;
+        e->size = type_size(cc, mi->type);
+        t = type_decay(cc, type_qualified(cc, mi->type, record->modifiers & TYPEMOD_CONST));
+        break;
     }
-
-    if (node->type == AST_TYPE) {
-        ASTNode *bt = node->type_node.base_type;
-        if (bt && bt->type == AST_IDENTIFIER) {
-            info->base_type = bt->identifier.name;
-        }
-        info->pointer_level = node->type_node.pointer_level;
-        info->type_modifiers = node->type_node.type_modifiers;
-    } else {
-        info->pointer_level = 0;
-    }
-
-    // Resolve typedefs
-    TypeInfo ti;
-    ti.base_type = info->base_type;
-    ti.pointer_level = info->pointer_level;
-    ti.type_modifiers = info->type_modifiers;
-    ti.is_array = info->is_array;
-    ti.dims_count = info->dims_count;
-    for(int i=0; i<8; i++) ti.dims[i] = info->dims[i];
-
-    resolve_type(cc, &ti);
-
-    info->base_type = ti.base_type;
-    info->pointer_level = ti.pointer_level;
-    info->type_modifiers = ti.type_modifiers;
-    info->is_array = ti.is_array;
-    info->dims_count = ti.dims_count;
-    for(int i=0; i<8; i++) info->dims[i] = ti.dims[i];
-    if (info->is_array && info->dims_count > 0) info->array_length = info->dims[0];
-}
-
-static int collect_local_type_info(CompilerContext *cc, ASTNode *node, LocalInfo *arr) {
-    int n = 0;
-    if (!node) return 0;
-    switch (node->type) {
-    case AST_BLOCK:
-        for (int i = 0; i < node->block.count; i++)
-            n += collect_local_type_info(cc, node->block.stmts[i], arr ? (arr + n) : NULL);
+    case AST_SIZEOF:
+        t = type_named(cc, ATOM_INT, 0);
         break;
-    case AST_VAR_DECL:
-        if (arr) {
-            arr[n].name = node->var_decl.name;
-            set_localinfo_from_type(cc, &arr[n], node->var_decl.var_type);
-        }
-        n++;
+    case AST_BINARY: {
+        const Type *lhs = type_decay(cc, expr_type(cc, flat_left(ast, expr)));
+        const Type *rhs = type_decay(cc, expr_type(cc, flat_right(ast, expr)));
+        if (!lhs || !rhs) return;
+        TokenKind op = flat_op(ast, expr);
+        int lp = lhs->kind == TYPE_POINTER, rp = rhs->kind == TYPE_POINTER;
+        if ((op == ADD || op == SUB) && lp && !rp) t = lhs;
+        else if (op == ADD && rp && !lp) t = rhs;
+        else if (op == SUB && lp && rp) t = type_named(cc, ATOM_INT, 0);
+        else if (!lp && !rp) t = lhs;
+        else return;
         break;
-    case AST_FOR:
-        if (node->for_stmt.init)
-            n += collect_local_type_info(cc, node->for_stmt.init, arr ? (arr + n) : NULL);
-        n += collect_local_type_info(cc, node->for_stmt.body, arr ? (arr + n) : NULL);
-        if (node->for_stmt.inc)
-            n += collect_local_type_info(cc, node->for_stmt.inc, arr ? (arr + n) : NULL);
+    }
+    case AST_UNARY: {
+        NodeRef operand = flat_operand(ast, expr);
+        const Type *inner = expr_type(cc, operand);
+        if (flat_op(ast, expr) == ASTARISK) {
+            e->lvalue = 1;
+            inner = type_decay(cc, inner);
+            if (!inner || inner->kind != TYPE_POINTER) return;
+            t = inner->of;
+        } else if (flat_op(ast, expr) == AMPERSAND) {
+            // &array points at the array, not at its first element
+            const LocalInfo *li = flat_kind(ast, operand) == AST_IDENTIFIER ? node_local(cc, operand) : NULL;
+            if (li) inner = li->type;
+            if (!inner) return;
+            t = type_pointer(cc, inner);
+        } else if (flat_op(ast, expr) == SUB || flat_op(ast, expr) == BITNOT) {
+            t = type_decay(cc, inner);
+            if (!t) return;
+        } else if (flat_op(ast, expr) == NOT) {
+            t = type_named(cc, ATOM_INT, 0);
+        } else {
+            return;
+        }
         break;
-    case AST_IF:
-        n += collect_local_type_info(cc, node->if_stmt.then_stmt, arr ? (arr + n) : NULL);
-        if (node->if_stmt.else_stmt)
-            n += collect_local_type_info(cc, node->if_stmt.else_stmt, arr ? (arr + n) : NULL);
+    }
+    case AST_TERNARY:
+        t = expr_type(cc, flat_then(ast, expr));
+        if (!t) t = expr_type(cc, flat_else(ast, expr));
+        if (!t) return;
         break;
     default:
+        return;
+    }
+    e->type = t;
+    e->is_const = type_is_const(t);
+    e->is_byte = type_is_char(t);
+    if (!e->size) e->size = type_size(cc, t);
+}
+
+// ---- Constant folding ----
+
+// A binary operation with an unsigned operand is done unsigned.
+static int binary_is_unsigned(CompilerContext *cc, NodeRef node) {
+    const Type *l = expr_info(cc, flat_left(cc->ast, node))->type;
+    const Type *r = expr_info(cc, flat_right(cc->ast, node))->type;
+    return (l && type_is_unsigned(l)) || (r && type_is_unsigned(r));
+}
+
+// The value of a BINARY on two folded operands; 0 when it is left to run.
+static int fold_binary(CompilerContext *cc, NodeRef expr, uint32_t *out) {
+    const FlatAST *ast = cc->ast;
+    const ExprInfo *l = expr_info(cc, flat_left(ast, expr));
+    const ExprInfo *r = expr_info(cc, flat_right(ast, expr));
+    TokenKind op = flat_op(ast, expr);
+    // Once the left side decides, the right is never evaluated.
+    if (op == LAND && l->is_constant && l->value == 0) { *out = 0; return 1; }
+    if (op == LOR && l->is_constant && l->value != 0) { *out = 1; return 1; }
+    if (!l->is_constant || !r->is_constant) return 0;
+    uint32_t a = (uint32_t)l->value, b = (uint32_t)r->value;
+    int32_t sa = l->value, sb = r->value;
+    int is_unsigned = binary_is_unsigned(cc, expr);
+    switch (op) {
+    case ADD: *out = a + b; break;
+    case SUB: *out = a - b; break;
+    case ASTARISK: *out = a * b; break;
+    case DIV:
+    case MOD:
+        if (b == 0) return 0;
+        if (is_unsigned) *out = op == DIV ? a / b : a % b;
+        else if (sa == INT32_MIN && sb == -1) *out = op == DIV ? a : 0;
+        else *out = (uint32_t)(op == DIV ? sa / sb : sa % sb);
+        break;
+    case AMPERSAND: *out = a & b; break;
+    case BITOR: *out = a | b; break;
+    case BITXOR: *out = a ^ b; break;
+    case LSH:
+        if (b > 31) return 0;
+        *out = a << b;
         break;
+    case RSH:
+        if (b > 31) return 0;
+        *out = a >> b;
+        break;
+    case EQ: *out = a == b; break;
+    case NEQ: *out = a != b; break;
+    case LT: *out = is_unsigned ? a < b : sa < sb; break;
+    case GT: *out = is_unsigned ? a > b : sa > sb; break;
+    case LTE: *out = is_unsigned ? a <= b : sa <= sb; break;
+    case GTE: *out = is_unsigned ? a >= b : sa >= sb; break;
+    case LAND: *out = a && b; break;
+    case LOR: *out = a || b; break;
+    default: return 0;
     }
-    return n;
+    return 1;
 }
 
-static void gen_lvalue_addr(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-                            char **params, int param_count,
-                            char **locals, int local_count) {
-    if (!node) { sb_append(sb, "  ; gen_lvalue_addr: null\n"); return; }
-    switch (node->type) {
-    case AST_IDENTIFIER: {
-        emit_addr_of_var(cc, sb, node->identifier.name, target_reg, params, param_count, locals, local_count);
+// Marks expr constant when its value follows from its operands', which are
+// folded first. Values are int: arithmetic wraps at 32 bits, and `>>` shifts
+// in zeros, as shr does. A division by zero or a shift by more than 31 is
+// left to run. Codegen loads a constant expression with one movi.
+static void fold_expr(CompilerContext *cc, NodeRef expr) {
+    const FlatAST *ast = cc->ast;
+    uint32_t v;
+    switch (flat_kind(ast, expr)) {
+    case AST_NUMBER:
+        if (flat_number_flags(ast, expr) & NUM_FLOAT) return;
+        v = (uint32_t)flat_number_ival(ast, expr);
+        break;
+    case AST_CHAR_LITERAL:
+        v = flat_name(ast, expr) ? (unsigned char)flat_name(ast, expr)[0] : 0;
+        break;
+    case AST_SIZEOF: {
+        // The operand is not evaluated, so it need not be constant.
+        NodeRef operand_node = flat_expr(ast, expr);
+        const ExprInfo *operand = expr_info(cc, operand_node);
+        if (flat_kind(ast, operand_node) == AST_TYPE)
+            v = (uint32_t)type_size(cc, type_from_ast(cc, operand_node));
+        else if (operand->type)
+            v = (uint32_t)operand->size;
+        else
+            v = SLOT_SIZE; // a global: untyped here, and stored in one slot
         break; }
     case AST_UNARY: {
-        if (node->unary.op == ASTARISK) {
-            // address is the value of operand
-            gen_expr(cc, node->unary.operand, sb, target_reg, params, param_count, locals, local_count);
-        } else {
-            sb_append(sb, "  ; unsupported lvalue op\n");
-        }
-        break; }
-    case AST_MEMBER_ACCESS: {
-        TypeInfo lhs_type = (TypeInfo){0};
-        if (!infer_expr_type(cc, node->member_access.lhs, &lhs_type) ||
-            !lhs_type.base_type || lhs_type.base_type[0] == '\0') {
-            sb_append(sb, "  ; unknown member base type\n");
-            break;
-        }
-        const MemberInfo *mi = find_member_info(cc, lhs_type.base_type, node->member_access.member);
-        if (!mi) {
-            sb_append(sb, "  ; unknown member %s of %s\n", node->member_access.member, lhs_type.base_type);
-            break;
+        const ExprInfo *operand = expr_info(cc, flat_operand(ast, expr));
+        if (!operand->is_constant) return;
+        uint32_t x = (uint32_t)operand->value;
+        switch (flat_op(ast, expr)) {
+        case SUB: v = 0u - x; break;
+        case BITNOT: v = ~x; break;
+        case NOT: v = x == 0; break;
+        default: return;
         }
-        gen_lvalue_addr(cc, node->member_access.lhs, sb, target_reg, params, param_count, locals, local_count);
-        sb_append(sb, "  addis %s, %d\n", target_reg, mi->offset);
         break; }
-    case AST_ARROW_ACCESS: {
-        TypeInfo lhs_type = (TypeInfo){0};
-        if (!infer_expr_type(cc, node->arrow_access.lhs, &lhs_type) ||
-            lhs_type.pointer_level <= 0 ||
-            !lhs_type.base_type || lhs_type.base_type[0] == '\0') {
-            sb_append(sb, "  ; unknown pointer base for arrow access\n");
-            break;
-        }
-        const MemberInfo *mi = find_member_info(cc, lhs_type.base_type, node->arrow_access.member);
-        if (!mi) {
-            sb_append(sb, "  ; unknown member %s of %s\n", node->arrow_access.member, lhs_type.base_type);
-            break;
-        }
-        gen_expr(cc, node->arrow_access.lhs, sb, target_reg, params, param_count, locals, local_count);
-        sb_append(sb, "  addis %s, %d\n", target_reg, mi->offset);
+    case AST_BINARY:
+        if (!fold_binary(cc, expr, &v)) return;
+        break;
+    case AST_TERNARY: {
+        const ExprInfo *cond = expr_info(cc, flat_cond(ast, expr));
+        if (!cond->is_constant) return;
+        const ExprInfo *taken = expr_info(cc, cond->value ? flat_then(ast, expr) : flat_else(ast, expr));
+        if (!taken->is_constant) return;
+        v = (uint32_t)taken->value;
         break; }
     default:
-        sb_append(sb, "  ; unsupported lvalue kind: %s\n", astType2str(node->type));
+        return;
     }
+    cc->types[expr].is_constant = 1;
+    cc->types[expr].value = (int32_t)v;
 }
 
-static void gen_expr_binop(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-                    char **params, int param_count, char **locals, int local_count)
-{
-    if (node->binary.op == LAND) {
-        int label = next_label(cc);
-        char label_false[32], label_end[32];
-        snprintf(label_false, sizeof(label_false), "b_land_false_%d", label);
-        snprintf(label_end, sizeof(label_end), "b_land_end_%d", label);
-
-        gen_expr(cc, node->binary.left, sb, "r1", params, param_count, locals, local_count);
-        sb_append(sb, "  cmp r1, 0\n");
-        sb_append(sb, "  jz %s\n", label_false);
-
-        gen_expr(cc, node->binary.right, sb, "r1", params, param_count, locals, local_count);
-        sb_append(sb, "  cmp r1, 0\n");
-        sb_append(sb, "  jz %s\n", label_false);
-
-        sb_append(sb, "  movi r1, 1\n");
-        sb_append(sb, "  jmp %s\n", label_end);
-        sb_append(sb, "%s:\n", label_false);
-        sb_append(sb, "  movi r1, 0\n");
-        sb_append(sb, "%s:\n", label_end);
-
-        if (strcmp(target_reg, "r1") != 0)
-            sb_append(sb, "  mov %s, r1\n", target_reg);
-        return;
-    }
-
-    if (node->binary.op == LOR) {
-        int label = next_label(cc);
-        char label_true[32], label_end[32];
-        snprintf(label_true, sizeof(label_true), "b_lor_true_%d", label);
-        snprintf(label_end, sizeof(label_end), "b_lor_end_%d", label);
-
-        gen_expr(cc, node->binary.left, sb, "r1", params, param_count, locals, local_count);
-        sb_append(sb, "  cmp r1, 0\n");
-        sb_append(sb, "  jnz %s\n", label_true);
-
-        gen_expr(cc, node->binary.right, sb, "r1", params, param_count, locals, local_count);
-        sb_append(sb, "  cmp r1, 0\n");
-        sb_append(sb, "  jnz %s\n", label_true);
-
-        sb_append(sb, "  movi r1, 0\n");
-        sb_append(sb, "  jmp %s\n", label_end);
-        sb_append(sb, "%s:\n", label_true);
-        sb_append(sb, "  movi r1, 1\n");
-        sb_append(sb, "%s:\n", label_end);
-
-        if (strcmp(target_reg, "r1") != 0)
-            sb_append(sb, "  mov %s, r1\n", target_reg);
-        return;
-    }
-
-    // Pointer arithmetic with constant index: scale by element size
-    TypeInfo lhs_t = {0}, rhs_t = {0};
-    int lhs_ptr = infer_expr_type(cc, node->binary.left, &lhs_t) &&
-                  (lhs_t.pointer_level > 0 || lhs_t.dims_count > 0);
-    int rhs_ptr = infer_expr_type(cc, node->binary.right, &rhs_t) &&
-                  (rhs_t.pointer_level > 0 || rhs_t.dims_count > 0);
-    if ((node->binary.op == ADD || node->binary.op == SUB) && lhs_ptr != rhs_ptr) {
-        ASTNode *ptr_expr = lhs_ptr ? node->binary.left : node->binary.right;
-        ASTNode *idx_expr = lhs_ptr ? node->binary.right : node->binary.left;
-        TypeInfo *ptr_t = lhs_ptr ? &lhs_t : &rhs_t;
-        long step = pointer_step_bytes(cc, ptr_t);
-        if (idx_expr->type == AST_NUMBER) {
-            long idx_val = strtol(idx_expr->number.value, NULL, 10);
-            long offset = idx_val * step;
-            if (node->binary.op == SUB && lhs_ptr) offset = -offset;
-            gen_expr(cc, ptr_expr, sb, target_reg, params, param_count, locals, local_count);
-            if (offset != 0) {
-                sb_append(sb, "  addis %s, %ld\n", target_reg, offset);
-            }
-            return;
-        } else {
-            // dynamic index
-            gen_expr(cc, ptr_expr, sb, target_reg, params, param_count, locals, local_count);
-            gen_expr(cc, idx_expr, sb, "r1", params, param_count, locals, local_count);
-            emit_scale_reg_const(cc, sb, "r1", step);
-            if (node->binary.op == SUB && lhs_ptr) {
-                sb_append(sb, "  sub %s, r1\n", target_reg);
-            } else {
-                sb_append(sb, "  add %s, r1\n", target_reg);
-            }
-            return;
-        }
+// ---- Binding ----
+
+static int add_local(CompilerContext *cc, const char *name, NodeRef type_node) {
+    if (cc->local_count == cc->local_cap) {
+        cc->local_cap = cc->local_cap ? cc->local_cap * 2 : 32;
+        cc->locals = realloc(cc->locals, sizeof(LocalInfo) * cc->local_cap);
     }
+    LocalInfo *li = &cc->locals[cc->local_count];
+    memset(li, 0, sizeof(*li));
+    li->name = name;
+    li->type = type_from_ast(cc, type_node);
+    return cc->local_count++;
+}
 
-    // --- Generate code for the left-hand operand ---
-    // If the operand is *ptr (dereference), we need to:
-    //   1. Evaluate the inner expression to get the address
-    //   2. Load the value from that address
-    if (node->binary.left->type == AST_UNARY &&
-        node->binary.left->unary.op == ASTARISK) {
-        gen_expr(cc, node->binary.left->unary.operand, sb, "r2", params, param_count, locals, local_count);
-        int isb = lvalue_is_byte(cc, node->binary.left);
-        emit_load_from_addr(sb, "r2", "r2", isb);
-    } else {
-        gen_expr(cc, node->binary.left, sb, "r2", params, param_count, locals, local_count);
-    }
-
-    // Preserve left operand across right evaluation (calls clobber r2)
-    sb_append(sb, "  push r2\n");
-
-    // --- Generate code for the right-hand operand ---
-    if (node->binary.right->type == AST_UNARY &&
-        node->binary.right->unary.op == ASTARISK) {
-        gen_expr(cc, node->binary.right->unary.operand, sb, "r1", params, param_count, locals, local_count);
-        int isb = lvalue_is_byte(cc, node->binary.right);
-        emit_load_from_addr(sb, "r1", "r1", isb);
-    } else {
-        gen_expr(cc, node->binary.right, sb, "r1", params, param_count, locals, local_count);
-    }
-
-    sb_append(sb, "  pop r2\n");
-
+static void scope_declare(CompilerContext *cc, const char *name, int index) {
+    if (cc->shadowed_count == cc->shadowed_cap) {
+        cc->shadowed_cap = cc->shadowed_cap ? cc->shadowed_cap * 2 : 32;
+        cc->shadowed = realloc(cc->shadowed, sizeof(ScopeEntry) * cc->shadowed_cap);
+    }
+    cc->shadowed[cc->shadowed_count++] = (ScopeEntry){ name, symtab_get(&cc->scope, name) };
+    symtab_put(&cc->scope, name, (void *)(intptr_t)(index + 1));
+}
 
-    switch (node->binary.op)
-    {
-    case ADD:
-        sb_append(sb, "\n; addition\n  add  r1, r2\n");
+// Closes the scopes opened since shadowed_count was `mark`.
+static void scope_close(CompilerContext *cc, int mark) {
+    while (cc->shadowed_count > mark) {
+        ScopeEntry *e = &cc->shadowed[--cc->shadowed_count];
+        symtab_put(&cc->scope, e->name, e->outer);
+    }
+}
+
+static void bind_node(CompilerContext *cc, NodeRef node);
+
+static void bind_list(CompilerContext *cc, NodeRef node) {
+    int count;
+    const NodeRef *items = flat_list(cc->ast, node, &count);
+    for (int i = 0; i < count; i++) bind_node(cc, items[i]);
+}
+
+static void bind_node(CompilerContext *cc, NodeRef node) {
+    if (!node) return;
+    const FlatAST *ast = cc->ast;
+    switch (flat_kind(ast, node)) {
+    case AST_IDENTIFIER:
+        cc->binding[node] = (uint32_t)(intptr_t)symtab_get(&cc->scope, flat_name(ast, node));
         break;
-    case SUB:
-        sb_append(sb, "\n; subtraction\n  sub  r2, r1\n");
-        sb_append(sb, "  mov r1, r2\n");
+    case AST_VAR_DECL: {
+        int i = add_local(cc, flat_name(ast, node), flat_var_type(ast, node));
+        scope_declare(cc, flat_name(ast, node), i);
+        cc->binding[node] = (uint32_t)i + 1;
+        bind_node(cc, flat_var_init(ast, node));
+        break; }
+    case AST_BLOCK: {
+        int mark = cc->shadowed_count;
+        bind_list(cc, node);
+        scope_close(cc, mark);
+        break; }
+    case AST_INIT_LIST:
+    case AST_CALL:
+        bind_list(cc, node);
         break;
-    case ASTARISK:
-        sb_append(sb, "\n; multiply r2 * r1\n");
-        sb_append(sb, "  movi r4, 0      ; r4 = result\n");
-        sb_append(sb, "  mov r5, r1     ; r5 = count\n");
-        int lbl_mul = next_label(cc);
-        sb_append(sb, "b_mul_loop_%d:\n", lbl_mul);
-        sb_append(sb, "  cmp r5, 0\n");
-        sb_append(sb, "  jz b_mul_end_%d\n", lbl_mul);
-        sb_append(sb, "  add r4, r2\n");
-        sb_append(sb, "  addis r5, -1\n");
-        sb_append(sb, "  jmp b_mul_loop_%d\n", lbl_mul);
-        sb_append(sb, "b_mul_end_%d:\n", lbl_mul);
-        sb_append(sb, "  mov r1, r4\n");
+    case AST_FOR: {
+        int mark = cc->shadowed_count;
+        bind_node(cc, flat_for_init(ast, node));
+        bind_node(cc, flat_cond(ast, node));
+        bind_node(cc, flat_for_inc(ast, node));
+        bind_node(cc, flat_body(ast, node));
+        scope_close(cc, mark);
+        break; }
+    case AST_IF:
+    case AST_TERNARY:
+        bind_node(cc, flat_cond(ast, node));
+        bind_node(cc, flat_then(ast, node));
+        bind_node(cc, flat_else(ast, node));
         break;
-    case DIV:
-        sb_append(sb, "\n; divide r2 / r1\n");
-        sb_append(sb, "  movi r4, 0      ; r4 = result (quotient)\n");
-        int lbl_div = next_label(cc);
-        sb_append(sb, "b_div_loop_%d:\n", lbl_div);
-        sb_append(sb, "  cmp r2, r1\n");
-        sb_append(sb, "  jl b_div_end_%d\n", lbl_div);
-        sb_append(sb, "  sub r2, r1\n");
-        sb_append(sb, "  addis r4, 1\n");
-        sb_append(sb, "  jmp b_div_loop_%d\n", lbl_div);
-        sb_append(sb, "b_div_end_%d:\n", lbl_div);
-        sb_append(sb, "  mov r1, r4\n");
+    case AST_WHILE:
+    case AST_DO_WHILE:
+        bind_node(cc, flat_cond(ast, node));
+        bind_node(cc, flat_body(ast, node));
         break;
-    case MOD:
-        sb_append(sb, "\n; modulo r2 %% r1\n");
-        sb_append(sb, "  mov r6, r2     ; r6 = dividend backup (r2)\n");
-        sb_append(sb, "  movi r4, 0      ; r4 = result (quotient)\n");
-        int lbl_mod = next_label(cc);
-        sb_append(sb, "b_mod_loop_%d:\n", lbl_mod);
-        sb_append(sb, "  cmp r2, r1\n");
-        sb_append(sb, "  jl b_mod_end_%d\n", lbl_mod);
-        sb_append(sb, "  sub r2, r1\n");
-        sb_append(sb, "  addis r4, 1\n");
-        sb_append(sb, "  jmp b_mod_loop_%d\n", lbl_mod);
-        sb_append(sb, "b_mod_end_%d:\n", lbl_mod);
-        sb_append(sb, "  ; r2 now contains remainder\n");
-        sb_append(sb, "  mov r1, r2\n");
+    case AST_BINARY:
+    case AST_ASSIGN:
+        bind_node(cc, flat_left(ast, node));
+        bind_node(cc, flat_right(ast, node));
         break;
-        
-    case AMPERSAND:
-        sb_append(sb, "\n; bitwise AND\n  and r1, r2\n");
+    case AST_UNARY:
+        bind_node(cc, flat_operand(ast, node));
+        if (flat_op(ast, node) == AMPERSAND && cc->binding[flat_operand(ast, node)])
+            cc->locals[cc->binding[flat_operand(ast, node)] - 1].addressed = 1;
         break;
-    case BITOR:
-        sb_append(sb, "\n; bitwise OR\n  or r1, r2\n");
+    case AST_MEMBER_ACCESS:
+    case AST_ARROW_ACCESS:
+        bind_node(cc, flat_lhs(ast, node));
         break;
-    case BITXOR:
-        sb_append(sb, "\n; bitwise XOR\n  xor r1, r2\n");
+    case AST_EXPR_STMT:
+    case AST_RETURN:
+    case AST_SIZEOF:
+        bind_node(cc, flat_expr(ast, node));
         break;
-    case LSH: {
-        sb_append(sb, "\n; bitwise left shift\n");
-        sb_append(sb, "  mov r4, r2\n"); // r4 = value (LHS)
-        sb_append(sb, "  mov r5, r1\n"); // r5 = count (RHS)
-        int lbl = next_label(cc);
-        sb_append(sb, "b_lsh_loop_%d:\n", lbl);
-        sb_append(sb, "  cmp r5, 0\n");
-        sb_append(sb, "  jz b_lsh_end_%d\n", lbl);
-        sb_append(sb, "  shl r4\n");
-        sb_append(sb, "  addis r5, -1\n");
-        sb_append(sb, "  jmp b_lsh_loop_%d\n", lbl);
-        sb_append(sb, "b_lsh_end_%d:\n", lbl);
-        sb_append(sb, "  mov r1, r4\n");
+    default:
         break;
     }
-    case RSH: {
-        sb_append(sb, "\n; bitwise right shift\n");
-        sb_append(sb, "  mov r4, r2\n"); // r4 = value (LHS)
-        sb_append(sb, "  mov r5, r1\n"); // r5 = count (RHS)
-        int lbl = next_label(cc);
-        sb_append(sb, "b_rsh_loop_%d:\n", lbl);
-        sb_append(sb, "  cmp r5, 0\n");
-        sb_append(sb, "  jz b_rsh_end_%d\n", lbl);
-        sb_append(sb, "  shr r4\n");
-        sb_append(sb, "  addis r5, -1\n");
-        sb_append(sb, "  jmp b_rsh_loop_%d\n", lbl);
-        sb_append(sb, "b_rsh_end_%d:\n", lbl);
-        sb_append(sb, "  mov r1, r4\n");
-        break;
-    }
-
-    case EQ:
-    case NEQ:
-    case LT:
-    case GT:
-    case LTE:
-    case GTE: {
-        int label = next_label(cc);
-        char label_true[32], label_end[32];
-        snprintf(label_true, sizeof(label_true), "b_cmp_true_%d", label);
-        snprintf(label_end, sizeof(label_end), "b_cmp_end_%d", label);
-        sb_append(sb, "  cmp r2, r1\n");
-        switch (node->binary.op) {
-        case EQ:
-            sb_append(sb, "  jz %s\n", label_true);
-            break;
-        case NEQ:
-            sb_append(sb, "  jnz %s\n", label_true);
-            break;
-        case LT:
-            sb_append(sb, "  jl %s\n", label_true);
-            break;
-        case GT:
-            sb_append(sb, "  jg %s\n", label_true);
-            break;
-        case LTE:
-            sb_append(sb, "  jl %s\n", label_true);
-            sb_append(sb, "  jz %s\n", label_true);
-            break;
-        case GTE:
-            sb_append(sb, "  jg %s\n", label_true);
-            sb_append(sb, "  jz %s\n", label_true);
-            break;
-        default:
-            break;
-        }
-        sb_append(sb, "  movi r1, 0\n");
-        sb_append(sb, "  jmp %s\n", label_end);
-        sb_append(sb, "%s:\n", label_true);
-        sb_append(sb, "  movi r1, 1\n");
-        sb_append(sb, "%s:\n", label_end);
-        break;
-    }
-
-    default:
-        fprintf(stderr, "Codegen error: unknown binary op\n");
-        exit(1);
-    }
-
-    if (strcmp(target_reg, "r1") != 0)
-        sb_append(sb, "  mov %s, r1\n", target_reg);
+    annotate_expr(cc, node);
+    fold_expr(cc, node);
 }
 
-static void gen_call(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-              char **params, int param_count, char **locals, int local_count)
-{
-    int argc = node->call.arg_count;
-    int stack_args = argc > 3 ? (argc - 3) : 0;
+// Scalars whose address is never taken: ints, chars and pointers.
+static int local_is_promotable(CompilerContext *cc, const LocalInfo *li) {
+    const Type *t = li->type;
+    if (li->addressed) return 0;
+    if (t->kind == TYPE_POINTER) return 1;
+    return t->kind == TYPE_NAMED && t->name[0] != '\0' && !find_struct(cc, t->name);
+}
 
-    // Allocate space for stack-passed arguments (4th and beyond)
-    if (stack_args > 0)
-    {
-        sb_append(sb, "  ; push stack arguments\n");
-        sb_append(sb, "  addis sp, -%d\n", stack_args * SLOT_SIZE);
-        for (int i = 3; i < argc; i++)
-        {
-            gen_expr(cc, node->call.args[i], sb, "r1", params, param_count, locals, local_count);
-            sb_append(sb, "  mov r2, sp\n");
-            sb_append(sb, "  addis r2, %d\n", (i - 3) * SLOT_SIZE);
-            sb_append(sb, "  store r2, r1\n"); // Store the argument value at [sp + offset]
-        }
+// Binds every name in fn's body and annotates every expression, in one
+// walk, then gives each of fn's variables somewhere to live. Scalars whose
+// address is never taken get a virtual register; the rest get frame slots.
+// The first three parameters arrive in registers and are placed like
+// locals; the rest already have slots, above the saved bp and lr, and a
+// promoted one is loaded from there once.
+static void bind_function(CompilerContext *cc, NodeRef fn) {
+    cc->local_count = 0;
+    symtab_clear(&cc->scope);
+    int param_count;
+    const NodeRef *params = flat_list(cc->ast, fn, &param_count);
+    for (int i = 0; i < param_count; i++) {
+        const char *name = flat_name(cc->ast, params[i]);
+        int idx = add_local(cc, name, flat_param_type(cc->ast, params[i]));
+        cc->locals[idx].param = i + 1;
+        scope_declare(cc, name, idx);
+        cc->binding[params[i]] = (uint32_t)idx + 1;
     }
-
-    // Pass the first 3 arguments via registers r5, r6, r7 (left to right)
-    for (int i = 0; i < argc && i < 3; i++)
-    {
-        gen_expr(cc, node->call.args[i], sb, arg_regs[i], params, param_count, locals, local_count);
+    bind_node(cc, flat_body(cc->ast, fn));
+    scope_close(cc, 0);
+
+    for (int i = 0; i < cc->local_count; i++) {
+        LocalInfo *li = &cc->locals[i];
+        li->slot = -1;
+        if (li->param > 3) li->slot = ir_fixed_slot(cc->fn, li->name, 8 + (li->param - 4) * SLOT_SIZE);
+        if (local_is_promotable(cc, li)) li->vreg = ir_new_vreg(cc->fn);
+        else if (li->slot < 0) li->slot = ir_slot(cc->fn, li->name, slots_for_type(cc, li->type) * SLOT_SIZE);
     }
+}
 
-    sb_append(sb, "  call f_%s\n", node->call.name);
+// ---- Lowering to IR ----
+// A promoted variable is its vreg: a use reads it and an assignment writes
+// it. The rest live in their frame slots, loaded and stored through the
+// address a FRAME instruction makes. Conditions branch straight to their
+// targets, and loops test at the bottom, so each round takes one branch.
 
-    // After call, restore stack pointer
-    if (stack_args > 0)
-    {
-        sb_append(sb, "  ; restore sp after call\n");
-        sb_append(sb, "  addis sp, %d\n", stack_args * SLOT_SIZE);
-    }
+static VReg lower_expr(CompilerContext *cc, NodeRef node);
+static void lower_cond(CompilerContext *cc, NodeRef node, int if_true, int if_false);
 
-    // Move return value to target register if needed
-    if (strcmp(target_reg, "r1") != 0)
-        sb_append(sb, "  mov %s, r1\n", target_reg);
+static int width_of(int is_byte) {
+    return is_byte ? 1 : SLOT_SIZE;
 }
 
-static void gen_if(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-    char **params, int param_count,
-    char **locals, int local_count,
-    const char *break_label,
-    const char *continue_label)
-{
-    int cur_label = next_label(cc);
-
-    char then_label[32], else_label[32], end_label[32];
-    snprintf(then_label, sizeof(then_label), "b_L_then_%d", cur_label);
-    snprintf(end_label, sizeof(end_label), "b_L_end_%d", cur_label);
-
-    if (node->if_stmt.else_stmt)
-        snprintf(else_label, sizeof(else_label), "b_L_else_%d", cur_label);
-    else
-        strcpy(else_label, end_label);
-
-    ASTNode *cond = node->if_stmt.cond;
-
-    if (cond->type == AST_BINARY)
-    {
-        if (is_comparison_op(cond->binary.op)) {
-            emit_cond_jump(cc, cond->binary.left, cond->binary.right, cond->binary.op, sb,
-                           params, param_count, locals, local_count, then_label, else_label);
-        } else {
-            gen_expr(cc, cond, sb, "r1", params, param_count, locals, local_count);
-            sb_append(sb, "  cmp r1, 0\n");
-            sb_append(sb, "  jnz %s\n", then_label);
-            sb_append(sb, "  jmp %s\n", else_label);
-        }
-    }
-    else
-    {
-        // General case: treat cond as value
-        gen_expr(cc, cond, sb, "r1", params, param_count, locals, local_count);
-        sb_append(sb, "  cmp r1, 0\n");
-        sb_append(sb, "  jnz %s\n", then_label);
-        sb_append(sb, "  jmp %s\n", else_label);
-    }
-
-    sb_append(sb, "%s:\n", then_label);
-    gen_stmt_internal(cc, node->if_stmt.then_stmt, sb, params, param_count, locals, local_count,
-        break_label, continue_label);
-    sb_append(sb, "  jmp %s\n", end_label);
+static int is_comparison(TokenKind op) {
+    return op == EQ || op == NEQ || op == LT || op == GT || op == LTE || op == GTE;
+}
 
-    if (node->if_stmt.else_stmt)
-    {
-        sb_append(sb, "%s:\n", else_label);
-        gen_stmt_internal(cc, node->if_stmt.else_stmt, sb, params, param_count, locals, local_count,
-            break_label, continue_label);
+static IRCond cond_of(TokenKind op, int is_unsigned) {
+    switch (op) {
+    case EQ: return IR_EQ;
+    case NEQ: return IR_NE;
+    case LT: return is_unsigned ? IR_ULT : IR_LT;
+    case GT: return is_unsigned ? IR_UGT : IR_GT;
+    case LTE: return is_unsigned ? IR_ULE : IR_LE;
+    default: return is_unsigned ? IR_UGE : IR_GE;
     }
-    sb_append(sb, "%s:\n", end_label);
 }
-static void gen_for(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-    char **params, int param_count,
-    char **locals, int local_count,
-    const char *break_label,
-    const char *continue_label)
 
-{
-    (void)break_label; (void)continue_label;
-    int cur_label = next_label(cc);
-    char for_cond[32], for_body[32], for_inc[32], for_end[32];
-    snprintf(for_cond, sizeof(for_cond), "b_L_for_cond_%d", cur_label);
-    snprintf(for_body, sizeof(for_body), "b_L_for_body_%d", cur_label);
-    snprintf(for_inc, sizeof(for_inc), "b_L_for_inc_%d", cur_label);
-    snprintf(for_end, sizeof(for_end), "b_L_for_end_%d", cur_label);
-
-    if (node->for_stmt.init)
-        gen_stmt(cc, node->for_stmt.init, sb, params, param_count, locals, local_count);
-
-    sb_append(sb, "%s:\n", for_cond);
-
-    if (node->for_stmt.cond && node->for_stmt.cond->type == AST_BINARY)
-    {
-        if (is_comparison_op(node->for_stmt.cond->binary.op)) {
-            emit_cond_jump(cc, node->for_stmt.cond->binary.left, node->for_stmt.cond->binary.right,
-                           node->for_stmt.cond->binary.op, sb,
-                           params, param_count, locals, local_count,
-                           for_body, for_end);
-        } else {
-            gen_expr(cc, node->for_stmt.cond, sb, "r1", params, param_count, locals, local_count);
-            sb_append(sb, "  cmp r1, 0\n");
-            sb_append(sb, "  jnz %s\n", for_body);
-            sb_append(sb, "  jmp %s\n", for_end);
-        }
-    }
-    else if (node->for_stmt.cond)
-    {
-        gen_expr(cc, node->for_stmt.cond, sb, "r1", params, param_count, locals, local_count);
-        sb_append(sb, "  cmp r1, 0\n");
-        sb_append(sb, "  jnz %s\n", for_body);
-        sb_append(sb, "  jmp %s\n", for_end);
-    }
-    else
-    {
-        sb_append(sb, "  jmp %s\n", for_body);
+static IROp binop_of(TokenKind op, int is_unsigned) {
+    switch (op) {
+    case ADD: return IR_ADD;
+    case SUB: return IR_SUB;
+    case ASTARISK: return IR_MUL;
+    case DIV: return is_unsigned ? IR_UDIV : IR_DIV;
+    case MOD: return is_unsigned ? IR_UMOD : IR_MOD;
+    case AMPERSAND: return IR_AND;
+    case BITOR: return IR_OR;
+    case BITXOR: return IR_XOR;
+    case LSH: return IR_SHL;
+    case RSH: return IR_SHR;
+    default:
+        fprintf(stderr, "Codegen error: unknown binary op\n");
+        exit(1);
     }
+}
 
-    sb_append(sb, "%s:\n", for_body);
-    gen_stmt_internal(cc, node->for_stmt.body, sb, params, param_count, locals, local_count,
-        for_end, for_inc);
-
-    sb_append(sb, "%s:\n", for_inc);
-    if (node->for_stmt.inc)
-        gen_stmt(cc, node->for_stmt.inc, sb, params, param_count, locals, local_count);
+static const char *callee_label(CompilerContext *cc, const char *name) {
+    size_t size = strlen(name) + 3;
+    char *label = arena_alloc(&cc->fn->arena, size);
+    snprintf(label, size, "f_%s", name);
+    return label;
+}
 
-    sb_append(sb, "  jmp %s\n", for_cond);
-    sb_append(sb, "%s:\n", for_end);
+// addr + offset. An address the last instruction just made from a slot, or
+// by adding a constant, takes the offset in that instruction instead.
+// A variable's own vreg never does: that would change the variable.
+static VReg add_offset(CompilerContext *cc, VReg addr, int32_t offset) {
+    if (offset == 0) return addr;
+    IRBlock *b = &cc->fn->blocks[cc->fn->cur];
+    IRInst *last = b->count ? &b->insts[b->count - 1] : NULL;
+    if (last && last->dst == addr && addr >= cc->first_temp &&
+        (last->op == IR_FRAME || (last->op == IR_ADD && !last->b))) {
+        last->imm = (int32_t)((uint32_t)last->imm + (uint32_t)offset);
+        return addr;
+    }
+    return ir_binop_imm(cc->fn, IR_ADD, addr, offset);
 }
 
-static void gen_while(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-    char **params, int param_count,
-    char **locals, int local_count,
-    const char *break_label,
-    const char *continue_label)
-{
-    (void)break_label; (void)continue_label;
-    int cur = next_label(cc);
-
-    char cond_label[32], body_label[32], end_label[32];
-    snprintf(cond_label, sizeof(cond_label), "b_L_while_cond_%d", cur);
-    snprintf(body_label, sizeof(body_label), "b_L_while_body_%d", cur);
-    snprintf(end_label, sizeof(end_label), "b_L_while_end_%d", cur);
-
-    // condition check
-    sb_append(sb, "%s:\n", cond_label);
-
-    if (node->while_stmt.cond->type == AST_BINARY) {
-        if (is_comparison_op(node->while_stmt.cond->binary.op)) {
-            emit_cond_jump(cc,
-                node->while_stmt.cond->binary.left,
-                node->while_stmt.cond->binary.right,
-                node->while_stmt.cond->binary.op,
-                sb, params, param_count, locals, local_count,
-                body_label, end_label
-            );
-        } else {
-            gen_expr(cc, node->while_stmt.cond, sb, "r1", params, param_count, locals, local_count);
-            sb_append(sb, "  cmp r1, 0\n");
-            sb_append(sb, "  jnz %s\n", body_label);
-            sb_append(sb, "  jmp %s\n", end_label);
-        }
-    } else {
-        gen_expr(cc, node->while_stmt.cond, sb, "r1", params, param_count, locals, local_count);
-        sb_append(sb, "  cmp r1, 0\n");
-        sb_append(sb, "  jnz %s\n", body_label);
-        sb_append(sb, "  jmp %s\n", end_label);
-    }
+static void set_const(IRFunc *fn, VReg dst, int32_t value) {
+    IRInst *in = ir_add(fn, IR_CONST);
+    in->dst = dst;
+    in->imm = value;
+}
 
-    // loop body
-    sb_append(sb, "%s:\n", body_label);
-    gen_stmt_internal(
-        cc, node->while_stmt.body, sb,
-        params, param_count, locals, local_count,
-        end_label, cond_label
-    );
+// The variable node names when it lives in a vreg, or NULL.
+static const LocalInfo *promoted_local(CompilerContext *cc, NodeRef node) {
+    if (flat_kind(cc->ast, node) != AST_IDENTIFIER) return NULL;
+    const LocalInfo *li = node_local(cc, node);
+    return li && li->vreg ? li : NULL;
+}
 
-    // loop back
-    sb_append(sb, "  jmp %s\n", cond_label);
+// Gives a promoted variable value, cut to a byte for a char. A temporary
+// the last instruction just made is made in the variable's vreg instead.
+static void set_local(CompilerContext *cc, const LocalInfo *li, VReg value) {
+    IRFunc *fn = cc->fn;
+    IRBlock *b = &fn->blocks[fn->cur];
+    IRInst *last = b->count ? &b->insts[b->count - 1] : NULL;
+    if (last && last->dst != value) last = NULL;
+    if (local_is_char_scalar(li) && !(last && last->op == IR_LOAD && last->width == 1)) {
+        value = ir_binop_imm(fn, IR_AND, value, 255);
+        last = &b->insts[b->count - 1];
+    }
+    if (last && value >= cc->first_temp) last->dst = li->vreg;
+    else ir_copy(fn, li->vreg, value);
+}
 
-    // exit label
-    sb_append(sb, "%s:\n", end_label);
+// a op b, with b as an immediate when it is a constant.
+static VReg lower_operands(CompilerContext *cc, IROp op, NodeRef left, NodeRef right) {
+    VReg a = lower_expr(cc, left);
+    const ExprInfo *r = expr_info(cc, right);
+    if (r->is_constant) return ir_binop_imm(cc->fn, op, a, r->value);
+    return ir_binop(cc->fn, op, a, lower_expr(cc, right));
 }
 
-static void gen_do_while(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-    char **params, int param_count,
-    char **locals, int local_count,
-    const char *break_label,
-    const char *continue_label)
-{
-    (void)break_label; (void)continue_label;
-    int cur = next_label(cc);
-
-    char cond_label[32], body_label[32], end_label[32];
-    snprintf(cond_label, sizeof(cond_label), "b_L_dowhile_cond_%d", cur);
-    snprintf(body_label, sizeof(body_label), "b_L_dowhile_body_%d", cur);
-    snprintf(end_label, sizeof(end_label), "b_L_dowhile_end_%d", cur);
-
-    // loop body start
-    sb_append(sb, "%s:\n", body_label);
-
-    // generate body
-    gen_stmt_internal(
-        cc, node->do_while_stmt.body, sb,
-        params, param_count, locals, local_count,
-        end_label, cond_label
-    );
-
-    // condition check (continue label)
-    sb_append(sb, "%s:\n", cond_label);
-
-    if (node->do_while_stmt.cond->type == AST_BINARY) {
-        if (is_comparison_op(node->do_while_stmt.cond->binary.op)) {
-            emit_cond_jump(cc,
-                node->do_while_stmt.cond->binary.left,
-                node->do_while_stmt.cond->binary.right,
-                node->do_while_stmt.cond->binary.op,
-                sb, params, param_count, locals, local_count,
-                body_label, end_label
-            );
-        } else {
-            gen_expr(cc, node->do_while_stmt.cond, sb, "r1", params, param_count, locals, local_count);
-            sb_append(sb, "  cmp r1, 0\n");
-            sb_append(sb, "  jnz %s\n", body_label);
-            sb_append(sb, "  jmp %s\n", end_label);
-        }
-    } else {
-        gen_expr(cc, node->do_while_stmt.cond, sb, "r1", params, param_count, locals, local_count);
-        sb_append(sb, "  cmp r1, 0\n");
-        sb_append(sb, "  jnz %s\n", body_label);
-        sb_append(sb, "  jmp %s\n", end_label);
+static VReg lower_addr(CompilerContext *cc, NodeRef node) {
+    const FlatAST *ast = cc->ast;
+    switch (flat_kind(ast, node)) {
+    case AST_IDENTIFIER: {
+        const LocalInfo *li = node_local(cc, node);
+        return li ? ir_frame(cc->fn, li->slot, 0) : ir_sym(cc->fn, flat_name(ast, node));
+    }
+    case AST_UNARY:
+        // the address is the value of the operand
+        if (flat_op(ast, node) == ASTARISK) return lower_expr(cc, flat_operand(ast, node));
+        break;
+    case AST_MEMBER_ACCESS:
+    case AST_ARROW_ACCESS: {
+        const MemberInfo *mi = member_of(cc, accessed_record(cc, node), flat_member(ast, node));
+        if (!mi) {
+            fprintf(stderr, "Codegen error: no member %s\n", flat_member(ast, node));
+            exit(1);
+        }
+        VReg base = flat_kind(ast, node) == AST_MEMBER_ACCESS ? lower_addr(cc, flat_lhs(ast, node))
+                                                              : lower_expr(cc, flat_lhs(ast, node));
+        return add_offset(cc, base, mi->offset);
     }
-    
-    // exit label
-    sb_append(sb, "%s:\n", end_label);
+    default:
+        break;
+    }
+    fprintf(stderr, "Codegen error: unsupported lvalue kind: %s\n", astType2str(flat_kind(ast, node)));
+    exit(1);
 }
 
-static void gen_assign(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-              char **params, int param_count,
-              char **locals, int local_count,
-              const char *target_reg) {
-    if (!node || node->type != AST_ASSIGN) {
-        fprintf(stderr, "Codegen error: gen_assign called on non-assignment node\n");
-        exit(1);
-    }
-    if (lvalue_is_const(cc, node->assign.left)) {
+static VReg lower_assign(CompilerContext *cc, NodeRef node) {
+    NodeRef target = flat_left(cc->ast, node);
+    if (lvalue_is_const(cc, target)) {
         fprintf(stderr, "Codegen error: assignment to const lvalue is not allowed\n");
         exit(1);
     }
-    gen_expr(cc, node->assign.right, sb, "r1", params, param_count, locals, local_count);
-    gen_lvalue_addr(cc, node->assign.left, sb, "r3", params, param_count, locals, local_count);
-    int is_byte = lvalue_is_byte(cc, node->assign.left);
-    emit_store_to_addr(sb, "r3", "r1", is_byte);
-    if (target_reg && strcmp(target_reg, "r1") != 0) {
-        sb_append(sb, "  mov %s, r1\n", target_reg);
+    VReg value = lower_expr(cc, flat_right(cc->ast, node));
+    const LocalInfo *li = promoted_local(cc, target);
+    if (li) {
+        set_local(cc, li, value);
+        return li->vreg;
+    }
+    ir_store(cc->fn, lower_addr(cc, target), value, width_of(lvalue_is_byte(cc, target)));
+    return value;
+}
+
+// ++ and --; x++ keeps the old x only when value_used.
+static VReg lower_inc_dec(CompilerContext *cc, NodeRef node, int value_used) {
+    NodeRef operand = flat_operand(cc->ast, node);
+    TokenKind op = flat_op(cc->ast, node);
+    if (op != INC && op != DEC && op != POST_INC && op != POST_DEC) {
+        fprintf(stderr, "Codegen error: unknown unary op\n");
+        exit(1);
+    }
+    if (lvalue_is_const(cc, operand)) {
+        fprintf(stderr, "Codegen error: modifying a const value is not allowed\n");
+        exit(1);
+    }
+    const Type *t = expr_type(cc, operand);
+    int step = t && t->kind == TYPE_POINTER ? pointer_step_bytes(cc, t) : 1;
+    if (op == DEC || op == POST_DEC) step = -step;
+    int post = op == POST_INC || op == POST_DEC;
+    const LocalInfo *li = promoted_local(cc, operand);
+    if (li) {
+        VReg old = 0;
+        if (post && value_used) {
+            old = ir_new_vreg(cc->fn);
+            ir_copy(cc->fn, old, li->vreg);
+        }
+        set_local(cc, li, ir_binop_imm(cc->fn, IR_ADD, li->vreg, step));
+        return old ? old : li->vreg;
     }
+    int width = width_of(lvalue_is_byte(cc, operand));
+    VReg addr = lower_addr(cc, operand);
+    VReg old = ir_load(cc->fn, addr, width);
+    VReg updated = ir_binop_imm(cc->fn, IR_ADD, old, step);
+    ir_store(cc->fn, addr, updated, width);
+    return post ? old : updated;
 }
 
-static void gen_expr(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-              char **params, int param_count,
-              char **locals, int local_count) {
-                _gen_expr(cc, node, sb, target_reg, params, param_count, locals, local_count, 0);
-              }
+// 1 or 0 from a condition, through two blocks that join.
+static VReg lower_truth(CompilerContext *cc, NodeRef node) {
+    IRFunc *fn = cc->fn;
+    VReg result = ir_new_vreg(fn);
+    int yes = ir_new_block(fn), no = ir_new_block(fn), join = ir_new_block(fn);
+    lower_cond(cc, node, yes, no);
+    ir_start_block(fn, yes);
+    set_const(fn, result, 1);
+    ir_jmp(fn, join);
+    ir_start_block(fn, no);
+    set_const(fn, result, 0);
+    ir_start_block(fn, join);
+    return result;
+}
 
-static void _gen_expr(CompilerContext *cc, ASTNode *node, StringBuilder *sb, const char *target_reg,
-              char **params, int param_count, char **locals, int local_count,
-              int want_address)
-{
-    switch (node->type)
-    {
-    case AST_SIZEOF: {
-        int sz = SLOT_SIZE;
-        int determined = 0;
-        if (node->sizeof_expr.expr && node->sizeof_expr.expr->type == AST_IDENTIFIER) {
-            const LocalInfo *li = find_local_info(cc, node->sizeof_expr.expr->identifier.name);
-            if (li) {
-                TypeInfo ti = {0};
-                ti.base_type = li->base_type;
-                ti.pointer_level = li->pointer_level;
-                ti.is_array = li->is_array;
-                ti.dims_count = li->dims_count;
-                for (int i = 0; i < li->dims_count && i < 8; i++) ti.dims[i] = li->dims[i];
-                sz = typeinfo_total_size_bytes(cc, &ti);
-                determined = 1;
-            }
+static VReg lower_binary(CompilerContext *cc, NodeRef node) {
+    const FlatAST *ast = cc->ast;
+    IRFunc *fn = cc->fn;
+    TokenKind op = flat_op(ast, node);
+    NodeRef left = flat_left(ast, node), right = flat_right(ast, node);
+    if (op == LAND || op == LOR) return lower_truth(cc, node);
+    if (is_comparison(op)) {
+        VReg a = lower_expr(cc, left);
+        const ExprInfo *r = expr_info(cc, right);
+        IRCond cond = cond_of(op, binary_is_unsigned(cc, node));
+        if (r->is_constant) return ir_set(fn, cond, a, 0, r->value);
+        return ir_set(fn, cond, a, lower_expr(cc, right), 0);
+    }
+
+    // Pointer arithmetic scales the integer side by the element size
+    const Type *lhs_t = expr_type(cc, left);
+    const Type *rhs_t = expr_type(cc, right);
+    int lhs_ptr = lhs_t && type_is_indirect(lhs_t);
+    int rhs_ptr = rhs_t && type_is_indirect(rhs_t);
+    if ((op == ADD || op == SUB) && lhs_ptr != rhs_ptr) {
+        NodeRef idx = lhs_ptr ? right : left;
+        int step = pointer_step_bytes(cc, lhs_ptr ? lhs_t : rhs_t);
+        int back = op == SUB && lhs_ptr;
+        VReg base = lower_expr(cc, lhs_ptr ? left : right);
+        const ExprInfo *i = expr_info(cc, idx);
+        if (i->is_constant) {
+            uint32_t offset = (uint32_t)i->value * (uint32_t)step;
+            return add_offset(cc, base, (int32_t)(back ? 0u - offset : offset));
         }
-            if (!determined) {
-                TypeInfo ti = {0};
-                if (infer_expr_type(cc, node->sizeof_expr.expr, &ti)) {
-                    sz = typeinfo_total_size_bytes(cc, &ti);
-                }
-            }
-        sb_append(sb, "  movi %s, %d\n", target_reg, sz);
-        break; }
-    case AST_STRING_LITERAL: {
-        const char *label = intern_string_literal(cc, node->string_literal.value ? node->string_literal.value : "");
-        sb_append(sb, "  movi  %s, %s\n", target_reg, label);
-        break; }
-    case AST_CHAR_LITERAL: {
-        unsigned char v = 0;
-        if (node->char_literal.value)
-            v = (unsigned char)node->char_literal.value[0];
-        sb_append(sb, "  \n; load char %u into %s\n", (unsigned)v, target_reg);
-        sb_append(sb, "  movi  %s, %u\n", target_reg, (unsigned)v);
-        break; }
-    case AST_ASSIGN:
-        gen_assign(cc, node, sb, params, param_count, locals, local_count, target_reg);
-        break;
-    case AST_TERNARY: {
-        int lbl = next_label(cc);
-        char label_else[32], label_end[32];
-        snprintf(label_else, sizeof(label_else), "b_ternary_else_%d", lbl);
-        snprintf(label_end, sizeof(label_end), "b_ternary_end_%d", lbl);
-        gen_expr(cc, node->ternary.cond, sb, "r1", params, param_count, locals, local_count);
-        sb_append(sb, "  cmp r1, 0\n");
-        sb_append(sb, "  jz %s\n", label_else);
-        gen_expr(cc, node->ternary.then_expr, sb, target_reg, params, param_count, locals, local_count);
-        sb_append(sb, "  jmp %s\n", label_end);
-        sb_append(sb, "%s:\n", label_else);
-        gen_expr(cc, node->ternary.else_expr, sb, target_reg, params, param_count, locals, local_count);
-        sb_append(sb, "%s:\n", label_end);
-        break;
-    }
+        VReg scaled = lower_expr(cc, idx);
+        if (step != 1) scaled = ir_binop_imm(fn, IR_MUL, scaled, step);
+        return ir_binop(fn, back ? IR_SUB : IR_ADD, base, scaled);
+    }
+
+    IROp irop = binop_of(op, binary_is_unsigned(cc, node));
+    int commutes = irop == IR_ADD || irop == IR_MUL || irop == IR_AND || irop == IR_OR || irop == IR_XOR;
+    if (commutes && expr_info(cc, left)->is_constant && !expr_info(cc, right)->is_constant)
+        return lower_operands(cc, irop, right, left);
+    return lower_operands(cc, irop, left, right);
+}
+
+static VReg lower_expr(CompilerContext *cc, NodeRef node) {
+    const FlatAST *ast = cc->ast;
+    IRFunc *fn = cc->fn;
+    const ExprInfo *info = expr_info(cc, node);
+    if (info->is_constant) return ir_const(fn, info->value);
+    switch (flat_kind(ast, node)) {
     case AST_NUMBER:
-        sb_append(sb, "  \n; load constant %s into %s\n", node->number.value, target_reg);
-        sb_append(sb, "  movi  %s, %s\n", target_reg, node->number.value);
-        break;
-    case AST_UNARY:
-        switch (node->unary.op)
-        {
+        // The backend has no floating point; float literals are passed
+        // through as written.
+        return ir_sym(fn, flat_number_value(ast, node));
+    case AST_STRING_LITERAL:
+        return ir_sym(fn, intern_string_literal(cc, flat_name(ast, node) ? flat_name(ast, node) : ATOM_EMPTY));
+    case AST_IDENTIFIER: {
+        const LocalInfo *li = node_local(cc, node);
+        if (li && li->vreg) return li->vreg;
+        VReg addr = lower_addr(cc, node);
+        // arrays decay to pointers
+        if (li && li->type->kind == TYPE_ARRAY) return addr;
+        return ir_load(fn, addr, width_of(li && local_is_char_scalar(li)));
+    }
+    case AST_ASSIGN:
+        return lower_assign(cc, node);
+    case AST_TERNARY: {
+        const ExprInfo *cond = expr_info(cc, flat_cond(ast, node));
+        if (cond->is_constant)
+            return lower_expr(cc, cond->value ? flat_then(ast, node) : flat_else(ast, node));
+        VReg result = ir_new_vreg(fn);
+        int yes = ir_new_block(fn), no = ir_new_block(fn), join = ir_new_block(fn);
+        lower_cond(cc, flat_cond(ast, node), yes, no);
+        ir_start_block(fn, yes);
+        ir_copy(fn, result, lower_expr(cc, flat_then(ast, node)));
+        ir_jmp(fn, join);
+        ir_start_block(fn, no);
+        ir_copy(fn, result, lower_expr(cc, flat_else(ast, node)));
+        ir_start_block(fn, join);
+        return result;
+    }
+    case AST_UNARY: {
+        NodeRef operand = flat_operand(ast, node);
+        switch (flat_op(ast, node)) {
         case SUB: {
-            // Unary minus: 0 - operand
-            _gen_expr(cc, node->unary.operand, sb, target_reg, params, param_count, locals, local_count, 0);
-            const char *zero_reg = (strcmp(target_reg, "r1") == 0) ? "r2" : "r1";
-            sb_append(sb, "  mov %s, 0\n", zero_reg);
-            sb_append(sb, "  sub %s, %s\n", zero_reg, target_reg);
-            sb_append(sb, "  mov %s, %s\n", target_reg, zero_reg);
-            break;
+            VReg value = lower_expr(cc, operand);
+            return ir_binop(fn, IR_SUB, ir_const(fn, 0), value);
         }
         case BITNOT:
-            _gen_expr(cc, node->unary.operand, sb, target_reg, params, param_count, locals, local_count, 0);
-            sb_append(sb, "  movi r3, -1\n");
-            sb_append(sb, "  xor %s, r3\n", target_reg);
-            break;
-        case NOT: {
-            _gen_expr(cc, node->unary.operand, sb, target_reg, params, param_count, locals, local_count, 0);
-            int lbl_true = next_label(cc);
-            int lbl_end = next_label(cc);
-            sb_append(sb, "  cmp %s, 0\n", target_reg);
-            sb_append(sb, "  jz b_not_true_%d\n", lbl_true);
-            sb_append(sb, "  movi %s, 0\n", target_reg);
-            sb_append(sb, "  jmp b_not_end_%d\n", lbl_end);
-            sb_append(sb, "b_not_true_%d:\n", lbl_true);
-            sb_append(sb, "  movi %s, 1\n", target_reg);
-            sb_append(sb, "b_not_end_%d:\n", lbl_end);
-            break; }
-        case ASTARISK: // *
-            _gen_expr(cc, node->unary.operand, sb, "r3",
-                      params, param_count, locals, local_count,
-                      0);
-            TypeInfo result_type = (TypeInfo){0};
-            int have_type = infer_expr_type(cc, node, &result_type);
-            int is_array_result = have_type && result_type.dims_count > 0;
-            if (!want_address) {
-                if (is_array_result) {
-                    sb_append(sb, "  ; dereference array -> decay to pointer\n");
-                    sb_append(sb, "  mov %s, r3\n", target_reg);
-                } else {
-                    sb_append(sb, "  ; dereference *expr\n");
-                    int isb = have_type ? typeinfo_is_byte(&result_type) : 0;
-                    emit_load_from_addr(sb, target_reg, "r3", isb);
-                }
-            } else {
-                sb_append(sb, "  mov %s, r3\n", target_reg);
-            }
-            break;
+            return ir_binop_imm(fn, IR_XOR, lower_expr(cc, operand), -1);
+        case NOT:
+            return ir_set(fn, IR_EQ, lower_expr(cc, operand), 0, 0);
+        case ASTARISK: {
+            VReg addr = lower_expr(cc, operand);
+            // *p of an array is the array, which decays
+            const Type *t = expr_type(cc, node);
+            if (t && t->kind == TYPE_ARRAY) return addr;
+            return ir_load(fn, addr, width_of(lvalue_is_byte(cc, node)));
+        }
         case AMPERSAND:
-            gen_lvalue_addr(cc, node->unary.operand, sb, target_reg, params, param_count, locals, local_count);
-            break;
-
+            return lower_addr(cc, operand);
         default:
-            emit_unary_inc_dec(cc, node, sb, target_reg, params, param_count, locals, local_count);
+            return lower_inc_dec(cc, node, 1);
         }
-        break;
-
-    case AST_IDENTIFIER:
-        emit_load_var(cc, sb, node->identifier.name, target_reg, params, param_count, locals, local_count);
-        break;
+    }
     case AST_BINARY:
-        gen_expr_binop(cc, node, sb, target_reg, params, param_count, locals, local_count);
-        break;
-    case AST_CALL:
-        gen_call(cc, node, sb, target_reg, params, param_count, locals, local_count);
-        break;
-    case AST_MEMBER_ACCESS: {
-        // load *(addr(lhs) + offset(member))
-        gen_lvalue_addr(cc, node, sb, "r3", params, param_count, locals, local_count);
-        {
-            int isb = lvalue_is_byte(cc, node);
-            emit_load_from_addr(sb, target_reg, "r3", isb);
-        }
-        break; }
+        return lower_binary(cc, node);
+    case AST_CALL: {
+        int argc;
+        const NodeRef *args = flat_list(ast, node, &argc);
+        VReg *values = malloc(sizeof(VReg) * (argc ? argc : 1));
+        for (int i = 0; i < argc; i++) values[i] = lower_expr(cc, args[i]);
+        VReg result = ir_call(fn, callee_label(cc, flat_name(ast, node)), values, argc);
+        free(values);
+        return result;
+    }
+    case AST_MEMBER_ACCESS:
     case AST_ARROW_ACCESS: {
-        gen_lvalue_addr(cc, node, sb, "r3", params, param_count, locals, local_count);
-        {
-            int isb = lvalue_is_byte(cc, node);
-            emit_load_from_addr(sb, target_reg, "r3", isb);
-        }
-        break; }
+        VReg addr = lower_addr(cc, node);
+        if (info->is_array) return addr;
+        return ir_load(fn, addr, width_of(info->is_byte));
+    }
     default:
-        fprintf(stderr, "Codegen error: unknown expr node %s\n", astType2str(node->type));
+        fprintf(stderr, "Codegen error: unknown expr node %s\n", astType2str(flat_kind(ast, node)));
         exit(1);
     }
 }
 
-static void gen_stmt(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-              char **params, int param_count,
-              char **locals, int local_count)
-{
-    gen_stmt_internal(cc, node, sb, params, param_count, locals, local_count,
-                      NULL, NULL);
+// Branches to if_true or if_false on node's truth. && and || branch from
+// each operand in turn; ! swaps the targets.
+static void lower_cond(CompilerContext *cc, NodeRef node, int if_true, int if_false) {
+    const FlatAST *ast = cc->ast;
+    IRFunc *fn = cc->fn;
+    const ExprInfo *info = expr_info(cc, node);
+    if (info->is_constant) {
+        ir_jmp(fn, info->value ? if_true : if_false);
+        return;
+    }
+    if (flat_kind(ast, node) == AST_BINARY) {
+        TokenKind op = flat_op(ast, node);
+        NodeRef left = flat_left(ast, node), right = flat_right(ast, node);
+        if (op == LAND || op == LOR) {
+            int rest = ir_new_block(fn);
+            if (op == LAND) lower_cond(cc, left, rest, if_false);
+            else lower_cond(cc, left, if_true, rest);
+            ir_start_block(fn, rest);
+            lower_cond(cc, right, if_true, if_false);
+            return;
+        }
+        if (is_comparison(op)) {
+            VReg a = lower_expr(cc, left);
+            const ExprInfo *r = expr_info(cc, right);
+            IRCond cond = cond_of(op, binary_is_unsigned(cc, node));
+            if (r->is_constant) ir_br(fn, cond, a, 0, r->value, if_true, if_false);
+            else ir_br(fn, cond, a, lower_expr(cc, right), 0, if_true, if_false);
+            return;
+        }
+    }
+    if (flat_kind(ast, node) == AST_UNARY && flat_op(ast, node) == NOT) {
+        lower_cond(cc, flat_operand(ast, node), if_false, if_true);
+        return;
+    }
+    ir_br(fn, IR_NE, lower_expr(cc, node), 0, 0, if_true, if_false);
 }
 
-// Statement codegen
-static void gen_stmt_internal(CompilerContext *cc, ASTNode *node, StringBuilder *sb,
-                       char **params, int param_count,
-                       char **locals, int local_count,
-                       const char *break_label,
-                       const char *continue_label)
-{
-    switch (node->type)
-    {
-    case AST_VAR_DECL:
-        if (node->var_decl.init)
-        {
-            ASTNode *vtype = node->var_decl.var_type;
-            if (vtype && vtype->type == AST_TYPE_ARRAY &&
-                (node->var_decl.init->type == AST_INIT_LIST || node->var_decl.init->type == AST_STRING_LITERAL)) {
-                // Array initializer
-                sb_append(sb, "  ; init array '%s'\n", node->var_decl.name);
-                // address of var into r3
-                emit_addr_of_var(cc, sb, node->var_decl.name, "r3", params, param_count, locals, local_count);
-
-                int elem_size = array_element_size_bytes(vtype);
-                int is_byte_elem = (elem_size == 1);
-                int total_elems = array_total_elements(vtype);
-
-                if (node->var_decl.init->type == AST_STRING_LITERAL && vtype->type_array.element_type && vtype->type_array.element_type->type != AST_TYPE_ARRAY) {
-                    const char *str = node->var_decl.init->string_literal.value ? node->var_decl.init->string_literal.value : "";
-                    int len = (int)strlen(str);
-                    int total = total_elems > 0 ? total_elems : (len + 1);
-                    for (int i = 0; i < total; i++) {
-                        unsigned char val = 0;
-                        if (i < len) {
-                            val = (unsigned char)str[i];
-                        } else if (i == len) {
-                            val = 0; // explicit NUL
-                        }
-                        int offset = elem_size * i;
-                        sb_append(sb, "  movi r1, %u\n", (unsigned)val);
-                        if (offset == 0) {
-                            emit_store_to_addr(sb, "r3", "r1", 1);
-                        } else {
-                            sb_append(sb, "  mov r2, r3\n");
-                            sb_append(sb, "  addis r2, %d\n", offset);
-                            emit_store_to_addr(sb, "r2", "r1", 1);
-                        }
-                    }
-                } else if (node->var_decl.init->type == AST_INIT_LIST) {
-                    int count = node->var_decl.init->init_list.count;
-                    int total = total_elems > 0 ? total_elems : count;
-                    int limit = count < total ? count : total;
-                    for (int i = 0; i < limit; i++) {
-                        gen_expr(cc, node->var_decl.init->init_list.elements[i], sb, "r1", params, param_count, locals, local_count);
-                        int offset = elem_size * i;
-                        if (offset == 0) {
-                            emit_store_to_addr(sb, "r3", "r1", is_byte_elem);
-                        } else {
-                            sb_append(sb, "  mov r2, r3\n");
-                            sb_append(sb, "  addis r2, %d\n", offset);
-                            emit_store_to_addr(sb, "r2", "r1", is_byte_elem);
-                        }
-                    }
-                    // zero-fill remaining slots if array is larger
-                    if (total > limit) {
-                        sb_append(sb, "  movi r1, 0\n");
-                        for (int i = limit; i < total; i++) {
-                            int offset = elem_size * i;
-                            if (offset == 0) {
-                                emit_store_to_addr(sb, "r3", "r1", is_byte_elem);
-                            } else {
-                                sb_append(sb, "  mov r2, r3\n");
-                                sb_append(sb, "  addis r2, %d\n", offset);
-                                emit_store_to_addr(sb, "r2", "r1", is_byte_elem);
-                            }
-                        }
-                    }
-                }
-            } else {
-                gen_expr(cc, node->var_decl.init, sb, "r1", params, param_count, locals, local_count);
-                emit_store_var(cc, sb, node->var_decl.name, "r1", params, param_count, locals, local_count);
-            }
+// Stores a declaration's initializer. Array initializers are flat, one
+// value per scalar through every dimension; elements they leave out are
+// zeroed.
+static void lower_var_init(CompilerContext *cc, NodeRef node) {
+    const FlatAST *ast = cc->ast;
+    IRFunc *fn = cc->fn;
+    const LocalInfo *li = node_local(cc, node);
+    NodeRef init = flat_var_init(ast, node);
+    ASTNodeType kind = flat_kind(ast, init);
+    if (li->type->kind != TYPE_ARRAY || (kind != AST_INIT_LIST && kind != AST_STRING_LITERAL)) {
+        VReg value = lower_expr(cc, init);
+        if (li->vreg) {
+            set_local(cc, li, value);
+            return;
+        }
+        ir_store(fn, ir_frame(fn, li->slot, 0), value, width_of(local_is_char_scalar(li)));
+        return;
+    }
+    const Type *scalar = array_scalar(li->type);
+    int elem_size = type_size(cc, scalar);
+    int total = type_size(cc, li->type) / elem_size;
+    if (kind == AST_STRING_LITERAL) {
+        if (li->type->of->kind == TYPE_ARRAY) return;
+        const char *str = flat_name(ast, init) ? flat_name(ast, init) : ATOM_EMPTY;
+        int len = (int)strlen(str);
+        for (int i = 0; i < total; i++) {
+            VReg c = ir_const(fn, i < len ? (unsigned char)str[i] : 0);
+            ir_store(fn, ir_frame(fn, li->slot, elem_size * i), c, 1);
+        }
+        return;
+    }
+    int count;
+    const NodeRef *elements = flat_list(ast, init, &count);
+    int width = width_of(type_is_char(scalar));
+    VReg zero = 0;
+    for (int i = 0; i < total; i++) {
+        VReg value;
+        if (i < count) {
+            value = lower_expr(cc, elements[i]);
+        } else {
+            if (!zero) zero = ir_const(fn, 0);
+            value = zero;
         }
+        ir_store(fn, ir_frame(fn, li->slot, elem_size * i), value, width);
+    }
+}
+
+// An expression evaluated for what it does, not its value.
+static void lower_effect(CompilerContext *cc, NodeRef node) {
+    const FlatAST *ast = cc->ast;
+    if (flat_kind(ast, node) == AST_UNARY && !expr_info(cc, node)->is_constant &&
+        (flat_op(ast, node) == POST_INC || flat_op(ast, node) == POST_DEC)) {
+        lower_inc_dec(cc, node, 0);
+        return;
+    }
+    lower_expr(cc, node);
+}
+
+// brk and cont are the blocks break and continue go to; -1 outside a loop.
+static void lower_stmt(CompilerContext *cc, NodeRef node, int brk, int cont) {
+    const FlatAST *ast = cc->ast;
+    IRFunc *fn = cc->fn;
+    if (!node) return;
+    switch (flat_kind(ast, node)) {
+    case AST_VAR_DECL:
+        if (flat_var_init(ast, node)) lower_var_init(cc, node);
+        // defined on every path, if only as 0
+        else if (node_local(cc, node)->vreg) set_const(fn, node_local(cc, node)->vreg, 0);
         break;
     case AST_UNARY:
-        emit_unary_inc_dec(cc, node, sb, "r1", params, param_count, locals, local_count);
-        break;
     case AST_ASSIGN:
-        gen_assign(cc, node, sb, params, param_count, locals, local_count, "r1");
-        break;
-    case AST_BREAK:
-        if (break_label)
-            sb_append(sb, "  jmp %s\n", break_label);
-        else
-            sb_append(sb, "  ; error: break used outside loop\n");
-        break;
-    case AST_CONTINUE:
-        if (continue_label)
-            sb_append(sb, "  jmp %s\n", continue_label);
-        else
-            sb_append(sb, "  ; error: continue used outside loop\n");
+        lower_effect(cc, node);
         break;
     case AST_EXPR_STMT:
-        gen_expr(cc, node->expr_stmt.expr, sb, "r1", params, param_count, locals, local_count);
-        break;
-    case AST_IF:
-        gen_if(cc, node, sb, params, param_count, locals, local_count, break_label, continue_label);
-        break;
-    case AST_FOR:
-        gen_for(cc, node, sb, params, param_count, locals, local_count,
-                break_label, continue_label);
-        break;
-    case AST_WHILE:
-        gen_while(cc, node, sb, params, param_count, locals, local_count,
-                  break_label, continue_label);
-        break;
-    case AST_DO_WHILE:
-        gen_do_while(cc, node, sb, params, param_count, locals, local_count,
-                  break_label, continue_label);
+        if (flat_expr(ast, node)) lower_effect(cc, flat_expr(ast, node));
         break;
+    case AST_BREAK:
+    case AST_CONTINUE: {
+        int is_break = flat_kind(ast, node) == AST_BREAK;
+        int target = is_break ? brk : cont;
+        if (target < 0) {
+            fprintf(stderr, "Codegen error: %s used outside loop\n", is_break ? "break" : "continue");
+            exit(1);
+        }
+        ir_jmp(fn, target);
+        break; }
+    case AST_IF: {
+        int then = ir_new_block(fn), join = ir_new_block(fn);
+        int other = flat_else(ast, node) ? ir_new_block(fn) : join;
+        lower_cond(cc, flat_cond(ast, node), then, other);
+        ir_start_block(fn, then);
+        lower_stmt(cc, flat_then(ast, node), brk, cont);
+        if (flat_else(ast, node)) {
+            ir_jmp(fn, join);
+            ir_start_block(fn, other);
+            lower_stmt(cc, flat_else(ast, node), brk, cont);
+        }
+        ir_start_block(fn, join);
+        break; }
+    case AST_WHILE: {
+        int body = ir_new_block(fn), test = ir_new_block(fn), done = ir_new_block(fn);
+        lower_cond(cc, flat_cond(ast, node), body, done);
+        ir_start_block(fn, body);
+        lower_stmt(cc, flat_body(ast, node), done, test);
+        ir_start_block(fn, test);
+        lower_cond(cc, flat_cond(ast, node), body, done);
+        ir_start_block(fn, done);
+        break; }
+    case AST_DO_WHILE: {
+        int body = ir_new_block(fn), test = ir_new_block(fn), done = ir_new_block(fn);
+        ir_start_block(fn, body);
+        lower_stmt(cc, flat_body(ast, node), done, test);
+        ir_start_block(fn, test);
+        lower_cond(cc, flat_cond(ast, node), body, done);
+        ir_start_block(fn, done);
+        break; }
+    case AST_FOR: {
+        NodeRef cond = flat_cond(ast, node);
+        lower_stmt(cc, flat_for_init(ast, node), -1, -1);
+        int body = ir_new_block(fn), step = ir_new_block(fn), done = ir_new_block(fn);
+        if (cond) lower_cond(cc, cond, body, done);
+        ir_start_block(fn, body);
+        lower_stmt(cc, flat_body(ast, node), done, step);
+        ir_start_block(fn, step);
+        lower_stmt(cc, flat_for_inc(ast, node), -1, -1);
+        if (cond) lower_cond(cc, cond, body, done);
+        else ir_jmp(fn, body);
+        ir_start_block(fn, done);
+        break; }
     case AST_RETURN:
-        gen_expr(cc, node->ret.expr, sb, "r1", params, param_count, locals, local_count);
-        // r1 = return value. No 'ret' for main.
-        sb_append(sb, "  \n; return\n");
-        if (cc->return_label)
-            sb_append(sb, "  jmp %s\n", cc->return_label);
+        ir_ret(fn, flat_expr(ast, node) ? lower_expr(cc, flat_expr(ast, node)) : 0);
         break;
-    case AST_BLOCK:
-        for (int i = 0; i < node->block.count; i++)
-        {
-            gen_stmt_internal(cc, node->block.stmts[i], sb, params, param_count, locals, local_count,
-                                 break_label, continue_label);
-        }
-        break;
+    case AST_BLOCK: {
+        int count;
+        const NodeRef *stmts = flat_list(ast, node, &count);
+        for (int i = 0; i < count; i++) lower_stmt(cc, stmts[i], brk, cont);
+        break; }
     default:
-        fprintf(stderr, "Codegen error: unknown stmt node %s\n", astType2str(node->type));
+        fprintf(stderr, "Codegen error: unknown stmt node %s\n", astType2str(flat_kind(ast, node)));
         exit(1);
     }
 }
 
-void gen_func(CompilerContext *cc, ASTNode *node, StringBuilder *sb)
-{
-
-    if (node->type != AST_FUNDEF) return;
-
-    char *fname = strcmp(node->fundef.name, "main") == 0 ? "__START__" : node->fundef.name;
-    int param_count = node->fundef.param_count;
-    char *params[16] = {0};
-    for (int i = 0; i < param_count; i++)
-    {
-        params[i] = node->fundef.params[i]->param.name;
+static void check_ir(IRFunc *fn, const char *stage) {
+    StringBuilder errors;
+    sb_init(&errors);
+    if (ir_verify(fn, &errors)) {
+        fprintf(stderr, "Codegen error: bad IR after %s:\n%s", stage, errors.buf);
+        exit(1);
     }
+    sb_free(&errors);
+}
 
-    char *locals[32] = {0};
-    int local_count = collect_locals(cc, node->fundef.body, locals);
-
-    // Collect param + local type info for struct member access
-    int locals_only_count = collect_local_type_info(cc, node->fundef.body, NULL);
-    cg_locals_count = param_count + locals_only_count;
-    if (cg_locals_count > 0) {
-        cg_locals_info = (LocalInfo*)malloc(sizeof(LocalInfo) * cg_locals_count);
-        int idx = 0;
-        // Parameters first
-        for (int i = 0; i < param_count; i++, idx++) {
-            ASTNode *p = node->fundef.params[i];
-            cg_locals_info[idx].name = p->param.name;
-            set_localinfo_from_type(cc, &cg_locals_info[idx], p->param.type);
-        }
-        // Then locals from body
-        if (locals_only_count > 0) {
-            collect_local_type_info(cc, node->fundef.body, cg_locals_info + idx);
-        }
-    } else {
-        cg_locals_info = NULL;
+// Lowers a function to IR, checks it, and writes it out as masm; the IR
+// as lowered goes to ir_sb too when there is one.
+static void gen_func(CompilerContext *cc, NodeRef node, StringBuilder *sb, StringBuilder *ir_sb)
+{
+    if (flat_kind(cc->ast, node) != AST_FUNDEF) return;
+
+    IRFunc fn;
+    ir_func_init(&fn, flat_name(cc->ast, node), flat_name(cc->ast, node) == ATOM_MAIN);
+    cc->fn = &fn;
+    bind_function(cc, node);
+
+    cc->first_temp = fn.vreg_count + 1;
+
+    // Parameters passed in registers arrive in their vregs or are stored
+    // to their slots; promoted stack parameters are loaded once.
+    int params = 0;
+    while (params < cc->local_count && cc->locals[params].param) params++;
+    for (int i = 0; i < params && i < 3; i++) {
+        IRInst *in = ir_add(&fn, IR_PARAM);
+        in->dst = cc->locals[i].vreg ? cc->locals[i].vreg : ir_new_vreg(&fn);
+        in->imm = i;
     }
-
-    sb_append(sb, "\n");
-    sb_append(sb, "%s%s:\n", strcmp(fname, "__START__") == 0 ? "" : "f_", fname);
-    sb_append(sb, "; prologue\n");
-    sb_append(sb, "  push lr\n");
-    sb_append(sb, "  push bp\n");
-    sb_append(sb, "  mov bp, sp\n  addis sp, -%d\n",
-              (local_count + param_count) * SLOT_SIZE);
-
-    // Store first 3 parameters from registers to stack frame
-    for (int i = 0; i < param_count && i < 3; i++)
-    {
-        sb_append(sb, "  ; store parameter '%s' from register %s\n", params[i], arg_regs[i]);
-        sb_append(sb, "  mov   r3, bp\n");
-        sb_append(sb, "  addis r3, %d\n", param_offset(i));
-        sb_append(sb, "  store r3, %s\n", arg_regs[i]);
+    for (int i = 0; i < params; i++) {
+        const LocalInfo *li = &cc->locals[i];
+        if (i < 3 && !li->vreg)
+            ir_store(&fn, ir_frame(&fn, li->slot, 0), fn.blocks[0].insts[i].dst, SLOT_SIZE);
+        else if (i < 3 && local_is_char_scalar(li))
+            set_local(cc, li, li->vreg);
+        else if (i >= 3 && li->vreg)
+            set_local(cc, li, ir_load(&fn, ir_frame(&fn, li->slot, 0), width_of(local_is_char_scalar(li))));
     }
 
-    char ret_label[32];
-    snprintf(ret_label, sizeof(ret_label), "b_L_ret_%d", next_label(cc));
-    cc->return_label = ret_label;
-
-    // Function body
-    gen_stmt(cc, node->fundef.body, sb, params, param_count, locals, local_count);
-
-    sb_append(sb, "%s:\n", ret_label);
-    sb_append(sb, "  addis sp, %d\n", (local_count + param_count) * SLOT_SIZE);
-    sb_append(sb, "; epilogue\n  pop  bp\n  pop  lr\n");
-
-    // Epilogue (not for main)
-    if (strcmp(fname, "__START__") != 0)
-    {
-        sb_append(sb, "  mov  pc, lr\n");
+    lower_stmt(cc, flat_body(cc->ast, node), -1, -1);
+    ir_ret(&fn, 0);
+    ir_finish(&fn);
+    check_ir(&fn, "lowering");
+    if (ir_sb) {
+        if (ir_sb->len) sb_append(ir_sb, "\n");
+        ir_print(&fn, ir_sb);
     }
-    if (strcmp(fname, "__START__") == 0)
-        sb_append(sb, "  halt");
-
-    cc->return_label = NULL;
-
-    // cleanup per-function locals info
-    if (cg_locals_info) { free(cg_locals_info); cg_locals_info = NULL; }
-    cg_locals_count = 0;
+    ir_legalize(&fn);
+    check_ir(&fn, "legalizing");
+    ir_emit_masm(&fn, sb);
+    ir_func_free(&fn);
+    cc->fn = NULL;
 }
 
 char *codegen(ASTNode *root)
+{
+    FlatAST ast;
+    flat_build(&ast, root);
+    char *out = codegen_flat(&ast);
+    flat_free(&ast);
+    return out;
+}
+
+char *codegen_flat(const FlatAST *ast)
+{
+    return codegen_flat_with_ir(ast, NULL);
+}
+
+char *codegen_flat_with_ir(const FlatAST *ast, char **ir)
 {
     CompilerContext ctx = {0};
     CompilerContext *cc = &ctx;
-    StringBuilder sb;
+    cc->ast = ast;
+    cc->binding = calloc(ast->node_count, sizeof(uint32_t));
+    cc->types = calloc(ast->node_count, sizeof(ExprInfo));
+    arena_init(&cc->type_table.arena);
+    NodeRef root = ast->root;
+    int top_count;
+    const NodeRef *top = flat_list(ast, root, &top_count);
+    StringBuilder sb, ir_sb;
     sb_init(&sb);
+    if (ir) sb_init(&ir_sb);
 
     // Build struct table from toplevel AST (typedef struct and struct)
-    // Assume each member consumes SLOT_SIZE and lay out sequentially
     cg_struct_count = 0;
     cg_structs = NULL;
     cg_typedef_count = 0;
     cg_typedefs = NULL;
-    if (root && root->type == AST_BLOCK) {
+    if (root && flat_kind(cc->ast, root) == AST_BLOCK) {
         // Pass 1: Collect Typedefs (non-struct)
-        for (int i = 0; i < root->block.count; i++) {
-            ASTNode *n = root->block.stmts[i];
-            if (n->type == AST_TYPEDEF) {
-                LocalInfo tmp = {0};
-                set_localinfo_from_type(cc, &tmp, n->typedef_stmt.src_type);
-                
+        for (int i = 0; i < top_count; i++) {
+            NodeRef n = top[i];
+            if (flat_kind(cc->ast, n) == AST_TYPEDEF) {
+                // Resolved against the typedefs before it, so uses never
+                // walk a chain of them.
+                const Type *type = type_from_ast(cc, flat_typedef_source(cc->ast, n));
                 cg_typedefs = (TypedefInfo*)realloc(cg_typedefs, sizeof(TypedefInfo) * (cg_typedef_count + 1));
-                cg_typedefs[cg_typedef_count].alias = n->typedef_stmt.alias;
-                cg_typedefs[cg_typedef_count].info.base_type = tmp.base_type;
-                cg_typedefs[cg_typedef_count].info.pointer_level = tmp.pointer_level;
-                cg_typedefs[cg_typedef_count].info.type_modifiers = tmp.type_modifiers;
-                cg_typedefs[cg_typedef_count].info.is_array = tmp.is_array;
-                cg_typedefs[cg_typedef_count].info.dims_count = tmp.dims_count;
-                for(int k=0; k<8; k++) cg_typedefs[cg_typedef_count].info.dims[k] = tmp.dims[k];
+                index_add(&cc->typedef_index, flat_name(cc->ast, n), cg_typedef_count);
+                cg_typedefs[cg_typedef_count].alias = flat_name(cc->ast, n);
+                cg_typedefs[cg_typedef_count].type = type;
                 cg_typedef_count++;
             }
         }
 
         // Pass 2: Structs
-        for (int i = 0; i < root->block.count; i++) {
-            ASTNode *n = root->block.stmts[i];
-            if (n->type == AST_TYPEDEF_STRUCT) {
-                int count = n->typedef_struct.member_count;
-                MemberInfo *members = NULL;
-                int struct_bytes = 0;
-                if (count > 0) {
-                    members = (MemberInfo*)malloc(sizeof(MemberInfo) * count);
-                    int offset = 0;
-                    for (int m = 0; m < count; m++) {
-                        ASTNode *mem = n->typedef_struct.members[m];
-                        const char *mname = "";
-                        LocalInfo tmp = {0};
-                        int member_slots = 1;
-                        if (mem->type == AST_VAR_DECL) {
-                            mname = mem->var_decl.name ? mem->var_decl.name : "";
-                            set_localinfo_from_type(cc, &tmp, mem->var_decl.var_type);
-                            if (mem->var_decl.var_type) {
-                                member_slots = slots_for_type(cc, mem->var_decl.var_type);
-                                if (member_slots < 1) member_slots = 1;
-                            }
-                        } else if (mem->type == AST_STRUCT_MEMBER) {
-                            mname = mem->struct_member.name ? mem->struct_member.name : "";
-                            tmp.base_type = mem->struct_member.type ? mem->struct_member.type : "";
-                            tmp.pointer_level = 0;
-                            tmp.is_array = 0;
-                            tmp.array_length = 0;
-                        } else {
-                            tmp.base_type = "";
-                            tmp.pointer_level = 0;
-                            tmp.is_array = 0;
-                            tmp.array_length = 0;
-                        }
-                        members[m].name = mname;
-                        members[m].base_type = tmp.base_type ? tmp.base_type : "";
-                        members[m].pointer_level = tmp.pointer_level;
-                        members[m].is_array = tmp.is_array;
-                        members[m].array_length = tmp.array_length;
-                        members[m].size_bytes = (tmp.pointer_level == 0 && !tmp.is_array && base_type_is_char(tmp.base_type)) ? 1 : SLOT_SIZE;
-                        members[m].offset = offset;
-                        members[m].total_size_bytes = member_slots * SLOT_SIZE;
-                        offset += members[m].total_size_bytes;
-                    }
-                    struct_bytes = offset;
-                }
-                cg_structs = (StructInfo*)realloc(cg_structs, sizeof(StructInfo) * (cg_struct_count + 1));
-                cg_structs[cg_struct_count].type_name = n->typedef_struct.typedef_name;
-                cg_structs[cg_struct_count].members = members;
-                cg_structs[cg_struct_count].member_count = count;
-                cg_structs[cg_struct_count].size_bytes = struct_bytes > 0 ? struct_bytes : SLOT_SIZE;
-                cg_struct_count++;
-            } else if (n->type == AST_STRUCT && n->struct_stmt.name) {
-                int count = n->struct_stmt.member_count;
-                MemberInfo *members = NULL;
-                int struct_bytes = 0;
-                if (count > 0) {
-                    members = (MemberInfo*)malloc(sizeof(MemberInfo) * count);
-                    int offset = 0;
-                    for (int m = 0; m < count; m++) {
-                        ASTNode *mem = n->struct_stmt.members[m];
-                        const char *mname = "";
-                        LocalInfo tmp = {0};
-                        int member_slots = 1;
-                        if (mem->type == AST_VAR_DECL) {
-                            mname = mem->var_decl.name ? mem->var_decl.name : "";
-                            set_localinfo_from_type(cc, &tmp, mem->var_decl.var_type);
-                            if (mem->var_decl.var_type) {
-                                member_slots = slots_for_type(cc, mem->var_decl.var_type);
-                                if (member_slots < 1) member_slots = 1;
-                            }
-                        } else if (mem->type == AST_STRUCT_MEMBER) {
-                            mname = mem->struct_member.name ? mem->struct_member.name : "";
-                            tmp.base_type = mem->struct_member.type ? mem->struct_member.type : "";
-                            tmp.pointer_level = 0;
-                            tmp.is_array = 0;
-                            tmp.array_length = 0;
-                        } else {
-                            tmp.base_type = "";
-                            tmp.pointer_level = 0;
-                            tmp.is_array = 0;
-                            tmp.array_length = 0;
-                        }
-                        members[m].name = mname;
-                        members[m].base_type = tmp.base_type ? tmp.base_type : "";
-                        members[m].pointer_level = tmp.pointer_level;
-                        members[m].is_array = tmp.is_array;
-                        members[m].array_length = tmp.array_length;
-                        members[m].size_bytes = (tmp.pointer_level == 0 && !tmp.is_array && base_type_is_char(tmp.base_type)) ? 1 : SLOT_SIZE;
-                        members[m].offset = offset;
-                        members[m].total_size_bytes = member_slots * SLOT_SIZE;
-                        offset += members[m].total_size_bytes;
-                    }
-                    struct_bytes = offset;
-                }
-                cg_structs = (StructInfo*)realloc(cg_structs, sizeof(StructInfo) * (cg_struct_count + 1));
-                cg_structs[cg_struct_count].type_name = n->struct_stmt.name;
-                cg_structs[cg_struct_count].members = members;
-                cg_structs[cg_struct_count].member_count = count;
-                cg_structs[cg_struct_count].size_bytes = struct_bytes > 0 ? struct_bytes : SLOT_SIZE;
-                cg_struct_count++;
-            }
+        for (int i = 0; i < top_count; i++) {
+            NodeRef n = top[i];
+            if (flat_kind(cc->ast, n) == AST_TYPEDEF_STRUCT ||
+                (flat_kind(cc->ast, n) == AST_STRUCT && flat_name(cc->ast, n)))
+                layout_struct(cc, n);
         }
     }
 
     // Output __START__ (main) first
-    for (int i = 0; i < root->block.count; i++)
+    for (int i = 0; i < top_count; i++)
     {
-        ASTNode *fn = root->block.stmts[i];
-        if (fn->type == AST_FUNDEF && strcmp(fn->fundef.name, "main") == 0)
+        NodeRef fn = top[i];
+        if (flat_kind(cc->ast, fn) == AST_FUNDEF && flat_name(cc->ast, fn) == ATOM_MAIN)
         {
-            gen_func(cc, fn, &sb);
+            gen_func(cc, fn, &sb, ir ? &ir_sb : NULL);
             break;
         }
     }
     // Output all other functions
-    for (int i = 0; i < root->block.count; i++)
+    for (int i = 0; i < top_count; i++)
     {
-        ASTNode *fn = root->block.stmts[i];
-        if (fn->type == AST_FUNDEF && strcmp(fn->fundef.name, "main") != 0)
+        NodeRef fn = top[i];
+        if (flat_kind(cc->ast, fn) == AST_FUNDEF && flat_name(cc->ast, fn) != ATOM_MAIN)
         {
-            gen_func(cc, fn, &sb);
+            gen_func(cc, fn, &sb, ir ? &ir_sb : NULL);
         }
     }
     // Append data (string literals) at the end
@@ -2097,9 +1451,20 @@ char *codegen(ASTNode *root)
     }
     // free string pool
     if (cg_strings) {
-        for (int i = 0; i < cg_string_count; i++) { free(cg_strings[i].text); free(cg_strings[i].label); }
+        for (int i = 0; i < cg_string_count; i++) free(cg_strings[i].label);
         free(cg_strings); cg_strings = NULL; cg_string_count = 0;
     }
+    symtab_free(&cc->struct_index);
+    symtab_free(&cc->typedef_index);
+    symtab_free(&cc->string_index);
+    free(cc->binding);
+    free(cc->types);
+    free(cc->type_table.slots);
+    arena_free(&cc->type_table.arena);
+    free(cc->locals);
+    free(cc->shadowed);
+    symtab_free(&cc->scope);
     if (cg_data_sb_inited) { sb_free(&cg_data_sb); cg_data_sb_inited = 0; }
+    if (ir) *ir = sb_dump(&ir_sb);
     return sb_dump(&sb);
 }
@@ -0,0 +1,236 @@
+#include "flatast.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static NodeRef add_node(FlatAST *f, ASTNodeType kind) {
+    if (f->node_count == f->node_cap) {
+        f->node_cap = f->node_cap ? f->node_cap * 2 : 1024;
+        f->nodes = realloc(f->nodes, sizeof(FlatNode) * f->node_cap);
+    }
+    NodeRef n = f->node_count++;
+    memset(&f->nodes[n], 0, sizeof(FlatNode));
+    f->nodes[n].kind = (uint8_t)kind;
+    return n;
+}
+
+// Reserves `words` words of extra, zeroed; returns the first.
+static uint32_t add_extra(FlatAST *f, uint32_t words) {
+    if (f->extra_count + words > f->extra_cap) {
+        while (f->extra_count + words > f->extra_cap)
+            f->extra_cap = f->extra_cap ? f->extra_cap * 2 : 1024;
+        f->extra = realloc(f->extra, sizeof(uint32_t) * f->extra_cap);
+    }
+    uint32_t at = f->extra_count;
+    memset(&f->extra[at], 0, sizeof(uint32_t) * words);
+    f->extra_count += words;
+    return at;
+}
+
+static uint32_t atom_id(FlatAST *f, const char *atom) {
+    if (!atom) return 0;
+    uintptr_t id = (uintptr_t)symtab_get(&f->atom_ids, atom);
+    if (id) return (uint32_t)id;
+    if (f->atom_count == f->atom_cap) {
+        f->atom_cap = f->atom_cap ? f->atom_cap * 2 : 256;
+        f->atoms = realloc(f->atoms, sizeof(const char *) * f->atom_cap);
+    }
+    id = f->atom_count++;
+    f->atoms[id] = atom;
+    symtab_put(&f->atom_ids, atom, (void *)id);
+    return (uint32_t)id;
+}
+
+static NodeRef build(FlatAST *f, const ASTNode *node);
+
+// Fills reserved words at..at+count with [count, children...]. The arrays
+// may move while a child is built, so every store goes through f after the
+// call.
+static void fill_list(FlatAST *f, uint32_t at, ASTNode *const *items, int count) {
+    f->extra[at] = (uint32_t)count;
+    for (int i = 0; i < count; i++) {
+        NodeRef child = build(f, items[i]);
+        f->extra[at + 1 + i] = child;
+    }
+}
+
+static uint32_t build_list(FlatAST *f, ASTNode *const *items, int count) {
+    uint32_t at = add_extra(f, (uint32_t)count + 1);
+    fill_list(f, at, items, count);
+    return at;
+}
+
+static NodeRef build(FlatAST *f, const ASTNode *node) {
+    if (!node) return 0;
+    NodeRef n = add_node(f, node->type);
+    uint32_t a = 0, b = 0;
+    NodeRef child;
+    switch (node->type) {
+    case AST_NUMBER:
+        f->nodes[n].flags = (uint8_t)node->number.flags;
+        a = atom_id(f, node->number.value);
+        b = add_extra(f, 2);
+        f->extra[b] = (uint32_t)node->number.ival;
+        f->extra[b + 1] = (uint32_t)(node->number.ival >> 32);
+        break;
+    case AST_IDENTIFIER:
+        a = atom_id(f, node->identifier.name);
+        break;
+    case AST_STRING_LITERAL:
+        a = atom_id(f, node->string_literal.value);
+        break;
+    case AST_CHAR_LITERAL:
+        a = atom_id(f, node->char_literal.value);
+        break;
+    case AST_BINARY:
+        f->nodes[n].flags = (uint8_t)node->binary.op;
+        a = build(f, node->binary.left);
+        b = build(f, node->binary.right);
+        break;
+    case AST_ASSIGN:
+        a = build(f, node->assign.left);
+        b = build(f, node->assign.right);
+        break;
+    case AST_UNARY:
+        f->nodes[n].flags = (uint8_t)node->unary.op;
+        a = build(f, node->unary.operand);
+        break;
+    case AST_TYPE:
+        f->nodes[n].flags = (uint8_t)node->type_node.type_modifiers;
+        a = build(f, node->type_node.base_type);
+        b = (uint32_t)node->type_node.pointer_level;
+        break;
+    case AST_TYPE_ARRAY:
+        a = build(f, node->type_array.element_type);
+        b = (uint32_t)node->type_array.array_size;
+        break;
+    case AST_VAR_DECL:
+        a = atom_id(f, node->var_decl.name);
+        b = add_extra(f, 2);
+        child = build(f, node->var_decl.var_type);
+        f->extra[b] = child;
+        child = build(f, node->var_decl.init);
+        f->extra[b + 1] = child;
+        break;
+    case AST_PARAM:
+        a = atom_id(f, node->param.name);
+        b = build(f, node->param.type);
+        break;
+    case AST_TYPEDEF:
+        a = atom_id(f, node->typedef_stmt.alias);
+        b = build(f, node->typedef_stmt.src_type);
+        break;
+    case AST_STRUCT_MEMBER:
+        a = atom_id(f, node->struct_member.name);
+        b = atom_id(f, node->struct_member.type);
+        break;
+    case AST_MEMBER_ACCESS:
+        a = build(f, node->member_access.lhs);
+        b = atom_id(f, node->member_access.member);
+        break;
+    case AST_ARROW_ACCESS:
+        a = build(f, node->arrow_access.lhs);
+        b = atom_id(f, node->arrow_access.member);
+        break;
+    case AST_EXPR_STMT:
+        a = build(f, node->expr_stmt.expr);
+        break;
+    case AST_RETURN:
+        a = build(f, node->ret.expr);
+        break;
+    case AST_SIZEOF:
+        a = build(f, node->sizeof_expr.expr);
+        break;
+    case AST_IF:
+        a = build(f, node->if_stmt.cond);
+        b = add_extra(f, 2);
+        child = build(f, node->if_stmt.then_stmt);
+        f->extra[b] = child;
+        child = build(f, node->if_stmt.else_stmt);
+        f->extra[b + 1] = child;
+        break;
+    case AST_TERNARY:
+        a = build(f, node->ternary.cond);
+        b = add_extra(f, 2);
+        child = build(f, node->ternary.then_expr);
+        f->extra[b] = child;
+        child = build(f, node->ternary.else_expr);
+        f->extra[b + 1] = child;
+        break;
+    case AST_WHILE:
+        a = build(f, node->while_stmt.cond);
+        b = build(f, node->while_stmt.body);
+        break;
+    case AST_DO_WHILE:
+        a = build(f, node->do_while_stmt.cond);
+        b = build(f, node->do_while_stmt.body);
+        break;
+    case AST_FOR: {
+        const ASTNode *parts[4] = { node->for_stmt.init, node->for_stmt.cond,
+                                    node->for_stmt.inc, node->for_stmt.body };
+        a = add_extra(f, 4);
+        for (int i = 0; i < 4; i++) {
+            child = build(f, parts[i]);
+            f->extra[a + i] = child;
+        }
+        break; }
+    case AST_BLOCK:
+        b = build_list(f, node->block.stmts, node->block.count);
+        break;
+    case AST_INIT_LIST:
+        b = build_list(f, node->init_list.elements, node->init_list.count);
+        break;
+    case AST_CALL:
+        a = atom_id(f, node->call.name);
+        b = build_list(f, node->call.args, node->call.arg_count);
+        break;
+    case AST_STRUCT:
+        a = atom_id(f, node->struct_stmt.name);
+        b = build_list(f, node->struct_stmt.members, node->struct_stmt.member_count);
+        break;
+    case AST_FUNDEF:
+        a = atom_id(f, node->fundef.name);
+        b = add_extra(f, 3 + (uint32_t)node->fundef.param_count);
+        child = build(f, node->fundef.ret_type);
+        f->extra[b] = child;
+        fill_list(f, b + 2, node->fundef.params, node->fundef.param_count);
+        child = build(f, node->fundef.body);
+        f->extra[b + 1] = child;
+        break;
+    case AST_TYPEDEF_STRUCT:
+        a = atom_id(f, node->typedef_struct.typedef_name);
+        b = add_extra(f, 2 + (uint32_t)node->typedef_struct.member_count);
+        f->extra[b] = atom_id(f, node->typedef_struct.struct_name);
+        fill_list(f, b + 1, node->typedef_struct.members, node->typedef_struct.member_count);
+        break;
+    case AST_BREAK:
+    case AST_CONTINUE:
+        break;
+    }
+    f->nodes[n].a = a;
+    f->nodes[n].b = b;
+    return n;
+}
+
+void flat_build(FlatAST *f, const ASTNode *root) {
+    memset(f, 0, sizeof(*f));
+    add_node(f, AST_BLOCK);  // index 0 stands for no node
+    f->atom_cap = 256;
+    f->atoms = malloc(sizeof(const char *) * f->atom_cap);
+    f->atoms[f->atom_count++] = NULL;
+    f->root = build(f, root);
+    symtab_free(&f->atom_ids);
+}
+
+void flat_free(FlatAST *f) {
+    free(f->nodes);
+    free(f->extra);
+    free(f->atoms);
+    symtab_free(&f->atom_ids);
+    memset(f, 0, sizeof(*f));
+}
+
+size_t flat_bytes(const FlatAST *f) {
+    return sizeof(FlatNode) * f->node_count + sizeof(uint32_t) * f->extra_count +
+           sizeof(const char *) * f->atom_count;
+}
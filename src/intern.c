@@ -0,0 +1,156 @@
+#include "intern.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char ATOM_EMPTY[] = "";
+const char ATOM_CHAR[] = "char";
+const char ATOM_INT[] = "int";
+const char ATOM_MAIN[] = "main";
+
+typedef struct {
+    const char *str;   // NULL marks an empty slot
+    uint32_t hash;
+    uint32_t len;
+} AtomSlot;
+
+// The table is split into shards by hash so that lexer threads interning in
+// parallel rarely contend. Each shard is an open-addressing table with linear
+// probing, power-of-two capacity, kept at most half full, plus its own string
+// storage: atoms are bump-allocated out of large chunks and never freed.
+#define SHARD_BITS 4
+#define SHARD_COUNT (1 << SHARD_BITS)
+#define CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+    pthread_mutex_t lock;
+    AtomSlot *slots;
+    size_t cap;
+    size_t count;
+    char *chunk;
+    size_t chunk_used;
+    size_t bytes;
+} Shard;
+
+static Shard shards[SHARD_COUNT];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+// Shard locks are only taken while some caller has declared concurrent use;
+// the common single-threaded compile pays nothing for them.
+static int concurrent = 0;
+
+static uint32_t hash_bytes(const char *s, size_t len) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Shards use the top hash bits, slots within a shard the low ones.
+static Shard *shard_for(uint32_t hash) {
+    return &shards[hash >> (32 - SHARD_BITS)];
+}
+
+static const char *store(Shard *sh, const char *s, size_t len) {
+    size_t need = len + 1;
+    char *dst;
+    if (need > CHUNK_SIZE / 4) {
+        dst = malloc(need);  // oversized strings get their own block
+    } else {
+        if (!sh->chunk || sh->chunk_used + need > CHUNK_SIZE) {
+            sh->chunk = malloc(CHUNK_SIZE);
+            sh->chunk_used = 0;
+        }
+        dst = sh->chunk + sh->chunk_used;
+        sh->chunk_used += need;
+    }
+    memcpy(dst, s, len);
+    dst[len] = '\0';
+    sh->bytes += need;
+    return dst;
+}
+
+static void insert_slot(Shard *sh, const char *str, uint32_t hash, uint32_t len) {
+    size_t mask = sh->cap - 1;
+    size_t i = hash & mask;
+    while (sh->slots[i].str) i = (i + 1) & mask;
+    sh->slots[i].str = str;
+    sh->slots[i].hash = hash;
+    sh->slots[i].len = len;
+}
+
+static void grow(Shard *sh) {
+    AtomSlot *old = sh->slots;
+    size_t old_cap = sh->cap;
+    sh->cap = old_cap ? old_cap * 2 : 256;
+    sh->slots = calloc(sh->cap, sizeof(AtomSlot));
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].str) insert_slot(sh, old[i].str, old[i].hash, old[i].len);
+    }
+    free(old);
+}
+
+static void seed(const char *atom) {
+    size_t len = strlen(atom);
+    uint32_t h = hash_bytes(atom, len);
+    Shard *sh = shard_for(h);
+    insert_slot(sh, atom, h, (uint32_t)len);
+    sh->count++;
+}
+
+static void init_table(void) {
+    for (int i = 0; i < SHARD_COUNT; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        grow(&shards[i]);
+    }
+    seed(ATOM_EMPTY);
+    seed(ATOM_CHAR);
+    seed(ATOM_INT);
+    seed(ATOM_MAIN);
+}
+
+const char *intern(const char *s, size_t len) {
+    pthread_once(&init_once, init_table);
+    uint32_t h = hash_bytes(s, len);
+    Shard *sh = shard_for(h);
+    int locked = concurrent;
+    if (locked) pthread_mutex_lock(&sh->lock);
+    size_t mask = sh->cap - 1;
+    for (size_t i = h & mask; sh->slots[i].str; i = (i + 1) & mask) {
+        const AtomSlot *e = &sh->slots[i];
+        if (e->hash == h && e->len == len && memcmp(e->str, s, len) == 0) {
+            if (locked) pthread_mutex_unlock(&sh->lock);
+            return e->str;
+        }
+    }
+    if ((sh->count + 1) * 2 > sh->cap) grow(sh);
+    const char *atom = store(sh, s, len);
+    insert_slot(sh, atom, h, (uint32_t)len);
+    sh->count++;
+    if (locked) pthread_mutex_unlock(&sh->lock);
+    return atom;
+}
+
+void intern_set_concurrent(int on) {
+    pthread_once(&init_once, init_table);
+    concurrent = on;
+}
+
+const char *intern_cstr(const char *s) {
+    return intern(s, strlen(s));
+}
+
+size_t intern_count(void) {
+    size_t n = 0;
+    for (int i = 0; i < SHARD_COUNT; i++) n += shards[i].count;
+    return n;
+}
+
+size_t intern_bytes(void) {
+    size_t n = 0;
+    for (int i = 0; i < SHARD_COUNT; i++) n += shards[i].bytes;
+    return n;
+}
@@ -0,0 +1,1186 @@
+#include "ir.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ---- Building ----
+
+static int is_terminator(int op) {
+    return op == IR_JMP || op == IR_BR || op == IR_RET;
+}
+
+static int block_done(const IRBlock *b) {
+    return b->count && is_terminator(b->insts[b->count - 1].op);
+}
+
+void ir_func_init(IRFunc *f, const char *name, int is_main) {
+    memset(f, 0, sizeof(*f));
+    arena_init(&f->arena);
+    f->name = name;
+    f->is_main = is_main;
+    if (is_main) {
+        f->label = "__START__";
+    } else {
+        size_t size = strlen(name) + 3;
+        char *label = arena_alloc(&f->arena, size);
+        snprintf(label, size, "f_%s", name);
+        f->label = label;
+    }
+    ir_start_block(f, ir_new_block(f));
+}
+
+void ir_func_free(IRFunc *f) {
+    for (int i = 0; i < f->block_count; i++) {
+        free(f->blocks[i].insts);
+        free(f->blocks[i].preds);
+    }
+    free(f->blocks);
+    free(f->started);
+    free(f->slots);
+    arena_free(&f->arena);
+    memset(f, 0, sizeof(*f));
+}
+
+int ir_slot(IRFunc *f, const char *name, int size) {
+    if (f->slot_count == f->slot_cap) {
+        f->slot_cap = f->slot_cap ? f->slot_cap * 2 : 16;
+        f->slots = realloc(f->slots, sizeof(IRSlot) * f->slot_cap);
+    }
+    f->slots[f->slot_count] = (IRSlot){ name, size, 0, 0 };
+    return f->slot_count++;
+}
+
+int ir_fixed_slot(IRFunc *f, const char *name, int offset) {
+    int i = ir_slot(f, name, 4);
+    f->slots[i].offset = offset;
+    f->slots[i].fixed = 1;
+    return i;
+}
+
+VReg ir_new_vreg(IRFunc *f) {
+    return ++f->vreg_count;
+}
+
+int ir_new_block(IRFunc *f) {
+    if (f->block_count == f->block_cap) {
+        f->block_cap = f->block_cap ? f->block_cap * 2 : 16;
+        f->blocks = realloc(f->blocks, sizeof(IRBlock) * f->block_cap);
+    }
+    memset(&f->blocks[f->block_count], 0, sizeof(IRBlock));
+    return f->block_count++;
+}
+
+void ir_start_block(IRFunc *f, int block) {
+    if (f->started_count && !block_done(&f->blocks[f->cur])) ir_jmp(f, block);
+    f->cur = block;
+    // started holds each block at most once, so block_count bounds it
+    f->started = realloc(f->started, sizeof(int) * f->block_cap);
+    f->started[f->started_count++] = block;
+}
+
+IRInst *ir_add(IRFunc *f, IROp op) {
+    if (block_done(&f->blocks[f->cur])) ir_start_block(f, ir_new_block(f));
+    IRBlock *b = &f->blocks[f->cur];
+    if (b->count == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 8;
+        b->insts = realloc(b->insts, sizeof(IRInst) * b->cap);
+    }
+    IRInst *in = &b->insts[b->count++];
+    memset(in, 0, sizeof(*in));
+    in->op = (uint8_t)op;
+    return in;
+}
+
+VReg ir_const(IRFunc *f, int32_t value) {
+    IRInst *in = ir_add(f, IR_CONST);
+    in->dst = ir_new_vreg(f);
+    in->imm = value;
+    return in->dst;
+}
+
+void ir_copy(IRFunc *f, VReg dst, VReg src) {
+    IRInst *in = ir_add(f, IR_COPY);
+    in->dst = dst;
+    in->a = src;
+}
+
+VReg ir_param(IRFunc *f, int index) {
+    IRInst *in = ir_add(f, IR_PARAM);
+    in->dst = ir_new_vreg(f);
+    in->imm = index;
+    return in->dst;
+}
+
+VReg ir_frame(IRFunc *f, int slot, int32_t offset) {
+    IRInst *in = ir_add(f, IR_FRAME);
+    in->dst = ir_new_vreg(f);
+    in->slot = slot;
+    in->imm = offset;
+    return in->dst;
+}
+
+VReg ir_sym(IRFunc *f, const char *sym) {
+    IRInst *in = ir_add(f, IR_SYM);
+    in->dst = ir_new_vreg(f);
+    in->sym = sym;
+    return in->dst;
+}
+
+VReg ir_binop(IRFunc *f, IROp op, VReg a, VReg b) {
+    IRInst *in = ir_add(f, op);
+    in->dst = ir_new_vreg(f);
+    in->a = a;
+    in->b = b;
+    return in->dst;
+}
+
+VReg ir_binop_imm(IRFunc *f, IROp op, VReg a, int32_t imm) {
+    IRInst *in = ir_add(f, op);
+    in->dst = ir_new_vreg(f);
+    in->a = a;
+    in->imm = imm;
+    return in->dst;
+}
+
+VReg ir_set(IRFunc *f, IRCond cond, VReg a, VReg b, int32_t imm) {
+    IRInst *in = ir_add(f, IR_SET);
+    in->dst = ir_new_vreg(f);
+    in->cond = (uint8_t)cond;
+    in->a = a;
+    in->b = b;
+    in->imm = imm;
+    return in->dst;
+}
+
+VReg ir_load(IRFunc *f, VReg addr, int width) {
+    IRInst *in = ir_add(f, IR_LOAD);
+    in->dst = ir_new_vreg(f);
+    in->a = addr;
+    in->width = (uint8_t)width;
+    return in->dst;
+}
+
+void ir_store(IRFunc *f, VReg addr, VReg value, int width) {
+    IRInst *in = ir_add(f, IR_STORE);
+    in->a = addr;
+    in->b = value;
+    in->width = (uint8_t)width;
+}
+
+VReg ir_call(IRFunc *f, const char *sym, const VReg *args, int arg_count) {
+    VReg *copy = arg_count ? arena_memdup(&f->arena, args, sizeof(VReg) * arg_count) : NULL;
+    IRInst *in = ir_add(f, IR_CALL);
+    in->dst = ir_new_vreg(f);
+    in->sym = sym;
+    in->args = copy;
+    in->arg_count = arg_count;
+    return in->dst;
+}
+
+void ir_jmp(IRFunc *f, int target) {
+    IRInst *in = ir_add(f, IR_JMP);
+    in->target[0] = target;
+}
+
+void ir_br(IRFunc *f, IRCond cond, VReg a, VReg b, int32_t imm, int if_true, int if_false) {
+    IRInst *in = ir_add(f, IR_BR);
+    in->cond = (uint8_t)cond;
+    in->a = a;
+    in->b = b;
+    in->imm = imm;
+    in->target[0] = if_true;
+    in->target[1] = if_false;
+}
+
+void ir_ret(IRFunc *f, VReg value) {
+    IRInst *in = ir_add(f, IR_RET);
+    in->a = value;
+}
+
+// The vregs an instruction reads: a and b, or a call's arguments. Entries
+// may be 0 (none).
+static int use_count(const IRInst *in) {
+    return in->op == IR_CALL ? in->arg_count : 2;
+}
+
+static VReg use_at(const IRInst *in, int i) {
+    if (in->op == IR_CALL) return in->args[i];
+    return i == 0 ? in->a : in->b;
+}
+
+static int successors(const IRBlock *b, int out[2]) {
+    if (!block_done(b)) return 0;
+    const IRInst *t = &b->insts[b->count - 1];
+    if (t->op == IR_JMP) { out[0] = t->target[0]; return 1; }
+    if (t->op == IR_BR) {
+        out[0] = t->target[0];
+        out[1] = t->target[1];
+        return out[0] == out[1] ? 1 : 2;
+    }
+    return 0;
+}
+
+void ir_finish(IRFunc *f) {
+    int n = f->block_count;
+    uint8_t *reached = calloc(n, 1);
+    int *stack = malloc(sizeof(int) * n);
+    int *map = malloc(sizeof(int) * n);
+    int depth = 0;
+    reached[0] = 1;
+    stack[depth++] = 0;
+    while (depth) {
+        int succ[2];
+        int k = successors(&f->blocks[stack[--depth]], succ);
+        for (int i = 0; i < k; i++) {
+            if (succ[i] < 0 || succ[i] >= n || reached[succ[i]]) continue;
+            reached[succ[i]] = 1;
+            stack[depth++] = succ[i];
+        }
+    }
+    // Blocks go in the order they were started; one reached but never
+    // started is left for the verifier to report, at the end.
+    int count = 0;
+    for (int i = 0; i < n; i++) map[i] = -1;
+    for (int i = 0; i < f->started_count; i++) {
+        int b = f->started[i];
+        if (reached[b] && map[b] < 0) map[b] = count++;
+    }
+    for (int i = 0; i < n; i++)
+        if (reached[i] && map[i] < 0) map[i] = count++;
+    IRBlock *blocks = malloc(sizeof(IRBlock) * (count ? count : 1));
+    for (int i = 0; i < n; i++) {
+        IRBlock *b = &f->blocks[i];
+        free(b->preds);
+        b->preds = NULL;
+        b->pred_count = 0;
+        if (map[i] < 0) {
+            free(b->insts);
+            continue;
+        }
+        if (block_done(b)) {
+            IRInst *t = &b->insts[b->count - 1];
+            int targets = t->op == IR_BR ? 2 : t->op == IR_JMP ? 1 : 0;
+            for (int j = 0; j < targets; j++)
+                if (t->target[j] >= 0 && t->target[j] < n) t->target[j] = map[t->target[j]];
+        }
+        blocks[map[i]] = *b;
+    }
+    free(f->blocks);
+    f->blocks = blocks;
+    f->block_count = f->block_cap = count;
+    f->started = realloc(f->started, sizeof(int) * (count ? count : 1));
+    for (int i = 0; i < count; i++) f->started[i] = i;
+    f->started_count = count;
+    f->cur = count - 1;
+
+    int *pred_counts = calloc(count ? count : 1, sizeof(int));
+    for (int i = 0; i < count; i++) {
+        int succ[2];
+        int k = successors(&blocks[i], succ);
+        for (int j = 0; j < k; j++)
+            if (succ[j] >= 0 && succ[j] < count) pred_counts[succ[j]]++;
+    }
+    for (int i = 0; i < count; i++)
+        blocks[i].preds = pred_counts[i] ? malloc(sizeof(int) * pred_counts[i]) : NULL;
+    for (int i = 0; i < count; i++) {
+        int succ[2];
+        int k = successors(&blocks[i], succ);
+        for (int j = 0; j < k; j++)
+            if (succ[j] >= 0 && succ[j] < count) blocks[succ[j]].preds[blocks[succ[j]].pred_count++] = i;
+    }
+    free(pred_counts);
+    free(reached);
+    free(stack);
+    free(map);
+}
+
+// ---- Legalizing ----
+
+static void emit_into(IRFunc *f, IROp op, VReg dst, VReg a, VReg b, int32_t imm) {
+    IRInst *in = ir_add(f, op);
+    in->dst = dst;
+    in->a = a;
+    in->b = b;
+    in->imm = imm;
+}
+
+// dst = a * imm as shifts and adds, one term per set bit of |imm|, negated
+// for a negative imm. The last step writes dst, so dst may be a.
+static void legalize_mul_const(IRFunc *f, VReg dst, VReg a, int32_t imm) {
+    uint32_t m = imm < 0 ? 0u - (uint32_t)imm : (uint32_t)imm;
+    if (m == 0) {
+        emit_into(f, IR_CONST, dst, 0, 0, 0);
+        return;
+    }
+    VReg acc = 0, term = a;
+    int at = 0;
+    for (int k = 0; k < 32; k++) {
+        if (!((m >> k) & 1)) continue;
+        int last = (m >> k) == 1 && imm > 0;
+        if (k > at) {
+            VReg to = last && !acc ? dst : ir_new_vreg(f);
+            emit_into(f, IR_SHL, to, term, 0, k - at);
+            term = to;
+            at = k;
+        }
+        if (acc) {
+            VReg to = last ? dst : ir_new_vreg(f);
+            emit_into(f, IR_ADD, to, acc, term, 0);
+            acc = to;
+        } else {
+            acc = term;
+        }
+    }
+    if (imm < 0) emit_into(f, IR_SUB, dst, ir_const(f, 0), acc, 0);
+    else if (acc != dst) emit_into(f, IR_COPY, dst, acc, 0, 0);
+}
+
+// dst = a * b by shift and add: at most 32 rounds, right for any signs.
+static void legalize_mul(IRFunc *f, VReg dst, VReg a, VReg b) {
+    VReg sum = ir_const(f, 0), x = ir_new_vreg(f), y = ir_new_vreg(f);
+    ir_copy(f, x, a);
+    ir_copy(f, y, b);
+    int body = ir_new_block(f), add = ir_new_block(f), skip = ir_new_block(f), tail = ir_new_block(f);
+    ir_br(f, IR_NE, y, 0, 0, body, tail);
+    ir_start_block(f, body);
+    ir_br(f, IR_EQ, ir_binop_imm(f, IR_AND, y, 1), 0, 0, skip, add);
+    ir_start_block(f, add);
+    emit_into(f, IR_ADD, sum, sum, x, 0);
+    ir_start_block(f, skip);
+    emit_into(f, IR_SHL, x, x, 0, 1);
+    emit_into(f, IR_SHR, y, y, 0, 1);
+    ir_br(f, IR_NE, y, 0, 0, body, tail);
+    ir_start_block(f, tail);
+    ir_copy(f, dst, sum);
+}
+
+// v with its sign bit flipped: signed compares order these as unsigned
+// compares order the originals.
+static VReg flip_sign(IRFunc *f, VReg v) {
+    return ir_binop_imm(f, IR_ADD, v, INT32_MIN);
+}
+
+// v = -v when sign is negative.
+static void negate_if_negative(IRFunc *f, VReg v, VReg sign) {
+    int neg = ir_new_block(f), done = ir_new_block(f);
+    ir_br(f, IR_LT, sign, 0, 0, neg, done);
+    ir_start_block(f, neg);
+    emit_into(f, IR_SUB, v, ir_const(f, 0), v, 0);
+    ir_start_block(f, done);
+}
+
+// dst = a / b or a % b by repeated subtraction, as the machine has no
+// divide: the quotient counts how often b fits. Signed operands are
+// divided as magnitudes; the quotient is then negated when the signs
+// differ and the remainder takes a's sign, so both truncate toward zero.
+static void legalize_div(IRFunc *f, const IRInst *in) {
+    int is_signed = in->op == IR_DIV || in->op == IR_MOD;
+    VReg b = in->b ? in->b : ir_const(f, in->imm);
+    VReg quot = ir_const(f, 0), rem = ir_new_vreg(f), y = ir_new_vreg(f);
+    ir_copy(f, rem, in->a);
+    ir_copy(f, y, b);
+    if (is_signed) {
+        negate_if_negative(f, rem, in->a);
+        negate_if_negative(f, y, b);
+    }
+    // The magnitude of INT_MIN only fits unsigned, so the loop compares so.
+    VReg y_flipped = flip_sign(f, y);
+    int body = ir_new_block(f), tail = ir_new_block(f);
+    ir_br(f, IR_GE, flip_sign(f, rem), y_flipped, 0, body, tail);
+    ir_start_block(f, body);
+    emit_into(f, IR_SUB, rem, rem, y, 0);
+    emit_into(f, IR_ADD, quot, quot, 0, 1);
+    ir_br(f, IR_GE, flip_sign(f, rem), y_flipped, 0, body, tail);
+    ir_start_block(f, tail);
+    if (is_signed && in->op == IR_DIV) negate_if_negative(f, quot, ir_binop(f, IR_XOR, in->a, b));
+    if (is_signed && in->op == IR_MOD) negate_if_negative(f, rem, in->a);
+    ir_copy(f, in->dst, in->op == IR_DIV || in->op == IR_UDIV ? quot : rem);
+}
+
+// An unsigned compare as the signed one of its operands with their sign
+// bits flipped.
+static void legalize_unsigned_compare(IRFunc *f, IRInst *in) {
+    in->cond = (uint8_t)(in->cond - IR_ULT + IR_LT);
+    in->a = flip_sign(f, in->a);
+    if (in->b) in->b = flip_sign(f, in->b);
+    else in->imm = (int32_t)((uint32_t)in->imm ^ 0x80000000u);
+}
+
+// dst = a << b or a >> b one place at a time.
+static void legalize_shift(IRFunc *f, const IRInst *in) {
+    VReg x = ir_new_vreg(f), count = ir_new_vreg(f);
+    ir_copy(f, x, in->a);
+    ir_copy(f, count, in->b);
+    int body = ir_new_block(f), tail = ir_new_block(f);
+    ir_br(f, IR_GT, count, 0, 0, body, tail);
+    ir_start_block(f, body);
+    emit_into(f, in->op, x, x, 0, 1);
+    emit_into(f, IR_ADD, count, count, 0, -1);
+    ir_br(f, IR_GT, count, 0, 0, body, tail);
+    ir_start_block(f, tail);
+    ir_copy(f, in->dst, x);
+}
+
+void ir_legalize(IRFunc *f) {
+    IRBlock *old = f->blocks;
+    int n = f->block_count;
+    f->blocks = NULL;
+    f->block_count = f->block_cap = 0;
+    f->started_count = 0;
+    // The blocks keep their numbers; the loops expansions need are new
+    // blocks, started where the expansion is, so they are laid out there.
+    for (int i = 0; i < n; i++) ir_new_block(f);
+    for (int i = 0; i < n; i++) {
+        ir_start_block(f, i);
+        for (int j = 0; j < old[i].count; j++) {
+            IRInst in = old[i].insts[j];
+            switch (in.op) {
+            case IR_MUL:
+                if (in.b) legalize_mul(f, in.dst, in.a, in.b);
+                else legalize_mul_const(f, in.dst, in.a, in.imm);
+                continue;
+            case IR_DIV:
+            case IR_MOD:
+            case IR_UDIV:
+            case IR_UMOD:
+                legalize_div(f, &in);
+                continue;
+            case IR_SET:
+            case IR_BR:
+                if (in.cond >= IR_ULT) legalize_unsigned_compare(f, &in);
+                break;
+            case IR_SHL:
+            case IR_SHR:
+                if (in.b) {
+                    legalize_shift(f, &in);
+                    continue;
+                }
+                break;
+            default:
+                break;
+            }
+            *ir_add(f, in.op) = in;
+        }
+        free(old[i].insts);
+        free(old[i].preds);
+    }
+    free(old);
+    ir_finish(f);
+}
+
+// ---- Verifying ----
+
+static void report(StringBuilder *errors, int *count, const IRFunc *f, int block, const char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    sb_append(errors, "%s: b%d: %s\n", f->label, block, msg);
+    (*count)++;
+}
+
+static int is_binop(int op) {
+    return op >= IR_ADD && op <= IR_SHR;
+}
+
+int ir_verify(const IRFunc *f, StringBuilder *errors) {
+    int count = 0;
+    if (f->block_count <= 0) {
+        sb_append(errors, "%s: no blocks\n", f->label);
+        return 1;
+    }
+    for (int b = 0; b < f->block_count; b++) {
+        const IRBlock *blk = &f->blocks[b];
+        if (!block_done(blk)) report(errors, &count, f, b, "does not end in a terminator");
+        int params_done = b != 0;
+        for (int i = 0; i < blk->count; i++) {
+            const IRInst *in = &blk->insts[i];
+            if (is_terminator(in->op) && i != blk->count - 1)
+                report(errors, &count, f, b, "%d: terminator before the end of the block", i);
+            if (in->dst > f->vreg_count) report(errors, &count, f, b, "%d: v%u out of range", i, in->dst);
+            for (int u = 0; u < use_count(in); u++)
+                if (use_at(in, u) > f->vreg_count)
+                    report(errors, &count, f, b, "%d: v%u out of range", i, use_at(in, u));
+            int need_dst = !(in->op == IR_STORE || is_terminator(in->op) || in->op == IR_CALL);
+            if (need_dst && !in->dst) report(errors, &count, f, b, "%d: no destination", i);
+            if ((is_binop(in->op) || in->op == IR_SET || in->op == IR_COPY || in->op == IR_LOAD ||
+                 in->op == IR_STORE || in->op == IR_BR) && !in->a)
+                report(errors, &count, f, b, "%d: missing operand", i);
+            if (in->op == IR_STORE && !in->b) report(errors, &count, f, b, "%d: store of nothing", i);
+            if (in->op == IR_PARAM) {
+                if (params_done) report(errors, &count, f, b, "%d: param after the start of the entry block", i);
+                if (in->imm < 0 || in->imm > 2) report(errors, &count, f, b, "%d: param %d is not a register", i, in->imm);
+            } else {
+                params_done = 1;
+            }
+            if (in->op == IR_FRAME && (in->slot < 0 || in->slot >= f->slot_count))
+                report(errors, &count, f, b, "%d: no slot %d", i, in->slot);
+            if ((in->op == IR_LOAD || in->op == IR_STORE) && in->width != 1 && in->width != 4)
+                report(errors, &count, f, b, "%d: width %d", i, in->width);
+            if ((in->op == IR_SYM || in->op == IR_CALL) && !in->sym)
+                report(errors, &count, f, b, "%d: no symbol", i);
+            int targets = in->op == IR_BR ? 2 : in->op == IR_JMP ? 1 : 0;
+            for (int t = 0; t < targets; t++)
+                if (in->target[t] < 0 || in->target[t] >= f->block_count)
+                    report(errors, &count, f, b, "%d: no block %d", i, in->target[t]);
+        }
+    }
+    if (count) return count;
+
+    // Definitions reaching each block on every path: the meet is
+    // intersection, so all but the entry start full and shrink.
+    size_t words = f->vreg_count / 64 + 1;
+    int n = f->block_count;
+    size_t set_bytes = sizeof(uint64_t) * words * (size_t)n;
+    uint64_t *gen_sets = calloc(1, set_bytes);
+    uint64_t *in_sets = calloc(1, set_bytes);
+    uint64_t *out_sets = malloc(set_bytes);
+    memset(out_sets, 0xff, set_bytes);
+    for (int b = 0; b < n; b++)
+        for (int i = 0; i < f->blocks[b].count; i++) {
+            VReg d = f->blocks[b].insts[i].dst;
+            if (d) gen_sets[b * words + d / 64] |= 1ull << (d % 64);
+        }
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int b = 0; b < n; b++) {
+            const IRBlock *blk = &f->blocks[b];
+            uint64_t *in = &in_sets[b * words], *out = &out_sets[b * words];
+            for (size_t w = 0; w < words; w++) {
+                uint64_t meet = b == 0 || blk->pred_count == 0 ? 0 : ~0ull;
+                for (int p = 0; b != 0 && p < blk->pred_count; p++) meet &= out_sets[blk->preds[p] * words + w];
+                in[w] = meet;
+                uint64_t o = meet | gen_sets[b * words + w];
+                if (o != out[w]) {
+                    out[w] = o;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    uint64_t *defined = malloc(sizeof(uint64_t) * words);
+    for (int b = 0; b < n; b++) {
+        const IRBlock *blk = &f->blocks[b];
+        memcpy(defined, &in_sets[b * words], sizeof(uint64_t) * words);
+        for (int i = 0; i < blk->count; i++) {
+            const IRInst *in = &blk->insts[i];
+            for (int u = 0; u < use_count(in); u++) {
+                VReg v = use_at(in, u);
+                if (v && !(defined[v / 64] & (1ull << (v % 64))))
+                    report(errors, &count, f, b, "%d: v%u is used before it is defined on every path", i, v);
+            }
+            if (in->dst) defined[in->dst / 64] |= 1ull << (in->dst % 64);
+        }
+    }
+    free(defined);
+    free(gen_sets);
+    free(in_sets);
+    free(out_sets);
+    return count;
+}
+
+// ---- Printing ----
+
+static const char *const op_names[] = {
+    [IR_ADD] = "add", [IR_SUB] = "sub", [IR_MUL] = "mul", [IR_DIV] = "div", [IR_MOD] = "mod",
+    [IR_UDIV] = "udiv", [IR_UMOD] = "umod",
+    [IR_AND] = "and", [IR_OR] = "or", [IR_XOR] = "xor", [IR_SHL] = "shl", [IR_SHR] = "shr",
+};
+
+static const char *const cond_names[] = {
+    [IR_EQ] = "eq", [IR_NE] = "ne", [IR_LT] = "lt", [IR_GT] = "gt", [IR_LE] = "le", [IR_GE] = "ge",
+    [IR_ULT] = "ult", [IR_UGT] = "ugt", [IR_ULE] = "ule", [IR_UGE] = "uge",
+};
+
+static void print_operand(StringBuilder *sb, VReg v, int32_t imm) {
+    if (v) sb_append(sb, "v%u", v);
+    else sb_append(sb, "%d", imm);
+}
+
+void ir_print(const IRFunc *f, StringBuilder *sb) {
+    sb_append(sb, "func %s\n", f->label);
+    for (int i = 0; i < f->slot_count; i++) {
+        const IRSlot *s = &f->slots[i];
+        sb_append(sb, "  slot %d %s %d", i, s->name ? s->name : "-", s->size);
+        if (s->fixed) sb_append(sb, " @%d", s->offset);
+        sb_append(sb, "\n");
+    }
+    for (int b = 0; b < f->block_count; b++) {
+        const IRBlock *blk = &f->blocks[b];
+        sb_append(sb, "b%d:", b);
+        for (int p = 0; p < blk->pred_count; p++) sb_append(sb, "%sb%d", p ? ", " : "  ; preds ", blk->preds[p]);
+        sb_append(sb, "\n");
+        for (int i = 0; i < blk->count; i++) {
+            const IRInst *in = &blk->insts[i];
+            sb_append(sb, "  ");
+            if (in->dst) sb_append(sb, "v%u = ", in->dst);
+            switch (in->op) {
+            case IR_CONST: sb_append(sb, "%d", in->imm); break;
+            case IR_COPY: sb_append(sb, "v%u", in->a); break;
+            case IR_PARAM: sb_append(sb, "param %d", in->imm); break;
+            case IR_FRAME: {
+                const char *name = in->slot >= 0 && in->slot < f->slot_count ? f->slots[in->slot].name : NULL;
+                if (name) sb_append(sb, "&%s", name);
+                else sb_append(sb, "&slot%d", in->slot);
+                if (in->imm) sb_append(sb, " + %d", in->imm);
+                break; }
+            case IR_SYM: sb_append(sb, "%s", in->sym); break;
+            case IR_SET:
+                sb_append(sb, "%s v%u, ", cond_names[in->cond], in->a);
+                print_operand(sb, in->b, in->imm);
+                break;
+            case IR_LOAD: sb_append(sb, "%s v%u", in->width == 1 ? "loadb" : "load", in->a); break;
+            case IR_STORE: sb_append(sb, "%s v%u, v%u", in->width == 1 ? "storeb" : "store", in->a, in->b); break;
+            case IR_CALL:
+                sb_append(sb, "call %s(", in->sym);
+                for (int a = 0; a < in->arg_count; a++) sb_append(sb, "%sv%u", a ? ", " : "", in->args[a]);
+                sb_append(sb, ")");
+                break;
+            case IR_JMP: sb_append(sb, "jmp b%d", in->target[0]); break;
+            case IR_BR:
+                sb_append(sb, "br %s v%u, ", cond_names[in->cond], in->a);
+                print_operand(sb, in->b, in->imm);
+                sb_append(sb, ", b%d, b%d", in->target[0], in->target[1]);
+                break;
+            case IR_RET:
+                if (in->a) sb_append(sb, "ret v%u", in->a);
+                else sb_append(sb, "ret");
+                break;
+            default:
+                sb_append(sb, "%s v%u, ", op_names[in->op], in->a);
+                print_operand(sb, in->b, in->imm);
+                break;
+            }
+            sb_append(sb, "\n");
+        }
+    }
+}
+
+// ---- Emitting masm ----
+
+// Machine registers: r1 returns, r5-r7 pass the first three arguments, and
+// every one is the caller's to save. r3 and r4 are kept as scratch for
+// values that live in the frame and for addresses; the rest hold vregs.
+static const int alloc_regs[] = { 1, 2, 5, 6, 7 };
+#define ALLOC_REG_COUNT (int)(sizeof(alloc_regs) / sizeof(alloc_regs[0]))
+
+#define LABEL_RET (-1)
+
+typedef struct {
+    IRFunc *f;
+    StringBuilder *sb;
+    int *reg;           // by vreg: its machine register; 0: it lives in its home
+    int *home;          // by vreg: bp offset of its frame home
+    uint8_t *save;      // by instruction: registers a call must keep, bit r for rN
+    int *base;          // by block: the index of its first instruction in save
+    int frame;          // bytes below bp
+    int labels;         // internal labels made so far
+    int ret_used;
+} Emitter;
+
+// Where each vreg is live. Instruction k of the function, counting through
+// the blocks in order, reads its operands at point 2k and writes its result
+// at 2k + 1, so a result may take the register of an operand read there for
+// the last time. A vreg's interval runs from the first point it is live to
+// the last, holes included: start[v] > end[v] for a vreg never mentioned.
+// Also sets e->base, hint[], the register each vreg would best be in,
+// and calls[] and call_dsts[], the instruction numbers and results of the
+// calls in order; returns the number of calls.
+static int live_intervals(Emitter *e, int *start, int *end, uint8_t *hint, int *calls, VReg *call_dsts) {
+    IRFunc *f = e->f;
+    int n = f->block_count;
+    size_t words = f->vreg_count / 64 + 1;
+    size_t set_bytes = sizeof(uint64_t) * words * (size_t)n;
+    uint64_t *use_sets = calloc(1, set_bytes);
+    uint64_t *def_sets = calloc(1, set_bytes);
+    uint64_t *in_sets = calloc(1, set_bytes);
+    uint64_t *out_sets = calloc(1, set_bytes);
+    int total = 0, call_count = 0;
+    for (int b = 0; b < n; b++) {
+        const IRBlock *blk = &f->blocks[b];
+        uint64_t *use = &use_sets[b * words], *def = &def_sets[b * words];
+        e->base[b] = total;
+        total += blk->count;
+        for (int i = 0; i < blk->count; i++) {
+            const IRInst *in = &blk->insts[i];
+            for (int u = 0; u < use_count(in); u++) {
+                VReg v = use_at(in, u);
+                if (v && !(def[v / 64] & (1ull << (v % 64)))) use[v / 64] |= 1ull << (v % 64);
+            }
+            if (in->dst) def[in->dst / 64] |= 1ull << (in->dst % 64);
+            if (in->op == IR_CALL) {
+                call_dsts[call_count] = in->dst;
+                calls[call_count++] = e->base[b] + i;
+            }
+            if (in->op == IR_CALL && in->dst) hint[in->dst] = 1;
+            if (in->op == IR_PARAM) hint[in->dst] = (uint8_t)(5 + in->imm);
+            // Failing those, where a value is passed or returned.
+            if (in->op == IR_CALL)
+                for (int a = 0; a < in->arg_count && a < 3; a++)
+                    if (!hint[in->args[a]]) hint[in->args[a]] = (uint8_t)(5 + a);
+            if (in->op == IR_RET && in->a && !hint[in->a]) hint[in->a] = 1;
+        }
+    }
+
+    // Live out of a block is live into a successor; live in is what the
+    // block reads before writing, plus what is live out and it leaves be.
+    // Going backwards, a loop settles in a few rounds.
+    for (int changed = 1; changed;) {
+        changed = 0;
+        for (int b = n - 1; b >= 0; b--) {
+            int succ[2];
+            int k = successors(&f->blocks[b], succ);
+            uint64_t *in = &in_sets[b * words], *out = &out_sets[b * words];
+            const uint64_t *use = &use_sets[b * words], *def = &def_sets[b * words];
+            for (size_t w = 0; w < words; w++) {
+                uint64_t o = 0;
+                for (int j = 0; j < k; j++) o |= in_sets[succ[j] * words + w];
+                uint64_t i = use[w] | (o & ~def[w]);
+                if (o != out[w] || i != in[w]) {
+                    out[w] = o;
+                    in[w] = i;
+                    changed = 1;
+                }
+            }
+        }
+    }
+
+    for (VReg v = 0; v <= f->vreg_count; v++) {
+        start[v] = INT_MAX;
+        end[v] = -1;
+    }
+#define EXTEND(v, p) do { if ((p) < start[v]) start[v] = (p); if ((p) > end[v]) end[v] = (p); } while (0)
+    for (int b = 0; b < n; b++) {
+        const IRBlock *blk = &f->blocks[b];
+        int first = 2 * e->base[b], last = 2 * (e->base[b] + blk->count) - 1;
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t x = out_sets[b * words + w]; x; x &= x - 1) {
+                VReg v = (VReg)(w * 64) + (VReg)__builtin_ctzll(x);
+                EXTEND(v, last);
+            }
+            for (uint64_t x = in_sets[b * words + w]; x; x &= x - 1) {
+                VReg v = (VReg)(w * 64) + (VReg)__builtin_ctzll(x);
+                EXTEND(v, first);
+            }
+        }
+        for (int i = 0; i < blk->count; i++) {
+            const IRInst *in = &blk->insts[i];
+            int k = e->base[b] + i;
+            for (int u = 0; u < use_count(in); u++) {
+                VReg v = use_at(in, u);
+                if (v) EXTEND(v, 2 * k);
+            }
+            if (in->dst) EXTEND(in->dst, 2 * k + 1);
+        }
+    }
+#undef EXTEND
+    free(use_sets);
+    free(def_sets);
+    free(in_sets);
+    free(out_sets);
+    return call_count;
+}
+
+// Linear scan. Intervals are taken in order of their start, each given a
+// free register: its hint when that is free, the register the value
+// arrives in (r1 for a call's result, r5-r7 for a parameter) or else
+// leaves in (r5-r7 as an argument, r1 returned). With none free,
+// whichever of it and the intervals holding registers ends last lives in
+// its frame home instead. Every register is the caller's to save, so a
+// call pushes those holding values live across it.
+static void allocate(Emitter *e) {
+    IRFunc *f = e->f;
+    VReg n = f->vreg_count;
+    int total = 0;
+    for (int b = 0; b < f->block_count; b++) total += f->blocks[b].count;
+    int *start = malloc(sizeof(int) * (n + 1));
+    int *end = malloc(sizeof(int) * (n + 1));
+    uint8_t *hint = calloc(n + 1, 1);
+    int *calls = malloc(sizeof(int) * (total ? total : 1));
+    VReg *call_dsts = malloc(sizeof(VReg) * (total ? total : 1));
+    int call_count = live_intervals(e, start, end, hint, calls, call_dsts);
+    e->save = calloc(total ? total : 1, 1);
+
+    // By start, with a counting sort: points run from 0 to 2 * total.
+    int points = 2 * total + 1;
+    int *first = calloc(points + 1, sizeof(int));
+    VReg *order = malloc(sizeof(VReg) * (n + 1));
+    for (VReg v = 1; v <= n; v++)
+        if (end[v] >= 0) first[start[v] + 1]++;
+    for (int p = 0; p < points; p++) first[p + 1] += first[p];
+    int count = 0;
+    for (VReg v = 1; v <= n; v++)
+        if (end[v] >= 0) order[first[start[v]]++] = v, count++;
+
+    VReg owner[8] = {0};
+    for (int i = 0; i < count; i++) {
+        VReg v = order[i];
+        for (int r = 0; r < 8; r++)
+            if (owner[r] && end[owner[r]] < start[v]) owner[r] = 0;
+        int r = hint[v] && !owner[hint[v]] ? hint[v] : 0;
+        for (int k = 0; !r && k < ALLOC_REG_COUNT; k++)
+            if (!owner[alloc_regs[k]]) r = alloc_regs[k];
+        if (!r) {
+            int victim = 0;
+            for (int k = 0; k < ALLOC_REG_COUNT; k++)
+                if (!victim || end[owner[alloc_regs[k]]] > end[owner[victim]]) victim = alloc_regs[k];
+            if (end[owner[victim]] <= end[v]) continue;
+            e->reg[owner[victim]] = 0;
+            r = victim;
+        }
+        e->reg[v] = r;
+        owner[r] = v;
+    }
+
+    // The calls each register's interval spans, from its first point after
+    // the start to the last before the end, but for a call that sets it.
+    for (VReg v = 1; v <= n; v++) {
+        if (!e->reg[v]) continue;
+        int lo = 0, hi = call_count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (2 * calls[mid] < start[v]) lo = mid + 1;
+            else hi = mid;
+        }
+        for (int c = lo; c < call_count && 2 * calls[c] + 2 <= end[v]; c++)
+            if (call_dsts[c] != v) e->save[calls[c]] |= (uint8_t)(1 << e->reg[v]);
+    }
+
+    // The frame: slots in order below bp, then the homes.
+    int size = 0;
+    for (int i = 0; i < f->slot_count; i++) {
+        IRSlot *s = &f->slots[i];
+        if (s->fixed) continue;
+        size += (s->size + 3) / 4 * 4;
+        s->offset = -size;
+    }
+    for (VReg v = 1; v <= n; v++) {
+        if (end[v] < 0 || e->reg[v]) continue;
+        size += 4;
+        e->home[v] = -size;
+    }
+    e->frame = size;
+    free(start);
+    free(end);
+    free(hint);
+    free(calls);
+    free(call_dsts);
+    free(first);
+    free(order);
+}
+
+static void emit_label(Emitter *e, int id) {
+    if (id >= 0) sb_append(e->sb, "b_%s_%d", e->f->name, id);
+    else if (id == LABEL_RET) sb_append(e->sb, "b_%s_ret", e->f->name);
+    else sb_append(e->sb, "b_%s_x%d", e->f->name, -id - 2);
+}
+
+static void emit_jump(Emitter *e, const char *op, int id) {
+    sb_append(e->sb, "  %s ", op);
+    emit_label(e, id);
+    sb_append(e->sb, "\n");
+}
+
+// Jumps to id when the last cmp found `cond`.
+static void emit_jump_if(Emitter *e, int cond, int id) {
+    switch (cond) {
+    case IR_EQ: emit_jump(e, "jz", id); break;
+    case IR_NE: emit_jump(e, "jnz", id); break;
+    case IR_LT: emit_jump(e, "jl", id); break;
+    case IR_GT: emit_jump(e, "jg", id); break;
+    case IR_LE: emit_jump(e, "jl", id); emit_jump(e, "jz", id); break;
+    case IR_GE: emit_jump(e, "jg", id); emit_jump(e, "jz", id); break;
+    }
+}
+
+static int invert(int cond) {
+    switch (cond) {
+    case IR_EQ: return IR_NE;
+    case IR_NE: return IR_EQ;
+    case IR_LT: return IR_GE;
+    case IR_GE: return IR_LT;
+    case IR_GT: return IR_LE;
+    default: return IR_GT;
+    }
+}
+
+// Makes register r hold v.
+static void emit_fetch(Emitter *e, VReg v, int r) {
+    if (e->reg[v]) {
+        if (e->reg[v] != r) sb_append(e->sb, "  mov r%d, r%d\n", r, e->reg[v]);
+        return;
+    }
+    sb_append(e->sb, "  mov r%d, bp\n  addis r%d, %d\n  load r%d, r%d\n", r, r, e->home[v], r, r);
+}
+
+// The register holding v, loading it into scratch if it lives in the frame.
+static int emit_src(Emitter *e, VReg v, int scratch) {
+    if (e->reg[v]) return e->reg[v];
+    emit_fetch(e, v, scratch);
+    return scratch;
+}
+
+// Where v is worked out: its register, or r3 on the way to its home.
+static int dst_reg(Emitter *e, VReg v) {
+    return e->reg[v] ? e->reg[v] : 3;
+}
+
+// Gives v the value in register r.
+static void emit_put(Emitter *e, VReg v, int r) {
+    if (e->reg[v]) {
+        if (e->reg[v] != r) sb_append(e->sb, "  mov r%d, r%d\n", e->reg[v], r);
+        return;
+    }
+    int t = r == 4 ? 3 : 4;
+    sb_append(e->sb, "  mov r%d, bp\n  addis r%d, %d\n  store r%d, r%d\n", t, t, e->home[v], t, r);
+}
+
+// Moves srcs[i] into dsts[i] all at once: a register is overwritten only
+// once nothing still to be moved reads it, and a cycle goes through r4.
+static void emit_parallel_move(Emitter *e, int *dsts, int *srcs, int n) {
+    int pending = 0;
+    for (int i = 0; i < n; i++) {
+        if (dsts[i] == srcs[i]) continue;
+        dsts[pending] = dsts[i];
+        srcs[pending] = srcs[i];
+        pending++;
+    }
+    while (pending) {
+        int moved = 0;
+        for (int i = 0; i < pending; i++) {
+            int blocked = 0;
+            for (int j = 0; j < pending; j++)
+                if (j != i && srcs[j] == dsts[i]) blocked = 1;
+            if (blocked) continue;
+            sb_append(e->sb, "  mov r%d, r%d\n", dsts[i], srcs[i]);
+            dsts[i] = dsts[--pending];
+            srcs[i] = srcs[pending];
+            moved = 1;
+            i--;
+        }
+        if (moved || !pending) continue;
+        int freed = srcs[0];
+        sb_append(e->sb, "  mov r4, r%d\n", freed);
+        for (int j = 0; j < pending; j++)
+            if (srcs[j] == freed) srcs[j] = 4;
+    }
+}
+
+static void emit_binop(Emitter *e, const IRInst *in) {
+    static const char *const alu[] = {
+        [IR_ADD] = "add", [IR_SUB] = "sub", [IR_AND] = "and", [IR_OR] = "or", [IR_XOR] = "xor",
+    };
+    int d = dst_reg(e, in->dst);
+    if (!in->b) {
+        if (in->op == IR_ADD || in->op == IR_SUB) {
+            emit_fetch(e, in->a, d);
+            uint32_t k = in->op == IR_ADD ? (uint32_t)in->imm : 0u - (uint32_t)in->imm;
+            if (k) sb_append(e->sb, "  addis r%d, %d\n", d, (int32_t)k);
+        } else if (in->op == IR_SHL || in->op == IR_SHR) {
+            if (in->imm < 0 || in->imm > 31) {
+                sb_append(e->sb, "  movi r%d, 0\n", d);
+            } else {
+                emit_fetch(e, in->a, d);
+                for (int k = 0; k < in->imm; k++) sb_append(e->sb, "  %s r%d\n", in->op == IR_SHL ? "shl" : "shr", d);
+            }
+        } else {
+            emit_fetch(e, in->a, d);
+            sb_append(e->sb, "  movi r4, %d\n  %s r%d, r4\n", in->imm, alu[in->op], d);
+        }
+        emit_put(e, in->dst, d);
+        return;
+    }
+    int b = emit_src(e, in->b, 4);
+    if (b == d && e->reg[in->a] != d) {
+        // d holds b, which fetching a into it would lose
+        if (in->op != IR_SUB) {
+            sb_append(e->sb, "  %s r%d, r%d\n", alu[in->op], d, emit_src(e, in->a, 4));
+            emit_put(e, in->dst, d);
+            return;
+        }
+        sb_append(e->sb, "  mov r4, r%d\n", d);
+        b = 4;
+    }
+    emit_fetch(e, in->a, d);
+    sb_append(e->sb, "  %s r%d, r%d\n", alu[in->op], d, b);
+    emit_put(e, in->dst, d);
+}
+
+static void emit_compare(Emitter *e, const IRInst *in) {
+    int a = emit_src(e, in->a, 3);
+    if (in->b) sb_append(e->sb, "  cmp r%d, r%d\n", a, emit_src(e, in->b, 4));
+    else sb_append(e->sb, "  cmp r%d, %d\n", a, in->imm);
+}
+
+static void emit_call(Emitter *e, const IRInst *in, int at) {
+    uint8_t save = e->save[at];
+    for (int r = 1; r < 8; r++)
+        if (save & (1 << r)) sb_append(e->sb, "  push r%d\n", r);
+    int stack = in->arg_count > 3 ? in->arg_count - 3 : 0;
+    if (stack) {
+        sb_append(e->sb, "  addis sp, -%d\n", stack * 4);
+        for (int i = 3; i < in->arg_count; i++) {
+            int v = emit_src(e, in->args[i], 4);
+            sb_append(e->sb, "  mov r3, sp\n");
+            if (i > 3) sb_append(e->sb, "  addis r3, %d\n", (i - 3) * 4);
+            sb_append(e->sb, "  store r3, r%d\n", v);
+        }
+    }
+    int dsts[3], srcs[3], moves = 0;
+    for (int i = 0; i < in->arg_count && i < 3; i++) {
+        if (!e->reg[in->args[i]]) continue;
+        dsts[moves] = 5 + i;
+        srcs[moves] = e->reg[in->args[i]];
+        moves++;
+    }
+    emit_parallel_move(e, dsts, srcs, moves);
+    for (int i = 0; i < in->arg_count && i < 3; i++)
+        if (!e->reg[in->args[i]]) emit_fetch(e, in->args[i], 5 + i);
+    sb_append(e->sb, "  call %s\n", in->sym);
+    if (stack) sb_append(e->sb, "  addis sp, %d\n", stack * 4);
+    if (in->dst) emit_put(e, in->dst, 1);
+    for (int r = 7; r > 0; r--)
+        if (save & (1 << r)) sb_append(e->sb, "  pop r%d\n", r);
+}
+
+// The leading params of the entry block, as one move out of r5-r7.
+static int emit_params(Emitter *e, const IRBlock *entry) {
+    int dsts[3], srcs[3], moves = 0, i = 0;
+    for (; i < entry->count && entry->insts[i].op == IR_PARAM; i++) {
+        const IRInst *in = &entry->insts[i];
+        if (!e->reg[in->dst]) {
+            emit_put(e, in->dst, 5 + in->imm);
+            continue;
+        }
+        dsts[moves] = e->reg[in->dst];
+        srcs[moves] = 5 + in->imm;
+        moves++;
+    }
+    emit_parallel_move(e, dsts, srcs, moves);
+    return i;
+}
+
+static void emit_inst(Emitter *e, int b, int i) {
+    IRFunc *f = e->f;
+    const IRInst *in = &f->blocks[b].insts[i];
+    StringBuilder *sb = e->sb;
+    int next = b + 1;
+    switch (in->op) {
+    case IR_CONST: {
+        int d = dst_reg(e, in->dst);
+        sb_append(sb, "  movi r%d, %d\n", d, in->imm);
+        emit_put(e, in->dst, d);
+        break; }
+    case IR_COPY:
+        emit_put(e, in->dst, emit_src(e, in->a, 3));
+        break;
+    case IR_FRAME: {
+        int d = dst_reg(e, in->dst);
+        const IRSlot *s = &f->slots[in->slot];
+        sb_append(sb, "  mov r%d, bp\n", d);
+        if (s->offset + in->imm) {
+            sb_append(sb, "  addis r%d, %d", d, s->offset + in->imm);
+            if (s->name) sb_append(sb, " ; %s", s->name);
+            sb_append(sb, "\n");
+        }
+        emit_put(e, in->dst, d);
+        break; }
+    case IR_SYM: {
+        int d = dst_reg(e, in->dst);
+        sb_append(sb, "  movi r%d, %s\n", d, in->sym);
+        emit_put(e, in->dst, d);
+        break; }
+    case IR_SET: {
+        emit_compare(e, in);
+        int d = dst_reg(e, in->dst);
+        int label = -2 - e->labels++;
+        sb_append(sb, "  movi r%d, 1\n", d);
+        emit_jump_if(e, in->cond, label);
+        sb_append(sb, "  movi r%d, 0\n", d);
+        emit_label(e, label);
+        sb_append(sb, ":\n");
+        emit_put(e, in->dst, d);
+        break; }
+    case IR_LOAD: {
+        int a = emit_src(e, in->a, 3);
+        int d = dst_reg(e, in->dst);
+        sb_append(sb, "  %s r%d, r%d\n", in->width == 1 ? "loadb" : "load", d, a);
+        emit_put(e, in->dst, d);
+        break; }
+    case IR_STORE: {
+        int a = emit_src(e, in->a, 3);
+        int v = emit_src(e, in->b, 4);
+        sb_append(sb, "  %s r%d, r%d\n", in->width == 1 ? "storeb" : "store", a, v);
+        break; }
+    case IR_CALL:
+        emit_call(e, in, e->base[b] + i);
+        break;
+    case IR_JMP:
+        if (in->target[0] != next) emit_jump(e, "jmp", in->target[0]);
+        break;
+    case IR_BR: {
+        int t = in->target[0], el = in->target[1];
+        if (t == el) {
+            if (t != next) emit_jump(e, "jmp", t);
+            break;
+        }
+        emit_compare(e, in);
+        if (el == next) {
+            emit_jump_if(e, in->cond, t);
+        } else if (t == next) {
+            emit_jump_if(e, invert(in->cond), el);
+        } else {
+            emit_jump_if(e, in->cond, t);
+            emit_jump(e, "jmp", el);
+        }
+        break; }
+    case IR_RET:
+        if (in->a) emit_fetch(e, in->a, 1);
+        if (next != f->block_count) {
+            emit_jump(e, "jmp", LABEL_RET);
+            e->ret_used = 1;
+        }
+        break;
+    default:
+        emit_binop(e, in);
+        break;
+    }
+}
+
+void ir_emit_masm(IRFunc *f, StringBuilder *sb) {
+    Emitter e = { .f = f, .sb = sb };
+    e.reg = calloc(f->vreg_count + 1, sizeof(int));
+    e.home = calloc(f->vreg_count + 1, sizeof(int));
+    e.base = calloc(f->block_count + 1, sizeof(int));
+    allocate(&e);
+    int frame = e.frame;
+
+    sb_append(sb, "\n%s:\n; prologue\n  push lr\n  push bp\n  mov bp, sp\n", f->label);
+    if (frame) sb_append(sb, "  addis sp, -%d\n", frame);
+    for (int b = 0; b < f->block_count; b++) {
+        const IRBlock *blk = &f->blocks[b];
+        if (blk->pred_count) {
+            emit_label(&e, b);
+            sb_append(sb, ":\n");
+        }
+        int i = b == 0 ? emit_params(&e, blk) : 0;
+        for (; i < blk->count; i++) emit_inst(&e, b, i);
+    }
+    if (e.ret_used) {
+        emit_label(&e, LABEL_RET);
+        sb_append(sb, ":\n");
+    }
+    sb_append(sb, "; epilogue\n");
+    if (frame) sb_append(sb, "  addis sp, %d\n", frame);
+    sb_append(sb, "  pop bp\n  pop lr\n");
+    sb_append(sb, f->is_main ? "  halt\n" : "  mov pc, lr\n");
+    free(e.reg);
+    free(e.home);
+    free(e.base);
+    free(e.save);
+}
@@ -1,40 +1,37 @@
 #include "lexer.h"
+#include "scan.h"
+#include "intern.h"
 
 #include <string.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <limits.h>
 
-static void advance_pos(const char *start, size_t len, int *line, int *col) {
-    for (size_t i = 0; i < len; i++) {
-        char c = start[i];
-        if (c == '\n') { (*line)++; *col = 1; }
-        else (*col)++;
-    }
-}
-
-StringTokenKindMap operators[] = {
-    {"==", EQ}, {"!=", NEQ}, {"<=", LTE}, {">=", GTE}, {"&&", LAND}, {"||", LOR},
-    {"<<", LSH}, {">>", RSH}, {"++", INC}, {"--", DEC}, {"*", ASTARISK}, {"->", ARROW},
-    {"+", ADD}, {"-", SUB}, {"/", DIV}, {"%", MOD}, {"=", ASSIGN},
-    {"(", L_PARENTHESES}, {")", R_PARENTHESES}, {";", SEMICOLON}, {",", COMMA},
-    {"{", L_BRACE}, {"}", R_BRACE}, {"[", L_BRACKET}, {"]", R_BRACKET},
-    {"<", LT}, {">", GT}, {".", DOT}, {"!", NOT}, {"?", QUESTION}, {":", COLON},
-    {"|", BITOR}, {"^", BITXOR}, {"~", BITNOT}, {"#", HASH}, {"&", AMPERSAND}
+// Character classes used by the first-byte dispatch in lexer().
+enum {
+    CH_SPACE = 1 << 0,  // ' ', \t, \n, \v, \f, \r
+    CH_DIGIT = 1 << 1,  // 0-9
+    CH_ALPHA = 1 << 2,  // a-z, A-Z, _
+    CH_PUNCT = 1 << 3,  // first byte of an operator or punctuator
 };
 
-StringTokenKindMap reservedWords[] = {
-    {"sizeof", SIZEOF}, {"bool", BOOL}, {"int", INT}, {"char", CHAR}, {"float", FLOAT},
-    {"double", DOUBLE}, {"void", VOID}, {"long", LONG}, {"short", SHORT},
-    {"unsigned", UNSIGNED}, {"signed", SIGNED}, {"const", CONST}, {"static", STATIC},
-    {"extern", EXTERN}, {"auto", AUTO}, {"register", REGISTER},
-    {"if", IF}, {"else", ELSE}, {"while", WHILE}, {"do", DO}, {"for", FOR},
-    {"switch", SWITCH}, {"case", CASE}, {"default", DEFAULT},
-    {"break", BREAK}, {"continue", CONTINUE}, {"return", RETURN},
-    {"typedef", TYPEDEF}, {"struct", STRUCT}, {"union", UNION}, {"enum", ENUM}
+static const unsigned char char_class[256] = {
+    [' '] = CH_SPACE, ['\t' ... '\r'] = CH_SPACE,
+    ['0' ... '9'] = CH_DIGIT,
+    ['a' ... 'z'] = CH_ALPHA, ['A' ... 'Z'] = CH_ALPHA, ['_'] = CH_ALPHA,
+    ['='] = CH_PUNCT, ['!'] = CH_PUNCT, ['<'] = CH_PUNCT, ['>'] = CH_PUNCT,
+    ['&'] = CH_PUNCT, ['|'] = CH_PUNCT, ['+'] = CH_PUNCT, ['-'] = CH_PUNCT,
+    ['*'] = CH_PUNCT, ['/'] = CH_PUNCT, ['%'] = CH_PUNCT, ['('] = CH_PUNCT,
+    [')'] = CH_PUNCT, [';'] = CH_PUNCT, [','] = CH_PUNCT, ['{'] = CH_PUNCT,
+    ['}'] = CH_PUNCT, ['['] = CH_PUNCT, [']'] = CH_PUNCT, ['.'] = CH_PUNCT,
+    ['?'] = CH_PUNCT, [':'] = CH_PUNCT, ['^'] = CH_PUNCT, ['~'] = CH_PUNCT,
+    ['#'] = CH_PUNCT,
 };
 
+#define IS_IDENT_CHAR(c) (char_class[(unsigned char)(c)] & (CH_ALPHA | CH_DIGIT))
+
 char *tokenkind2str(TokenKind kind) {
     switch (kind) {
         case EQ: return "EQ";
@@ -116,97 +113,178 @@ char *tokenkind2str(TokenKind kind) {
     return "UNKNOWN";
 }
 
-Token *createToken(Token *cur, int kind, char *value, int line, int col) {
-    Token *newTk = malloc(sizeof(Token));
-    newTk->kind = kind;
-    newTk->value = strdup(value);
-    newTk->line = line;
-    newTk->col = col;
-    newTk->next = NULL;
-    cur->next = newTk;
-    return newTk;
-}
+static void setToken(Token *tk, TokenKind kind, const char *src, const char *start, size_t len) {
+    tk->kind = kind;
+    tk->offset = (int)(start - src);
+    tk->len = (int)len;
+    tk->num_flags = 0;
+    tk->atom = NULL;
+}
 
-bool isComment(char *ptr, char *buffer) {
-    if (ptr[0] != '/' || ptr[1] != '/') return false;
-    while (*ptr && *ptr != '\n') *buffer++ = *ptr++;
-    *buffer = '\0';
-    return true;
-}
-
-bool isCommentBlock(char *ptr, char *buffer) {
-    if (ptr[0] != '/' || ptr[1] != '*') return false;
-    ptr += 2;
-    while (*ptr && !(ptr[0] == '*' && ptr[1] == '/')) *buffer++ = *ptr++;
-    if (*ptr) ptr += 2;
-    *buffer = '\0';
-    return true;
-}
-
-bool isOperator(char *ptr, TokenKind *tk, char *buffer) {
-    for (long unsigned int i = 0; i < sizeof(operators)/sizeof(operators[0]); i++) {
-        size_t len = strlen(operators[i].str);
-        if (strncmp(ptr, operators[i].str, len) == 0) {
-            strcpy(buffer, operators[i].str);
-            if (tk) *tk = operators[i].kind;
-            return true;
-        }
+// Longest-match operator recognition keyed on the first byte.
+// Returns the operator length (0 if ptr does not start an operator).
+static int matchOperator(const char *ptr, TokenKind *tk) {
+    char c1 = ptr[1];
+    switch (ptr[0]) {
+    case '=': if (c1 == '=') { *tk = EQ; return 2; }   *tk = ASSIGN; return 1;
+    case '!': if (c1 == '=') { *tk = NEQ; return 2; }  *tk = NOT; return 1;
+    case '<':
+        if (c1 == '=') { *tk = LTE; return 2; }
+        if (c1 == '<') { *tk = LSH; return 2; }
+        *tk = LT; return 1;
+    case '>':
+        if (c1 == '=') { *tk = GTE; return 2; }
+        if (c1 == '>') { *tk = RSH; return 2; }
+        *tk = GT; return 1;
+    case '&': if (c1 == '&') { *tk = LAND; return 2; } *tk = AMPERSAND; return 1;
+    case '|': if (c1 == '|') { *tk = LOR; return 2; }  *tk = BITOR; return 1;
+    case '+': if (c1 == '+') { *tk = INC; return 2; }  *tk = ADD; return 1;
+    case '-':
+        if (c1 == '-') { *tk = DEC; return 2; }
+        if (c1 == '>') { *tk = ARROW; return 2; }
+        *tk = SUB; return 1;
+    case '*': *tk = ASTARISK; return 1;
+    case '/': *tk = DIV; return 1;
+    case '%': *tk = MOD; return 1;
+    case '(': *tk = L_PARENTHESES; return 1;
+    case ')': *tk = R_PARENTHESES; return 1;
+    case ';': *tk = SEMICOLON; return 1;
+    case ',': *tk = COMMA; return 1;
+    case '{': *tk = L_BRACE; return 1;
+    case '}': *tk = R_BRACE; return 1;
+    case '[': *tk = L_BRACKET; return 1;
+    case ']': *tk = R_BRACKET; return 1;
+    case '.': *tk = DOT; return 1;
+    case '?': *tk = QUESTION; return 1;
+    case ':': *tk = COLON; return 1;
+    case '^': *tk = BITXOR; return 1;
+    case '~': *tk = BITNOT; return 1;
+    case '#': *tk = HASH; return 1;
+    default: return 0;
     }
-    return false;
 }
 
-bool isReservedWord(char *ptr, TokenKind *tk, char *buffer) {
-    for (long unsigned int i = 0; i < sizeof(reservedWords)/sizeof(reservedWords[0]); i++) {
-        size_t len = strlen(reservedWords[i].str);
-        if (strncmp(ptr, reservedWords[i].str, len) == 0 &&
-            !isalnum(ptr[len]) && ptr[len] != '_') {
-            strcpy(buffer, reservedWords[i].str);
-            if (tk) *tk = reservedWords[i].kind;
-            return true;
+#define KEYWORD(str, kind) \
+    if (len == sizeof(str) - 1 && memcmp(s, str, len) == 0) return kind
+
+// Maps an identifier-shaped lexeme to its reserved word kind, or IDENTIFIER.
+static TokenKind lookupKeyword(const char *s, size_t len) {
+    switch (s[0]) {
+    case 'a': KEYWORD("auto", AUTO); break;
+    case 'b': KEYWORD("bool", BOOL); KEYWORD("break", BREAK); break;
+    case 'c':
+        KEYWORD("char", CHAR); KEYWORD("const", CONST);
+        KEYWORD("case", CASE); KEYWORD("continue", CONTINUE);
+        break;
+    case 'd': KEYWORD("do", DO); KEYWORD("double", DOUBLE); KEYWORD("default", DEFAULT); break;
+    case 'e': KEYWORD("else", ELSE); KEYWORD("enum", ENUM); KEYWORD("extern", EXTERN); break;
+    case 'f': KEYWORD("for", FOR); KEYWORD("float", FLOAT); break;
+    case 'i': KEYWORD("int", INT); KEYWORD("if", IF); break;
+    case 'l': KEYWORD("long", LONG); break;
+    case 'r': KEYWORD("return", RETURN); KEYWORD("register", REGISTER); break;
+    case 's':
+        KEYWORD("sizeof", SIZEOF); KEYWORD("struct", STRUCT); KEYWORD("static", STATIC);
+        KEYWORD("short", SHORT); KEYWORD("signed", SIGNED); KEYWORD("switch", SWITCH);
+        break;
+    case 't': KEYWORD("typedef", TYPEDEF); break;
+    case 'u': KEYWORD("unsigned", UNSIGNED); KEYWORD("union", UNION); break;
+    case 'v': KEYWORD("void", VOID); break;
+    case 'w': KEYWORD("while", WHILE); break;
+    default: break;
+    }
+    return IDENTIFIER;
+}
+
+#undef KEYWORD
+
+// Returns the length of the numeric literal at ptr, which starts with a digit
+// or with '.' and a digit. Like a C pp-number it takes every following letter,
+// digit and '.', plus a sign right after an exponent letter. So "0x1Fu" and
+// "1e-3f" are one token, and so are malformed spellings like "09" or "1abc";
+// decodeNumber() rejects those.
+static size_t scanNumber(const char *ptr) {
+    const char *p = ptr + 1;
+    while (IS_IDENT_CHAR(*p) || *p == '.') {
+        char c = *p++;
+        if ((c == 'e' || c == 'E' || c == 'p' || c == 'P') && (*p == '+' || *p == '-')) p++;
+    }
+    return (size_t)(p - ptr);
+}
+
+static int digitValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 99;
+}
+
+// Decodes the NUMBER lexeme [p, p + len) into tk's value and NUM_* flags.
+static void decodeNumber(Token *tk, const char *p, size_t len) {
+    const char *end = p + len;
+    const char *digits = p;
+    int base = 10;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) { base = 16; digits = p + 2; }
+    else if (p[0] == '0' && (p[1] == 'b' || p[1] == 'B')) { base = 2; digits = p + 2; }
+
+    int is_float = 0;
+    for (const char *q = digits; q < end; q++) {
+        if (*q == '.' || (base == 10 && (*q == 'e' || *q == 'E'))
+                      || (base == 16 && (*q == 'p' || *q == 'P'))) is_float = 1;
+    }
+
+    if (is_float) {
+        // The lexeme spans everything strtod could accept, so it stops inside
+        // it; only a float suffix may remain.
+        char *stop;
+        tk->fval = strtod(p, &stop);
+        tk->num_flags = NUM_FLOAT;
+        if (stop == end - 1 && (*stop == 'f' || *stop == 'F')) tk->num_flags |= NUM_FLOAT32;
+        else if (stop == end - 1 && (*stop == 'l' || *stop == 'L')) tk->num_flags |= NUM_LONG;
+        else if (stop != end) tk->num_flags |= NUM_INVALID;
+        return;
+    }
+
+    if (base == 10 && p[0] == '0') base = 8;
+    unsigned long long v = 0;
+    int flags = 0;
+    const char *q = digits;
+    for (; q < end && digitValue(*q) < base; q++) {
+        unsigned d = (unsigned)digitValue(*q);
+        if (v > (ULLONG_MAX - d) / (unsigned)base) flags |= NUM_INVALID;  // out of range
+        v = v * (unsigned)base + d;
+    }
+    if (q == digits) flags |= NUM_INVALID;  // "0x" or "0b" alone
+
+    // u and l/ll may each appear once, in either order; ll must not mix case.
+    while (q < end) {
+        if ((*q == 'u' || *q == 'U') && !(flags & NUM_UNSIGNED)) {
+            flags |= NUM_UNSIGNED;
+            q++;
+        } else if ((*q == 'l' || *q == 'L') && !(flags & (NUM_LONG | NUM_LONGLONG))) {
+            if (q + 1 < end && q[1] == q[0]) { flags |= NUM_LONGLONG; q += 2; }
+            else { flags |= NUM_LONG; q++; }
+        } else {
+            flags |= NUM_INVALID;
+            break;
         }
     }
-    return false;
+    tk->ival = v;
+    tk->num_flags = flags;
 }
 
-bool isNumber(char *ptr, char *buffer) {
-    char *start = ptr;
-    if (*ptr == '+' || *ptr == '-') ptr++;
-    char *numStart = ptr;
-    while (isdigit(*ptr)) ptr++;
-    if (*ptr == '.') {
-        ptr++;
-        while (isdigit(*ptr)) ptr++;
+// Returns the length of the string literal at ptr including both quotes,
+// or 0 if it is not terminated.
+static size_t scanStringLiteral(const char *ptr) {
+    const char *p = ptr + 1;
+    while (*p && *p != '"') {
+        if (*p == '\\' && p[1]) p++;
+        p++;
     }
-    if (ptr == numStart) return false;
-    size_t len = ptr - start;
-    strncpy(buffer, start, len);
-    buffer[len] = '\0';
-    return true;
-}
-
-bool isIdentifier(char *ptr, char *buffer) {
-    if (!isalpha(*ptr) && *ptr != '_') return false;
-    char *start = ptr;
-    while (isalnum(*ptr) || *ptr == '_') ptr++;
-    size_t len = ptr - start;
-    strncpy(buffer, start, len);
-    buffer[len] = '\0';
-    return true;
-}
-
-bool isStringLiteral(char *ptr, char *buffer) {
-    if (*ptr != '"') return false;
-    char *start = ptr++;
-    while (*ptr && (*ptr != '"' || *(ptr - 1) == '\\')) ptr++;
-    if (*ptr != '"') return false;
-    ptr++;
-    size_t len = ptr - start;
-    strncpy(buffer, start, len);
-    buffer[len] = '\0';
-    return true;
-}
-
-int isCharLiteral(char *ptr, char *buffer) {
+    if (*p != '"') return 0;
+    return (size_t)(p + 1 - ptr);
+}
+
+int isCharLiteral(const char *ptr, char *buffer) {
     if (*ptr != '\'') return 0;
     ptr++;  // skip opening '
 
@@ -236,101 +314,442 @@ int isCharLiteral(char *ptr, char *buffer) {
     return consumed;
 }
 
-Token *lexer(char *input) {
-    Token head = {0};
-    Token *cur = &head;
-    char *ptr = input;
-    char buffer[256];
+// Lexes the first token that starts in [ptr, end) of src into *tk and returns
+// the position after it. ptr must be a point the lexer reaches between
+// tokens. If no token starts there, *tk becomes an EOT token at the point
+// where lexing stopped, which can be past end when a run of blanks straddles
+// it.
+static const char *lexToken(const char *src, const char *ptr, const char *end, Token *tk) {
+    char buffer[2];
     TokenKind kind;
-    int line = 1;
-    int col = 1;
-
-    while (*ptr) {
-        buffer[0] = '\0';
-
-        if (isspace(*ptr)) {
-            advance_pos(ptr, 1, &line, &col);
-            ptr++;
-            continue;
-        }
-
-        if (isComment(ptr, buffer)) {
-            size_t consumed = strlen(buffer);
-            advance_pos(ptr, consumed, &line, &col);
-            ptr += consumed;
-            while (*ptr && *ptr != '\n') { advance_pos(ptr,1,&line,&col); ptr++; }
-            if (*ptr == '\n') { advance_pos(ptr,1,&line,&col); ptr++; }
-            continue;
-        }
 
-        if (isCommentBlock(ptr, buffer)) {
-            size_t consumed = strlen(buffer) + 4; // /* + content + */
-            advance_pos(ptr, consumed, &line, &col);
-            ptr += consumed;
-            continue;
-        }
+    while (ptr < end && *ptr) {
+        unsigned char cls = char_class[(unsigned char)*ptr];
 
-        if (isOperator(ptr, &kind, buffer)) {
-            int tok_line = line, tok_col = col;
-            size_t consumed = strlen(buffer);
-            cur = createToken(cur, kind, buffer, tok_line, tok_col);
-            advance_pos(ptr, consumed, &line, &col);
-            ptr += consumed;
+        if (cls & CH_SPACE) {
+            // Single spaces between tokens are the common case; only runs
+            // (indentation, blank lines) are worth the bulk scanner.
+            if (*ptr == ' ' && !(char_class[(unsigned char)ptr[1]] & CH_SPACE)) ptr++;
+            else ptr = scanBlanks(ptr);
             continue;
         }
 
-        if (isReservedWord(ptr, &kind, buffer)) {
-            int tok_line = line, tok_col = col;
-            size_t consumed = strlen(buffer);
-            cur = createToken(cur, kind, buffer, tok_line, tok_col);
-            advance_pos(ptr, consumed, &line, &col);
-            ptr += consumed;
-            continue;
+        if (cls & CH_ALPHA) {
+            const char *start = ptr;
+            while (IS_IDENT_CHAR(*ptr)) ptr++;
+            size_t len = (size_t)(ptr - start);
+            TokenKind kw = lookupKeyword(start, len);
+            setToken(tk, kw, src, start, len);
+            if (kw == IDENTIFIER) tk->atom = intern(start, len);
+            return ptr;
         }
 
-        if (isNumber(ptr, buffer)) {
-            int tok_line = line, tok_col = col;
-            size_t consumed = strlen(buffer);
-            cur = createToken(cur, NUMBER, buffer, tok_line, tok_col);
-            advance_pos(ptr, consumed, &line, &col);
-            ptr += consumed;
-            continue;
+        if ((cls & CH_DIGIT) ||
+            (ptr[0] == '.' && (char_class[(unsigned char)ptr[1]] & CH_DIGIT))) {  // ".5"
+            size_t len = scanNumber(ptr);
+            setToken(tk, NUMBER, src, ptr, len);
+            decodeNumber(tk, ptr, len);
+            return ptr + len;
         }
 
-        if (isIdentifier(ptr, buffer)) {
-            int tok_line = line, tok_col = col;
-            size_t consumed = strlen(buffer);
-            cur = createToken(cur, IDENTIFIER, buffer, tok_line, tok_col);
-            advance_pos(ptr, consumed, &line, &col);
-            ptr += consumed;
-            continue;
+        if (cls & CH_PUNCT) {
+            if (ptr[0] == '/' && ptr[1] == '/') {
+                ptr = scanLineEnd(ptr + 2);
+                continue;
+            }
+            if (ptr[0] == '/' && ptr[1] == '*') {
+                ptr = scanBlockComment(ptr + 2);
+                continue;
+            }
+            int len = matchOperator(ptr, &kind);
+            setToken(tk, kind, src, ptr, (size_t)len);
+            return ptr + len;
         }
 
-        if (isStringLiteral(ptr, buffer)) {
-            int tok_line = line, tok_col = col;
-            size_t consumed = strlen(buffer);
-            ptr += consumed;
-            advance_pos(ptr - consumed, consumed, &line, &col);
-
-            memmove(buffer, buffer + 1, strlen(buffer) - 2); // Remove quotes
-            buffer[strlen(buffer) - 2] = '\0';
-            cur = createToken(cur, STRING_LITERAL, buffer, tok_line, tok_col);
-            continue;
+        if (*ptr == '"') {
+            size_t len = scanStringLiteral(ptr);
+            if (len > 0) {
+                setToken(tk, STRING_LITERAL, src, ptr, len);
+                return ptr + len;
+            }
         }
 
         int len;
         if ((len = isCharLiteral(ptr, buffer)) > 0) {
-            int tok_line = line, tok_col = col;
-            cur = createToken(cur, CHAR_LITERAL, buffer, tok_line, tok_col);
-            advance_pos(ptr, (size_t)len, &line, &col);
-            ptr += len;
-            continue;
+            setToken(tk, CHAR_LITERAL, src, ptr, (size_t)len);
+            return ptr + len;
         }
 
-        advance_pos(ptr, 1, &line, &col);
         ptr++;
     }
-
-    createToken(cur, EOT, "", line, col);
-    return head.next;
+    setToken(tk, EOT, src, ptr, 0);
+    return ptr;
+}
+
+// Appends the tokens that start in [begin, end) of ts->src to ts and returns
+// where lexing stopped. The slot after the last token holds an EOT token for
+// that point; it is not counted.
+static const char *lexRange(TokenStream *ts, const char *begin, const char *end) {
+    const char *ptr = begin;
+    for (;;) {
+        if (ts->count == ts->cap) {
+            ts->cap = ts->cap ? ts->cap * 2 : 256;
+            ts->data = realloc(ts->data, sizeof(Token) * (size_t)ts->cap);
+        }
+        Token *tk = &ts->data[ts->count];
+        ptr = lexToken(ts->src, ptr, end, tk);
+        if (tk->kind == EOT) return ptr;
+        ts->count++;
+    }
+}
+
+static void initStream(TokenStream *ts, const char *src, size_t bytes) {
+    ts->src = src;
+    ts->line_starts = NULL;
+    ts->line_count = 0;
+    ts->map = NULL;
+    // Source code averages a few bytes per token; reserving up front keeps
+    // the stream to a single allocation for typical files.
+    ts->count = 0;
+    ts->cap = (int)(bytes / 4) + 16;
+    ts->data = malloc(sizeof(Token) * (size_t)ts->cap);
+}
+
+TokenStream lexer(const char *input) {
+    size_t size = strlen(input);
+    TokenStream ts;
+    initStream(&ts, input, size);
+    lexRange(&ts, input, input + size);
+    ts.count++;  // the EOT
+    return ts;
+}
+
+// ---- Parallel lexing ----
+
+// Below this many bytes per thread, splitting costs more than it saves.
+#define MIN_PARALLEL_CHUNK (256 * 1024)
+#define MAX_LEX_THREADS 64
+
+// Returns the first line start at or after target that the lexer reaches
+// between tokens, i.e. not inside a comment, string or char literal.
+// Scanning must begin at a point the lexer also reaches between tokens.
+// This walks the same literal and comment rules as lexRange but emits
+// nothing, so it runs several times faster than lexing.
+static const char *nextSafeSplit(const char *p, const char *target, const char *end) {
+    char buffer[2];
+    while (p < end) {
+        switch (*p) {
+        case '\n':
+            p++;
+            if (p >= target) return p;
+            continue;
+        case '/':
+            if (p[1] == '/') { p = scanLineEnd(p + 2); continue; }
+            if (p[1] == '*') { p = scanBlockComment(p + 2); continue; }
+            break;
+        case '"': {
+            size_t len = scanStringLiteral(p);
+            if (len > 0) { p += len; continue; }
+            break;
+        }
+        case '\'': {
+            int len = isCharLiteral(p, buffer);
+            if (len > 0) { p += len; continue; }
+            break;
+        }
+        case '\0':
+            return end;
+        default:
+            break;
+        }
+        p++;
+    }
+    return end;
+}
+
+typedef struct {
+    const char *begin, *end;
+    TokenStream ts;
+    Token *dst;               // stitch target in the merged stream
+} LexChunk;
+
+static void *lexChunk(void *arg) {
+    LexChunk *c = arg;
+    lexRange(&c->ts, c->begin, c->end);
+    return NULL;
+}
+
+static void *stitchChunk(void *arg) {
+    LexChunk *c = arg;
+    memcpy(c->dst, c->ts.data, sizeof(Token) * (size_t)c->ts.count);
+    freeTokenStream(&c->ts);
+    return NULL;
+}
+
+static void runChunks(LexChunk *chunks, int n, void *(*fn)(void *)) {
+    pthread_t tids[MAX_LEX_THREADS];
+    for (int i = 1; i < n; i++) pthread_create(&tids[i], NULL, fn, &chunks[i]);
+    fn(&chunks[0]);
+    for (int i = 1; i < n; i++) pthread_join(tids[i], NULL);
+}
+
+TokenStream lexerParallel(const char *input, size_t size, int threads) {
+    if (threads > MAX_LEX_THREADS) threads = MAX_LEX_THREADS;
+    if ((size_t)threads > size / MIN_PARALLEL_CHUNK) threads = (int)(size / MIN_PARALLEL_CHUNK);
+    if (threads <= 1) return lexer(input);
+
+    const char *end = input + size;
+    LexChunk chunks[MAX_LEX_THREADS];
+    int n = 0;
+    const char *begin = input;
+    for (int i = 1; i <= threads && begin < end; i++) {
+        const char *split = i == threads ? end
+            : nextSafeSplit(begin, input + size / (size_t)threads * (size_t)i, end);
+        chunks[n].begin = begin;
+        chunks[n].end = split;
+        initStream(&chunks[n].ts, input, (size_t)(split - begin));
+        n++;
+        begin = split;
+    }
+
+    // The scanners pick their implementation on first use; do that here,
+    // not in several chunks at once.
+    scanImplName();
+    intern_set_concurrent(1);
+    runChunks(chunks, n, lexChunk);
+    intern_set_concurrent(0);
+
+    int total = 0;
+    for (int i = 0; i < n; i++) total += chunks[i].ts.count;
+    // Offsets are relative to the whole input, so the first chunk's tokens
+    // are already in place; grow its array and copy the others in behind.
+    TokenStream out = chunks[0].ts;
+    out.cap = total + 1;
+    out.data = realloc(out.data, sizeof(Token) * (size_t)out.cap);
+    for (int i = 1, at = out.count; i < n; i++) {
+        chunks[i].dst = out.data + at;
+        at += chunks[i].ts.count;
+    }
+    out.count = total;
+    if (n > 1) runChunks(chunks + 1, n - 1, stitchChunk);
+
+    setToken(&out.data[out.count++], EOT, input, end, 0);
+    return out;
 }
+
+void freeTokenStream(TokenStream *ts) {
+    free(ts->data);
+    free(ts->line_starts);
+    ts->data = NULL;
+    ts->line_starts = NULL;
+    ts->line_count = 0;
+    ts->count = ts->cap = 0;
+}
+
+// ---- Source positions ----
+
+// Records the offset of every line start in text. scanLineEnd is the vector
+// scanner, so this runs at memory speed; it happens at most once per buffer,
+// and only when a position is asked for.
+static void buildLineIndex(const char *text, int **starts_out, int *count_out) {
+    int cap = 256;
+    int *starts = malloc(sizeof(int) * (size_t)cap);
+    int count = 0;
+    starts[count++] = 0;
+    for (const char *p = text; *(p = scanLineEnd(p)) == '\n'; p++) {
+        if (count == cap) {
+            cap *= 2;
+            starts = realloc(starts, sizeof(int) * (size_t)cap);
+        }
+        starts[count++] = (int)(p + 1 - text);
+    }
+    *starts_out = starts;
+    *count_out = count;
+}
+
+static SourceFile *findFile(const SourceMap *map, int offset) {
+    int lo = 0, hi = map->count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (map->files[mid]->base <= offset) lo = mid;
+        else hi = mid - 1;
+    }
+    return map->files[lo];
+}
+
+static const char *textAt(const TokenStream *ts, int offset) {
+    if (!ts->map) return ts->src + offset;
+    const SourceFile *f = findFile(ts->map, offset);
+    return f->text + (offset - f->base);
+}
+
+// Where a token's text lives: its buffer, the offset in it, and the line
+// index for that buffer (built here if needed).
+typedef struct {
+    const char *text;
+    int offset;
+    const int *line_starts;
+    int line_count;
+} Location;
+
+static Location locate(TokenStream *ts, const Token *tok) {
+    Location loc;
+    if (ts->map) {
+        SourceFile *f = findFile(ts->map, tok->offset);
+        if (!f->line_starts) buildLineIndex(f->text, &f->line_starts, &f->line_count);
+        loc.text = f->text;
+        loc.offset = tok->offset - f->base;
+        loc.line_starts = f->line_starts;
+        loc.line_count = f->line_count;
+    } else {
+        if (!ts->line_starts) buildLineIndex(ts->src, &ts->line_starts, &ts->line_count);
+        loc.text = ts->src;
+        loc.offset = tok->offset;
+        loc.line_starts = ts->line_starts;
+        loc.line_count = ts->line_count;
+    }
+    return loc;
+}
+
+// Index of the last line starting at or before loc.offset.
+static int lineOf(const Location *loc) {
+    int lo = 0, hi = loc->line_count - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (loc->line_starts[mid] <= loc->offset) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+void tokenPosition(TokenStream *ts, const Token *tok, int *line, int *col) {
+    Location loc = locate(ts, tok);
+    int i = lineOf(&loc);
+    if (line) *line = i + 1;
+    if (col) *col = loc.offset - loc.line_starts[i] + 1;
+}
+
+const char *tokenLine(TokenStream *ts, const Token *tok, int *len) {
+    Location loc = locate(ts, tok);
+    const char *start = loc.text + loc.line_starts[lineOf(&loc)];
+    const char *end = scanLineEnd(start);
+    if (end > start && end[-1] == '\r') end--;
+    *len = (int)(end - start);
+    return start;
+}
+
+const char *tokenFileName(const TokenStream *ts, const Token *tok) {
+    return ts->map ? findFile(ts->map, tok->offset)->name : NULL;
+}
+
+SourceFile *sourceMapAdd(SourceMap *map, const char *name, const char *text, int size) {
+    SourceFile *f = calloc(1, sizeof(SourceFile));
+    f->name = name;
+    f->text = text;
+    f->size = size;
+    if (map->count > 0) {
+        const SourceFile *last = map->files[map->count - 1];
+        f->base = last->base + last->size + 1;  // the +1 gives EOT its own offset
+    }
+    if (map->count == map->cap) {
+        map->cap = map->cap ? map->cap * 2 : 16;
+        map->files = realloc(map->files, sizeof(SourceFile *) * (size_t)map->cap);
+    }
+    map->files[map->count++] = f;
+    return f;
+}
+
+// ---- Pull-based reader ----
+
+void tokenReaderInit(TokenReader *r, const char *src, size_t size) {
+    memset(r, 0, sizeof(*r));
+    r->own.src = src;
+    r->stream = &r->own;
+    r->pos = src;
+    r->end = src + size;
+}
+
+void tokenReaderInitStream(TokenReader *r, TokenStream *ts) {
+    memset(r, 0, sizeof(*r));
+    r->stream = ts;
+}
+
+void tokenReaderInitStreamAt(TokenReader *r, TokenStream *ts, unsigned index) {
+    tokenReaderInitStream(r, ts);
+    // Starts a little earlier so the history is there too.
+    unsigned back = index < TOKEN_HISTORY ? index : TOKEN_HISTORY;
+    r->head = r->filled = index - back;
+    while (back--) nextToken(r);
+}
+
+void tokenReaderInitPull(TokenReader *r, TokenStream *stream,
+                         void (*pull)(void *ctx, Token *out), void *ctx) {
+    memset(r, 0, sizeof(*r));
+    r->stream = stream;
+    r->pull = pull;
+    r->ctx = ctx;
+}
+
+void tokenReaderFree(TokenReader *r) {
+    freeTokenStream(&r->own);  // only its line index, if one was built
+}
+
+static void fillTo(TokenReader *r, unsigned index) {
+    while (r->filled <= index) {
+        Token *slot = &r->ring[r->filled % TOKEN_RING];
+        if (r->pull) {
+            r->pull(r->ctx, slot);
+        } else if (r->stream != &r->own) {
+            const TokenStream *ts = r->stream;
+            *slot = ts->data[r->filled < (unsigned)ts->count ? r->filled : (unsigned)ts->count - 1];
+        } else {
+            r->pos = lexToken(r->own.src, r->pos, r->end, slot);
+        }
+        r->filled++;
+    }
+}
+
+Token *peekToken(TokenReader *r, int k) {
+    fillTo(r, r->head + (unsigned)k);
+    return &r->ring[(r->head + (unsigned)k) % TOKEN_RING];
+}
+
+Token *prevToken(TokenReader *r, int k) {
+    if ((unsigned)k > r->head) return NULL;
+    return &r->ring[(r->head - (unsigned)k) % TOKEN_RING];
+}
+
+Token *nextToken(TokenReader *r) {
+    Token *tok = peekToken(r, 0);
+    if (tok->kind != EOT) r->head++;
+    return tok;
+}
+
+const char *tokenText(const TokenStream *ts, const Token *tok) {
+    return textAt(ts, tok->offset);
+}
+
+const char *tokenSpelling(const TokenStream *ts, const Token *tok, int *len) {
+    const char *start = textAt(ts, tok->offset);
+    int n = tok->len;
+    if (tok->kind == STRING_LITERAL && n >= 2) {
+        start++;
+        n -= 2;
+    }
+    if (len) *len = n;
+    return start;
+}
+
+char *tokenStrdup(const TokenStream *ts, const Token *tok) {
+    if (tok->kind == CHAR_LITERAL) {
+        char buffer[2] = {0};
+        isCharLiteral(textAt(ts, tok->offset), buffer);
+        return strdup(buffer);
+    }
+    int len;
+    const char *start = tokenSpelling(ts, tok, &len);
+    char *copy = malloc((size_t)len + 1);
+    memcpy(copy, start, (size_t)len);
+    copy[len] = '\0';
+    return copy;
+}
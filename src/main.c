@@ -1,10 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "lexer.h"
 #include "parser.h"
+#include "preproc.h"
 #include "codegen.h"
+#include "astcache.h"
 #include "AST.h"
 #include "utils.h"
 
@@ -25,33 +28,140 @@ static char *build_sidecar_path(const char *out_path, const char *suffix) {
     return res;
 }
 
+// Each pass over the tokens preprocesses the input afresh, pulling tokens
+// rather than keeping a list. Files are read and lexed only once: the
+// preprocessor caches them for the life of the process.
+static Preprocessor *open_reader(TokenReader *r, const char *path, int threads) {
+    Preprocessor *pp = ppOpen(path, threads);
+    if (!pp) exit(1);
+    ppReaderInit(r, pp);
+    return pp;
+}
+
+static void close_reader(TokenReader *r, Preprocessor *pp) {
+    tokenReaderFree(r);
+    ppClose(pp);
+}
+
+// The rest of the unit as a token list, resolving through r's stream.
+static TokenStream collect_tokens(TokenReader *r) {
+    TokenStream ts = *r->stream;
+    ts.data = NULL;
+    ts.count = ts.cap = 0;
+    ts.line_starts = NULL;
+    ts.line_count = 0;
+    for (;;) {
+        Token *tok = nextToken(r);
+        if (ts.count == ts.cap) {
+            ts.cap = ts.cap ? ts.cap * 2 : 4096;
+            ts.data = realloc(ts.data, sizeof(Token) * (size_t)ts.cap);
+        }
+        ts.data[ts.count++] = *tok;
+        if (tok->kind == EOT) break;
+    }
+    return ts;
+}
+
+static void dump_tokens(FILE *out, TokenReader *r) {
+    for (;;) {
+        Token *tok = nextToken(r);
+        char *value = tokenStrdup(r->stream, tok);
+        fprintf(out, "Token: kind=%s, value=%s\n", tokenkind2str(tok->kind), value);
+        free(value);
+        if (tok->kind == EOT) break;
+    }
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <input.c> <output.asm>\n", argv[0]);
+    // -j N lexes large inputs and parses function bodies on up to N threads,
+    // never more than there are cores. -I dir adds an #include search
+    // directory. -fmax-errors=N stops after N syntax errors (0: report them
+    // all). -fcache-dir=DIR keeps parsed trees in DIR; when the input and
+    // everything it includes are unchanged, the tree is loaded from there and
+    // only code is generated, so the token and tree dumps are not produced.
+    int threads = 1;
+    const char *cache_dir = NULL;
+    int argi = 1;
+    while (argi < argc) {
+        if (argi + 1 < argc && strcmp(argv[argi], "-j") == 0) {
+            threads = atoi(argv[argi + 1]);
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            if (cores > 0 && threads > cores) threads = (int)cores;
+            argi += 2;
+        } else if (strncmp(argv[argi], "-I", 2) == 0 && (argv[argi][2] || argi + 1 < argc)) {
+            ppAddIncludeDir(argv[argi][2] ? argv[argi] + 2 : argv[++argi]);
+            argi++;
+        } else if (strncmp(argv[argi], "-fmax-errors=", 13) == 0) {
+            parser_set_max_errors(atoi(argv[argi] + 13));
+            argi++;
+        } else if (strncmp(argv[argi], "-fcache-dir=", 12) == 0 && argv[argi][12]) {
+            cache_dir = argv[argi] + 12;
+            argi++;
+        } else {
+            break;
+        }
+    }
+    if (argc - argi < 2) {
+        fprintf(stderr, "Usage: %s [-j threads] [-I dir]... [-fmax-errors=N] [-fcache-dir=DIR] <input.c | -> <output.asm>\n", argv[0]);
         return 1;
     }
-    char *input_path = argv[1];
-    char *output_path = argv[2];
-
-    char *input = readSampleInput(input_path);
+    char *input_path = argv[argi];
+    char *output_path = argv[argi + 1];
+
+    CachedAST cached;
+    if (cache_dir && astcache_lookup(cache_dir, input_path, &cached)) {
+        char *output = codegen_flat(&cached.ast);
+        astcache_release(&cached);
+        if (!output) {
+            fprintf(stderr, "Code generation failed.\n");
+            return 1;
+        }
+        saveOutput(output_path, output);
+        printf("Code generation completed from cached AST. Output saved to %s\n", output_path);
+        free(output);
+        return 0;
+    }
 
-    Token *tokens = lexer(input);
+    TokenReader reader;
     // Also print to console as before
-    for (Token *t = tokens; t; t = t->next) {
-        printf("Token: kind=%s, value=%s\n", tokenkind2str(t->kind), t->value ? t->value : "(null)");
-    }
-    free(input);
+    Preprocessor *pp = open_reader(&reader, input_path, threads);
+    dump_tokens(stdout, &reader);
+    close_reader(&reader, pp);
 
     parser_set_filename(input_path);
-    Token *cur = tokens;
-    ASTNode *root = parse_program(&cur);
+    pp = open_reader(&reader, input_path, threads);
+    // Bodies parsed on several threads are found by position in a token
+    // list, so that path collects one first.
+    TokenStream tokens = {0};
+    ASTNode *root;
+    if (threads > 1) {
+        tokens = collect_tokens(&reader);
+        root = parse_program_parallel(&tokens, threads);
+    } else {
+        root = parse_program_reader(&reader);
+    }
+    int errors = parser_error_count();
+    if (errors) {
+        freeTokenStream(&tokens);
+        close_reader(&reader, pp);
+        fprintf(stderr, "%d error%s generated.\n", errors, errors == 1 ? "" : "s");
+        return 1;
+    }
+    FlatAST flat;
+    flat_build(&flat, root);
+    if (cache_dir) astcache_store(cache_dir, pp, &flat);
+    freeTokenStream(&tokens);
+    close_reader(&reader, pp);
 
     print_ast(root, 0);
     printf("AST parsing completed.\n");
 
-    char *output = codegen(root);
+    char *ir_text = NULL;
+    char *output = codegen_flat_with_ir(&flat, &ir_text);
+    flat_free(&flat);
     
     if (!output) {
+        free(ir_text);
         fprintf(stderr, "Code generation failed.\n");
         return 1;
     }
@@ -61,17 +171,17 @@ int main(int argc, char *argv[]) {
     
     free(output);
 
-    // Save lexer tokens and AST to sidecar .txt files next to the output
+    // Save lexer tokens, AST and IR to sidecar .txt files next to the output
     char *tokens_txt = build_sidecar_path(output_path, "_tokens.txt");
     char *ast_txt = build_sidecar_path(output_path, "_ast.txt");
+    char *ir_txt = build_sidecar_path(output_path, "_ir.txt");
 
     if (tokens_txt) {
         FILE *tf = fopen(tokens_txt, "wb");
         if (tf) {
-            for (Token *t = tokens; t; t = t->next) {
-                fprintf(tf, "Token: kind=%s, value=%s\n",
-                        tokenkind2str(t->kind), t->value ? t->value : "(null)");
-            }
+            pp = open_reader(&reader, input_path, threads);
+            dump_tokens(tf, &reader);
+            close_reader(&reader, pp);
             fclose(tf);
             printf("Tokens saved to %s\n", tokens_txt);
         } else {
@@ -90,8 +200,21 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (ir_txt && ir_text) {
+        FILE *irf = fopen(ir_txt, "wb");
+        if (irf) {
+            fputs(ir_text, irf);
+            fclose(irf);
+            printf("IR saved to %s\n", ir_txt);
+        } else {
+            perror("Failed to save ir.txt");
+        }
+    }
+
     free(tokens_txt);
     free(ast_txt);
+    free(ir_txt);
+    free(ir_text);
 
     return 0;
 }
@@ -1,278 +1,369 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <pthread.h>
 
 #include "parser.h"
 #include "lexer.h"
 #include "AST.h"
+#include "intern.h"
+#include "arena.h"
+#include "symtab.h"
+#include "utils.h"
 
-typedef struct FunctionTable {
-    ASTNode **funcs;
-    int count;
-} FunctionTable;
-
-#define MAX_TYPE_NAME 128
-typedef struct TypeTable {
-    char **typenames;
-    int count;
-} TypeTable;
+// Every node, child list and registry entry of a parse comes from here, so
+// free_ast is a single reset. Threads parsing function bodies allocate from
+// arenas of their own, which are merged into this one when they finish.
+static Arena g_ast_arena;
 
-typedef struct StructDef {
-    char *name;
-    ASTNode **members;
-    int member_count;
-} StructDef;
+// Registries of the names the last parse declared, by atom.
+static SymTab g_functions;  // -> AST_FUNDEF node
+static SymTab g_typenames;  // -> declaration order, from 1
+static SymTab g_structs;    // -> StructDef, by tag and by typedef name
 
-typedef struct StructTable {
-    StructDef **structs;
-    int count;
-} StructTable;
-
-Token *token_head = NULL;
-ASTNode *root;
-StructTable g_struct_table = { NULL, 0 };
-
-FunctionTable g_func_table = { NULL, 0 };
-TypeTable g_type_table = { NULL, 0 };
+static const char *g_parse_filename = NULL;
 
-void add_function(ASTNode *fn) {
-    g_func_table.funcs = realloc(g_func_table.funcs, sizeof(ASTNode*) * (g_func_table.count + 1));
-    g_func_table.funcs[g_func_table.count++] = fn;
+// Syntax errors of the last parse, and the scratch stack's buffer, which
+// each parse borrows and gives back so the next one starts with capacity.
+static ParseDiag *g_errors = NULL;
+static int g_error_count = 0;
+static int g_error_cap = 0;
+static int g_max_errors = 20;
+static ASTNode **g_scratch = NULL;
+static int g_scratch_cap = 0;
+
+// Bumped whenever the arena is reset, which frees every session's nodes.
+static unsigned g_arena_generation;
+
+// State of one parse. The parse functions reach everything through it, so
+// function bodies can be parsed on several threads at once: each thread has
+// its own context and arena and shares the registries, which body parses
+// only read.
+typedef struct BodyJob BodyJob;
+
+typedef struct ParseContext {
+    TokenReader *reader;
+    TokenStream *tokens;    // the reader's stream, for source text and lines
+    Arena *arena;
+    SymTab *functions, *typenames, *structs;
+    uintptr_t typename_limit;  // typedef names declared after this many are hidden
+    const char *filename;
+    // Child lists are collected on one scratch stack shared by all nesting
+    // levels, then copied into the arena once their length is known: a list
+    // of n children costs one allocation instead of n reallocs.
+    ASTNode **scratch;
+    int scratch_count;
+    int scratch_cap;
+    // parse_error records an error and jumps to recover, set by the
+    // innermost block or by the top level, which skips to the next statement
+    // or declaration and carries on. Once g_max_errors are recorded it jumps
+    // to abort instead and the parse ends there.
+    ParseDiag *errors;
+    int error_count;
+    int error_cap;
+    jmp_buf *recover;
+    jmp_buf *abort;
+    int quiet;              // record errors without printing them
+    // Set by parse_program_parallel: function bodies are skipped and left
+    // in jobs for its threads.
+    int defer_bodies;
+    BodyJob *jobs;
+    int job_count, job_cap;
+} ParseContext;
+
+// A context for a parse on the calling thread, into the shared arena and
+// registries.
+static void context_begin(ParseContext *pc, TokenReader *reader) {
+    memset(pc, 0, sizeof(*pc));
+    pc->reader = reader;
+    pc->tokens = reader->stream;
+    pc->arena = &g_ast_arena;
+    pc->functions = &g_functions;
+    pc->typenames = &g_typenames;
+    pc->structs = &g_structs;
+    pc->typename_limit = UINTPTR_MAX;
+    pc->filename = g_parse_filename;
+    pc->scratch = g_scratch;
+    pc->scratch_cap = g_scratch_cap;
+    pc->errors = g_errors;
+    pc->error_cap = g_error_cap;
+}
+
+// Publishes the context's errors as the last parse's.
+static void context_end(ParseContext *pc) {
+    g_scratch = pc->scratch;
+    g_scratch_cap = pc->scratch_cap;
+    g_errors = pc->errors;
+    g_error_cap = pc->error_cap;
+    g_error_count = pc->error_count;
+    free(pc->jobs);
+}
+
+static void add_function(ParseContext *pc, ASTNode *fn) {
+    symtab_put(pc->functions, fn->fundef.name, fn);
 }
 
-static const char *g_parse_filename = NULL;
 void parser_set_filename(const char *name) { g_parse_filename = name; }
 
 ASTNode* find_function(const char *name) {
-    for (int i = 0; i < g_func_table.count; i++) {
-        if (strcmp(g_func_table.funcs[i]->fundef.name, name) == 0) {
-            return g_func_table.funcs[i];
-        }
-    }
-    return NULL;
+    return symtab_get(&g_functions, name);
+}
+
+// Typedef names are numbered in declaration order, so a function body
+// parsed out of order sees only the ones declared before it.
+static void add_typename(ParseContext *pc, const char *name) {
+    if (!symtab_get(pc->typenames, name))
+        symtab_put(pc->typenames, name, (void *)(uintptr_t)(pc->typenames->count + 1));
 }
 
-void add_typename(const char *name) {
-    g_type_table.typenames = realloc(g_type_table.typenames, sizeof(char*) * (g_type_table.count + 1));
-    g_type_table.typenames[g_type_table.count++] = strdup(name);
+static int typename_visible(ParseContext *pc, const char *name) {
+    uintptr_t order = (uintptr_t)symtab_get(pc->typenames, name);
+    return order && order <= pc->typename_limit;
 }
 
 int is_user_typename(const char *name) {
-    for (int i = 0; i < g_type_table.count; i++) {
-        if (strcmp(g_type_table.typenames[i], name) == 0) return 1;
-    }
-    return 0;
+    return symtab_get(&g_typenames, name) != NULL;
 }
 
-void add_structdef(char *name, ASTNode **members, int member_count) {
-    StructDef *def = malloc(sizeof(StructDef));
-    def->name = strdup(name);
+// Registers a struct under its tag and typedef name, either of which may be
+// NULL. A definition replaces an earlier forward declaration.
+static void add_structdef(ParseContext *pc, const char *tag, const char *typedef_name,
+                          ASTNode **members, int member_count) {
+    StructDef *def = arena_alloc(pc->arena, sizeof(StructDef));
+    def->name = typedef_name ? typedef_name : tag;
     def->members = members;
     def->member_count = member_count;
-    g_struct_table.structs = realloc(g_struct_table.structs, sizeof(StructDef*) * (g_struct_table.count + 1));
-    g_struct_table.structs[g_struct_table.count++] = def;
+    if (tag && (members || !symtab_get(pc->structs, tag))) symtab_put(pc->structs, tag, def);
+    if (typedef_name) symtab_put(pc->structs, typedef_name, def);
+}
+
+const StructDef *find_structdef(const char *name) {
+    return symtab_get(&g_structs, name);
 }
 
-StructDef *find_structdef(const char *name) {
-    for (int i = 0; i < g_struct_table.count; i++) {
-        if (strcmp(g_struct_table.structs[i]->name, name) == 0) return g_struct_table.structs[i];
+static const char *token_spelling(ParseContext *pc, const Token *tok, int *len) {
+    return tokenSpelling(pc->tokens, tok, len);
+}
+
+// The token's value as an atom: identifiers were interned by the lexer, other
+// lexemes are interned on first use. Char literals intern the decoded char.
+static const char *token_atom(ParseContext *pc, const Token *tok) {
+    if (tok->kind == IDENTIFIER) return tok->atom;
+    if (tok->kind == CHAR_LITERAL) {
+        char *value = tokenStrdup(pc->tokens, tok);
+        const char *atom = intern_cstr(value);
+        free(value);
+        return atom;
     }
-    return NULL;
+    int len;
+    const char *text = token_spelling(pc, tok, &len);
+    return intern(text, (size_t)len);
 }
 
-ASTNode *new_var_decl(ASTNode *type, char *name, ASTNode *init);
+void parse_error(ParseContext *pc, const char *msg, Token *cur);
 
-ASTNode *new_string_literal(char *str) {
-    ASTNode *node = calloc(1, sizeof(ASTNode));
-    node->type = AST_STRING_LITERAL;
-    node->string_literal.value = strdup(str);
+// Array sizes: the lexer has already decoded the literal.
+static int token_int(ParseContext *pc, Token *tok) {
+    if ((tok->num_flags & (NUM_FLOAT | NUM_INVALID)) || tok->ival > INT_MAX)
+        parse_error(pc, "array size must be an integer constant", tok);
+    return (int)tok->ival;
+}
+
+ASTNode *new_var_decl(ParseContext *pc, ASTNode *type, const char *name, ASTNode *init);
+
+static ASTNode *new_node(ParseContext *pc, ASTNodeType type) {
+    ASTNode *node = arena_zalloc(pc->arena, sizeof(ASTNode));
+    node->type = type;
     return node;
 }
 
-ASTNode *new_char_literal(char *str) {
-    ASTNode *node = calloc(1, sizeof(ASTNode));
-    node->type = AST_CHAR_LITERAL;
-    node->char_literal.value = strdup(str);
+static void scratch_push(ParseContext *pc, ASTNode *node) {
+    if (pc->scratch_count == pc->scratch_cap) {
+        pc->scratch_cap = pc->scratch_cap ? pc->scratch_cap * 2 : 256;
+        pc->scratch = realloc(pc->scratch, sizeof(ASTNode*) * pc->scratch_cap);
+    }
+    pc->scratch[pc->scratch_count++] = node;
+}
+
+// Pops the children pushed since mark into a list of their own.
+static ASTNode **scratch_pop(ParseContext *pc, int mark, int *count) {
+    *count = pc->scratch_count - mark;
+    pc->scratch_count = mark;
+    if (*count == 0) return NULL;
+    return arena_memdup(pc->arena, pc->scratch + mark, sizeof(ASTNode*) * *count);
+}
+
+ASTNode *new_string_literal(ParseContext *pc, const char *str) {
+    ASTNode *node = new_node(pc, AST_STRING_LITERAL);
+    node->string_literal.value = str;
     return node;
 }
 
-ASTNode *new_sizeof(ASTNode *expr) {
-    ASTNode *node = calloc(1, sizeof(ASTNode));
-    node->type = AST_SIZEOF;
+ASTNode *new_char_literal(ParseContext *pc, const char *str) {
+    ASTNode *node = new_node(pc, AST_CHAR_LITERAL);
+    node->char_literal.value = str;
+    return node;
+}
+
+ASTNode *new_sizeof(ParseContext *pc, ASTNode *expr) {
+    ASTNode *node = new_node(pc, AST_SIZEOF);
     node->sizeof_expr.expr = expr;
     return node;
 }
 
 
-ASTNode *new_type_array(ASTNode *elem_type, int size) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_TYPE_ARRAY;
+ASTNode *new_type_array(ParseContext *pc, ASTNode *elem_type, int size) {
+    ASTNode *node = new_node(pc, AST_TYPE_ARRAY);
     node->type_array.element_type = elem_type;
     node->type_array.array_size = size;
     return node;
 }
 
-ASTNode *new_var_decl(ASTNode *type, char *name, ASTNode *init) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_VAR_DECL;
+ASTNode *new_var_decl(ParseContext *pc, ASTNode *type, const char *name, ASTNode *init) {
+    ASTNode *node = new_node(pc, AST_VAR_DECL);
     node->var_decl.var_type = type;
-    node->var_decl.name = strdup(name);
+    node->var_decl.name = name;
     node->var_decl.init = init;
     return node;
 }
 
-ASTNode* new_param(ASTNode *type, char *name) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_PARAM;
+ASTNode* new_param(ParseContext *pc, ASTNode *type, const char *name) {
+    ASTNode *node = new_node(pc, AST_PARAM);
     node->param.type = type;
-    node->param.name = strdup(name);
+    node->param.name = name;
     return node;
 }
-ASTNode* new_fundef(ASTNode *ret_type, char *name, ASTNode **params, int param_count, ASTNode *body) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_FUNDEF;
+ASTNode* new_fundef(ParseContext *pc, ASTNode *ret_type, const char *name, ASTNode **params, int param_count, ASTNode *body) {
+    ASTNode *node = new_node(pc, AST_FUNDEF);
     node->fundef.ret_type = ret_type;
-    node->fundef.name = strdup(name);
+    node->fundef.name = name;
     node->fundef.params = params;
     node->fundef.param_count = param_count;
     node->fundef.body = body;
     return node;
 }
-ASTNode *new_number(char *val) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_NUMBER;
-    node->number.value = strdup(val);
+ASTNode *new_number(ParseContext *pc, const char *val, const Token *tok) {
+    ASTNode *node = new_node(pc, AST_NUMBER);
+    node->number.value = val;
+    node->number.flags = tok->num_flags;
+    if (tok->num_flags & NUM_FLOAT) node->number.fval = tok->fval;
+    else node->number.ival = tok->ival;
     return node;
 }
-ASTNode *new_identifier(char *name) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_IDENTIFIER;
-    node->identifier.name = strdup(name);
+ASTNode *new_identifier(ParseContext *pc, const char *name) {
+    ASTNode *node = new_node(pc, AST_IDENTIFIER);
+    node->identifier.name = name;
     return node;
 }
-ASTNode *new_binary(TokenKind op, ASTNode *left, ASTNode *right) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_BINARY;
+ASTNode *new_binary(ParseContext *pc, TokenKind op, ASTNode *left, ASTNode *right) {
+    ASTNode *node = new_node(pc, AST_BINARY);
     node->binary.op = op;
     node->binary.left = left;
     node->binary.right = right;
     return node;
 }
-ASTNode *new_unary(TokenKind op, ASTNode *operand) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_UNARY;
+ASTNode *new_unary(ParseContext *pc, TokenKind op, ASTNode *operand) {
+    ASTNode *node = new_node(pc, AST_UNARY);
     node->unary.op = op;
     node->unary.operand = operand;
     return node;
 }
-ASTNode *new_assign(ASTNode *left, ASTNode *right) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_ASSIGN;
+ASTNode *new_assign(ParseContext *pc, ASTNode *left, ASTNode *right) {
+    ASTNode *node = new_node(pc, AST_ASSIGN);
     node->assign.left = left;
     node->assign.right = right;
     return node;
 }
-ASTNode *new_ternary(ASTNode *cond, ASTNode *then_expr, ASTNode *else_expr) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_TERNARY;
+ASTNode *new_ternary(ParseContext *pc, ASTNode *cond, ASTNode *then_expr, ASTNode *else_expr) {
+    ASTNode *node = new_node(pc, AST_TERNARY);
     node->ternary.cond = cond;
     node->ternary.then_expr = then_expr;
     node->ternary.else_expr = else_expr;
     return node;
 }
-ASTNode *new_type_node(ASTNode *base_type, int pointer_level, int modifiers) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_TYPE;
+ASTNode *new_type_node(ParseContext *pc, ASTNode *base_type, int pointer_level, int modifiers) {
+    ASTNode *node = new_node(pc, AST_TYPE);
     node->type_node.base_type = base_type;
     node->type_node.pointer_level = pointer_level;
     node->type_node.type_modifiers = modifiers;
     return node;
 }
 
-ASTNode *new_expr_stmt(ASTNode *expr) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_EXPR_STMT;
+ASTNode *new_expr_stmt(ParseContext *pc, ASTNode *expr) {
+    ASTNode *node = new_node(pc, AST_EXPR_STMT);
     node->expr_stmt.expr = expr;
     return node;
 }
 
-ASTNode *new_typedef(ASTNode *src_type, char *alias) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_TYPEDEF;
+ASTNode *new_typedef(ParseContext *pc, ASTNode *src_type, const char *alias) {
+    ASTNode *node = new_node(pc, AST_TYPEDEF);
     node->typedef_stmt.src_type = src_type;
-    node->typedef_stmt.alias = strdup(alias);
+    node->typedef_stmt.alias = alias;
     return node;
 }
 
-ASTNode *new_typedef_struct(char *struct_name, ASTNode **members, int member_count, char *typedef_name) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_TYPEDEF_STRUCT;
-    node->typedef_struct.struct_name = strdup(struct_name ? struct_name : "");
+ASTNode *new_typedef_struct(ParseContext *pc, const char *struct_name, ASTNode **members, int member_count, const char *typedef_name) {
+    ASTNode *node = new_node(pc, AST_TYPEDEF_STRUCT);
+    node->typedef_struct.struct_name = struct_name ? struct_name : ATOM_EMPTY;
     node->typedef_struct.members = members;
     node->typedef_struct.member_count = member_count;
-    node->typedef_struct.typedef_name = strdup(typedef_name);
+    node->typedef_struct.typedef_name = typedef_name;
     return node;
 }
 
-ASTNode *new_struct(char *name, ASTNode **members, int member_count) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_STRUCT;
-    node->struct_stmt.name = strdup(name);
+ASTNode *new_struct(ParseContext *pc, const char *name, ASTNode **members, int member_count) {
+    ASTNode *node = new_node(pc, AST_STRUCT);
+    node->struct_stmt.name = name ? name : ATOM_EMPTY;
     node->struct_stmt.members = members;
     node->struct_stmt.member_count = member_count;
     return node;
 }
 
-ASTNode *new_member_access(ASTNode *lhs, char *member_name) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_MEMBER_ACCESS;
+ASTNode *new_member_access(ParseContext *pc, ASTNode *lhs, const char *member_name) {
+    ASTNode *node = new_node(pc, AST_MEMBER_ACCESS);
     node->member_access.lhs = lhs;
-    node->member_access.member = strdup(member_name);
+    node->member_access.member = member_name;
     return node;
 }
-ASTNode *new_arrow_access(ASTNode *lhs, char *member_name) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_ARROW_ACCESS;
+ASTNode *new_arrow_access(ParseContext *pc, ASTNode *lhs, const char *member_name) {
+    ASTNode *node = new_node(pc, AST_ARROW_ACCESS);
     node->arrow_access.lhs = lhs;
-    node->arrow_access.member = strdup(member_name);
+    node->arrow_access.member = member_name;
     return node;
 }
 
-ASTNode *new_struct_member(char *type, char *name) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_STRUCT_MEMBER;
-    node->struct_member.type = strdup(type);
-    node->struct_member.name = strdup(name);
+ASTNode *new_struct_member(ParseContext *pc, const char *type, const char *name) {
+    ASTNode *node = new_node(pc, AST_STRUCT_MEMBER);
+    node->struct_member.type = type;
+    node->struct_member.name = name;
     return node;
 }
 
-ASTNode *new_init_list(ASTNode **elems, int count) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_INIT_LIST;
+ASTNode *new_init_list(ParseContext *pc, ASTNode **elems, int count) {
+    ASTNode *node = new_node(pc, AST_INIT_LIST);
     node->init_list.elements = elems;
     node->init_list.count = count;
     return node;
 }
 
-ASTNode *new_while(ASTNode *cond, ASTNode *body) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_WHILE;
+ASTNode *new_while(ParseContext *pc, ASTNode *cond, ASTNode *body) {
+    ASTNode *node = new_node(pc, AST_WHILE);
     node->while_stmt.cond = cond;
     node->while_stmt.body = body;
     return node;
 }
 
-ASTNode *new_do_while(ASTNode *cond, ASTNode *body) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_DO_WHILE;
+ASTNode *new_do_while(ParseContext *pc, ASTNode *cond, ASTNode *body) {
+    ASTNode *node = new_node(pc, AST_DO_WHILE);
     node->do_while_stmt.cond = cond;
     node->do_while_stmt.body = body;
     return node;
 }
 
-ASTNode *new_for(ASTNode *init, ASTNode *cond, ASTNode *inc, ASTNode *body) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_FOR;
+ASTNode *new_for(ParseContext *pc, ASTNode *init, ASTNode *cond, ASTNode *inc, ASTNode *body) {
+    ASTNode *node = new_node(pc, AST_FOR);
     node->for_stmt.init = init;
     node->for_stmt.cond = cond;
     node->for_stmt.inc = inc;
@@ -280,121 +371,156 @@ ASTNode *new_for(ASTNode *init, ASTNode *cond, ASTNode *inc, ASTNode *body) {
     return node;
 }
 
-ASTNode *new_break() {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_BREAK;
+ASTNode *new_break(ParseContext *pc) {
+    ASTNode *node = new_node(pc, AST_BREAK);
     return node;
 }
 
-ASTNode *new_continue() {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_CONTINUE;
+ASTNode *new_continue(ParseContext *pc) {
+    ASTNode *node = new_node(pc, AST_CONTINUE);
     return node;
 }
 
-ASTNode *new_if(ASTNode *cond, ASTNode *then_stmt, ASTNode *else_stmt) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_IF;
+ASTNode *new_if(ParseContext *pc, ASTNode *cond, ASTNode *then_stmt, ASTNode *else_stmt) {
+    ASTNode *node = new_node(pc, AST_IF);
     node->if_stmt.cond = cond;
     node->if_stmt.then_stmt = then_stmt;
     node->if_stmt.else_stmt = else_stmt;
     return node;
 }
-ASTNode *new_return(ASTNode *expr) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_RETURN;
+ASTNode *new_return(ParseContext *pc, ASTNode *expr) {
+    ASTNode *node = new_node(pc, AST_RETURN);
     node->ret.expr = expr;
     return node;
 }
-ASTNode *new_block(ASTNode **stmts, int count) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_BLOCK;
+ASTNode *new_block(ParseContext *pc, ASTNode **stmts, int count) {
+    ASTNode *node = new_node(pc, AST_BLOCK);
     node->block.stmts = stmts;
     node->block.count = count;
     return node;
 }
-ASTNode *new_call(char *name, ASTNode **args, int arg_count) {
-    ASTNode *node = malloc(sizeof(ASTNode));
-    node->type = AST_CALL;
-    node->call.name = strdup(name);
+ASTNode *new_call(ParseContext *pc, const char *name, ASTNode **args, int arg_count) {
+    ASTNode *node = new_node(pc, AST_CALL);
+    node->call.name = name;
     node->call.args = args;
     node->call.arg_count = arg_count;
     return node;
 }
 
-static void print_line_snippet(const char *file, int line, int col) {
-    if (!file || line <= 0) return;
-    FILE *fp = fopen(file, "r");
-    if (!fp) return;
-    char buf[512];
-    int cur_line = 1;
-    while (fgets(buf, sizeof(buf), fp)) {
-        if (cur_line == line) {
-            size_t len = strlen(buf);
-            while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r')) buf[--len] = '\0';
-            fprintf(stderr, "  %s\n", buf);
-            if (col > 0) fprintf(stderr, "  %*s^\n", col, "");
-            break;
-        }
-        cur_line++;
-    }
-    fclose(fp);
+// The line comes from the token stream's line index, not from re-reading
+// the file, so it also works for stdin.
+static void print_line_snippet(ParseContext *pc, const Token *tok, int col) {
+    int len;
+    const char *text = tokenLine(pc->tokens, tok, &len);
+    fprintf(stderr, "  %.*s\n", len, text);
+    if (col > 0) fprintf(stderr, "  %*s^\n", col, "");
 }
 
-void parse_error(const char *msg, Token *head, Token *cur) {
-    fprintf(stderr, "%s:%d:%d: error: %s\n",
-            g_parse_filename ? g_parse_filename : "<input>",
-            cur ? cur->line : 0,
-            cur ? cur->col : 0,
-            msg);
-    if (cur) print_line_snippet(g_parse_filename, cur->line, cur->col);
+void parser_set_max_errors(int max) { g_max_errors = max; }
+int parser_error_count(void) { return g_error_count; }
+const ParseDiag *parser_errors(void) { return g_errors; }
+
+static void record_error(ParseContext *pc, const char *msg, const char *file, int line, int col) {
+    if (pc->error_count == pc->error_cap) {
+        pc->error_cap = pc->error_cap ? pc->error_cap * 2 : 16;
+        pc->errors = realloc(pc->errors, sizeof(ParseDiag) * (size_t)pc->error_cap);
+    }
+    pc->errors[pc->error_count++] = (ParseDiag){ msg, file, line, col };
+}
+
+// cur must be the reader's current token; the context window around it
+// comes from the reader's history and lookahead. Does not return.
+void parse_error(ParseContext *pc, const char *msg, Token *cur) {
+    int line = 0, col = 0;
+    const char *file = NULL;
+    if (pc->quiet) {
+        // A body parsed on a worker thread: the line index is not built
+        // concurrently, and the error is reported again by a serial parse.
+        record_error(pc, msg, pc->filename, 0, 0);
+        if (g_max_errors > 0 && pc->error_count >= g_max_errors) longjmp(*pc->abort, 1);
+        longjmp(*pc->recover, 1);
+    }
+    if (cur && pc->tokens) {
+        tokenPosition(pc->tokens, cur, &line, &col);
+        file = tokenFileName(pc->tokens, cur);  // set for preprocessed input
+    }
+    if (!file) file = pc->filename ? pc->filename : "<input>";
+    fprintf(stderr, "%s:%d:%d: error: %s\n", file, line, col, msg);
+    if (cur && pc->tokens) print_line_snippet(pc, cur, col);
+    record_error(pc, msg, file, line, col);
 
     // Print a small window of surrounding tokens for context
-    Token *prevs[2] = {NULL, NULL};
-    Token *nexts[2] = {NULL, NULL};
-
-    Token *p = head;
-    while (p && p != cur) {
-        prevs[1] = prevs[0];
-        prevs[0] = p;
-        p = p->next;
-    }
-    Token *q = cur;
-    for (int i = 0; i < 2 && q; i++) {
-        q = q->next;
-        nexts[i] = q;
-    }
-
-    if (prevs[1])
-        fprintf(stderr, "  prev-2: kind=%s, value=%s (l%d c%d)\n",
-                tokenkind2str(prevs[1]->kind),
-                prevs[1]->value ? prevs[1]->value : "(null)",
-                prevs[1]->line, prevs[1]->col);
-    if (prevs[0])
-        fprintf(stderr, "  prev-1: kind=%s, value=%s (l%d c%d)\n",
-                tokenkind2str(prevs[0]->kind),
-                prevs[0]->value ? prevs[0]->value : "(null)",
-                prevs[0]->line, prevs[0]->col);
-    if (nexts[0])
-        fprintf(stderr, "  next+1: kind=%s, value=%s (l%d c%d)\n",
-                tokenkind2str(nexts[0]->kind),
-                nexts[0]->value ? nexts[0]->value : "(null)",
-                nexts[0]->line, nexts[0]->col);
-    if (nexts[1])
-        fprintf(stderr, "  next+2: kind=%s, value=%s (l%d c%d)\n",
-                tokenkind2str(nexts[1]->kind),
-                nexts[1]->value ? nexts[1]->value : "(null)",
-                nexts[1]->line, nexts[1]->col);
-    exit(1);
-}
-int expect(Token **cur, TokenKind kind) {
+    if (cur && pc->reader) {
+        static const char *labels[] = { "prev-2", "prev-1", NULL, "next+1", "next+2" };
+        for (int i = -2; i <= 2; i++) {
+            if (i == 0) continue;
+            const Token *t = i < 0 ? prevToken(pc->reader, -i) : peekToken(pc->reader, i);
+            if (!t) continue;
+            if (i > 0 && peekToken(pc->reader, i - 1)->kind == EOT) break;
+            int len;
+            const char *text = token_spelling(pc, t, &len);
+            tokenPosition(pc->tokens, t, &line, &col);
+            fprintf(stderr, "  %s: kind=%s, value=%.*s (l%d c%d)\n",
+                    labels[i + 2], tokenkind2str(t->kind), len, text, line, col);
+        }
+    }
+    if (!pc->recover) exit(1);
+    if (g_max_errors > 0 && pc->error_count >= g_max_errors) {
+        fprintf(stderr, "too many errors, stopping (limit %d)\n", g_max_errors);
+        longjmp(*pc->abort, 1);
+    }
+    longjmp(*pc->recover, 1);
+}
+// Moves *cur to the next token. Tokens live in the reader's ring, so a
+// parser never steps through them by pointer arithmetic.
+static void advance(ParseContext *pc, Token **cur) {
+    nextToken(pc->reader);
+    *cur = peekToken(pc->reader, 0);
+}
+int expect(ParseContext *pc, Token **cur, TokenKind kind) {
     if (*cur && (*cur)->kind == kind) {
-        *cur = (*cur)->next;
+        advance(pc, cur);
         return 1;
     }
     return 0;
 }
-int is_type(TokenKind kind, Token *cur) {
+// Panic-mode recovery inside a block: skips the rest of the broken
+// statement, through its ';' or a '{...}' body, stopping before the '}'
+// that closes the block.
+static void sync_statement(ParseContext *pc, Token **cur) {
+    *cur = peekToken(pc->reader, 0);
+    int depth = 0;
+    while ((*cur)->kind != EOT) {
+        TokenKind kind = (*cur)->kind;
+        if (kind == R_BRACE && depth == 0) return;
+        advance(pc, cur);
+        if (kind == L_BRACE) depth++;
+        else if (kind == R_BRACE && --depth == 0) return;
+        else if (kind == SEMICOLON && depth == 0) return;
+    }
+}
+
+int is_type(ParseContext *pc, TokenKind kind, Token *cur);
+
+// Recovery at file scope: as above, and also stops at what looks like the
+// start of the next declaration. At least one token is skipped, so the
+// token that failed is never parsed again.
+static void sync_toplevel(ParseContext *pc, Token **cur) {
+    *cur = peekToken(pc->reader, 0);
+    int depth = 0, skipped = 0;
+    while ((*cur)->kind != EOT) {
+        TokenKind kind = (*cur)->kind;
+        if (depth == 0 && skipped &&
+            (kind == TYPEDEF || kind == STRUCT || is_type(pc, kind, *cur))) return;
+        advance(pc, cur);
+        skipped = 1;
+        if (kind == L_BRACE) depth++;
+        else if (kind == R_BRACE && (depth == 0 || --depth == 0)) return;
+        else if (kind == SEMICOLON && depth == 0) return;
+    }
+}
+
+int is_type(ParseContext *pc, TokenKind kind, Token *cur) {
     if (kind == CONST || kind == UNSIGNED || kind == SIGNED) return 1;
 
     if (kind == VOID ||
@@ -404,219 +530,221 @@ int is_type(TokenKind kind, Token *cur) {
         kind == DOUBLE ||
         kind == BOOL
     ) return 1;
-    if (kind == IDENTIFIER && is_user_typename(cur->value)) return 1;
+    if (kind == IDENTIFIER && typename_visible(pc, cur->atom)) return 1;
     return 0;
 }
 
-ASTNode *parse_expr(Token **cur);
-ASTNode *parse_variable_declaration(Token **cur, int need_semicolon);
-ASTNode *parse_struct(Token **cur);
-ASTNode *parse_type(Token **cur);
+ASTNode *parse_expr(ParseContext *pc, Token **cur);
+ASTNode *parse_variable_declaration(ParseContext *pc, Token **cur, int need_semicolon);
+ASTNode *parse_struct(ParseContext *pc, Token **cur);
+ASTNode *parse_type(ParseContext *pc, Token **cur);
 
-ASTNode *parse_primary(Token **cur) {
+ASTNode *parse_primary(ParseContext *pc, Token **cur) {
 
     if ((*cur)->kind == NUMBER) {
-        ASTNode *node = new_number((*cur)->value);
-        *cur = (*cur)->next;
+        if ((*cur)->num_flags & NUM_INVALID) parse_error(pc, "invalid numeric literal", *cur);
+        ASTNode *node = new_number(pc, token_atom(pc, *cur), *cur);
+        advance(pc, cur);
         return node;
     }
     if ((*cur)->kind == STRING_LITERAL) {
-        ASTNode *node = new_string_literal((*cur)->value);
-        *cur = (*cur)->next;
+        ASTNode *node = new_string_literal(pc, token_atom(pc, *cur));
+        advance(pc, cur);
         return node;
     }
     if ((*cur)->kind == CHAR_LITERAL) {
-        ASTNode *node = new_char_literal((*cur)->value);
-        *cur = (*cur)->next;
+        ASTNode *node = new_char_literal(pc, token_atom(pc, *cur));
+        advance(pc, cur);
         return node;
     }
 
     if ((*cur)->kind == IDENTIFIER) {
-        char *name = (*cur)->value;
-        *cur = (*cur)->next;
+        const char *name = token_atom(pc, *cur);
+        advance(pc, cur);
 
         if ((*cur)->kind == L_PARENTHESES) {
-            *cur = (*cur)->next;
-            ASTNode **args = NULL;
-            int arg_count = 0;
+            advance(pc, cur);
+            int mark = pc->scratch_count;
             if ((*cur)->kind != R_PARENTHESES) {
                 while (1) {
-                    ASTNode *arg = parse_expr(cur);
-                    args = realloc(args, sizeof(ASTNode*) * (arg_count + 1));
-                    args[arg_count++] = arg;
-                    if ((*cur)->kind == COMMA) { *cur = (*cur)->next; continue; }
+                    scratch_push(pc, parse_expr(pc, cur));
+                    if ((*cur)->kind == COMMA) { advance(pc, cur); continue; }
                     break;
                 }
             }
 
-            if (!expect(cur, R_PARENTHESES))
-                parse_error("expected ')' after args", token_head, *cur);
-            return new_call(name, args, arg_count);
+            if (!expect(pc, cur, R_PARENTHESES))
+                parse_error(pc, "expected ')' after args", *cur);
+            int arg_count;
+            ASTNode **args = scratch_pop(pc, mark, &arg_count);
+            return new_call(pc, name, args, arg_count);
         }
 
-        ASTNode *node = new_identifier(name);
+        ASTNode *node = new_identifier(pc, name);
         while ((*cur)->kind == L_BRACKET) {
-            *cur = (*cur)->next;
-            ASTNode *index = parse_expr(cur);
+            advance(pc, cur);
+            ASTNode *index = parse_expr(pc, cur);
 
-            if (!expect(cur, R_BRACKET))
-                parse_error("expected ']' after array index", token_head, *cur);
+            if (!expect(pc, cur, R_BRACKET))
+                parse_error(pc, "expected ']' after array index", *cur);
 
-            ASTNode *add = new_binary(ADD, node, index);
-            node = new_unary(ASTARISK, add);  // *(name + index)
+            ASTNode *add = new_binary(pc, ADD, node, index);
+            node = new_unary(pc, ASTARISK, add);  // *(name + index)
         }
 
         return node;
     }
 
     if ((*cur)->kind == L_PARENTHESES) {
-        *cur = (*cur)->next;
-        ASTNode *node = parse_expr(cur);
-        if (!expect(cur, R_PARENTHESES)) parse_error("expected ')'", token_head, *cur);
+        advance(pc, cur);
+        ASTNode *node = parse_expr(pc, cur);
+        if (!expect(pc, cur, R_PARENTHESES)) parse_error(pc, "expected ')'", *cur);
         return node;
     }
-    parse_error("expected primary", token_head, *cur);
+    parse_error(pc, "expected primary", *cur);
 
     return NULL;
 }
-ASTNode *parse_base_type(Token **cur) {
-    if (!is_type((*cur)->kind, *cur))
-        parse_error("expected type", token_head, *cur);
-    ASTNode *base = new_identifier((*cur)->value);
-    *cur = (*cur)->next;
+ASTNode *parse_base_type(ParseContext *pc, Token **cur) {
+    if (!is_type(pc, (*cur)->kind, *cur))
+        parse_error(pc, "expected type", *cur);
+    ASTNode *base = new_identifier(pc, token_atom(pc, *cur));
+    advance(pc, cur);
     return base;
 }
-void parse_struct_members(Token **cur, ASTNode ***members, int *member_count) {
-    *members = NULL;
-    *member_count = 0;
-    if (!expect(cur, L_BRACE)) parse_error("expected '{' in struct", token_head, *cur);
+void parse_struct_members(ParseContext *pc, Token **cur, ASTNode ***members, int *member_count) {
+    int mark = pc->scratch_count;
+    if (!expect(pc, cur, L_BRACE)) parse_error(pc, "expected '{' in struct", *cur);
     while ((*cur)->kind != R_BRACE) {
-        ASTNode *member = parse_variable_declaration(cur, 1);
-        *members = realloc(*members, sizeof(ASTNode*) * (*member_count + 1));
-        (*members)[(*member_count)++] = member;
+        scratch_push(pc, parse_variable_declaration(pc, cur, 1));
     }
-    if (!expect(cur, R_BRACE)) parse_error("expected '}' to close struct definition", token_head, *cur);
+    if (!expect(pc, cur, R_BRACE)) parse_error(pc, "expected '}' to close struct definition", *cur);
+    *members = scratch_pop(pc, mark, member_count);
 }
-ASTNode *parse_struct(Token **cur) {
-    if (!expect(cur, STRUCT))
-        parse_error("expected 'struct'", token_head, *cur);
+ASTNode *parse_struct(ParseContext *pc, Token **cur) {
+    if (!expect(pc, cur, STRUCT))
+        parse_error(pc, "expected 'struct'", *cur);
 
-    char *name = NULL;
+    const char *name = NULL;
     if ((*cur)->kind == IDENTIFIER) {
-        name = strdup((*cur)->value);
-        *cur = (*cur)->next;
+        name = token_atom(pc, *cur);
+        advance(pc, cur);
     }
 
     ASTNode **members = NULL;
     int member_count = 0;
 
     if ((*cur)->kind == L_BRACE) {
-        parse_struct_members(cur, &members, &member_count);
+        parse_struct_members(pc, cur, &members, &member_count);
         if ((*cur)->kind == IDENTIFIER) {
-            char *typedef_name = strdup((*cur)->value);
-            *cur = (*cur)->next;
-            if (!expect(cur, SEMICOLON))
-                parse_error("expected ';' after typedef struct", token_head, *cur);
-            add_typename(typedef_name);
-            return new_typedef_struct(name ? name : "", members, member_count, typedef_name);
+            const char *typedef_name = token_atom(pc, *cur);
+            advance(pc, cur);
+            if (!expect(pc, cur, SEMICOLON))
+                parse_error(pc, "expected ';' after typedef struct", *cur);
+            add_typename(pc, typedef_name);
+            add_structdef(pc, name, typedef_name, members, member_count);
+            return new_typedef_struct(pc, name, members, member_count, typedef_name);
         }
-        if (!expect(cur, SEMICOLON))
-            parse_error("expected ';' after struct definition", token_head, *cur);
-        if (name) add_typename(name);
-        return new_struct(name ? name : "", members, member_count);
+        if (!expect(pc, cur, SEMICOLON))
+            parse_error(pc, "expected ';' after struct definition", *cur);
+        if (name) add_typename(pc, name);
+        add_structdef(pc, name, NULL, members, member_count);
+        return new_struct(pc, name, members, member_count);
     }
-    if (!expect(cur, SEMICOLON))
-        parse_error("expected ';' after struct declaration", token_head, *cur);
-    if (name) add_typename(name);
-    return new_struct(name ? name : "", NULL, 0);
+    if (!expect(pc, cur, SEMICOLON))
+        parse_error(pc, "expected ';' after struct declaration", *cur);
+    if (name) add_typename(pc, name);
+    add_structdef(pc, name, NULL, NULL, 0);
+    return new_struct(pc, name, NULL, 0);
 }
 
-ASTNode *parse_typedef(Token **cur) {
-    if (!expect(cur, TYPEDEF)) parse_error("expected 'typedef'", token_head, *cur);
+ASTNode *parse_typedef(ParseContext *pc, Token **cur) {
+    if (!expect(pc, cur, TYPEDEF)) parse_error(pc, "expected 'typedef'", *cur);
 
     if ((*cur)->kind == STRUCT) {
-        *cur = (*cur)->next;
-        char *struct_name = NULL;
+        advance(pc, cur);
+        const char *struct_name = NULL;
         if ((*cur)->kind == IDENTIFIER) {
-            struct_name = strdup((*cur)->value);
-            *cur = (*cur)->next;
+            struct_name = token_atom(pc, *cur);
+            advance(pc, cur);
         }
         ASTNode **members = NULL;
         int member_count = 0;
-        parse_struct_members(cur, &members, &member_count);
+        parse_struct_members(pc, cur, &members, &member_count);
         // typedef struct {...} Name;
         if ((*cur)->kind != IDENTIFIER)
-            parse_error("expected typedef name after struct definition", token_head, *cur);
-        char *typedef_name = strdup((*cur)->value);
-        *cur = (*cur)->next;
-        if (!expect(cur, SEMICOLON))
-            parse_error("expected ';' after typedef", token_head, *cur);
-        add_typename(typedef_name);
-        return new_typedef_struct(struct_name ? struct_name : "", members, member_count, typedef_name);
+            parse_error(pc, "expected typedef name after struct definition", *cur);
+        const char *typedef_name = token_atom(pc, *cur);
+        advance(pc, cur);
+        if (!expect(pc, cur, SEMICOLON))
+            parse_error(pc, "expected ';' after typedef", *cur);
+        add_typename(pc, typedef_name);
+        add_structdef(pc, struct_name, typedef_name, members, member_count);
+        return new_typedef_struct(pc, struct_name, members, member_count, typedef_name);
     } else {
         // typedef int MyInt;
-        ASTNode *type = parse_type(cur);
+        ASTNode *type = parse_type(pc, cur);
         if ((*cur)->kind != IDENTIFIER)
-            parse_error("expected typedef name", token_head, *cur);
-        char *typedef_name = strdup((*cur)->value);
-        *cur = (*cur)->next;
-        if (!expect(cur, SEMICOLON))
-            parse_error("expected ';' after typedef", token_head, *cur);
-        add_typename(typedef_name);
-        return new_typedef(type, typedef_name);
+            parse_error(pc, "expected typedef name", *cur);
+        const char *typedef_name = token_atom(pc, *cur);
+        advance(pc, cur);
+        if (!expect(pc, cur, SEMICOLON))
+            parse_error(pc, "expected ';' after typedef", *cur);
+        add_typename(pc, typedef_name);
+        return new_typedef(pc, type, typedef_name);
     }
 }
 
 
-ASTNode *parse_type(Token **cur) {
+ASTNode *parse_type(ParseContext *pc, Token **cur) {
     int modifiers = 0;
 
     while ((*cur)->kind == CONST || (*cur)->kind == UNSIGNED || (*cur)->kind == SIGNED) {
         if ((*cur)->kind == CONST)    modifiers |= TYPEMOD_CONST;
         if ((*cur)->kind == UNSIGNED) modifiers |= TYPEMOD_UNSIGNED;
         if ((*cur)->kind == SIGNED)   modifiers |= TYPEMOD_SIGNED;
-        *cur = (*cur)->next;
+        advance(pc, cur);
     }
 
-    if (!is_type((*cur)->kind, *cur))
-        parse_error("expected base type", token_head, *cur);
+    if (!is_type(pc, (*cur)->kind, *cur))
+        parse_error(pc, "expected base type", *cur);
 
-    ASTNode *base_type = parse_base_type(cur);
+    ASTNode *base_type = parse_base_type(pc, cur);
 
     int pointer_level = 0;
     while ((*cur)->kind == ASTARISK) {
         pointer_level++;
-        *cur = (*cur)->next;
+        advance(pc, cur);
     }
-   return new_type_node(base_type, pointer_level, modifiers);
+   return new_type_node(pc, base_type, pointer_level, modifiers);
 
 }
 
-ASTNode *parse_postfix(Token **cur) {
-    ASTNode *node = parse_primary(cur);
+ASTNode *parse_postfix(ParseContext *pc, Token **cur) {
+    ASTNode *node = parse_primary(pc, cur);
     while (1) {
         if ((*cur)->kind == INC) {
-            *cur = (*cur)->next;
-            node = new_unary(POST_INC, node);
+            advance(pc, cur);
+            node = new_unary(pc, POST_INC, node);
         } else if ((*cur)->kind == DEC) {
-            *cur = (*cur)->next;
-            node = new_unary(POST_DEC, node);
+            advance(pc, cur);
+            node = new_unary(pc, POST_DEC, node);
         } 
         else if ((*cur)->kind == DOT) {
-            *cur = (*cur)->next;
+            advance(pc, cur);
             if ((*cur)->kind != IDENTIFIER)
-                parse_error("expected identifier after '.'", token_head, *cur);
-            char *member_name = (*cur)->value;
-            *cur = (*cur)->next;
-            node = new_member_access(node, member_name);
+                parse_error(pc, "expected identifier after '.'", *cur);
+            const char *member_name = token_atom(pc, *cur);
+            advance(pc, cur);
+            node = new_member_access(pc, node, member_name);
         }
         else if ((*cur)->kind == ARROW) {
-            *cur = (*cur)->next;
+            advance(pc, cur);
             if ((*cur)->kind != IDENTIFIER)
-                parse_error("expected identifier after '->'", token_head, *cur);
-            char *member_name = (*cur)->value;
-            *cur = (*cur)->next;
-            node = new_arrow_access(node, member_name);
+                parse_error(pc, "expected identifier after '->'", *cur);
+            const char *member_name = token_atom(pc, *cur);
+            advance(pc, cur);
+            node = new_arrow_access(pc, node, member_name);
         } else {
             break;
         }
@@ -624,370 +752,293 @@ ASTNode *parse_postfix(Token **cur) {
     return node;
 }
 
-ASTNode *parse_unary(Token **cur) {
-    printf("parse_unary: cur kind = %s\n", tokenkind2str((*cur)->kind));
+ASTNode *parse_unary(ParseContext *pc, Token **cur) {
     if ((*cur)->kind == SUB) {
-        *cur = (*cur)->next;
-        return new_unary(SUB, parse_unary(cur));
+        advance(pc, cur);
+        return new_unary(pc, SUB, parse_unary(pc, cur));
     }
     if ((*cur)->kind == BITNOT) {
-        *cur = (*cur)->next;
-        return new_unary(BITNOT, parse_unary(cur));
+        advance(pc, cur);
+        return new_unary(pc, BITNOT, parse_unary(pc, cur));
     }
     if ((*cur)->kind == NOT) {
-        *cur = (*cur)->next;
-        return new_unary(NOT, parse_unary(cur));
+        advance(pc, cur);
+        return new_unary(pc, NOT, parse_unary(pc, cur));
     }
     if ((*cur)->kind == AMPERSAND) {
-        *cur = (*cur)->next;
-        return new_unary(AMPERSAND, parse_unary(cur));
+        advance(pc, cur);
+        return new_unary(pc, AMPERSAND, parse_unary(pc, cur));
     }
     if ((*cur)->kind == ASTARISK) {
-        *cur = (*cur)->next;
-        return new_unary(ASTARISK, parse_unary(cur));
+        advance(pc, cur);
+        return new_unary(pc, ASTARISK, parse_unary(pc, cur));
     }
     if ((*cur)->kind == INC) {
-        *cur = (*cur)->next;
-        return new_unary(INC, parse_unary(cur));
+        advance(pc, cur);
+        return new_unary(pc, INC, parse_unary(pc, cur));
     }
     if ((*cur)->kind == DEC) {
-        *cur = (*cur)->next;
-        return new_unary(DEC, parse_unary(cur));
+        advance(pc, cur);
+        return new_unary(pc, DEC, parse_unary(pc, cur));
     }
     if ((*cur)->kind == SIZEOF) {
-        *cur = (*cur)->next;
-        if (!expect(cur, L_PARENTHESES)) parse_error("expected '(' after sizeof", token_head, *cur);
-        ASTNode *inner = parse_expr(cur);
-        if (!expect(cur, R_PARENTHESES)) parse_error("expected ')' after sizeof expression", token_head, *cur);
-        return new_sizeof(inner);
+        advance(pc, cur);
+        if (!expect(pc, cur, L_PARENTHESES)) parse_error(pc, "expected '(' after sizeof", *cur);
+        // sizeof(type) or sizeof(expr); the codegen folds both to a constant.
+        ASTNode *inner = is_type(pc, (*cur)->kind, *cur) ? parse_type(pc, cur) : parse_expr(pc, cur);
+        if (!expect(pc, cur, R_PARENTHESES)) parse_error(pc, "expected ')' after sizeof expression", *cur);
+        return new_sizeof(pc, inner);
     }
     if ((*cur)->kind == STRING_LITERAL) {
-        ASTNode *node = new_string_literal((*cur)->value);
-        *cur = (*cur)->next;
+        ASTNode *node = new_string_literal(pc, token_atom(pc, *cur));
+        advance(pc, cur);
         return node;
     }
     if ((*cur)->kind == CHAR_LITERAL) {
-        ASTNode *node = new_char_literal((*cur)->value);
-        *cur = (*cur)->next;
+        ASTNode *node = new_char_literal(pc, token_atom(pc, *cur));
+        advance(pc, cur);
         return node;
     }
 
-    return parse_postfix(cur);
-}
-
-
-ASTNode *parse_mul(Token **cur) {
-    ASTNode *node = parse_unary(cur);
-    while ((*cur)->kind == ASTARISK || (*cur)->kind == DIV || (*cur)->kind == MOD) {
+    return parse_postfix(pc, cur);
+}
+
+
+// Binding power of each infix operator, indexed by TokenKind; 0 means the
+// token ends the expression. Binary operators are left-associative, ?: and =
+// right-associative.
+enum {
+    BP_ASSIGN = 1,
+    BP_CONDITIONAL,
+    BP_LOGICAL_OR,
+    BP_LOGICAL_AND,
+    BP_BITWISE_OR,
+    BP_BITWISE_XOR,
+    BP_BITWISE_AND,
+    BP_EQUALITY,
+    BP_RELATIONAL,
+    BP_SHIFT,
+    BP_ADDITIVE,
+    BP_MULTIPLICATIVE,
+};
+
+static const unsigned char g_infix_bp[EOT + 1] = {
+    [ASSIGN] = BP_ASSIGN,
+    [QUESTION] = BP_CONDITIONAL,
+    [LOR] = BP_LOGICAL_OR,
+    [LAND] = BP_LOGICAL_AND,
+    [BITOR] = BP_BITWISE_OR,
+    [BITXOR] = BP_BITWISE_XOR,
+    [AMPERSAND] = BP_BITWISE_AND,
+    [EQ] = BP_EQUALITY, [NEQ] = BP_EQUALITY,
+    [LT] = BP_RELATIONAL, [GT] = BP_RELATIONAL, [LTE] = BP_RELATIONAL, [GTE] = BP_RELATIONAL,
+    [LSH] = BP_SHIFT, [RSH] = BP_SHIFT,
+    [ADD] = BP_ADDITIVE, [SUB] = BP_ADDITIVE,
+    [ASTARISK] = BP_MULTIPLICATIVE, [DIV] = BP_MULTIPLICATIVE, [MOD] = BP_MULTIPLICATIVE,
+};
+
+// Precedence climbing: parses a unary operand, then folds in every infix
+// operator that binds at least as tightly as min_bp.
+static ASTNode *parse_infix(ParseContext *pc, Token **cur, int min_bp) {
+    ASTNode *node = parse_unary(pc, cur);
+    for (;;) {
         TokenKind op = (*cur)->kind;
-        *cur = (*cur)->next;
-        node = new_binary(op, node, parse_unary(cur));
-    }
-    return node;
-}
-
-ASTNode *parse_add(Token **cur) {
-    ASTNode *node = parse_mul(cur);
-    while ((*cur)->kind == ADD || (*cur)->kind == SUB) {
-        TokenKind op = (*cur)->kind;
-        *cur = (*cur)->next;
-        node = new_binary(op, node, parse_mul(cur));
-    }
-    return node;
-}
-
-ASTNode *parse_shift(Token **cur) {
-    ASTNode *node = parse_add(cur);
-    while (1) {
-        if ((*cur)->kind == LSH) {
-            *cur = (*cur)->next;
-            node = new_binary(LSH, node, parse_add(cur));
-        } else if ((*cur)->kind == RSH) {
-            *cur = (*cur)->next;
-            node = new_binary(RSH, node, parse_add(cur));
+        int bp = g_infix_bp[op];
+        if (bp == 0 || bp < min_bp) return node;
+        advance(pc, cur);
+        if (op == ASSIGN) {
+            node = new_assign(pc, node, parse_infix(pc, cur, BP_ASSIGN));
+        } else if (op == QUESTION) {
+            ASTNode *then_expr = parse_expr(pc, cur);
+            if (!expect(pc, cur, COLON))
+                parse_error(pc, "expected ':' in ternary expression", *cur);
+            node = new_ternary(pc, node, then_expr, parse_infix(pc, cur, BP_CONDITIONAL));
         } else {
-            break;
+            node = new_binary(pc, op, node, parse_infix(pc, cur, bp + 1));
         }
     }
-    return node;
-}
-
-ASTNode *parse_relational(Token **cur) {
-    ASTNode *node = parse_shift(cur);
-    while (1) {
-        if ((*cur)->kind == LT) {
-            *cur = (*cur)->next;
-            node = new_binary(LT, node, parse_add(cur));
-        } else if ((*cur)->kind == GT) {
-            *cur = (*cur)->next;
-            node = new_binary(GT, node, parse_add(cur));
-        } else if ((*cur)->kind == LTE) {
-            *cur = (*cur)->next;
-            node = new_binary(LTE, node, parse_add(cur));
-        } else if ((*cur)->kind == GTE) {
-            *cur = (*cur)->next;
-            node = new_binary(GTE, node, parse_add(cur));
-        } else break;
-    }
-    return node;
-}
-ASTNode *parse_equality(Token **cur) {
-    ASTNode *node = parse_relational(cur);
-    while (1) {
-        if ((*cur)->kind == EQ) {
-            *cur = (*cur)->next;
-            node = new_binary(EQ, node, parse_relational(cur));
-        } else if ((*cur)->kind == NEQ) {
-            *cur = (*cur)->next;
-            node = new_binary(NEQ, node, parse_relational(cur));
-        } else break;
-    }
-    return node;
-}
-
-ASTNode *parse_bitwise_and(Token **cur) {
-    ASTNode *node = parse_equality(cur);
-    while ((*cur)->kind == AMPERSAND) {
-        *cur = (*cur)->next;
-        node = new_binary(AMPERSAND, node, parse_equality(cur));
-    }
-    return node;
 }
 
-ASTNode *parse_bitwise_xor(Token **cur) {
-    ASTNode *node = parse_bitwise_and(cur);
-    while ((*cur)->kind == BITXOR) {
-        *cur = (*cur)->next;
-        node = new_binary(BITXOR, node, parse_bitwise_and(cur));
-    }
-    return node;
+ASTNode *parse_expr(ParseContext *pc, Token **cur) {
+    return parse_infix(pc, cur, BP_ASSIGN);
 }
 
-ASTNode *parse_bitwise_or(Token **cur) {
-    ASTNode *node = parse_bitwise_xor(cur);
-    while ((*cur)->kind == BITOR) {
-        *cur = (*cur)->next;
-        node = new_binary(BITOR, node, parse_bitwise_xor(cur));
-    }
-    return node;
-}
-
-// &&
-ASTNode *parse_logical_and(Token **cur) {
-    ASTNode *node = parse_bitwise_or(cur);
-    while ((*cur)->kind == LAND) {
-        *cur = (*cur)->next;
-        node = new_binary(LAND, node, parse_bitwise_or(cur));
-    }
-    return node;
-}
-
-// ||
-ASTNode *parse_logical_or(Token **cur) {
-    ASTNode *node = parse_logical_and(cur);
-    while ((*cur)->kind == LOR) {
-        *cur = (*cur)->next;
-        node = new_binary(LOR, node, parse_logical_and(cur));
-    }
-    return node;
-}
-
-// ?: (right-associative)
-ASTNode *parse_conditional(Token **cur) {
-    ASTNode *cond = parse_logical_or(cur);
-    if ((*cur)->kind == QUESTION) {
-        *cur = (*cur)->next;
-        ASTNode *then_expr = parse_expr(cur);
-        if (!expect(cur, COLON))
-            parse_error("expected ':' in ternary expression", token_head, *cur);
-        ASTNode *else_expr = parse_conditional(cur);
-        return new_ternary(cond, then_expr, else_expr);
-    }
-    return cond;
-}
-
-ASTNode *parse_assign_expr(Token **cur) {
-    ASTNode *node = parse_conditional(cur);
-    if ((*cur)->kind == ASSIGN) {
-        *cur = (*cur)->next;
-        node = new_assign(node, parse_assign_expr(cur));
-    }
-    return node;
-}
-ASTNode *parse_expr(Token **cur) {
-    return parse_assign_expr(cur);
-}
-
-ASTNode* parse_param(Token **cur) {
-    ASTNode *type = parse_type(cur);
-    if ((*cur)->kind != IDENTIFIER) parse_error("expected param name", token_head, *cur);
-    char *name = (*cur)->value;
-    *cur = (*cur)->next;
+ASTNode* parse_param(ParseContext *pc, Token **cur) {
+    ASTNode *type = parse_type(pc, cur);
+    if ((*cur)->kind != IDENTIFIER) parse_error(pc, "expected param name", *cur);
+    const char *name = token_atom(pc, *cur);
+    advance(pc, cur);
 
     ASTNode *final_type = type;
     while ((*cur)->kind == L_BRACKET) {
-        *cur = (*cur)->next;
+        advance(pc, cur);
         int size = -1;
         if ((*cur)->kind == NUMBER) {
-            size = atoi((*cur)->value);
-            *cur = (*cur)->next;
+            size = token_int(pc, *cur);
+            advance(pc, cur);
         }
-        if (!expect(cur, R_BRACKET)) parse_error("expected ']' for parameter array", token_head, *cur);
-        final_type = new_type_array(final_type, size);
+        if (!expect(pc, cur, R_BRACKET)) parse_error(pc, "expected ']' for parameter array", *cur);
+        final_type = new_type_array(pc, final_type, size);
     }
 
-    return new_param(final_type, name);
+    return new_param(pc, final_type, name);
 }
 
-ASTNode** parse_param_list(Token **cur, int *out_count) {
-    ASTNode **params = NULL;
-    int count = 0;
+ASTNode** parse_param_list(ParseContext *pc, Token **cur, int *out_count) {
+    int mark = pc->scratch_count;
     if ((*cur)->kind == R_PARENTHESES) { *out_count = 0; return NULL; }
     while (1) {
-        ASTNode *param = parse_param(cur);
-        params = realloc(params, sizeof(ASTNode*) * (count+1));
-        params[count++] = param;
-        if ((*cur)->kind == COMMA) { *cur = (*cur)->next; continue; }
+        scratch_push(pc, parse_param(pc, cur));
+        if ((*cur)->kind == COMMA) { advance(pc, cur); continue; }
         break;
     }
-    *out_count = count;
-    return params;
+    return scratch_pop(pc, mark, out_count);
 }
 
-ASTNode *parse_stmt(Token **cur);
+ASTNode *parse_stmt(ParseContext *pc, Token **cur);
 
-ASTNode *parse_block(Token **cur) {
-    if (!expect(cur, L_BRACE)) parse_error("expected '{'", token_head, *cur);
-    ASTNode **stmts = NULL;
-    int count = 0;
+ASTNode *parse_block(ParseContext *pc, Token **cur) {
+    if (!expect(pc, cur, L_BRACE)) parse_error(pc, "expected '{'", *cur);
+    int mark = pc->scratch_count;
+    jmp_buf *outer = pc->recover;
+    jmp_buf here;
+    pc->recover = &here;
     while ((*cur)->kind != R_BRACE && (*cur)->kind != EOT) {
-        stmts = realloc(stmts, sizeof(ASTNode*) * (count+1));
-        stmts[count++] = parse_stmt(cur);
+        int stmt_mark = pc->scratch_count;
+        if (setjmp(here)) {
+            // A statement failed: drop what it pushed and skip past it.
+            pc->recover = &here;
+            pc->scratch_count = stmt_mark;
+            sync_statement(pc, cur);
+            continue;
+        }
+        scratch_push(pc, parse_stmt(pc, cur));
     }
-    if (!expect(cur, R_BRACE)) parse_error("expected '}'", token_head, *cur);
-    root = new_block(stmts, count);
-    return root;
+    pc->recover = outer;
+    if (!expect(pc, cur, R_BRACE)) parse_error(pc, "expected '}'", *cur);
+    int count;
+    ASTNode **stmts = scratch_pop(pc, mark, &count);
+    return new_block(pc, stmts, count);
 }
 
-ASTNode *parse_while_stmt(Token **cur) {
-    if (!expect(cur, WHILE)) parse_error("expected 'while'", token_head, *cur);
-    if (!expect(cur, L_PARENTHESES)) parse_error("expected '(' after while", token_head, *cur);
-    ASTNode *cond = parse_expr(cur);
-    if (!expect(cur, R_PARENTHESES)) parse_error("expected ')'", token_head, *cur);
-    ASTNode *body = parse_stmt(cur);
-    return new_while(cond, body);
+ASTNode *parse_while_stmt(ParseContext *pc, Token **cur) {
+    if (!expect(pc, cur, WHILE)) parse_error(pc, "expected 'while'", *cur);
+    if (!expect(pc, cur, L_PARENTHESES)) parse_error(pc, "expected '(' after while", *cur);
+    ASTNode *cond = parse_expr(pc, cur);
+    if (!expect(pc, cur, R_PARENTHESES)) parse_error(pc, "expected ')'", *cur);
+    ASTNode *body = parse_stmt(pc, cur);
+    return new_while(pc, cond, body);
 }
 
-ASTNode *parse_do_while_stmt(Token **cur) {
-    if (!expect(cur, DO)) parse_error("expected 'do'", token_head, *cur);
-    ASTNode *body = parse_stmt(cur);
-    if (!expect(cur, WHILE)) parse_error("expected 'while' after do-body", token_head, *cur);
-    if (!expect(cur, L_PARENTHESES)) parse_error("expected '(' after while", token_head, *cur);
-    ASTNode *cond = parse_expr(cur);
-    if (!expect(cur, R_PARENTHESES)) parse_error("expected ')'", token_head, *cur);
-    if (!expect(cur, SEMICOLON)) parse_error("expected ';' after do-while", token_head, *cur);
-    return new_do_while(cond, body);
+ASTNode *parse_do_while_stmt(ParseContext *pc, Token **cur) {
+    if (!expect(pc, cur, DO)) parse_error(pc, "expected 'do'", *cur);
+    ASTNode *body = parse_stmt(pc, cur);
+    if (!expect(pc, cur, WHILE)) parse_error(pc, "expected 'while' after do-body", *cur);
+    if (!expect(pc, cur, L_PARENTHESES)) parse_error(pc, "expected '(' after while", *cur);
+    ASTNode *cond = parse_expr(pc, cur);
+    if (!expect(pc, cur, R_PARENTHESES)) parse_error(pc, "expected ')'", *cur);
+    if (!expect(pc, cur, SEMICOLON)) parse_error(pc, "expected ';' after do-while", *cur);
+    return new_do_while(pc, cond, body);
 }
 
-ASTNode *parse_for_stmt(Token **cur) {
-    if (!expect(cur, FOR)) parse_error("expected 'for'", token_head, *cur);
-    if (!expect(cur, L_PARENTHESES)) parse_error("expected '(' after for", token_head, *cur);
+ASTNode *parse_for_stmt(ParseContext *pc, Token **cur) {
+    if (!expect(pc, cur, FOR)) parse_error(pc, "expected 'for'", *cur);
+    if (!expect(pc, cur, L_PARENTHESES)) parse_error(pc, "expected '(' after for", *cur);
 
     // for (init; cond; inc)
     ASTNode *init = NULL, *cond = NULL, *inc = NULL;
 
     if ((*cur)->kind != SEMICOLON) {
-        if (is_type((*cur)->kind, *cur)) {
-            init = parse_variable_declaration(cur, 0);
+        if (is_type(pc, (*cur)->kind, *cur)) {
+            init = parse_variable_declaration(pc, cur, 0);
         } else {
-            init = parse_expr(cur);
+            init = parse_expr(pc, cur);
         }
     }
-    if (!expect(cur, SEMICOLON)) parse_error("expected ';' after for-init", token_head, *cur);
+    if (!expect(pc, cur, SEMICOLON)) parse_error(pc, "expected ';' after for-init", *cur);
 
     if ((*cur)->kind != SEMICOLON) {
-        cond = parse_expr(cur);
+        cond = parse_expr(pc, cur);
     }
-    if (!expect(cur, SEMICOLON)) parse_error("expected second ';' in for", token_head, *cur);
+    if (!expect(pc, cur, SEMICOLON)) parse_error(pc, "expected second ';' in for", *cur);
 
     if ((*cur)->kind != R_PARENTHESES) {
-        inc = parse_expr(cur);
+        inc = parse_expr(pc, cur);
     }
-    if (!expect(cur, R_PARENTHESES)) parse_error("expected ')' after for", token_head, *cur);
+    if (!expect(pc, cur, R_PARENTHESES)) parse_error(pc, "expected ')' after for", *cur);
 
-    ASTNode *body = parse_stmt(cur);
-    return new_for(init, cond, inc, body);
+    ASTNode *body = parse_stmt(pc, cur);
+    return new_for(pc, init, cond, inc, body);
 }
 
-ASTNode *parse_if_stmt(Token **cur) {
-    if (!expect(cur, IF)) parse_error("expected 'if'", token_head, *cur);
-    if (!expect(cur, L_PARENTHESES)) parse_error("expected '(' after if", token_head, *cur);
-    ASTNode *cond = parse_expr(cur);
-    if (!expect(cur, R_PARENTHESES)) parse_error("expected ')'", token_head, *cur);
-    ASTNode *then_stmt = parse_stmt(cur);
+ASTNode *parse_if_stmt(ParseContext *pc, Token **cur) {
+    if (!expect(pc, cur, IF)) parse_error(pc, "expected 'if'", *cur);
+    if (!expect(pc, cur, L_PARENTHESES)) parse_error(pc, "expected '(' after if", *cur);
+    ASTNode *cond = parse_expr(pc, cur);
+    if (!expect(pc, cur, R_PARENTHESES)) parse_error(pc, "expected ')'", *cur);
+    ASTNode *then_stmt = parse_stmt(pc, cur);
     ASTNode *else_stmt = NULL;
     if ((*cur)->kind == ELSE) {
-        expect(cur, ELSE);
-        else_stmt = parse_stmt(cur);
+        expect(pc, cur, ELSE);
+        else_stmt = parse_stmt(pc, cur);
     }
-    return new_if(cond, then_stmt, else_stmt);
+    return new_if(pc, cond, then_stmt, else_stmt);
 }
-ASTNode *parse_return_stmt(Token **cur) {
-    if (!expect(cur, RETURN)) parse_error("expected 'return'", token_head, *cur);
-    ASTNode *expr = parse_expr(cur);
-    if (!expect(cur, SEMICOLON)) parse_error("expected ';' after return", token_head, *cur);
-    return new_return(expr);
+ASTNode *parse_return_stmt(ParseContext *pc, Token **cur) {
+    if (!expect(pc, cur, RETURN)) parse_error(pc, "expected 'return'", *cur);
+    ASTNode *expr = parse_expr(pc, cur);
+    if (!expect(pc, cur, SEMICOLON)) parse_error(pc, "expected ';' after return", *cur);
+    return new_return(pc, expr);
 }
-ASTNode *parse_expr_stmt(Token **cur) {
-    ASTNode *expr = parse_expr(cur);
-    if (!expect(cur, SEMICOLON)) parse_error("expected ';' after expression", token_head, *cur);
-    return new_expr_stmt(expr);
+ASTNode *parse_expr_stmt(ParseContext *pc, Token **cur) {
+    ASTNode *expr = parse_expr(pc, cur);
+    if (!expect(pc, cur, SEMICOLON)) parse_error(pc, "expected ';' after expression", *cur);
+    return new_expr_stmt(pc, expr);
 }
 
-static ASTNode *parse_init_list(Token **cur) {
-    if (!expect(cur, L_BRACE)) parse_error("expected '{' for initializer list", token_head, *cur);
-    ASTNode **elems = NULL;
-    int count = 0;
+static ASTNode *parse_init_list(ParseContext *pc, Token **cur) {
+    if (!expect(pc, cur, L_BRACE)) parse_error(pc, "expected '{' for initializer list", *cur);
+    int mark = pc->scratch_count;
     if ((*cur)->kind != R_BRACE) {
         while (1) {
-            ASTNode *e = parse_expr(cur);
-            elems = realloc(elems, sizeof(ASTNode*) * (count + 1));
-            elems[count++] = e;
+            scratch_push(pc, parse_expr(pc, cur));
             if ((*cur)->kind == COMMA) {
-                *cur = (*cur)->next;
+                advance(pc, cur);
                 continue;
             }
             break;
         }
     }
-    if (!expect(cur, R_BRACE)) parse_error("expected '}' to close initializer list", token_head, *cur);
-    return new_init_list(elems, count);
+    if (!expect(pc, cur, R_BRACE)) parse_error(pc, "expected '}' to close initializer list", *cur);
+    int count;
+    ASTNode **elems = scratch_pop(pc, mark, &count);
+    return new_init_list(pc, elems, count);
 }
-ASTNode *parse_variable_declaration(Token **cur, int need_semicolon) {
-    ASTNode *type = parse_type(cur);
+ASTNode *parse_variable_declaration(ParseContext *pc, Token **cur, int need_semicolon) {
+    ASTNode *type = parse_type(pc, cur);
     if ((*cur)->kind != IDENTIFIER)
-        parse_error("expected identifier for variable name", token_head, *cur);
-    char *name = (*cur)->value;
-    *cur = (*cur)->next;
+        parse_error(pc, "expected identifier for variable name", *cur);
+    const char *name = token_atom(pc, *cur);
+    advance(pc, cur);
 
     ASTNode *final_type = type;
     while ((*cur)->kind == L_BRACKET) {
-        *cur = (*cur)->next;
+        advance(pc, cur);
         int size = -1;
         if ((*cur)->kind == NUMBER) {
-            size = atoi((*cur)->value);
-            *cur = (*cur)->next;
+            size = token_int(pc, *cur);
+            advance(pc, cur);
         }
-        if (!expect(cur, R_BRACKET)) parse_error("expected ']' for array", token_head, *cur);
-        final_type = new_type_array(final_type, size);
+        if (!expect(pc, cur, R_BRACKET)) parse_error(pc, "expected ']' for array", *cur);
+        final_type = new_type_array(pc, final_type, size);
     }
 
     ASTNode *init = NULL;
-    if (expect(cur, ASSIGN)) {
+    if (expect(pc, cur, ASSIGN)) {
         if ((*cur)->kind == L_BRACE) {
-            init = parse_init_list(cur);
+            init = parse_init_list(pc, cur);
         } else {
-            init = parse_expr(cur);
+            init = parse_expr(pc, cur);
         }
         if (final_type && final_type->type == AST_TYPE_ARRAY && final_type->type_array.array_size <= 0) {
             if (init && init->type == AST_STRING_LITERAL) {
@@ -999,89 +1050,575 @@ ASTNode *parse_variable_declaration(Token **cur, int need_semicolon) {
         }
     }
     if (need_semicolon) {
-        if (!expect(cur, SEMICOLON))
-            parse_error("expected ';' after variable declaration", token_head, *cur);
+        if (!expect(pc, cur, SEMICOLON))
+            parse_error(pc, "expected ';' after variable declaration", *cur);
     }
-    return new_var_decl(final_type, name, init);
+    return new_var_decl(pc, final_type, name, init);
 }
 
 
-ASTNode *parse_variable_assignment(Token **cur) {
-    if ((*cur)->kind != IDENTIFIER) parse_error("expected identifier for assignment", token_head, *cur);
-    char *name = (*cur)->value;
-    *cur = (*cur)->next;
-    if (!expect(cur, ASSIGN)) parse_error("expected '=' for assignment", token_head, *cur);
-    ASTNode *expr = parse_expr(cur);
-    if (!expect(cur, SEMICOLON)) parse_error("expected ';' after assignment", token_head, *cur);
-    return new_assign(new_identifier(name), expr);
+ASTNode *parse_variable_assignment(ParseContext *pc, Token **cur) {
+    if ((*cur)->kind != IDENTIFIER) parse_error(pc, "expected identifier for assignment", *cur);
+    const char *name = token_atom(pc, *cur);
+    advance(pc, cur);
+    if (!expect(pc, cur, ASSIGN)) parse_error(pc, "expected '=' for assignment", *cur);
+    ASTNode *expr = parse_expr(pc, cur);
+    if (!expect(pc, cur, SEMICOLON)) parse_error(pc, "expected ';' after assignment", *cur);
+    return new_assign(pc, new_identifier(pc, name), expr);
 }
 
-ASTNode *parse_stmt(Token **cur) {
-    if ((*cur)->kind == IF) return parse_if_stmt(cur);
-    if ((*cur)->kind == WHILE) return parse_while_stmt(cur);
-    if ((*cur)->kind == DO) return parse_do_while_stmt(cur);
-    if ((*cur)->kind == FOR) return parse_for_stmt(cur);
-    if ((*cur)->kind == RETURN) return parse_return_stmt(cur);
+ASTNode *parse_stmt(ParseContext *pc, Token **cur) {
+    if ((*cur)->kind == IF) return parse_if_stmt(pc, cur);
+    if ((*cur)->kind == WHILE) return parse_while_stmt(pc, cur);
+    if ((*cur)->kind == DO) return parse_do_while_stmt(pc, cur);
+    if ((*cur)->kind == FOR) return parse_for_stmt(pc, cur);
+    if ((*cur)->kind == RETURN) return parse_return_stmt(pc, cur);
 
     if ((*cur)->kind == BREAK) {
-        *cur = (*cur)->next;
-        if (!expect(cur, SEMICOLON)) parse_error("expected ';' after break", token_head, *cur);
-        return new_break();
+        advance(pc, cur);
+        if (!expect(pc, cur, SEMICOLON)) parse_error(pc, "expected ';' after break", *cur);
+        return new_break(pc);
     }
     if ((*cur)->kind == CONTINUE) {
-        *cur = (*cur)->next;
-        if (!expect(cur, SEMICOLON)) parse_error("expected ';' after continue", token_head, *cur);
-        return new_continue();
+        advance(pc, cur);
+        if (!expect(pc, cur, SEMICOLON)) parse_error(pc, "expected ';' after continue", *cur);
+        return new_continue(pc);
     }
 
-    if ((*cur)->kind == L_BRACE) return parse_block(cur);
-    if (is_type((*cur)->kind, *cur)) return parse_variable_declaration(cur, 1);
-
-    printf("DEBUG: parse_stmt falling back to expr_stmt at token kind %s\n", tokenkind2str((*cur)->kind));
-    return parse_expr_stmt(cur);
+    if ((*cur)->kind == L_BRACE) return parse_block(pc, cur);
+    if (is_type(pc, (*cur)->kind, *cur)) return parse_variable_declaration(pc, cur, 1);
+
+    return parse_expr_stmt(pc, cur);
+}
+
+// A function body to be parsed on a thread: the tokens from its '{' on, with
+// the typedef names declared before the function.
+struct BodyJob {
+    ASTNode *fn;
+    unsigned start;
+    int tokens;
+    uintptr_t typename_limit;
+};
+
+// Skips the body at *cur, which must be '{', and queues it. A body is parsed
+// in place instead if it declares a struct or typedef, which would change
+// the registries, or if its closing brace is missing.
+static int defer_body(ParseContext *pc, Token **cur, ASTNode *fn) {
+    if (!pc->defer_bodies || (*cur)->kind != L_BRACE) return 0;
+    const TokenStream *ts = pc->tokens;
+    unsigned start = pc->reader->head;
+    int depth = 0, end = -1;
+    for (int i = (int)start; i < ts->count && end < 0; i++) {
+        TokenKind kind = ts->data[i].kind;
+        if (kind == TYPEDEF || kind == STRUCT) return 0;
+        if (kind == L_BRACE) depth++;
+        else if (kind == R_BRACE && --depth == 0) end = i;
+    }
+    if (end < 0) return 0;
+    if (pc->job_count == pc->job_cap) {
+        pc->job_cap = pc->job_cap ? pc->job_cap * 2 : 64;
+        pc->jobs = realloc(pc->jobs, sizeof(BodyJob) * (size_t)pc->job_cap);
+    }
+    pc->jobs[pc->job_count++] = (BodyJob){ fn, start, end + 1 - (int)start,
+                                           (uintptr_t)pc->typenames->count };
+    tokenReaderInitStreamAt(pc->reader, pc->tokens, (unsigned)end + 1);
+    *cur = peekToken(pc->reader, 0);
+    return 1;
 }
 
-ASTNode* parse_fundef(Token **cur) {
-    ASTNode *ret_type = parse_type(cur);
-    if ((*cur)->kind != IDENTIFIER) parse_error("expected function name", token_head, *cur);
-    char *name = (*cur)->value;
-    *cur = (*cur)->next;
-    if (!expect(cur, L_PARENTHESES)) parse_error("expected '(' after function name", token_head, *cur);
+ASTNode* parse_fundef(ParseContext *pc, Token **cur) {
+    ASTNode *ret_type = parse_type(pc, cur);
+    if ((*cur)->kind != IDENTIFIER) parse_error(pc, "expected function name", *cur);
+    const char *name = token_atom(pc, *cur);
+    advance(pc, cur);
+    if (!expect(pc, cur, L_PARENTHESES)) parse_error(pc, "expected '(' after function name", *cur);
 
     int param_count = 0;
     ASTNode **params = NULL;
     if ((*cur)->kind != R_PARENTHESES)
-        params = parse_param_list(cur, &param_count);
+        params = parse_param_list(pc, cur, &param_count);
 
-    if (!expect(cur, R_PARENTHESES)) parse_error("expected ')' after parameter list", token_head, *cur);
-    ASTNode *body = parse_block(cur);
-    ASTNode *fndef = new_fundef(ret_type, name, params, param_count, body);
-    add_function(fndef);
+    if (!expect(pc, cur, R_PARENTHESES)) parse_error(pc, "expected ')' after parameter list", *cur);
+    ASTNode *fndef = new_fundef(pc, ret_type, name, params, param_count, NULL);
+    if (!defer_body(pc, cur, fndef)) fndef->fundef.body = parse_block(pc, cur);
+    add_function(pc, fndef);
     return fndef;
 }
-ASTNode* parse_toplevel(Token **cur) {
-    if ((*cur)->kind == TYPEDEF) return parse_typedef(cur);
-    if ((*cur)->kind == STRUCT) return parse_struct(cur);
-    if (is_type((*cur)->kind, *cur)) {
-        Token *save = *cur;
-        ASTNode *fn = parse_fundef(cur);
-        if (fn) return fn;
-        *cur = save;
-    }
-    ASTNode *stmt = parse_stmt(cur);
-    if (!stmt) parse_error("unexpected toplevel construct", token_head, *cur);
+ASTNode* parse_toplevel(ParseContext *pc, Token **cur) {
+    if ((*cur)->kind == TYPEDEF) return parse_typedef(pc, cur);
+    if ((*cur)->kind == STRUCT) return parse_struct(pc, cur);
+    if (is_type(pc, (*cur)->kind, *cur)) return parse_fundef(pc, cur);
+    ASTNode *stmt = parse_stmt(pc, cur);
+    if (!stmt) parse_error(pc, "unexpected toplevel construct", *cur);
     return stmt;
 }
-ASTNode* parse_program(Token **cur) {
-    ASTNode **nodes = NULL;
-    int count = 0;
-    while ((*cur)->kind != EOT) {
-        ASTNode *node = parse_toplevel(cur);
-        if (!node) parse_error("failed to parse toplevel", token_head, *cur);
-        nodes = realloc(nodes, sizeof(ASTNode*) * (count+1));
-        nodes[count++] = node;
+ASTNode* parse_program(TokenStream *ts) {
+    TokenReader reader;
+    tokenReaderInitStream(&reader, ts);
+    ASTNode *program = parse_program_reader(&reader);
+    tokenReaderFree(&reader);
+    return program;
+}
+
+// ---- Incremental parsing ----
+
+// A top-level declaration of a session's source. Its span runs from the end
+// of the one before through its last token; `from` is its first token. The
+// hash covers [from, end), so it ignores the comments and blank lines above.
+typedef struct {
+    int start, from, end;
+    uint64_t hash;
+    ASTNode *node;
+} SessionDecl;
+
+struct ParseSession {
+    char *src;              // text of the last update, NUL-terminated
+    size_t size;
+    SessionDecl *decls;     // in source order
+    int count, cap;
+    SessionDecl *next;      // declarations of the update in progress
+    int next_count, next_cap;
+    int *reusable;          // open table of decls[] indices, by hash; -1 empty
+    int reusable_cap;
+    const char *old_src;    // text the reusable declarations came from
+    unsigned generation;    // g_arena_generation the nodes were made in
+    size_t full_bytes;      // arena bytes used by the last full parse
+    int dirty;              // the last update had errors
+    ParseSessionStats stats;
+};
+
+static void session_note(ParseContext *pc, ParseSession *s, int start, int from, int end, ASTNode *node) {
+    if (s->next_count == s->next_cap) {
+        s->next_cap = s->next_cap ? s->next_cap * 2 : 256;
+        s->next = realloc(s->next, sizeof(SessionDecl) * (size_t)s->next_cap);
+    }
+    const char *text = pc->tokens->src;
+    s->next[s->next_count++] = (SessionDecl){ start, from, end,
+                                              hash64(HASH64_SEED, text + from, (size_t)(end - from)), node };
+}
+
+// Index of the token after the declaration starting at tokens[i], found
+// without parsing: a ';' at depth 0, or the '}' closing a function body.
+static int decl_token_end(const Token *tokens, int i) {
+    int depth = 0, body = 0;
+    for (int start = i; tokens[i].kind != EOT; i++) {
+        TokenKind kind = tokens[i].kind;
+        if (kind == L_BRACE) {
+            if (depth++ == 0) body = i > start && tokens[i - 1].kind == R_PARENTHESES;
+        } else if (kind == R_BRACE) {
+            if (depth > 0 && --depth == 0 && body) return i + 1;
+        } else if (kind == SEMICOLON && depth == 0) {
+            return i + 1;
+        }
+    }
+    return i;
+}
+
+// A declaration of the previous update with the same text as [from, end) of
+// the current one, not yet reused; NULL if there is none.
+static SessionDecl *session_find(ParseContext *pc, ParseSession *s, int from, int end) {
+    if (!s->reusable_cap) return NULL;
+    const char *text = pc->tokens->src + from;
+    uint64_t hash = hash64(HASH64_SEED, text, (size_t)(end - from));
+    unsigned mask = (unsigned)s->reusable_cap - 1;
+    for (unsigned i = (unsigned)hash & mask; s->reusable[i] >= 0; i = (i + 1) & mask) {
+        SessionDecl *d = &s->decls[s->reusable[i]];
+        if (d->node && d->hash == hash && d->end - d->from == end - from &&
+            memcmp(s->old_src + d->from, text, (size_t)(end - from)) == 0)
+            return d;
+    }
+    return NULL;
+}
+
+// Top-level loop. With a session it also records each declaration's span,
+// and when the tokens were lexed up front it takes a declaration whose text
+// matches one of s->reusable instead of parsing it again.
+static void parse_toplevel_decls(ParseContext *pc, Token **cur, ParseSession *s, int start) {
+    jmp_buf abort_parse, here;
+    volatile int node_mark = pc->scratch_count;
+    volatile int prev_end = start;
+    if (setjmp(abort_parse)) {
+        pc->scratch_count = node_mark;  // drop the declaration cut short
+    } else {
+        pc->abort = &abort_parse;
+        pc->recover = &here;
+        while ((*cur)->kind != EOT) {
+            node_mark = pc->scratch_count;
+            if (setjmp(here)) {
+                pc->recover = &here;
+                pc->scratch_count = node_mark;
+                sync_toplevel(pc, cur);
+                continue;
+            }
+            int from = (*cur)->offset;
+            const Token *tokens = pc->reader->stream->data;
+            if (s && tokens && !pc->reader->pull) {
+                int last = decl_token_end(tokens, (int)pc->reader->head) - 1;
+                SessionDecl *old = session_find(pc, s, from, tokens[last].offset + tokens[last].len);
+                if (old) {
+                    while ((int)pc->reader->head <= last) advance(pc, cur);
+                    scratch_push(pc, old->node);
+                    session_note(pc, s, prev_end, from, tokens[last].offset + tokens[last].len, old->node);
+                    old->node = NULL;  // each is used once
+                    s->stats.reused++;
+                    prev_end = s->next[s->next_count - 1].end;
+                    continue;
+                }
+            }
+            ASTNode *node = parse_toplevel(pc, cur);
+            if (!node) parse_error(pc, "failed to parse toplevel", *cur);
+            scratch_push(pc, node);
+            if (s) {
+                const Token *last = prevToken(pc->reader, 1);
+                session_note(pc, s, prev_end, from, last->offset + last->len, node);
+                s->stats.parsed++;
+                prev_end = last->offset + last->len;
+            }
+        }
+    }
+    pc->recover = pc->abort = NULL;
+}
+
+ASTNode* parse_program_reader(TokenReader *reader) {
+    ParseContext pc;
+    context_begin(&pc, reader);
+    Token *tok = peekToken(reader, 0);
+    // Registries describe this parse only.
+    symtab_clear(&g_functions);
+    symtab_clear(&g_typenames);
+    symtab_clear(&g_structs);
+    int mark = pc.scratch_count;
+    parse_toplevel_decls(&pc, &tok, NULL, 0);
+    int count;
+    ASTNode **nodes = scratch_pop(&pc, mark, &count);
+    ASTNode *program = new_block(&pc, nodes, count);
+    context_end(&pc);
+    return program;
+}
+
+ParseSession *parse_session_new(void) {
+    return calloc(1, sizeof(ParseSession));
+}
+
+void parse_session_free(ParseSession *s) {
+    if (!s) return;
+    free(s->src);
+    free(s->decls);
+    free(s->next);
+    free(s->reusable);
+    free(s);
+}
+
+ParseSessionStats parse_session_stats(const ParseSession *s) {
+    return s->stats;
+}
+
+static void register_decl(ParseContext *pc, ASTNode *node) {
+    switch (node->type) {
+    case AST_FUNDEF:
+        add_function(pc, node);
+        break;
+    case AST_TYPEDEF:
+        add_typename(pc, node->typedef_stmt.alias);
+        break;
+    case AST_TYPEDEF_STRUCT:
+        add_typename(pc, node->typedef_struct.typedef_name);
+        add_structdef(pc, node->typedef_struct.struct_name, node->typedef_struct.typedef_name,
+                      node->typedef_struct.members, node->typedef_struct.member_count);
+        break;
+    case AST_STRUCT:
+        if (node->struct_stmt.name) add_typename(pc, node->struct_stmt.name);
+        add_structdef(pc, node->struct_stmt.name, NULL, node->struct_stmt.members,
+                      node->struct_stmt.member_count);
+        break;
+    default:
+        break;
+    }
+}
+
+// Makes the declarations of the finished update current; returns the tree.
+static ASTNode *session_commit(ParseContext *pc, ParseSession *s, char *src, size_t size) {
+    free(s->src);
+    s->src = src;
+    s->size = size;
+    SessionDecl *decls = s->decls;
+    int cap = s->cap;
+    s->decls = s->next;
+    s->count = s->next_count;
+    s->cap = s->next_cap;
+    s->next = decls;
+    s->next_cap = cap;
+    s->next_count = 0;
+    s->dirty = pc->error_count > 0;
+    int mark = pc->scratch_count;
+    for (int i = 0; i < s->count; i++) scratch_push(pc, s->decls[i].node);
+    int count;
+    ASTNode **nodes = scratch_pop(pc, mark, &count);
+    return new_block(pc, nodes, count);
+}
+
+static ASTNode *session_parse_full(ParseSession *s, char *src, size_t size) {
+    arena_reset(&g_ast_arena);
+    g_arena_generation++;
+    s->generation = g_arena_generation;
+    s->next_count = 0;
+    memset(&s->stats, 0, sizeof(s->stats));
+    s->stats.full = 1;
+    s->stats.bytes_lexed = size;
+    TokenReader reader;
+    tokenReaderInit(&reader, src, size);
+    ParseContext pc;
+    context_begin(&pc, &reader);
+    Token *tok = peekToken(&reader, 0);
+    symtab_clear(&g_functions);
+    symtab_clear(&g_typenames);
+    symtab_clear(&g_structs);
+    parse_toplevel_decls(&pc, &tok, s, 0);
+    ASTNode *program = session_commit(&pc, s, src, size);
+    context_end(&pc);
+    tokenReaderFree(&reader);
+    s->full_bytes = g_ast_arena.bytes;
+    return program;
+}
+
+// Lexes src[start, end) alone into a stream over all of src, so offsets,
+// and with them diagnostics and spans, are those of the whole text.
+static TokenStream lex_region(const char *src, int start, int end) {
+    TokenStream ts = {0};
+    TokenReader r;
+    tokenReaderInit(&r, src + start, (size_t)(end - start));
+    for (;;) {
+        Token *tok = nextToken(&r);
+        if (ts.count == ts.cap) {
+            ts.cap = ts.cap ? ts.cap * 2 : 256;
+            ts.data = realloc(ts.data, sizeof(Token) * (size_t)ts.cap);
+        }
+        ts.data[ts.count] = *tok;
+        ts.data[ts.count++].offset += start;
+        if (tok->kind == EOT) break;
+    }
+    tokenReaderFree(&r);
+    ts.src = src;
+    return ts;
+}
+
+ASTNode *parse_session_update(ParseSession *s, const char *text, size_t size) {
+    char *src = malloc(size + 1);
+    memcpy(src, text, size);
+    src[size] = '\0';
+    memset(&s->stats, 0, sizeof(s->stats));
+    // Replaced declarations stay in the arena until the next full parse, so
+    // one is forced once the garbage outgrows the live tree.
+    if (!s->src || s->dirty || s->generation != g_arena_generation ||
+        g_ast_arena.bytes > 2 * s->full_bytes + ARENA_CHUNK)
+        return session_parse_full(s, src, size);
+
+    // Declarations wholly inside the common prefix or suffix are unchanged.
+    size_t old_size = s->size, limit = old_size < size ? old_size : size;
+    size_t prefix = 0, suffix = 0;
+    while (prefix < limit && s->src[prefix] == src[prefix]) prefix++;
+    while (suffix < limit - prefix && s->src[old_size - 1 - suffix] == src[size - 1 - suffix]) suffix++;
+    int first = 0, last = s->count;
+    while (first < s->count && (size_t)s->decls[first].end <= prefix) first++;
+    while (last > first && (size_t)s->decls[last - 1].start >= old_size - suffix) last--;
+
+    // Only function definitions are re-parsed on their own: any other
+    // declaration may change how the code after it parses.
+    for (int i = first; i < last; i++)
+        if (s->decls[i].node->type != AST_FUNDEF) return session_parse_full(s, src, size);
+
+    int region_start = first ? s->decls[first - 1].end : 0;
+    int old_region_end = last < s->count ? s->decls[last].start : (int)old_size;
+    int delta = (int)size - (int)old_size;
+    int region_end = old_region_end + delta;
+
+    TokenStream tokens = lex_region(src, region_start, region_end);
+    s->stats.bytes_lexed = (size_t)(region_end - region_start);
+
+    // The replaced declarations can be picked up again by text, e.g. when a
+    // function was moved.
+    int want = 16;
+    while (want < 2 * (last - first)) want *= 2;
+    s->reusable = realloc(s->reusable, sizeof(int) * (size_t)want);
+    s->reusable_cap = want;
+    memset(s->reusable, -1, sizeof(int) * (size_t)want);
+    for (int i = first; i < last; i++) {
+        unsigned at = (unsigned)s->decls[i].hash & (unsigned)(want - 1);
+        while (s->reusable[at] >= 0) at = (at + 1) & (unsigned)(want - 1);
+        s->reusable[at] = i;
+    }
+    s->old_src = s->src;
+
+    TokenReader reader;
+    tokenReaderInitStream(&reader, &tokens);
+    ParseContext pc;
+    context_begin(&pc, &reader);
+
+    // The region sees the types declared before it, as in a full parse.
+    symtab_clear(&g_typenames);
+    symtab_clear(&g_structs);
+    for (int i = 0; i < first; i++)
+        if (s->decls[i].node->type != AST_FUNDEF) register_decl(&pc, s->decls[i].node);
+
+    s->next_count = 0;
+    for (int i = 0; i < first; i++) {
+        if (s->next_count == s->next_cap) {
+            s->next_cap = s->next_cap ? s->next_cap * 2 : 256;
+            s->next = realloc(s->next, sizeof(SessionDecl) * (size_t)s->next_cap);
+        }
+        s->next[s->next_count++] = s->decls[i];
+    }
+    s->stats.reused = first + (s->count - last);
+    int region_first = s->next_count;
+
+    Token *tok = peekToken(&reader, 0);
+    parse_toplevel_decls(&pc, &tok, s, region_start);
+    tokenReaderFree(&reader);
+    s->reusable_cap = 0;
+
+    // The region must end cleanly where the unchanged text resumes: after
+    // its last declaration there may only be white space. Syntax errors are
+    // the region's own and have been reported; the next update reparses in
+    // full.
+    int ok = 1;
+    int tail = s->next_count > region_first ? s->next[s->next_count - 1].end : region_start;
+    for (int i = tail; ok && i < region_end; i++)
+        if (src[i] != ' ' && src[i] != '\t' && src[i] != '\n' && src[i] != '\r') ok = 0;
+    for (int i = region_first; ok && i < s->next_count; i++)
+        if (s->next[i].node->type != AST_FUNDEF) ok = 0;
+    freeTokenStream(&tokens);
+    if (!ok && pc.error_count == 0) {
+        context_end(&pc);
+        return session_parse_full(s, src, size);
     }
-    return new_block(nodes, count);
+
+    for (int i = last; i < s->count; i++) {
+        if (s->next_count == s->next_cap) {
+            s->next_cap = s->next_cap ? s->next_cap * 2 : 256;
+            s->next = realloc(s->next, sizeof(SessionDecl) * (size_t)s->next_cap);
+        }
+        SessionDecl d = s->decls[i];
+        d.start += delta;
+        d.from += delta;
+        d.end += delta;
+        s->next[s->next_count++] = d;
+    }
+    if (last < s->count) s->next[s->next_count - (s->count - last)].start = tail;
+
+    // Registries as a full parse would leave them.
+    symtab_clear(&g_functions);
+    for (int i = 0; i < s->next_count; i++) {
+        ASTNode *node = s->next[i].node;
+        if (node->type == AST_FUNDEF || i >= s->next_count - (s->count - last)) register_decl(&pc, node);
+    }
+    ASTNode *program = session_commit(&pc, s, src, size);
+    context_end(&pc);
+    return program;
+}
+
+// ---- Parallel parsing ----
+
+#define MAX_PARSE_THREADS 64
+
+typedef struct {
+    TokenStream *tokens;
+    BodyJob *jobs;
+    int count;
+    ParseContext *shared;  // the serial pass, for registries and file name
+    Arena arena;
+    int errors;
+} BodyChunk;
+
+static void parse_body(ParseContext *pc, BodyJob *job) {
+    TokenReader reader;
+    tokenReaderInitStreamAt(&reader, pc->tokens, job->start);
+    pc->reader = &reader;
+    pc->typename_limit = job->typename_limit;
+    jmp_buf top;
+    pc->recover = pc->abort = &top;
+    if (setjmp(top) == 0) {
+        Token *tok = peekToken(&reader, 0);
+        job->fn->fundef.body = parse_block(pc, &tok);
+    }
+    tokenReaderFree(&reader);
+    pc->reader = NULL;
+}
+
+static void *parse_bodies(void *arg) {
+    BodyChunk *c = arg;
+    ParseContext pc;
+    memset(&pc, 0, sizeof(pc));
+    pc.tokens = c->tokens;
+    pc.arena = &c->arena;
+    pc.functions = c->shared->functions;
+    pc.typenames = c->shared->typenames;
+    pc.structs = c->shared->structs;
+    pc.filename = c->shared->filename;
+    pc.quiet = 1;
+    for (int i = 0; i < c->count && pc.error_count == 0; i++) parse_body(&pc, &c->jobs[i]);
+    c->errors = pc.error_count;
+    free(pc.scratch);
+    free(pc.errors);
+    return NULL;
+}
+
+ASTNode *parse_program_parallel(TokenStream *ts, int threads) {
+    if (threads > MAX_PARSE_THREADS) threads = MAX_PARSE_THREADS;
+    if (threads <= 1) return parse_program(ts);
+
+    // The serial pass parses everything but the function bodies.
+    TokenReader reader;
+    tokenReaderInitStream(&reader, ts);
+    ParseContext pc;
+    context_begin(&pc, &reader);
+    pc.quiet = 1;
+    pc.defer_bodies = 1;
+    Token *tok = peekToken(&reader, 0);
+    symtab_clear(&g_functions);
+    symtab_clear(&g_typenames);
+    symtab_clear(&g_structs);
+    int mark = pc.scratch_count;
+    parse_toplevel_decls(&pc, &tok, NULL, 0);
+    int count;
+    ASTNode **nodes = scratch_pop(&pc, mark, &count);
+    ASTNode *program = new_block(&pc, nodes, count);
+    int errors = pc.error_count;
+
+    // Contiguous runs of bodies with about as many tokens each.
+    long total = 0;
+    for (int i = 0; i < pc.job_count; i++) total += pc.jobs[i].tokens;
+    if (threads > pc.job_count) threads = pc.job_count;
+    BodyChunk chunks[MAX_PARSE_THREADS];
+    int n = 0;
+    for (int i = 0, done = 0; errors == 0 && i < pc.job_count; n++) {
+        long goal = total * (n + 1) / threads, have = 0;
+        int first = i;
+        while (i < pc.job_count && (n == threads - 1 || i == first || done + have < goal))
+            have += pc.jobs[i++].tokens;
+        done += (int)have;
+        chunks[n] = (BodyChunk){ ts, pc.jobs + first, i - first, &pc, {0}, 0 };
+        arena_init(&chunks[n].arena);
+    }
+    if (n > 0) {
+        pthread_t tids[MAX_PARSE_THREADS];
+        intern_set_concurrent(1);
+        for (int i = 1; i < n; i++) pthread_create(&tids[i], NULL, parse_bodies, &chunks[i]);
+        parse_bodies(&chunks[0]);
+        for (int i = 1; i < n; i++) pthread_join(tids[i], NULL);
+        intern_set_concurrent(0);
+    }
+    for (int i = 0; i < n; i++) {
+        errors += chunks[i].errors;
+        arena_adopt(&g_ast_arena, &chunks[i].arena);
+    }
+    context_end(&pc);
+    tokenReaderFree(&reader);
+
+    // Errors were recorded without positions: parse again serially, which
+    // reports them as usual. The partial tree stays in the arena until the
+    // next free_ast.
+    if (errors) return parse_program(ts);
+    return program;
 }
 
 void print_ast(ASTNode *node, int indent) {
@@ -1457,139 +1994,14 @@ void fprint_ast(FILE *out, ASTNode *node, int indent) {
     #undef INDENT
 }
 
+// One reset releases every tree in the arena. Names and literal values are
+// atoms and outlive it.
 void free_ast(ASTNode *node) {
     if (!node) return;
-    switch (node->type) {
-        case AST_NUMBER:
-            free(node->number.value);
-            break;
-        case AST_IDENTIFIER:
-            free(node->identifier.name);
-            break;
-        case AST_BINARY:
-            free_ast(node->binary.left);
-            free_ast(node->binary.right);
-            break;
-        case AST_ASSIGN:
-            free_ast(node->assign.left);
-            free_ast(node->assign.right);
-            break;
-        case AST_VAR_DECL:
-            free_ast(node->var_decl.var_type);
-            free(node->var_decl.name);
-            if (node->var_decl.init) free_ast(node->var_decl.init);
-            break;
-        case AST_TYPE:
-            free_ast(node->type_node.base_type);
-            break;
-        case AST_TYPE_ARRAY:
-            free_ast(node->type_array.element_type);
-            break;
-        case AST_STRING_LITERAL:
-            free(node->string_literal.value);
-            break;
-        case AST_CHAR_LITERAL:
-            free(node->char_literal.value);
-            break;
-        case AST_UNARY:
-            free_ast(node->unary.operand);
-            break;
-        case AST_TERNARY:
-            free_ast(node->ternary.cond);
-            free_ast(node->ternary.then_expr);
-            free_ast(node->ternary.else_expr);
-            break;
-        case AST_EXPR_STMT:
-            free_ast(node->expr_stmt.expr);
-            break;
-        case AST_IF:
-            free_ast(node->if_stmt.cond);
-            free_ast(node->if_stmt.then_stmt);
-            if (node->if_stmt.else_stmt) free_ast(node->if_stmt.else_stmt);
-            break;
-        case AST_RETURN:
-            free_ast(node->ret.expr);
-            break;
-        case AST_BLOCK:
-            for (int i = 0; i < node->block.count; i++)
-                free_ast(node->block.stmts[i]);
-            free(node->block.stmts);
-            break;
-        case AST_FUNDEF:
-            if (node->fundef.ret_type) free_ast(node->fundef.ret_type);
-            free(node->fundef.name);
-            for (int i = 0; i < node->fundef.param_count; i++)
-                free_ast(node->fundef.params[i]);
-            free(node->fundef.params);
-            free_ast(node->fundef.body);
-            break;
-        case AST_CALL:
-            free(node->call.name);
-            for (int i = 0; i < node->call.arg_count; i++)
-                free_ast(node->call.args[i]);
-            free(node->call.args);
-            break;
-        case AST_PARAM:
-            if (node->param.type) free_ast(node->param.type);
-            free(node->param.name);
-            break;
-        case AST_STRUCT:
-            free(node->struct_stmt.name);
-            for (int i = 0; i < node->struct_stmt.member_count; i++)
-                free_ast(node->struct_stmt.members[i]);
-            free(node->struct_stmt.members);
-            break;
-        case AST_STRUCT_MEMBER:
-            free(node->struct_member.type);
-            free(node->struct_member.name);
-            break;
-        case AST_TYPEDEF:
-            free(node->typedef_stmt.alias);
-            free_ast(node->typedef_stmt.src_type);
-            break;
-        case AST_TYPEDEF_STRUCT:
-            free(node->typedef_struct.struct_name);
-            for (int i = 0; i < node->typedef_struct.member_count; i++)
-                free_ast(node->typedef_struct.members[i]);
-            free(node->typedef_struct.members);
-            free(node->typedef_struct.typedef_name);
-            break;
-        case AST_MEMBER_ACCESS:
-            free(node->member_access.member);
-            free_ast(node->member_access.lhs);
-            break;
-        case AST_ARROW_ACCESS:
-            free(node->arrow_access.member);
-            free_ast(node->arrow_access.lhs);
-            break;
-        case AST_INIT_LIST:
-            for (int i = 0; i < node->init_list.count; i++)
-                free_ast(node->init_list.elements[i]);
-            free(node->init_list.elements);
-            break;
-        case AST_SIZEOF:
-            free_ast(node->sizeof_expr.expr);
-            break;
-        case AST_WHILE:
-            free_ast(node->while_stmt.cond);
-            free_ast(node->while_stmt.body);
-            break;
-        case AST_DO_WHILE:
-            free_ast(node->do_while_stmt.cond);
-            free_ast(node->do_while_stmt.body);
-            break;
-        case AST_FOR:
-            if (node->for_stmt.init) free_ast(node->for_stmt.init);
-            if (node->for_stmt.cond) free_ast(node->for_stmt.cond);
-            if (node->for_stmt.inc) free_ast(node->for_stmt.inc);
-            free_ast(node->for_stmt.body);
-            break;
-        case AST_BREAK:
-        case AST_CONTINUE:
-            break;
-        default:
-            fprintf(stderr, "Unknown AST Node Type: %d\n", node->type);
-            exit(1);
-    }
-    free(node);
+    arena_reset(&g_ast_arena);
+    g_arena_generation++;
+}
+
+const Arena *parser_arena(void) {
+    return &g_ast_arena;
 }
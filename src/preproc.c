@@ -0,0 +1,1103 @@
+#include "preproc.h"
+#include "intern.h"
+#include "stringBuilder.h"
+#include "symtab.h"
+#include "utils.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_INCLUDE_DEPTH 200
+#define SCRATCH_CHUNK (16 * 1024)
+
+// ---- File cache ----
+
+// Everything here lives for the whole process and is shared by all
+// translation units.
+typedef struct {
+    const char *key;      // atom of the resolved path
+    SourceBuffer buf;
+    SourceFile *file;     // the file's place in g_map; name is the path as found
+    TokenStream tokens;   // lexed the first time the file is included
+    const char *guard;    // macro of its include guard, once detected
+    int once;             // #pragma once seen
+    int last_tu;          // last translation unit that entered it
+    int dep_tu;           // last translation unit that listed it as a dependency
+} CachedFile;
+
+static SourceMap g_map;
+static SymTab g_files;            // resolved path -> CachedFile
+static SymTab g_paths;            // path as spelled -> CachedFile or &g_missing
+static CachedFile g_missing;
+static const char **g_include_dirs;
+static int g_include_dir_count;
+static PPStats g_stats;
+static int g_tu_count;
+
+// Text of tokens made by # and ##, so their offsets resolve like any other.
+static char *g_scratch;
+static int g_scratch_size;
+static int g_scratch_used;
+static int g_scratch_base;
+
+static int scratchAdd(const char *text, int len) {
+    if (!g_scratch || g_scratch_used + len + 1 > g_scratch_size) {
+        int size = len + 1 > SCRATCH_CHUNK ? len + 1 : SCRATCH_CHUNK;
+        // Entries are separated by newlines, so each reads as its own line.
+        g_scratch = calloc((size_t)size + 1, 1);
+        g_scratch_size = size;
+        g_scratch_used = 0;
+        g_scratch_base = sourceMapAdd(&g_map, intern_cstr("<scratch>"), g_scratch, size)->base;
+    }
+    int offset = g_scratch_base + g_scratch_used;
+    memcpy(g_scratch + g_scratch_used, text, (size_t)len);
+    g_scratch[g_scratch_used + len] = '\n';
+    g_scratch_used += len + 1;
+    return offset;
+}
+
+static CachedFile *loadFile(const char *key, const char *name) {
+    CachedFile *f = symtab_get(&g_files, key);
+    if (f) return f;
+    SourceBuffer buf;
+    if (openSource(name, &buf) != 0) return NULL;
+    int end = g_map.count ? g_map.files[g_map.count - 1]->base + g_map.files[g_map.count - 1]->size : 0;
+    if (buf.size > (size_t)(INT_MAX - 2 - end)) {
+        fprintf(stderr, "%s: error: sources exceed 2 GiB in total\n", name);
+        closeSource(&buf);
+        return NULL;
+    }
+    f = calloc(1, sizeof(CachedFile));
+    f->key = key;
+    f->buf = buf;
+    f->file = sourceMapAdd(&g_map, intern_cstr(name), buf.data, (int)buf.size);
+    symtab_put(&g_files, key, f);
+    g_stats.files_read++;
+    return f;
+}
+
+// Looks up a path as an #include would spell it. Results, including misses,
+// are remembered, so a header found before costs no system calls.
+static CachedFile *lookupPath(const char *path) {
+    const char *atom = intern_cstr(path);
+    CachedFile *f = symtab_get(&g_paths, atom);
+    if (f) return f == &g_missing ? NULL : f;
+    char resolved[PATH_MAX];
+    if (access(path, R_OK) != 0 || !realpath(path, resolved)) {
+        symtab_put(&g_paths, atom, &g_missing);
+        return NULL;
+    }
+    f = loadFile(intern_cstr(resolved), path);
+    symtab_put(&g_paths, atom, f ? f : &g_missing);
+    return f;
+}
+
+void ppAddIncludeDir(const char *dir) {
+    g_include_dirs = realloc(g_include_dirs, sizeof(char *) * (size_t)(g_include_dir_count + 1));
+    g_include_dirs[g_include_dir_count++] = intern_cstr(dir);
+}
+
+const char *const *ppIncludeDirs(int *count) {
+    *count = g_include_dir_count;
+    return g_include_dirs;
+}
+
+PPStats ppStats(void) {
+    return g_stats;
+}
+
+// ---- Translation units ----
+
+// Hide sets (Prosser's algorithm): the macros a token has already been
+// expanded from, which must not expand it again.
+typedef struct Hide {
+    const char *name;
+    struct Hide *next;
+} Hide;
+
+typedef struct HideChunk {
+    struct HideChunk *prev;
+    Hide items[256];
+} HideChunk;
+
+typedef struct {
+    Token tok;    // offset is global
+    Hide *hide;
+} PPToken;
+
+typedef struct {
+    PPToken *data;
+    int count;
+    int cap;
+} TokVec;
+
+// Where expansion reads from: pushed-back tokens first (the next one is
+// last), then, for the main input, the include stack.
+typedef struct {
+    TokVec stack;
+    int from_file;
+} Input;
+
+typedef struct {
+    const char *name;
+    int function_like;
+    int variadic;        // the last parameter is __VA_ARGS__
+    int param_count;
+    const char **params;
+    Token *body;         // ## is stored as one HASH token of length 2
+    int *param_of;       // parameter index of each body token, or -1
+    int body_count;
+} Macro;
+
+typedef struct {
+    int active;          // tokens in the current group are kept
+    int taken;           // some group of this #if has been kept
+    int seen_else;
+    int parent_active;
+    Token at;            // the #if, for errors
+} Cond;
+
+// Include-guard detection for one file: the first thing in it must be
+// #ifndef X, whose #endif must be the last thing, with no #elif/#else.
+enum { GUARD_START, GUARD_OPEN, GUARD_CLOSED, GUARD_NONE };
+
+typedef struct {
+    CachedFile *file;
+    TokenReader reader;  // yields offsets relative to the file
+    int prev_end;        // end of the previous token in the file, or -1
+    int cond_base;       // conditional depth when the file was entered
+    int guard_state;
+    const char *guard_name;
+    int guard_depth;
+} Frame;
+
+struct Preprocessor {
+    TokenStream desc;
+    int tu;
+    int threads;
+    Frame *frames;
+    int depth;
+    Cond *conds;
+    int cond_count;
+    int cond_cap;
+    SymTab macros;
+    int keyword_macros;  // macros named like keywords, which need a lookup by spelling
+    Input in;
+    HideChunk *hides;
+    int hide_used;
+    CachedFile **deps;   // every file the unit included, main file first
+    int dep_count;
+};
+
+static const char *A_define, *A_include, *A_ifdef, *A_ifndef, *A_elif,
+                  *A_endif, *A_undef, *A_pragma, *A_error, *A_warning,
+                  *A_line, *A_once, *A_defined, *A_va_args;
+
+static void initAtoms(void) {
+    if (A_define) return;
+    A_define = intern_cstr("define");
+    A_include = intern_cstr("include");
+    A_ifdef = intern_cstr("ifdef");
+    A_ifndef = intern_cstr("ifndef");
+    A_elif = intern_cstr("elif");
+    A_endif = intern_cstr("endif");
+    A_undef = intern_cstr("undef");
+    A_pragma = intern_cstr("pragma");
+    A_error = intern_cstr("error");
+    A_warning = intern_cstr("warning");
+    A_line = intern_cstr("line");
+    A_once = intern_cstr("once");
+    A_defined = intern_cstr("defined");
+    A_va_args = intern_cstr("__VA_ARGS__");
+}
+
+static void ppError(Preprocessor *pp, const Token *at, const char *fmt, ...) {
+    int line = 0, col = 0;
+    const char *file = "<input>";
+    if (at) {
+        tokenPosition(&pp->desc, at, &line, &col);
+        file = tokenFileName(&pp->desc, at);
+    }
+    fprintf(stderr, "%s:%d:%d: error: ", file, line, col);
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    if (at) {
+        int len;
+        const char *text = tokenLine(&pp->desc, at, &len);
+        fprintf(stderr, "  %.*s\n  %*s^\n", len, text, col, "");
+    }
+    exit(1);
+}
+
+static void vecPush(TokVec *v, const Token *tok, Hide *hide) {
+    if (v->count == v->cap) {
+        v->cap = v->cap ? v->cap * 2 : 16;
+        v->data = realloc(v->data, sizeof(PPToken) * (size_t)v->cap);
+    }
+    v->data[v->count].tok = *tok;
+    v->data[v->count].hide = hide;
+    v->count++;
+}
+
+static Hide *hideAdd(Preprocessor *pp, Hide *set, const char *name) {
+    for (Hide *h = set; h; h = h->next) {
+        if (h->name == name) return set;
+    }
+    if (!pp->hides || pp->hide_used == 256) {
+        HideChunk *c = malloc(sizeof(HideChunk));
+        c->prev = pp->hides;
+        pp->hides = c;
+        pp->hide_used = 0;
+    }
+    Hide *h = &pp->hides->items[pp->hide_used++];
+    h->name = name;
+    h->next = set;
+    return h;
+}
+
+static int hidden(const Hide *set, const char *name) {
+    for (; set; set = set->next) {
+        if (set->name == name) return 1;
+    }
+    return 0;
+}
+
+static Hide *hideUnion(Preprocessor *pp, Hide *a, Hide *b) {
+    for (; a; a = a->next) b = hideAdd(pp, b, a->name);
+    return b;
+}
+
+static Hide *hideIntersect(Preprocessor *pp, Hide *a, Hide *b) {
+    Hide *out = NULL;
+    for (; a; a = a->next) {
+        if (hidden(b, a->name)) out = hideAdd(pp, out, a->name);
+    }
+    return out;
+}
+
+static int isKeyword(TokenKind kind) {
+    return (kind >= BOOL && kind <= SIZEOF) || kind == INLINE;
+}
+
+// The name a token would have as a macro, or NULL if it cannot be one.
+static const char *macroName(Preprocessor *pp, const Token *tok) {
+    if (tok->kind == IDENTIFIER) return tok->atom;
+    if (!isKeyword(tok->kind)) return NULL;
+    return intern(tokenText(&pp->desc, tok), (size_t)tok->len);
+}
+
+static Macro *findMacro(Preprocessor *pp, const Token *tok) {
+    if (pp->macros.count == 0) return NULL;
+    if (tok->kind == IDENTIFIER) return symtab_get(&pp->macros, tok->atom);
+    if (!pp->keyword_macros || !isKeyword(tok->kind)) return NULL;
+    return symtab_get(&pp->macros, macroName(pp, tok));
+}
+
+static int isDefined(Preprocessor *pp, const char *name) {
+    return symtab_get(&pp->macros, name) != NULL;
+}
+
+static int isActive(const Preprocessor *pp) {
+    return pp->cond_count == 0 || pp->conds[pp->cond_count - 1].active;
+}
+
+// ---- Reading files ----
+
+// Whether a newline ends the logical line somewhere in [p, end), the gap
+// between two tokens. Backslash-newlines continue the line, and newlines
+// inside block comments do not count.
+static int newlineIn(const char *p, const char *end) {
+    for (; p < end; p++) {
+        if (p[0] == '/' && p[1] == '*') {
+            for (p += 2; p < end && !(p[0] == '*' && p[1] == '/'); p++) {}
+            p++;
+        } else if (*p == '\n') {
+            const char *q = p;
+            if (q[-1] == '\r') q--;
+            if (q[-1] != '\\') return 1;
+        }
+    }
+    return 0;
+}
+
+static int atLineStart(const Frame *fr, const Token *tok) {
+    if (fr->prev_end < 0) return 1;
+    const char *text = fr->file->file->text;
+    return newlineIn(text + fr->prev_end, text + tok->offset);
+}
+
+// Consumes the frame's next token, converting its offset to a global one.
+static Token frameNext(Frame *fr) {
+    Token tok = *nextToken(&fr->reader);
+    fr->prev_end = tok.offset + tok.len;
+    tok.offset += fr->file->file->base;
+    return tok;
+}
+
+// The rest of the directive line, as global tokens.
+static void readLine(Frame *fr, TokVec *line) {
+    for (;;) {
+        Token *tok = peekToken(&fr->reader, 0);
+        if (tok->kind == EOT || atLineStart(fr, tok)) return;
+        Token t = frameNext(fr);
+        vecPush(line, &t, NULL);
+    }
+}
+
+static void addDependency(Preprocessor *pp, CachedFile *f) {
+    if (f->dep_tu == pp->tu) return;
+    f->dep_tu = pp->tu;
+    pp->deps = realloc(pp->deps, sizeof(CachedFile *) * (size_t)(pp->dep_count + 1));
+    pp->deps[pp->dep_count++] = f;
+}
+
+static void pushFrame(Preprocessor *pp, CachedFile *f, const Token *at) {
+    if (pp->depth == MAX_INCLUDE_DEPTH) ppError(pp, at, "#include nested too deeply");
+    Frame *fr = &pp->frames[pp->depth++];
+    fr->file = f;
+    fr->prev_end = -1;
+    fr->cond_base = pp->cond_count;
+    fr->guard_state = GUARD_START;
+    fr->guard_name = NULL;
+    f->last_tu = pp->tu;
+    if (pp->depth == 1 && pp->threads <= 1 && !f->tokens.data) {
+        // The main file is lexed as it is read, as without preprocessing.
+        tokenReaderInit(&fr->reader, f->buf.data, f->buf.size);
+        return;
+    }
+    if (!f->tokens.data) {
+        f->tokens = lexerParallel(f->buf.data, f->buf.size, pp->depth == 1 ? pp->threads : 1);
+        g_stats.files_lexed++;
+    }
+    tokenReaderInitStream(&fr->reader, &f->tokens);
+}
+
+static void popFrame(Preprocessor *pp) {
+    Frame *fr = &pp->frames[pp->depth - 1];
+    if (fr->guard_state == GUARD_CLOSED) fr->file->guard = fr->guard_name;
+    tokenReaderFree(&fr->reader);
+    pp->depth--;
+}
+
+static void directive(Preprocessor *pp, Frame *fr, const Token *hash);
+
+// Next token of the include stack that survives directives and skipped
+// groups.
+static void fileToken(Preprocessor *pp, PPToken *out) {
+    for (;;) {
+        Frame *fr = &pp->frames[pp->depth - 1];
+        Token *peek = peekToken(&fr->reader, 0);
+        int bol = peek->kind == HASH && atLineStart(fr, peek);
+        Token tok = frameNext(fr);
+        if (tok.kind == EOT) {
+            if (pp->cond_count > fr->cond_base) {
+                ppError(pp, &pp->conds[pp->cond_count - 1].at, "unterminated conditional directive");
+            }
+            if (pp->depth == 1) {
+                out->tok = tok;
+                out->hide = NULL;
+                return;
+            }
+            popFrame(pp);
+            continue;
+        }
+        if (bol) {
+            directive(pp, fr, &tok);
+            continue;
+        }
+        if (fr->guard_state != GUARD_OPEN) fr->guard_state = GUARD_NONE;
+        if (!isActive(pp)) continue;
+        out->tok = tok;
+        out->hide = NULL;
+        return;
+    }
+}
+
+// ---- Macro expansion ----
+
+static void take(Preprocessor *pp, Input *in, PPToken *out) {
+    if (in->stack.count > 0) {
+        *out = in->stack.data[--in->stack.count];
+    } else if (in->from_file) {
+        fileToken(pp, out);
+    } else {
+        memset(out, 0, sizeof(*out));
+        out->tok.kind = EOT;
+    }
+}
+
+static void untake(Input *in, const PPToken *t) {
+    vecPush(&in->stack, &t->tok, t->hide);
+}
+
+// Pushes tokens so that they are taken next, in order.
+static void pushAll(Input *in, const TokVec *v) {
+    for (int i = v->count - 1; i >= 0; i--) untake(in, &v->data[i]);
+}
+
+// Lexes text made by # or ##. It must form exactly one token, which gets an
+// offset in the scratch area.
+static int makeToken(const char *text, int len, Token *out) {
+    TokenStream ts = lexer(text);
+    int ok = ts.count == 2 && ts.data[0].offset == 0 && ts.data[0].len == len;
+    if (ok) {
+        *out = ts.data[0];
+        out->offset = scratchAdd(text, len);
+    }
+    freeTokenStream(&ts);
+    return ok;
+}
+
+static Token stringize(Preprocessor *pp, const TokVec *arg, const Token *at) {
+    StringBuilder sb;
+    sb_init(&sb);
+    sb_append(&sb, "\"");
+    for (int i = 0; i < arg->count; i++) {
+        const Token *t = &arg->data[i].tok;
+        if (i > 0 && t->offset != arg->data[i - 1].tok.offset + arg->data[i - 1].tok.len) {
+            sb_append(&sb, " ");
+        }
+        const char *text = tokenText(&pp->desc, t);
+        if (t->kind == STRING_LITERAL || t->kind == CHAR_LITERAL) {
+            for (int k = 0; k < t->len; k++) {
+                if (text[k] == '"' || text[k] == '\\') sb_append(&sb, "\\");
+                sb_append(&sb, "%c", text[k]);
+            }
+        } else {
+            sb_append(&sb, "%.*s", t->len, text);
+        }
+    }
+    sb_append(&sb, "\"");
+    Token tok;
+    if (!makeToken(sb.buf, (int)sb.len, &tok)) ppError(pp, at, "invalid string made by '#'");
+    sb_free(&sb);
+    return tok;
+}
+
+static void paste(Preprocessor *pp, PPToken *lhs, const Token *rhs, const Token *at) {
+    StringBuilder sb;
+    sb_init(&sb);
+    sb_append(&sb, "%.*s%.*s", lhs->tok.len, tokenText(&pp->desc, &lhs->tok),
+              rhs->len, tokenText(&pp->desc, rhs));
+    if (!makeToken(sb.buf, (int)sb.len, &lhs->tok)) {
+        ppError(pp, at, "pasting forms '%s', an invalid token", sb.buf);
+    }
+    sb_free(&sb);
+}
+
+static void expandNext(Preprocessor *pp, Input *in, PPToken *out);
+
+static void expandAll(Preprocessor *pp, const TokVec *raw, TokVec *out) {
+    Input in = {0};
+    pushAll(&in, raw);
+    for (;;) {
+        PPToken t;
+        expandNext(pp, &in, &t);
+        if (t.tok.kind == EOT) break;
+        vecPush(out, &t.tok, t.hide);
+    }
+    free(in.stack.data);
+}
+
+static int isPaste(const Token *t) {
+    return t->kind == HASH && t->len == 2;
+}
+
+// The macro's replacement list with arguments substituted, before rescanning.
+static void substitute(Preprocessor *pp, const Macro *m, TokVec *args, TokVec *out) {
+    int lhs_empty = 0;  // the left operand of a following ## is an empty argument
+    for (int i = 0; i < m->body_count; i++) {
+        const Token *t = &m->body[i];
+        if (isPaste(t)) {
+            const Token *rt = &m->body[++i];
+            int q = m->param_of[i];
+            TokVec one = {0};
+            PPToken single = {*rt, NULL};
+            const TokVec *rhs = q >= 0 ? &args[q] : &one;
+            if (q < 0) {
+                one.data = &single;
+                one.count = 1;
+            }
+            if (lhs_empty) {
+                for (int k = 0; k < rhs->count; k++) vecPush(out, &rhs->data[k].tok, rhs->data[k].hide);
+            } else if (rhs->count > 0) {
+                paste(pp, &out->data[out->count - 1], &rhs->data[0].tok, t);
+                for (int k = 1; k < rhs->count; k++) vecPush(out, &rhs->data[k].tok, rhs->data[k].hide);
+            }
+            lhs_empty = lhs_empty && rhs->count == 0;
+            continue;
+        }
+        lhs_empty = 0;
+        if (m->function_like && t->kind == HASH) {
+            Token s = stringize(pp, &args[m->param_of[++i]], t);
+            vecPush(out, &s, NULL);
+            continue;
+        }
+        int p = m->param_of[i];
+        if (p < 0) {
+            vecPush(out, t, NULL);
+        } else if (i + 1 < m->body_count && isPaste(&m->body[i + 1])) {
+            // Operands of ## are not expanded first.
+            for (int k = 0; k < args[p].count; k++) vecPush(out, &args[p].data[k].tok, args[p].data[k].hide);
+            lhs_empty = args[p].count == 0;
+        } else {
+            expandAll(pp, &args[p], out);
+        }
+    }
+}
+
+// Reads the arguments of a function-like macro after its '('.
+static TokVec *readArgs(Preprocessor *pp, Input *in, const Macro *m,
+                        PPToken *rparen, const Token *at) {
+    int n = m->param_count ? m->param_count : 1;
+    TokVec *args = calloc((size_t)n, sizeof(TokVec));
+    int index = 0, depth = 0;
+    for (;;) {
+        PPToken t;
+        take(pp, in, &t);
+        if (t.tok.kind == EOT) ppError(pp, at, "unterminated argument list invoking macro '%s'", m->name);
+        if (depth == 0 && t.tok.kind == R_PARENTHESES) {
+            *rparen = t;
+            break;
+        }
+        if (depth == 0 && t.tok.kind == COMMA && !(m->variadic && index == m->param_count - 1)) {
+            if (++index >= n) ppError(pp, at, "too many arguments to macro '%s'", m->name);
+            continue;
+        }
+        if (t.tok.kind == L_PARENTHESES) depth++;
+        if (t.tok.kind == R_PARENTHESES) depth--;
+        vecPush(&args[index], &t.tok, t.hide);
+    }
+    // An empty __VA_ARGS__ may be left out along with its comma.
+    int given = index + 1;
+    if (m->variadic && given == m->param_count - 1) given++;
+    if (m->param_count == 0 && args[0].count > 0) {
+        ppError(pp, at, "macro '%s' takes no arguments", m->name);
+    }
+    if (m->param_count > 0 && given != m->param_count) {
+        ppError(pp, at, "macro '%s' requires %d arguments, but %d given", m->name, m->param_count, given);
+    }
+    return args;
+}
+
+// The next token of `in` after macro expansion.
+static void expandNext(Preprocessor *pp, Input *in, PPToken *out) {
+    for (;;) {
+        PPToken t;
+        take(pp, in, &t);
+        Macro *m = findMacro(pp, &t.tok);
+        if (!m || hidden(t.hide, m->name)) {
+            *out = t;
+            return;
+        }
+        TokVec body = {0};
+        Hide *hide;
+        if (!m->function_like) {
+            hide = hideAdd(pp, t.hide, m->name);
+            substitute(pp, m, NULL, &body);
+        } else {
+            PPToken next;
+            take(pp, in, &next);
+            if (next.tok.kind != L_PARENTHESES) {
+                untake(in, &next);
+                *out = t;
+                return;
+            }
+            PPToken rparen;
+            TokVec *args = readArgs(pp, in, m, &rparen, &t.tok);
+            hide = hideAdd(pp, hideIntersect(pp, t.hide, rparen.hide), m->name);
+            substitute(pp, m, args, &body);
+            for (int i = 0; i < (m->param_count ? m->param_count : 1); i++) free(args[i].data);
+            free(args);
+        }
+        for (int i = 0; i < body.count; i++) body.data[i].hide = hideUnion(pp, hide, body.data[i].hide);
+        pushAll(in, &body);
+        free(body.data);
+    }
+}
+
+// ---- Directives ----
+
+static void freeMacro(Macro *m) {
+    free(m->params);
+    free(m->body);
+    free(m->param_of);
+    free(m);
+}
+
+static void defineMacro(Preprocessor *pp, const TokVec *line) {
+    if (line->count < 2) ppError(pp, &line->data[0].tok, "no macro name given in #define directive");
+    const Token *name_tok = &line->data[1].tok;
+    const char *name = macroName(pp, name_tok);
+    if (!name) ppError(pp, name_tok, "macro names must be identifiers");
+    Macro *m = calloc(1, sizeof(Macro));
+    m->name = name;
+    int i = 2;
+    if (i < line->count && line->data[i].tok.kind == L_PARENTHESES &&
+        line->data[i].tok.offset == name_tok->offset + name_tok->len) {
+        m->function_like = 1;
+        int cap = 4;
+        m->params = malloc(sizeof(char *) * (size_t)cap);
+        for (i++; i < line->count && line->data[i].tok.kind != R_PARENTHESES; i++) {
+            const Token *p = &line->data[i].tok;
+            if (m->param_count > 0) {
+                if (p->kind != COMMA) ppError(pp, p, "expected ',' or ')' in macro parameter list");
+                p = &line->data[++i].tok;
+                if (i >= line->count) break;
+            }
+            if (m->param_count == cap) {
+                cap *= 2;
+                m->params = realloc(m->params, sizeof(char *) * (size_t)cap);
+            }
+            if (p->kind == DOT && i + 2 < line->count &&
+                line->data[i + 1].tok.kind == DOT && line->data[i + 2].tok.kind == DOT) {
+                m->variadic = 1;
+                m->params[m->param_count++] = A_va_args;
+                i += 2;
+            } else if (p->kind == IDENTIFIER && !m->variadic) {
+                m->params[m->param_count++] = p->atom;
+            } else {
+                ppError(pp, p, "invalid macro parameter");
+            }
+        }
+        if (i >= line->count) ppError(pp, name_tok, "missing ')' in macro parameter list");
+        i++;
+    }
+    int n = line->count - i;
+    m->body = malloc(sizeof(Token) * (size_t)(n ? n : 1));
+    m->param_of = malloc(sizeof(int) * (size_t)(n ? n : 1));
+    for (; i < line->count; i++) {
+        Token t = line->data[i].tok;
+        if (t.kind == HASH && i + 1 < line->count && line->data[i + 1].tok.kind == HASH &&
+            line->data[i + 1].tok.offset == t.offset + 1) {
+            t.len = 2;  // ##
+            i++;
+        }
+        int p = -1;
+        if (t.kind == IDENTIFIER) {
+            for (int k = 0; k < m->param_count; k++) {
+                if (m->params[k] == t.atom) p = k;
+            }
+        }
+        m->body[m->body_count] = t;
+        m->param_of[m->body_count++] = p;
+    }
+    for (int k = 0; k < m->body_count; k++) {
+        const Token *t = &m->body[k];
+        if (isPaste(t) && (k == 0 || k == m->body_count - 1)) {
+            ppError(pp, t, "'##' cannot appear at either end of a macro expansion");
+        }
+        if (m->function_like && t->kind == HASH && t->len == 1 &&
+            (k + 1 == m->body_count || m->param_of[k + 1] < 0)) {
+            ppError(pp, t, "'#' is not followed by a macro parameter");
+        }
+    }
+    // A redefinition replaces the old macro, which is counted once.
+    Macro *old = symtab_get(&pp->macros, name);
+    if (old) freeMacro(old);
+    else if (name_tok->kind != IDENTIFIER) pp->keyword_macros++;
+    symtab_put(&pp->macros, name, m);
+}
+
+// Constant expressions of #if, evaluated in long long.
+typedef struct {
+    Preprocessor *pp;
+    const TokVec *toks;
+    int pos;
+    int dead;    // inside an operand that is not evaluated, e.g. after 0 &&
+    const Token *at;
+} Eval;
+
+static long long evalExpr(Eval *e);
+
+static const Token *evalPeek(Eval *e) {
+    return e->pos < e->toks->count ? &e->toks->data[e->pos].tok : NULL;
+}
+
+static int evalAccept(Eval *e, TokenKind kind) {
+    const Token *t = evalPeek(e);
+    if (!t || t->kind != kind) return 0;
+    e->pos++;
+    return 1;
+}
+
+static long long evalUnary(Eval *e) {
+    const Token *t = evalPeek(e);
+    if (!t) ppError(e->pp, e->at, "expected value in expression");
+    e->pos++;
+    switch (t->kind) {
+    case ADD: return evalUnary(e);
+    case SUB: return (long long)(0ull - (unsigned long long)evalUnary(e));
+    case NOT: return !evalUnary(e);
+    case BITNOT: return ~evalUnary(e);
+    case L_PARENTHESES: {
+        long long v = evalExpr(e);
+        if (!evalAccept(e, R_PARENTHESES)) ppError(e->pp, t, "missing ')' in expression");
+        return v;
+    }
+    case NUMBER:
+        if (t->num_flags & (NUM_FLOAT | NUM_INVALID)) {
+            ppError(e->pp, t, "invalid integer constant in preprocessor expression");
+        }
+        return (long long)t->ival;
+    case CHAR_LITERAL: {
+        char buffer[2] = {0};
+        isCharLiteral(tokenText(&e->pp->desc, t), buffer);
+        return buffer[0];
+    }
+    default:
+        // Identifiers left after expansion, keywords included, read as 0.
+        if (t->kind == IDENTIFIER || isKeyword(t->kind)) return 0;
+        ppError(e->pp, t, "token is not valid in preprocessor expressions");
+        return 0;
+    }
+}
+
+static int binaryPrecedence(TokenKind kind) {
+    switch (kind) {
+    case ASTARISK: case DIV: case MOD: return 10;
+    case ADD: case SUB: return 9;
+    case LSH: case RSH: return 8;
+    case LT: case GT: case LTE: case GTE: return 7;
+    case EQ: case NEQ: return 6;
+    case AMPERSAND: return 5;
+    case BITXOR: return 4;
+    case BITOR: return 3;
+    case LAND: return 2;
+    case LOR: return 1;
+    default: return 0;
+    }
+}
+
+static long long evalBinary(Eval *e, int min_prec) {
+    long long lhs = evalUnary(e);
+    for (;;) {
+        const Token *op = evalPeek(e);
+        int prec = op ? binaryPrecedence(op->kind) : 0;
+        if (prec == 0 || prec < min_prec) return lhs;
+        e->pos++;
+        int skip = (op->kind == LAND && !lhs) || (op->kind == LOR && lhs);
+        e->dead += skip;
+        long long rhs = evalBinary(e, prec + 1);
+        e->dead -= skip;
+        unsigned long long a = (unsigned long long)lhs, b = (unsigned long long)rhs;
+        switch (op->kind) {
+        case ASTARISK: lhs = (long long)(a * b); break;
+        case DIV:
+        case MOD:
+            if (rhs == 0) {
+                if (!e->dead) ppError(e->pp, op, "division by zero in #if");
+                lhs = 0;
+            } else if (rhs == -1) {
+                lhs = op->kind == DIV ? (long long)(0ull - a) : 0;
+            } else {
+                lhs = op->kind == DIV ? lhs / rhs : lhs % rhs;
+            }
+            break;
+        case ADD: lhs = (long long)(a + b); break;
+        case SUB: lhs = (long long)(a - b); break;
+        case LSH: lhs = (long long)(a << (b & 63)); break;
+        case RSH: lhs = lhs >> (b & 63); break;
+        case LT: lhs = lhs < rhs; break;
+        case GT: lhs = lhs > rhs; break;
+        case LTE: lhs = lhs <= rhs; break;
+        case GTE: lhs = lhs >= rhs; break;
+        case EQ: lhs = lhs == rhs; break;
+        case NEQ: lhs = lhs != rhs; break;
+        case AMPERSAND: lhs = lhs & rhs; break;
+        case BITXOR: lhs = lhs ^ rhs; break;
+        case BITOR: lhs = lhs | rhs; break;
+        case LAND: lhs = lhs && rhs; break;
+        default: lhs = lhs || rhs; break;
+        }
+    }
+}
+
+static long long evalExpr(Eval *e) {
+    long long cond = evalBinary(e, 1);
+    if (!evalAccept(e, QUESTION)) return cond;
+    e->dead += !cond;
+    long long a = evalExpr(e);
+    e->dead -= !cond;
+    if (!evalAccept(e, COLON)) ppError(e->pp, e->at, "expected ':' in expression");
+    e->dead += !!cond;
+    long long b = evalExpr(e);
+    e->dead -= !!cond;
+    return cond ? a : b;
+}
+
+// Evaluates the #if or #elif on line (line->data[0] is the directive name).
+static int evalCondition(Preprocessor *pp, const TokVec *line) {
+    const Token *at = &line->data[0].tok;
+    TokVec pre = {0};
+    for (int i = 1; i < line->count; i++) {
+        Token t = line->data[i].tok;
+        if (t.kind == IDENTIFIER && t.atom == A_defined) {
+            int paren = i + 1 < line->count && line->data[i + 1].tok.kind == L_PARENTHESES;
+            int k = i + 1 + paren;
+            const char *name = k < line->count ? macroName(pp, &line->data[k].tok) : NULL;
+            if (!name) ppError(pp, &t, "operator 'defined' requires an identifier");
+            if (paren && (k + 1 >= line->count || line->data[k + 1].tok.kind != R_PARENTHESES)) {
+                ppError(pp, &t, "missing ')' after 'defined'");
+            }
+            t.kind = NUMBER;
+            t.num_flags = 0;
+            t.ival = isDefined(pp, name);
+            i = k + paren;
+        }
+        vecPush(&pre, &t, NULL);
+    }
+    TokVec expanded = {0};
+    expandAll(pp, &pre, &expanded);
+    if (expanded.count == 0) ppError(pp, at, "#if with no expression");
+    Eval e = { pp, &expanded, 0, 0, at };
+    long long v = evalExpr(&e);
+    if (e.pos != expanded.count) ppError(pp, &expanded.data[e.pos].tok, "missing binary operator in #if");
+    free(pre.data);
+    free(expanded.data);
+    return v != 0;
+}
+
+static void pushCond(Preprocessor *pp, int active, const Token *at) {
+    int parent_active = isActive(pp);
+    if (pp->cond_count == pp->cond_cap) {
+        pp->cond_cap = pp->cond_cap ? pp->cond_cap * 2 : 16;
+        pp->conds = realloc(pp->conds, sizeof(Cond) * (size_t)pp->cond_cap);
+    }
+    Cond *c = &pp->conds[pp->cond_count++];
+    c->parent_active = parent_active;
+    c->active = c->parent_active && active;
+    c->taken = !c->parent_active || active;
+    c->seen_else = 0;
+    c->at = *at;
+}
+
+static void include(Preprocessor *pp, Frame *fr, const TokVec *line) {
+    const Token *at = &line->data[0].tok;
+    char *name = NULL;
+    int angled = 0;
+    if (line->count >= 2 && line->data[1].tok.kind == STRING_LITERAL) {
+        int len;
+        const char *s = tokenSpelling(&pp->desc, &line->data[1].tok, &len);
+        name = strndup(s, (size_t)len);
+    } else if (line->count >= 2 && line->data[1].tok.kind == LT) {
+        const Token *lt = &line->data[1].tok;
+        int k = 2;
+        while (k < line->count && line->data[k].tok.kind != GT) k++;
+        if (k == line->count) ppError(pp, lt, "missing terminating > character");
+        const char *s = tokenText(&pp->desc, lt) + 1;
+        name = strndup(s, (size_t)(line->data[k].tok.offset - lt->offset - 1));
+        angled = 1;
+    } else {
+        TokVec rest = { line->data + 1, line->count - 1, 0 }, expanded = {0};
+        expandAll(pp, &rest, &expanded);
+        if (expanded.count == 0 || expanded.data[0].tok.kind != STRING_LITERAL) {
+            ppError(pp, at, "#include expects \"FILENAME\" or <FILENAME>");
+        }
+        int len;
+        const char *s = tokenSpelling(&pp->desc, &expanded.data[0].tok, &len);
+        name = strndup(s, (size_t)len);
+        free(expanded.data);
+    }
+
+    CachedFile *f = NULL;
+    StringBuilder path;
+    sb_init(&path);
+    if (name[0] == '/') {
+        f = lookupPath(name);
+    } else {
+        if (!angled) {
+            const char *from = fr->file->file->name;
+            const char *slash = strrchr(from, '/');
+            if (slash) sb_append(&path, "%.*s/%s", (int)(slash - from), from, name);
+            else sb_append(&path, "%s", name);
+            f = lookupPath(path.buf);
+        }
+        for (int i = 0; !f && i < g_include_dir_count; i++) {
+            path.len = 0;
+            sb_append(&path, "%s/%s", g_include_dirs[i], name);
+            f = lookupPath(path.buf);
+        }
+    }
+    sb_free(&path);
+    if (!f) ppError(pp, at, "'%s' file not found", name);
+    free(name);
+
+    g_stats.includes++;
+    // A skipped header still counts: a change to its guard would change the
+    // unit.
+    addDependency(pp, f);
+    if ((f->guard && isDefined(pp, f->guard)) || (f->once && f->last_tu == pp->tu)) {
+        g_stats.includes_skipped++;
+        return;
+    }
+    pushFrame(pp, f, at);
+}
+
+static void directive(Preprocessor *pp, Frame *fr, const Token *hash) {
+    TokVec line = {0};
+    readLine(fr, &line);
+    if (line.count == 0) {  // null directive
+        if (fr->guard_state != GUARD_OPEN) fr->guard_state = GUARD_NONE;
+        return;
+    }
+    const Token *name = &line.data[0].tok;
+    const char *word = name->kind == IDENTIFIER ? name->atom : NULL;
+    int guard_top = fr->guard_state == GUARD_OPEN && pp->cond_count == fr->guard_depth + 1;
+
+    if (name->kind == IF || word == A_ifdef || word == A_ifndef) {
+        if (fr->guard_state == GUARD_START && word == A_ifndef && line.count == 2) {
+            fr->guard_state = GUARD_OPEN;
+            fr->guard_name = macroName(pp, &line.data[1].tok);
+            fr->guard_depth = pp->cond_count;
+        } else if (fr->guard_state != GUARD_OPEN) {
+            fr->guard_state = GUARD_NONE;
+        }
+        int value = 0;
+        if (isActive(pp)) {
+            if (name->kind == IF) {
+                value = evalCondition(pp, &line);
+            } else {
+                const char *macro = line.count >= 2 ? macroName(pp, &line.data[1].tok) : NULL;
+                if (!macro) ppError(pp, name, "macro names must be identifiers");
+                value = isDefined(pp, macro) == (word == A_ifdef);
+            }
+        }
+        pushCond(pp, value, hash);
+    } else if (word == A_elif || name->kind == ELSE) {
+        if (pp->cond_count <= fr->cond_base) ppError(pp, name, "#%s without #if", word ? "elif" : "else");
+        Cond *c = &pp->conds[pp->cond_count - 1];
+        if (c->seen_else) ppError(pp, name, "#%s after #else", word ? "elif" : "else");
+        if (guard_top) fr->guard_state = GUARD_NONE;
+        if (name->kind == ELSE) c->seen_else = 1;
+        if (c->taken) {
+            c->active = 0;
+        } else {
+            c->active = name->kind == ELSE || evalCondition(pp, &line);
+            c->taken = c->active;
+        }
+    } else if (word == A_endif) {
+        if (pp->cond_count <= fr->cond_base) ppError(pp, name, "#endif without #if");
+        pp->cond_count--;
+        if (guard_top) fr->guard_state = GUARD_CLOSED;
+    } else {
+        if (fr->guard_state != GUARD_OPEN) fr->guard_state = GUARD_NONE;
+        if (!isActive(pp)) {
+            // Other directives in skipped groups are not even checked.
+        } else if (word == A_define) {
+            defineMacro(pp, &line);
+        } else if (word == A_undef) {
+            const char *macro = line.count >= 2 ? macroName(pp, &line.data[1].tok) : NULL;
+            if (!macro) ppError(pp, name, "macro names must be identifiers");
+            Macro *m = symtab_get(&pp->macros, macro);
+            if (m) {
+                if (line.data[1].tok.kind != IDENTIFIER) pp->keyword_macros--;
+                freeMacro(m);
+                symtab_put(&pp->macros, macro, NULL);
+            }
+        } else if (word == A_include) {
+            include(pp, fr, &line);
+        } else if (word == A_pragma) {
+            if (line.count >= 2 && line.data[1].tok.kind == IDENTIFIER && line.data[1].tok.atom == A_once) {
+                fr->file->once = 1;
+            }
+            // Other pragmas are ignored.
+        } else if (word == A_error || word == A_warning) {
+            const Token *first = line.count > 1 ? &line.data[1].tok : name;
+            const Token *last = &line.data[line.count - 1].tok;
+            const char *text = tokenText(&pp->desc, first);
+            int len = line.count > 1 ? last->offset + last->len - first->offset : 0;
+            if (word == A_error) ppError(pp, name, "#error %.*s", len, text);
+            int l, col;
+            tokenPosition(&pp->desc, name, &l, &col);
+            fprintf(stderr, "%s:%d:%d: warning: #warning %.*s\n",
+                    tokenFileName(&pp->desc, name), l, col, len, text);
+        } else if (word != A_line) {
+            ppError(pp, name, "invalid preprocessing directive");
+        }
+    }
+    free(line.data);
+}
+
+// ---- Public interface ----
+
+Preprocessor *ppOpen(const char *path, int threads) {
+    initAtoms();
+    CachedFile *f;
+    if (strcmp(path, "-") == 0) {
+        f = loadFile(intern_cstr(path), path);  // read once, replayed after
+    } else {
+        char resolved[PATH_MAX];
+        if (!realpath(path, resolved)) {
+            perror(path);
+            return NULL;
+        }
+        f = loadFile(intern_cstr(resolved), path);
+    }
+    if (!f) return NULL;
+    Preprocessor *pp = calloc(1, sizeof(Preprocessor));
+    pp->desc.map = &g_map;
+    pp->tu = ++g_tu_count;
+    pp->threads = threads;
+    pp->frames = malloc(sizeof(Frame) * MAX_INCLUDE_DEPTH);
+    pp->in.from_file = 1;
+    addDependency(pp, f);
+    pushFrame(pp, f, NULL);
+    return pp;
+}
+
+void ppClose(Preprocessor *pp) {
+    if (!pp) return;
+    while (pp->depth > 0) popFrame(pp);
+    for (int i = 0; i < pp->macros.cap; i++) {
+        if (pp->macros.slots[i].value) freeMacro(pp->macros.slots[i].value);
+    }
+    symtab_free(&pp->macros);
+    while (pp->hides) {
+        HideChunk *prev = pp->hides->prev;
+        free(pp->hides);
+        pp->hides = prev;
+    }
+    free(pp->in.stack.data);
+    free(pp->conds);
+    free(pp->frames);
+    free(pp->deps);
+    free(pp->desc.line_starts);
+    free(pp);
+}
+
+void ppNext(Preprocessor *pp, Token *out) {
+    PPToken t;
+    expandNext(pp, &pp->in, &t);
+    *out = t.tok;
+}
+
+TokenStream *ppStream(Preprocessor *pp) {
+    return &pp->desc;
+}
+
+static void pull(void *ctx, Token *out) {
+    ppNext(ctx, out);
+}
+
+void ppReaderInit(TokenReader *r, Preprocessor *pp) {
+    tokenReaderInitPull(r, &pp->desc, pull, pp);
+}
+
+int ppDependencyCount(Preprocessor *pp) {
+    return pp->dep_count;
+}
+
+const char *ppDependency(Preprocessor *pp, int i, const char **text, size_t *size) {
+    CachedFile *f = pp->deps[i];
+    if (text) *text = f->buf.data;
+    if (size) *size = f->buf.size;
+    return f->key;
+}
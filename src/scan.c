@@ -0,0 +1,223 @@
+#include "scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// ---- scalar ----------------------------------------------------------------
+
+static const char *blanksScalar(const char *p) {
+    for (;; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c != ' ' && (c < '\t' || c > '\r')) return p;
+    }
+}
+
+static const char *lineEndScalar(const char *p) {
+    while (*p && *p != '\n') p++;
+    return p;
+}
+
+static const char *blockCommentScalar(const char *p) {
+    for (; *p; p++) {
+        if (p[0] == '*' && p[1] == '/') return p + 2;
+    }
+    return p;
+}
+
+#ifdef SCAN_X86
+
+// The vector scanners use aligned loads only. An aligned block never crosses
+// a page boundary, so reading the whole block that holds the terminating NUL
+// (or bytes just before p) cannot fault. Bits for bytes before p are masked
+// off with `valid`.
+
+// ---- SSE2 ------------------------------------------------------------------
+
+static inline uint32_t blankMaskSSE2(__m128i v) {
+    // c == ' ' || (unsigned)(c - '\t') <= '\r' - '\t'
+    __m128i off = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i ctl = _mm_cmpeq_epi8(_mm_min_epu8(off, _mm_set1_epi8('\r' - '\t')), off);
+    __m128i sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    return (uint32_t)_mm_movemask_epi8(_mm_or_si128(ctl, sp));
+}
+
+static inline uint32_t byteMaskSSE2(__m128i v, char c) {
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static const char *blanksSSE2(const char *p) {
+    const char *block = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    uint32_t valid = 0xFFFFu << (p - block);
+    for (;;) {
+        __m128i v = _mm_load_si128((const __m128i *)block);
+        uint32_t stop = ~blankMaskSSE2(v) & valid;
+        if (stop) return block + __builtin_ctz(stop);
+        block += 16;
+        valid = 0xFFFFu;
+    }
+}
+
+static const char *lineEndSSE2(const char *p) {
+    const char *block = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    uint32_t valid = 0xFFFFu << (p - block);
+    for (;;) {
+        __m128i v = _mm_load_si128((const __m128i *)block);
+        uint32_t stop = (byteMaskSSE2(v, '\n') | byteMaskSSE2(v, '\0')) & valid;
+        if (stop) return block + __builtin_ctz(stop);
+        block += 16;
+        valid = 0xFFFFu;
+    }
+}
+
+static const char *blockCommentSSE2(const char *p) {
+    const char *block = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+    uint32_t valid = 0xFFFFu << (p - block);
+    uint32_t carry = 0;  // last byte of the previous block was '*'
+    for (;;) {
+        __m128i v = _mm_load_si128((const __m128i *)block);
+        uint32_t star = byteMaskSSE2(v, '*') & valid;
+        uint32_t close = byteMaskSSE2(v, '/') & ((star << 1) | carry) & valid;
+        uint32_t nul = byteMaskSSE2(v, '\0') & valid;
+        uint32_t stop = close | nul;
+        if (stop) {
+            int i = __builtin_ctz(stop);
+            return block + i + ((close >> i) & 1);
+        }
+        carry = (star >> 15) & 1;
+        block += 16;
+        valid = 0xFFFFu;
+    }
+}
+
+// ---- AVX2 ------------------------------------------------------------------
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 uint32_t blankMaskAVX2(__m256i v) {
+    __m256i off = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(off, _mm256_set1_epi8('\r' - '\t')), off);
+    __m256i sp = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(ctl, sp));
+}
+
+static inline AVX2 uint32_t byteMaskAVX2(__m256i v, char c) {
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+
+static AVX2 const char *blanksAVX2(const char *p) {
+    const char *block = (const char *)((uintptr_t)p & ~(uintptr_t)31);
+    uint32_t valid = 0xFFFFFFFFu << (p - block);
+    for (;;) {
+        __m256i v = _mm256_load_si256((const __m256i *)block);
+        uint32_t stop = ~blankMaskAVX2(v) & valid;
+        if (stop) return block + __builtin_ctz(stop);
+        block += 32;
+        valid = 0xFFFFFFFFu;
+    }
+}
+
+static AVX2 const char *lineEndAVX2(const char *p) {
+    const char *block = (const char *)((uintptr_t)p & ~(uintptr_t)31);
+    uint32_t valid = 0xFFFFFFFFu << (p - block);
+    for (;;) {
+        __m256i v = _mm256_load_si256((const __m256i *)block);
+        uint32_t stop = (byteMaskAVX2(v, '\n') | byteMaskAVX2(v, '\0')) & valid;
+        if (stop) return block + __builtin_ctz(stop);
+        block += 32;
+        valid = 0xFFFFFFFFu;
+    }
+}
+
+static AVX2 const char *blockCommentAVX2(const char *p) {
+    const char *block = (const char *)((uintptr_t)p & ~(uintptr_t)31);
+    uint32_t valid = 0xFFFFFFFFu << (p - block);
+    uint32_t carry = 0;
+    for (;;) {
+        __m256i v = _mm256_load_si256((const __m256i *)block);
+        uint32_t star = byteMaskAVX2(v, '*') & valid;
+        uint32_t close = byteMaskAVX2(v, '/') & ((star << 1) | carry) & valid;
+        uint32_t nul = byteMaskAVX2(v, '\0') & valid;
+        uint32_t stop = close | nul;
+        if (stop) {
+            int i = __builtin_ctz(stop);
+            return block + i + ((close >> i) & 1);
+        }
+        carry = star >> 31;
+        block += 32;
+        valid = 0xFFFFFFFFu;
+    }
+}
+
+#undef AVX2
+
+#endif // SCAN_X86
+
+// ---- dispatch --------------------------------------------------------------
+
+typedef struct {
+    const char *name;
+    const char *(*blanks)(const char *);
+    const char *(*line_end)(const char *);
+    const char *(*block_comment)(const char *);
+} ScanImpl;
+
+static const ScanImpl impls[] = {
+#ifdef SCAN_X86
+    { "avx2", blanksAVX2, lineEndAVX2, blockCommentAVX2 },
+    { "sse2", blanksSSE2, lineEndSSE2, blockCommentSSE2 },
+#endif
+    { "scalar", blanksScalar, lineEndScalar, blockCommentScalar },
+};
+
+static const ScanImpl *active = NULL;
+
+static int supported(const ScanImpl *impl) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (strcmp(impl->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(impl->name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+    (void)impl;
+    return 1;
+}
+
+static const ScanImpl *impl(void) {
+    if (!active) {
+        // impls[] is ordered best first and always ends with the scalar one.
+        size_t i = 0;
+        while (!supported(&impls[i])) i++;
+        active = &impls[i];
+    }
+    return active;
+}
+
+const char *scanBlanks(const char *p) {
+    return impl()->blanks(p);
+}
+
+const char *scanLineEnd(const char *p) {
+    return impl()->line_end(p);
+}
+
+const char *scanBlockComment(const char *p) {
+    return impl()->block_comment(p);
+}
+
+const char *scanImplName(void) {
+    return impl()->name;
+}
+
+int scanSetImpl(const char *name) {
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (strcmp(impls[i].name, name) == 0 && supported(&impls[i])) {
+            active = &impls[i];
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include "symtab.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Atoms are distinct pointers, so a multiplicative hash of the address
+// spreads them well; the high bits are the best mixed.
+static unsigned slot_of(const char *name, int cap) {
+    uint64_t h = (uint64_t)(uintptr_t)name * 0x9E3779B97F4A7C15ull;
+    return (unsigned)(h >> 32) & (unsigned)(cap - 1);
+}
+
+void *symtab_get(const SymTab *t, const char *name) {
+    if (t->count == 0) return NULL;
+    unsigned mask = (unsigned)t->cap - 1;
+    for (unsigned i = slot_of(name, t->cap); t->slots[i].name; i = (i + 1) & mask) {
+        if (t->slots[i].name == name) return t->slots[i].value;
+    }
+    return NULL;
+}
+
+static void grow(SymTab *t) {
+    SymSlot *old = t->slots;
+    int old_cap = t->cap;
+    t->cap = old_cap ? old_cap * 2 : 64;
+    t->slots = calloc((size_t)t->cap, sizeof(SymSlot));
+    unsigned mask = (unsigned)t->cap - 1;
+    for (int i = 0; i < old_cap; i++) {
+        if (!old[i].name) continue;
+        unsigned k = slot_of(old[i].name, t->cap);
+        while (t->slots[k].name) k = (k + 1) & mask;
+        t->slots[k] = old[i];
+    }
+    free(old);
+}
+
+void symtab_put(SymTab *t, const char *name, void *value) {
+    if ((t->count + 1) * 2 > t->cap) grow(t);
+    unsigned mask = (unsigned)t->cap - 1;
+    unsigned i = slot_of(name, t->cap);
+    while (t->slots[i].name && t->slots[i].name != name) i = (i + 1) & mask;
+    if (!t->slots[i].name) {
+        t->slots[i].name = name;
+        t->count++;
+    }
+    t->slots[i].value = value;
+}
+
+void symtab_clear(SymTab *t) {
+    if (t->slots) memset(t->slots, 0, sizeof(SymSlot) * (size_t)t->cap);
+    t->count = 0;
+}
+
+void symtab_free(SymTab *t) {
+    free(t->slots);
+    memset(t, 0, sizeof(*t));
+}
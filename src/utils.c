@@ -5,20 +5,29 @@
 #ifdef _WIN32
 #include <direct.h>
 #else
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #endif
 
+static int streamSource(FILE *fp, const char *name, SourceBuffer *out);
+
 char *readSampleInput(const char *filePath) {
+    SourceBuffer src;
+    if (strcmp(filePath, "-") == 0)
+        return streamSource(stdin, "<stdin>", &src) == 0 ? (char *)src.data : NULL;
     FILE *file = fopen(filePath, "rb");
     if (!file) {
         perror("Failed to open file");
         return NULL;
     }
     if (fseek(file, 0, SEEK_END) != 0) {
-        perror("Failed to seek file");
+        // Pipes and character devices cannot seek; read them in chunks.
+        int rc = streamSource(file, filePath, &src);
         fclose(file);
-        return NULL;
+        return rc == 0 ? (char *)src.data : NULL;
     }
     long fileSize = ftell(file);
     if (fileSize < 0) {
@@ -46,6 +55,138 @@ char *readSampleInput(const char *filePath) {
     return buffer;
 }
 
+#define STREAM_CHUNK (64 * 1024)
+
+// Reads fp to EOF in fixed-size chunks; works for pipes and terminals.
+static int streamSource(FILE *fp, const char *name, SourceBuffer *out) {
+    size_t cap = STREAM_CHUNK, len = 0;
+    char *buf = malloc(cap + 1);
+    if (!buf) {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+    for (;;) {
+        if (cap - len < STREAM_CHUNK) {
+            cap *= 2;
+            char *grown = realloc(buf, cap + 1);
+            if (!grown) {
+                perror("Failed to allocate memory");
+                free(buf);
+                return -1;
+            }
+            buf = grown;
+        }
+        size_t n = fread(buf + len, 1, cap - len, fp);
+        len += n;
+        if (n == 0) break;
+    }
+    if (ferror(fp)) {
+        fprintf(stderr, "Failed to read %s\n", name);
+        free(buf);
+        return -1;
+    }
+    buf[len] = '\0';
+    out->data = buf;
+    out->size = len;
+    out->kind = SOURCE_HEAP;
+    out->map_size = 0;
+    return 0;
+}
+
+#ifndef _WIN32
+// Maps a regular file read-only. The kernel zero-fills the tail of the last
+// page, which provides the NUL sentinel unless the size is an exact multiple
+// of the page size. In that case an extra anonymous zero page is reserved
+// first and the file is mapped over the front of it.
+static int mapSource(int fd, size_t size, SourceBuffer *out) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t map_size = (size + page) & ~(page - 1);  // always >= size + 1
+    char *base = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return -1;
+    if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, map_size);
+        return -1;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+    out->data = base;
+    out->size = size;
+    out->kind = SOURCE_MMAP;
+    out->map_size = map_size;
+    return 0;
+}
+#endif
+
+int openSource(const char *path, SourceBuffer *out) {
+    if (strcmp(path, "-") == 0) return streamSource(stdin, "<stdin>", out);
+#ifdef _WIN32
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror("Failed to open file");
+        return -1;
+    }
+    int rc = streamSource(fp, path, out);
+    fclose(fp);
+    return rc;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open file");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            close(fd);
+            out->data = "";
+            out->size = 0;
+            out->kind = SOURCE_STATIC;
+            out->map_size = 0;
+            return 0;
+        }
+        if (mapSource(fd, (size_t)st.st_size, out) == 0) {
+            close(fd);
+            return 0;
+        }
+        // Fall through to streaming if the file system refuses mmap.
+    }
+    FILE *fp = fdopen(fd, "rb");
+    if (!fp) {
+        perror("Failed to open file");
+        close(fd);
+        return -1;
+    }
+    int rc = streamSource(fp, path, out);
+    fclose(fp);
+    return rc;
+#endif
+}
+
+void closeSource(SourceBuffer *src) {
+    switch (src->kind) {
+    case SOURCE_HEAP:
+        free((char *)src->data);
+        break;
+    case SOURCE_MMAP:
+#ifndef _WIN32
+        munmap((void *)src->data, src->map_size);
+#endif
+        break;
+    case SOURCE_STATIC:
+        break;
+    }
+    src->data = NULL;
+    src->size = 0;
+}
+
+uint64_t hash64(uint64_t h, const void *data, size_t size) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
 static void ensure_outputs_dir(void) {
 #ifdef _WIN32
     _mkdir("tests\\outputs");
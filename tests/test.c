@@ -1,11 +1,19 @@
 #include "unity.h"
 #include "../inc/lexer.h"
+#include "../inc/scan.h"
+#include "../inc/intern.h"
 #include "../inc/parser.h"
+#include "../inc/preproc.h"
 #include "../inc/codegen.h"
+#include "../inc/ir.h"
+#include "../inc/astcache.h"
 #include "../inc/utils.h"
 
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 void setUp(void) {}
 void tearDown(void) {}
@@ -14,11 +22,8 @@ void test_codegen_from_simpleFunc(void) {
     char *input = readSampleInput("tests/inputs/simpleFunc.c");
     TEST_ASSERT_NOT_NULL(input);
 
-    Token *tokens = lexer(input);
-    free(input);
-
-    Token *cur = tokens;
-    ASTNode *root = parse_program(&cur);
+    TokenStream tokens = lexer(input);
+    ASTNode *root = parse_program(&tokens);
 
     print_ast(root, 0);
 
@@ -26,10 +31,1116 @@ void test_codegen_from_simpleFunc(void) {
 
     saveOutput("tests/outputs/simpleFunc_gen.masm", output);
     free(output);
+    freeTokenStream(&tokens);
+    free(input);
+}
+
+void test_lexer_longest_match_and_keywords(void) {
+    char input[] = "integer if a->b >>= != x<<2 'q' \"s\"";
+    TokenKind expected[] = {
+        IDENTIFIER, IF, IDENTIFIER, ARROW, IDENTIFIER, RSH, ASSIGN, NEQ,
+        IDENTIFIER, LSH, NUMBER, CHAR_LITERAL, STRING_LITERAL, EOT
+    };
+    TokenStream ts = lexer(input);
+    TEST_ASSERT_EQUAL_INT(sizeof(expected) / sizeof(expected[0]), ts.count);
+    for (int i = 0; i < ts.count; i++) {
+        TEST_ASSERT_EQUAL_STRING(tokenkind2str(expected[i]), tokenkind2str(ts.data[i].kind));
+    }
+    freeTokenStream(&ts);
+}
+
+void test_lexer_decodes_numeric_literals(void) {
+    TokenStream ts = lexer("42 0x1Fu 017 0b101 10ul 7LL 3.25 .5f 1e3 09 0x 1abc 5lul");
+    const struct { unsigned long long ival; int flags; } ints[] = {
+        {42, 0}, {31, NUM_UNSIGNED}, {15, 0}, {5, 0},
+        {10, NUM_UNSIGNED | NUM_LONG}, {7, NUM_LONGLONG},
+    };
+    for (int i = 0; i < 6; i++) {
+        TEST_ASSERT_EQUAL_STRING("NUMBER", tokenkind2str(ts.data[i].kind));
+        TEST_ASSERT_EQUAL_INT(ints[i].flags, ts.data[i].num_flags);
+        TEST_ASSERT_TRUE(ints[i].ival == ts.data[i].ival);
+    }
+    TEST_ASSERT_EQUAL_INT(NUM_FLOAT, ts.data[6].num_flags);
+    TEST_ASSERT_TRUE(ts.data[6].fval == 3.25);
+    TEST_ASSERT_EQUAL_INT(NUM_FLOAT | NUM_FLOAT32, ts.data[7].num_flags);
+    TEST_ASSERT_TRUE(ts.data[7].fval == 0.5);
+    TEST_ASSERT_TRUE(ts.data[8].fval == 1000.0);
+    for (int i = 9; i < 13; i++) {
+        TEST_ASSERT_TRUE(ts.data[i].num_flags & NUM_INVALID);  // one token each
+    }
+    TEST_ASSERT_EQUAL_STRING("EOT", tokenkind2str(ts.data[13].kind));
+    freeTokenStream(&ts);
+}
+
+void test_lexer_tokens_are_source_slices(void) {
+    // A 390-byte string literal: longer than any fixed token buffer.
+    char input[512];
+    strcpy(input, "s = \"");
+    memset(input + 5, 'x', 389);
+    strcpy(input + 394, "y\";'\\n'");
+
+    TokenStream ts = lexer(input);
+    TEST_ASSERT_EQUAL_INT(6, ts.count);
+    TEST_ASSERT_EQUAL_INT(4, ts.data[2].offset);
+    TEST_ASSERT_EQUAL_INT(392, ts.data[2].len);
+
+    int len;
+    const char *text = tokenSpelling(&ts, &ts.data[2], &len);
+    TEST_ASSERT_EQUAL_INT(390, len);
+    TEST_ASSERT_EQUAL_PTR(input + 5, text);
+    TEST_ASSERT_EQUAL_CHAR('y', text[len - 1]);
+
+    char *value = tokenStrdup(&ts, &ts.data[4]);
+    TEST_ASSERT_EQUAL_STRING("\n", value);
+    free(value);
+    freeTokenStream(&ts);
+}
+
+void test_lexer_scanners_agree_on_positions(void) {
+    // Comment bodies and blank runs wider than a vector block, a "*/" split
+    // across blocks by a run of stars, and a "/*/" that does not close.
+    char input[256];
+    strcpy(input, "a /* ");
+    memset(input + 5, '*', 40);
+    strcpy(input + 45, "\n\n*/ b\n");
+    memset(input + 52, ' ', 37);
+    strcpy(input + 89, "c // x\n\t d /*/ x */ e");
+
+    const int expected[][2] = { {1, 1}, {3, 4}, {4, 38}, {5, 3}, {5, 14} };
+    const char *impls[] = { "scalar", "sse2", "avx2" };
+    const char *saved = scanImplName();
+    for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (!scanSetImpl(impls[i])) continue;  // not supported on this CPU
+        TokenStream ts = lexer(input);
+        TEST_ASSERT_EQUAL_INT(6, ts.count);
+        for (int k = 0; k < 5; k++) {
+            int line, col;
+            tokenPosition(&ts, &ts.data[k], &line, &col);
+            TEST_ASSERT_EQUAL_STRING("IDENTIFIER", tokenkind2str(ts.data[k].kind));
+            TEST_ASSERT_EQUAL_INT(expected[k][0], line);
+            TEST_ASSERT_EQUAL_INT(expected[k][1], col);
+        }
+        freeTokenStream(&ts);
+    }
+    scanSetImpl(saved);
+}
+
+void test_token_positions_from_line_index(void) {
+    const char *input = "int a;\r\n  \"x\ny\" b\n\n\tc";
+    TokenStream ts = lexer(input);
+    TEST_ASSERT_NULL(ts.line_starts);  // nothing is indexed until asked
+
+    const int expected[][2] = { {1, 1}, {1, 5}, {1, 6}, {2, 3}, {3, 4}, {5, 2}, {5, 3} };
+    TEST_ASSERT_EQUAL_INT(7, ts.count);
+    for (int i = 0; i < ts.count; i++) {
+        int line, col;
+        tokenPosition(&ts, &ts.data[i], &line, &col);
+        TEST_ASSERT_EQUAL_INT(expected[i][0], line);
+        TEST_ASSERT_EQUAL_INT(expected[i][1], col);
+    }
+
+    int len;
+    const char *text = tokenLine(&ts, &ts.data[1], &len);
+    TEST_ASSERT_EQUAL_INT(6, len);  // without the \r\n
+    TEST_ASSERT_EQUAL_PTR(input, text);
+    text = tokenLine(&ts, &ts.data[4], &len);  // "b", after the string's newline
+    TEST_ASSERT_EQUAL_PTR(input + 13, text);
+    TEST_ASSERT_EQUAL_INT(4, len);
+    freeTokenStream(&ts);
+}
+
+void test_token_reader_pulls_same_tokens_as_lexer(void) {
+    const char *input = "int main() { /* c */ return f(0x10, 'a', \"s\"); }";
+    TokenStream ts = lexer(input);
+    TokenReader r;
+    tokenReaderInit(&r, input, strlen(input));
+
+    TEST_ASSERT_NULL(prevToken(&r, 1));
+    TEST_ASSERT_EQUAL_INT(ts.data[3].offset, peekToken(&r, 3)->offset);
+    for (int i = 0; i < ts.count; i++) {
+        Token *tok = nextToken(&r);
+        TEST_ASSERT_EQUAL_INT(ts.data[i].kind, tok->kind);
+        TEST_ASSERT_EQUAL_INT(ts.data[i].offset, tok->offset);
+        TEST_ASSERT_EQUAL_INT(ts.data[i].len, tok->len);
+        TEST_ASSERT_TRUE(ts.data[i].ival == tok->ival);  // atom or value
+        if (i >= 1 && i < ts.count - 1) {
+            TEST_ASSERT_EQUAL_INT(ts.data[i].offset, prevToken(&r, 1)->offset);
+            TEST_ASSERT_EQUAL_INT(ts.data[i - 1].offset, prevToken(&r, 2)->offset);
+        }
+    }
+    // EOT is never consumed and lookahead past it stays EOT.
+    TEST_ASSERT_EQUAL_STRING("EOT", tokenkind2str(nextToken(&r)->kind));
+    TEST_ASSERT_EQUAL_STRING("EOT", tokenkind2str(peekToken(&r, TOKEN_LOOKAHEAD - 1)->kind));
+    tokenReaderFree(&r);
+    freeTokenStream(&ts);
+}
+
+void test_lexer_parallel_matches_serial(void) {
+    // Every unit has a block comment spanning lines and a string holding
+    // comment and quote characters, so chunk splits land near both. About
+    // 1.3 MB in all, enough for four chunks.
+    const char unit[] = "x1 = y / 2; /* a\n * b \"\n */ s = \"//\\\"\"; c = '\\'';\n\t\n";
+    size_t unit_len = sizeof(unit) - 1, units = 24 * 1024;
+    char *input = malloc(unit_len * units + 1);
+    for (size_t i = 0; i < units; i++) memcpy(input + i * unit_len, unit, unit_len);
+    input[unit_len * units] = '\0';
+
+    TokenStream serial = lexer(input);
+    TokenStream parallel = lexerParallel(input, unit_len * units, 4);
+    TEST_ASSERT_EQUAL_INT(serial.count, parallel.count);
+    for (int i = 0; i < serial.count; i++) {
+        const Token *a = &serial.data[i], *b = &parallel.data[i];
+        TEST_ASSERT_EQUAL_INT(a->kind, b->kind);
+        TEST_ASSERT_EQUAL_INT(a->offset, b->offset);
+        TEST_ASSERT_EQUAL_INT(a->len, b->len);
+        TEST_ASSERT_EQUAL_PTR(a->atom, b->atom);
+    }
+    freeTokenStream(&serial);
+    freeTokenStream(&parallel);
+    free(input);
+}
+
+void test_intern_returns_one_pointer_per_spelling(void) {
+    char a[] = "counter", b[] = "counter_x";
+    const char *atom = intern(a, 7);
+    TEST_ASSERT_EQUAL_PTR(atom, intern(b, 7));
+    TEST_ASSERT_EQUAL_PTR(atom, intern_cstr("counter"));
+    TEST_ASSERT_TRUE(atom != intern_cstr(b));
+    TEST_ASSERT_EQUAL_PTR(ATOM_CHAR, intern_cstr("char"));
+    TEST_ASSERT_EQUAL_PTR(ATOM_EMPTY, intern("", 0));
+
+    // Identifier tokens carry the same atom, so the parser and codegen can
+    // compare names by pointer.
+    TokenStream ts = lexer("counter = counter_x + counter;");
+    TEST_ASSERT_EQUAL_PTR(atom, ts.data[0].atom);
+    TEST_ASSERT_EQUAL_PTR(atom, ts.data[4].atom);
+    TEST_ASSERT_NULL(ts.data[1].atom);
+    freeTokenStream(&ts);
+}
+
+void test_open_source_page_sized_file_has_sentinel(void) {
+    // A file that ends exactly on a page boundary gets no zero-filled tail
+    // from the kernel, so the sentinel must come from the reserved page.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char path[] = "/tmp/mycc_srcXXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    char *text = malloc(page);
+    memset(text, ' ', page);
+    memcpy(text, "int x;", 6);
+    TEST_ASSERT_EQUAL_INT((int)page, (int)write(fd, text, page));
+    close(fd);
+
+    SourceBuffer src;
+    TEST_ASSERT_EQUAL_INT(0, openSource(path, &src));
+    TEST_ASSERT_EQUAL_INT(SOURCE_MMAP, src.kind);
+    TEST_ASSERT_EQUAL_INT((int)page, (int)src.size);
+    TEST_ASSERT_EQUAL_MEMORY(text, src.data, page);
+    TEST_ASSERT_EQUAL_CHAR('\0', src.data[page]);
+
+    TokenStream ts = lexer(src.data);
+    TEST_ASSERT_EQUAL_INT(4, ts.count);
+    freeTokenStream(&ts);
+    closeSource(&src);
+    unlink(path);
+    free(text);
+}
+
+void test_parser_child_lists_come_from_arena(void) {
+    // Enough statements to span several scratch-stack growths and arena
+    // chunks, with a nested block and a call list in between.
+    char *input = malloc(64 * 1024);
+    size_t len = (size_t)sprintf(input, "int f(int a, int b, int c) {\n");
+    for (int i = 0; i < 1000; i++) len += (size_t)sprintf(input + len, "a = a + %d;\n", i);
+    len += (size_t)sprintf(input + len, "{ b = g(a, b, c, 4); c = 1; }\nreturn a;\n}\n");
+
+    TokenStream tokens = lexer(input);
+    ASTNode *root = parse_program(&tokens);
+    TEST_ASSERT_EQUAL_INT(1, root->block.count);
+    ASTNode *fn = root->block.stmts[0];
+    TEST_ASSERT_EQUAL_INT(3, fn->fundef.param_count);
+    ASTNode *body = fn->fundef.body;
+    TEST_ASSERT_EQUAL_INT(1002, body->block.count);
+    TEST_ASSERT_EQUAL_INT(AST_NUMBER, body->block.stmts[999]->expr_stmt.expr->assign.right->binary.right->type);
+    TEST_ASSERT_EQUAL_UINT64(999, body->block.stmts[999]->expr_stmt.expr->assign.right->binary.right->number.ival);
+    ASTNode *inner = body->block.stmts[1000];
+    TEST_ASSERT_EQUAL_INT(2, inner->block.count);
+    TEST_ASSERT_EQUAL_INT(4, inner->block.stmts[0]->expr_stmt.expr->assign.right->call.arg_count);
+    TEST_ASSERT_EQUAL_INT(AST_RETURN, body->block.stmts[1001]->type);
+
+    TEST_ASSERT_TRUE(parser_arena()->allocs > 1000);
+    free_ast(root);
+    TEST_ASSERT_EQUAL_INT(0, (int)parser_arena()->allocs);
+    freeTokenStream(&tokens);
+    free(input);
+}
+
+void test_parser_registries_find_every_declaration(void) {
+    // Thousands of typedefs, each used as a type after it, and as many
+    // functions; the registries must answer for every one of them.
+    char *input = malloc(256 * 1024);
+    size_t len = 0;
+    for (int i = 0; i < 3000; i++)
+        len += (size_t)sprintf(input + len, "typedef int T%d;\nT%d f%d(T%d x) { return x; }\n", i, i, i, i);
+    len += (size_t)sprintf(input + len, "struct P { int x; int y; };\ntypedef struct Q { int a; } QT;\n");
+
+    TokenStream tokens = lexer(input);
+    ASTNode *root = parse_program(&tokens);
+    TEST_ASSERT_EQUAL_INT(6002, root->block.count);
+    TEST_ASSERT_TRUE(is_user_typename(intern_cstr("T2999")));
+    TEST_ASSERT_FALSE(is_user_typename(intern_cstr("f17")));
+    TEST_ASSERT_EQUAL_PTR(root->block.stmts[2 * 1234 + 1], find_function(intern_cstr("f1234")));
+    TEST_ASSERT_NULL(find_function(intern_cstr("T5")));
+    TEST_ASSERT_EQUAL_INT(2, find_structdef(intern_cstr("P"))->member_count);
+    TEST_ASSERT_EQUAL_PTR(find_structdef(intern_cstr("Q")), find_structdef(intern_cstr("QT")));
+    TEST_ASSERT_NULL(find_structdef(intern_cstr("T0")));
+    free_ast(root);
+    freeTokenStream(&tokens);
+    free(input);
+}
+
+void test_parser_binds_operators_by_precedence(void) {
+    TokenStream tokens = lexer(
+        "int f(int a, int b, int c) {\n"
+        "    return a < b << c == a + b * c ? a = b = c : a - b - c ? a : b;\n"
+        "}\n");
+    ASTNode *root = parse_program(&tokens);
+    ASTNode *e = root->block.stmts[0]->fundef.body->block.stmts[0]->ret.expr;
+
+    TEST_ASSERT_EQUAL_INT(AST_TERNARY, e->type);
+    ASTNode *cond = e->ternary.cond;  // (a < (b << c)) == (a + (b * c))
+    TEST_ASSERT_EQUAL_INT(EQ, cond->binary.op);
+    TEST_ASSERT_EQUAL_INT(LT, cond->binary.left->binary.op);
+    TEST_ASSERT_EQUAL_INT(LSH, cond->binary.left->binary.right->binary.op);
+    TEST_ASSERT_EQUAL_INT(ASTARISK, cond->binary.right->binary.right->binary.op);
+    // = and ?: group to the right, - to the left.
+    TEST_ASSERT_EQUAL_INT(AST_ASSIGN, e->ternary.then_expr->assign.right->type);
+    ASTNode *rest = e->ternary.else_expr;
+    TEST_ASSERT_EQUAL_INT(AST_TERNARY, rest->type);
+    TEST_ASSERT_EQUAL_INT(SUB, rest->ternary.cond->binary.op);
+    TEST_ASSERT_EQUAL_INT(SUB, rest->ternary.cond->binary.left->binary.op);
+    free_ast(root);
+    freeTokenStream(&tokens);
+}
+
+void test_parser_recovers_and_reports_every_error(void) {
+    const char *src =
+        "int f(int a) {\n"
+        "    int x = a +;\n"
+        "    x = 3;\n"
+        "    return x\n"
+        "}\n"
+        "int g(int b {\n"
+        "    return b;\n"
+        "}\n"
+        "int h(int c) {\n"
+        "    if (c > ) { c = 1; }\n"
+        "    return c * 2;\n"
+        "}\n"
+        "int main() { return h(1); }\n";
+    static const int lines[] = { 2, 5, 6, 10 };
+
+    TokenStream tokens = lexer(src);
+    ASTNode *root = parse_program(&tokens);
+    TEST_ASSERT_EQUAL_INT(4, parser_error_count());
+    for (int i = 0; i < 4; i++) TEST_ASSERT_EQUAL_INT(lines[i], parser_errors()[i].line);
+    // Everything around the errors still parsed.
+    TEST_ASSERT_EQUAL_INT(3, root->block.count);
+    ASTNode *h = find_function(intern_cstr("h"));
+    TEST_ASSERT_NOT_NULL(h);
+    TEST_ASSERT_EQUAL_INT(1, h->fundef.body->block.count);  // the broken if is dropped
+    TEST_ASSERT_EQUAL_INT(AST_RETURN, h->fundef.body->block.stmts[0]->type);
+    TEST_ASSERT_NOT_NULL(find_function(intern_cstr("main")));
+    free_ast(root);
+    freeTokenStream(&tokens);
+
+    parser_set_max_errors(2);
+    tokens = lexer(src);
+    root = parse_program(&tokens);
+    TEST_ASSERT_EQUAL_INT(2, parser_error_count());
+    parser_set_max_errors(20);
+    free_ast(root);
+    freeTokenStream(&tokens);
+}
+
+static void write_file(const char *path, const char *text) {
+    FILE *f = fopen(path, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    fputs(text, f);
+    fclose(f);
+}
+
+// Spells out a translation unit's expanded tokens, separated by spaces.
+static void preprocess_to(const char *path, char *out, size_t cap) {
+    Preprocessor *pp = ppOpen(path, 1);
+    TEST_ASSERT_NOT_NULL(pp);
+    size_t used = 0;
+    out[0] = '\0';
+    for (;;) {
+        Token tok;
+        ppNext(pp, &tok);
+        if (tok.kind == EOT) break;
+        used += (size_t)snprintf(out + used, cap - used, "%s%.*s", used ? " " : "",
+                                 tok.len, tokenText(ppStream(pp), &tok));
+    }
+    ppClose(pp);
+}
+
+void test_flat_ast_mirrors_the_tree(void) {
+    const char *src =
+        "int add(int a, int b) { return a + b * 2; }\n"
+        "int main() { int x = 40; if (x > 1) { x = add(x, 1); } return x; }\n";
+    TokenStream tokens = lexer(src);
+    ASTNode *root = parse_program(&tokens);
+    FlatAST flat;
+    flat_build(&flat, root);
+
+    int count;
+    const NodeRef *top = flat_list(&flat, flat.root, &count);
+    TEST_ASSERT_EQUAL_INT(2, count);
+    TEST_ASSERT_EQUAL_INT(AST_FUNDEF, flat_kind(&flat, top[0]));
+    TEST_ASSERT_EQUAL_STRING("add", flat_name(&flat, top[0]));
+    int params;
+    const NodeRef *p = flat_list(&flat, top[0], &params);
+    TEST_ASSERT_EQUAL_INT(2, params);
+    TEST_ASSERT_EQUAL_STRING("b", flat_name(&flat, p[1]));
+    // Atoms keep the interned pointers.
+    TEST_ASSERT_EQUAL_PTR(intern_cstr("add"), flat_name(&flat, top[0]));
+
+    int stmts;
+    const NodeRef *body = flat_list(&flat, flat_body(&flat, top[0]), &stmts);
+    NodeRef sum = flat_expr(&flat, body[0]);
+    TEST_ASSERT_EQUAL_INT(ADD, flat_op(&flat, sum));
+    NodeRef product = flat_right(&flat, sum);
+    TEST_ASSERT_EQUAL_INT(ASTARISK, flat_op(&flat, product));
+    TEST_ASSERT_EQUAL_UINT64(2, flat_number_ival(&flat, flat_right(&flat, product)));
+
+    const NodeRef *main_body = flat_list(&flat, flat_body(&flat, top[1]), &stmts);
+    TEST_ASSERT_EQUAL_INT(3, stmts);
+    TEST_ASSERT_EQUAL_STRING("x", flat_name(&flat, main_body[0]));
+    TEST_ASSERT_EQUAL_UINT64(40, flat_number_ival(&flat, flat_var_init(&flat, main_body[0])));
+    TEST_ASSERT_EQUAL_INT(AST_IF, flat_kind(&flat, main_body[1]));
+    TEST_ASSERT_EQUAL_INT(0, flat_else(&flat, main_body[1]));
+
+    char *from_flat = codegen_flat(&flat);
+    char *from_tree = codegen(root);
+    TEST_ASSERT_EQUAL_STRING(from_tree, from_flat);
+    free(from_flat);
+    free(from_tree);
+    flat_free(&flat);
+    free_ast(root);
+    freeTokenStream(&tokens);
+}
+
+void test_parse_session_reparses_only_edited_functions(void) {
+    const char *v1 =
+        "typedef int num;\n"
+        "int a(int x) { return x + 1; }\n"
+        "int b(int x) { return x + 2; }\n"
+        "int c(int x) { num y = x; return y; }\n";
+    const char *v2 =
+        "typedef int num;\n"
+        "int a(int x) { return x + 1; }\n"
+        "int b(int x) { return x * 2 + 7; }\n"
+        "int c(int x) { num y = x; return y; }\n";
+    ParseSession *s = parse_session_new();
+    ASTNode *root = parse_session_update(s, v1, strlen(v1));
+    TEST_ASSERT_TRUE(parse_session_stats(s).full);
+    ASTNode *a = root->block.stmts[1], *b = root->block.stmts[2], *c = root->block.stmts[3];
+
+    root = parse_session_update(s, v2, strlen(v2));
+    ParseSessionStats st = parse_session_stats(s);
+    TEST_ASSERT_FALSE(st.full);
+    TEST_ASSERT_EQUAL_INT(1, st.parsed);
+    TEST_ASSERT_EQUAL_INT(3, st.reused);
+    TEST_ASSERT_TRUE(st.bytes_lexed < strlen(v2) / 2);
+    TEST_ASSERT_EQUAL_INT(4, root->block.count);
+    TEST_ASSERT_EQUAL_PTR(a, root->block.stmts[1]);
+    TEST_ASSERT_EQUAL_PTR(c, root->block.stmts[3]);
+    TEST_ASSERT_TRUE(b != root->block.stmts[2]);
+    TEST_ASSERT_EQUAL_PTR(root->block.stmts[2], find_function(intern_cstr("b")));
+    TEST_ASSERT_EQUAL_PTR(c, find_function(intern_cstr("c")));
+    TEST_ASSERT_TRUE(is_user_typename(intern_cstr("num")));
+
+    // The same as parsing the edited text afresh.
+    char *incremental = codegen(root);
+    TokenStream tokens = lexer(v2);
+    char *fresh = codegen(parse_program(&tokens));
+    TEST_ASSERT_EQUAL_STRING(fresh, incremental);
+    free(incremental);
+    free(fresh);
+    freeTokenStream(&tokens);
+
+    // Editing a typedef can change how everything after it parses.
+    char v3[256];
+    snprintf(v3, sizeof(v3), "typedef char%s", v2 + strlen("typedef int"));
+    root = parse_session_update(s, v3, strlen(v3));
+    TEST_ASSERT_TRUE(parse_session_stats(s).full);
+    TEST_ASSERT_EQUAL_INT(0, parser_error_count());
+    parse_session_free(s);
+    free_ast(root);
+}
+
+// The frame offset the nth address of local `name` in masm is taken at.
+static int frame_offset(const char *masm, const char *name, int nth) {
+    char marker[64];
+    snprintf(marker, sizeof(marker), " ; %s\n", name);
+    const char *at = masm;
+    for (int i = 0; i <= nth; i++) {
+        at = strstr(at, marker);
+        TEST_ASSERT_NOT_NULL(at);
+        at += strlen(marker);
+    }
+    at -= strlen(marker);
+    while (at > masm && at[-1] != ' ') at--;
+    return atoi(at);
+}
+
+// The IR of src's functions as lowered, before legalizing.
+static char *lower_to_ir(const char *src) {
+    TokenStream tokens = lexer(src);
+    ASTNode *root = parse_program(&tokens);
+    FlatAST flat;
+    flat_build(&flat, root);
+    char *ir = NULL;
+    free(codegen_flat_with_ir(&flat, &ir));
+    flat_free(&flat);
+    free_ast(root);
+    freeTokenStream(&tokens);
+    TEST_ASSERT_NOT_NULL(ir);
+    return ir;
+}
+
+void test_codegen_binds_scoped_locals_to_their_own_slots(void) {
+    char src[4096];
+    int len = snprintf(src, sizeof(src),
+        "int f(int a, int b, int c, int d) {\n"
+        "  int x = 1;\n"
+        "  { int x = 2; a = x; bump(&x); }\n"
+        "  b = x;\n"
+        "  bump(&x);\n");
+    for (int i = 0; i < 40; i++) len += snprintf(src + len, sizeof(src) - len, "  int v%d = %d;\n", i, i);
+    snprintf(src + len, sizeof(src) - len, "  while (a) { int w = d; a = w; bump(&w); }\n  return v39 + b;\n}\n");
+    TokenStream tokens = lexer(src);
+    ASTNode *root = parse_program(&tokens);
+    char *masm = codegen(root);
+
+    // Only what has its address taken needs a slot: x, the inner x and w.
+    TEST_ASSERT_NOT_NULL(strstr(masm, "addis sp, -12\n"));
+    // x = 1, x = 2, a = x, bump(&x), b = x, bump(&x).
+    TEST_ASSERT_EQUAL_INT(-4, frame_offset(masm, "x", 0));
+    TEST_ASSERT_EQUAL_INT(-8, frame_offset(masm, "x", 1));
+    TEST_ASSERT_EQUAL_INT(-8, frame_offset(masm, "x", 2));
+    TEST_ASSERT_EQUAL_INT(-8, frame_offset(masm, "x", 3));
+    TEST_ASSERT_EQUAL_INT(-4, frame_offset(masm, "x", 4));
+    TEST_ASSERT_EQUAL_INT(-4, frame_offset(masm, "x", 5));
+    TEST_ASSERT_EQUAL_INT(-12, frame_offset(masm, "w", 0));
+    // d is loaded from the caller's frame once; a lives in a register.
+    TEST_ASSERT_EQUAL_INT(8, frame_offset(masm, "d", 0));
+    TEST_ASSERT_NULL(strstr(strstr(masm, " ; d\n") + 1, " ; d\n"));
+    TEST_ASSERT_NULL(strstr(masm, " ; a\n"));
+    TEST_ASSERT_NULL(strstr(masm, "movi  r3, w"));
+    free(masm);
+    free_ast(root);
+    freeTokenStream(&tokens);
+}
+
+void test_codegen_reads_annotated_expression_types(void) {
+    char src[8192];
+    int len = snprintf(src, sizeof(src),
+        "int f(char *s) {\n"
+        "  int a[3][2];\n"
+        "  char c;\n"
+        "  int x = sizeof(a);\n"
+        "  x = sizeof(*(a + 1));\n"
+        "  x = sizeof(c);\n"
+        "  return *(s");
+    // A long pointer chain: each + is typed from its operands once.
+    for (int i = 0; i < 500; i++) len += snprintf(src + len, sizeof(src) - len, " + 1");
+    snprintf(src + len, sizeof(src) - len, ");\n}\n");
+    char *ir = lower_to_ir(src);
+
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = 24\n"));
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = 8\n"));
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = 1\n"));
+    // s + 1 + ... + 1 is still a char *, so the dereference loads a byte.
+    TEST_ASSERT_NOT_NULL(strstr(ir, ", 500\n"));
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = loadb v"));
+    free(ir);
+}
+
+void test_codegen_types_have_no_depth_limits(void) {
+    char src[4096];
+    int len = snprintf(src, sizeof(src), "typedef char t0;\n");
+    for (int i = 1; i < 12; i++) len += snprintf(src + len, sizeof(src) - len, "typedef t%d t%d;\n", i - 1, i);
+    snprintf(src + len, sizeof(src) - len,
+        "int f() {\n"
+        "  char g[2][2][2][2][2][2][2][2][2];\n"
+        "  t11 *q;\n"
+        "  int x = sizeof(g);\n"
+        "  x = sizeof(*(g + 1));\n"
+        "  return *(q + 2);\n"
+        "}\n");
+    char *ir = lower_to_ir(src);
+
+    // All nine dimensions count.
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = 512\n"));
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = 256\n"));
+    // t11 is char twelve typedefs down: q steps and loads by the byte.
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = add v1, 2\n"));
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = loadb v"));
+    free(ir);
+}
+
+void test_codegen_packs_struct_members(void) {
+    const char *src =
+        "typedef struct { char a; char b; char c; } Flags;\n"
+        "typedef struct { char tag; Flags f; int v; } Rec;\n"
+        "int f() {\n"
+        "  Flags fl[8];\n"
+        "  Rec rs[4];\n"
+        "  int x = sizeof(fl);\n"
+        "  x = sizeof(rs);\n"
+        "  rs[2].f.c = 1;\n"
+        "  return rs[3].v;\n"
+        "}\n";
+    char *ir = lower_to_ir(src);
+
+    // Flags is three bytes; Rec pads tag and f out to v's alignment.
+    TEST_ASSERT_NOT_NULL(strstr(ir, "  slot 0 fl 24\n  slot 1 rs 32\n"));
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = 24\n"));
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = 32\n"));
+    // Constant indexes and member offsets fold into the address.
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = &rs + 19\n  storeb "));
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = &rs + 28\n"));
+    free(ir);
+}
+
+void test_codegen_folds_constant_expressions(void) {
+    const char *src =
+        "typedef struct { char a; int b; } Rec;\n"
+        "int g() { return 1; }\n"
+        "int f() {\n"
+        "  char buf[10];\n"
+        "  int x = 3 * 4 + 1;\n"
+        "  x = 2147483647 + 1;\n"
+        "  x = -7 / 2;\n"
+        "  x = 'A' + sizeof(buf) * 2;\n"
+        "  x = sizeof(Rec) * 100 + sizeof(char) * 10 + sizeof(int*);\n"
+        "  return 0 && g();\n"
+        "}\n";
+    char *ir = lower_to_ir(src);
+
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = 13\n"));
+    TEST_ASSERT_NULL(strstr(ir, " mul "));
+    // int arithmetic wraps and divides toward zero.
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = -2147483648\n"));
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = -3\n"));
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = 85\n"));
+    // Type names are sized from their layout, padding included.
+    TEST_ASSERT_NOT_NULL(strstr(ir, " = 814\n"));
+    // The right side of a decided && is never called.
+    TEST_ASSERT_NULL(strstr(ir, "call"));
+    free(ir);
+}
+
+// The masm of function `label`, up to the next one; the caller frees it.
+static char *function_masm(const char *masm, const char *label) {
+    const char *at = strstr(masm, label);
+    TEST_ASSERT_NOT_NULL(at);
+    const char *next = strstr(at + 1, "\nf_");
+    size_t len = next ? (size_t)(next - at) : strlen(at);
+    char *text = malloc(len + 1);
+    memcpy(text, at, len);
+    text[len] = '\0';
+    return text;
+}
+
+void test_codegen_keeps_locals_in_registers(void) {
+    const char *src =
+        "int sum(int n) {\n"
+        "  int s = 0;\n"
+        "  int i;\n"
+        "  for (i = 0; i < n; i++) s = s + i;\n"
+        "  return s;\n"
+        "}\n"
+        "int keep(int x) {\n"
+        "  int y = x + 1;\n"
+        "  return sum(x) + y;\n"
+        "}\n"
+        "int wide(int a) {\n"
+        "  int b = a + 1; int c = a + 2; int d = a + 3; int e = a + 4; int f = a + 5; int g = a + 6;\n"
+        "  return a + b + c + d + e + f + g;\n"
+        "}\n";
+    TokenStream tokens = lexer(src);
+    ASTNode *root = parse_program(&tokens);
+    char *masm = codegen(root);
+
+    // The loop touches no memory, and n stays where it was passed.
+    char *sum = function_masm(masm, "f_sum:");
+    TEST_ASSERT_NULL(strstr(sum, "load"));
+    TEST_ASSERT_NULL(strstr(sum, "store"));
+    TEST_ASSERT_NULL(strstr(sum, "addis sp"));
+    TEST_ASSERT_NOT_NULL(strstr(sum, "  cmp r2, r5\n"));
+    // y is live across the call, which saves it.
+    char *keep = function_masm(masm, "f_keep:");
+    TEST_ASSERT_NOT_NULL(strstr(keep, "  push r1\n  call f_sum\n"));
+    TEST_ASSERT_NOT_NULL(strstr(keep, "  pop r1\n"));
+    // Seven values live at once: two go to the frame.
+    char *wide = function_masm(masm, "f_wide:");
+    TEST_ASSERT_NOT_NULL(strstr(wide, "  addis sp, -8\n"));
+    free(sum);
+    free(keep);
+    free(wide);
+    free(masm);
+    free_ast(root);
+    freeTokenStream(&tokens);
+}
+
+// A small interpreter for the masm codegen writes, enough to run what these
+// tests compile: returns r1 when __START__ halts. Registers are r0-r15
+// plus sp, bp and lr; only cmp sets the flags, signed.
+#define MASM_MEM (1 << 16)
+
+typedef struct {
+    char op[8];
+    char arg[2][64];
+} MasmInst;
+
+typedef struct {
+    char name[64];
+    uint32_t value;
+} MasmLabel;
+
+static int masm_reg(const char *s) {
+    if (s[0] == 'r' && s[1] >= '0' && s[1] <= '9') return atoi(s + 1);
+    if (!strcmp(s, "sp")) return 16;
+    if (!strcmp(s, "bp")) return 17;
+    if (!strcmp(s, "lr")) return 18;
+    return -1;
+}
+
+static uint32_t masm_value(const uint32_t *regs, const MasmLabel *labels, int label_count, const char *s) {
+    int r = masm_reg(s);
+    if (r >= 0) return regs[r];
+    for (int i = 0; i < label_count; i++)
+        if (!strcmp(labels[i].name, s)) return labels[i].value;
+    return (uint32_t)strtoll(s, NULL, 0);
+}
+
+static char *masm_trim(char *s) {
+    while (*s == ' ' || *s == '\t') s++;
+    char *e = s + strlen(s);
+    while (e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r')) *--e = '\0';
+    return s;
+}
+
+static int32_t run_masm(const char *masm) {
+    static uint8_t mem[MASM_MEM];
+    memset(mem, 0, sizeof(mem));
+    int code_cap = 256, count = 0, label_count = 0, label_cap = 64;
+    MasmInst *code = malloc(sizeof(MasmInst) * code_cap);
+    MasmLabel *labels = malloc(sizeof(MasmLabel) * label_cap);
+    uint32_t data = 0x1000;
+    for (const char *line = masm; *line;) {
+        const char *eol = strchr(line, '\n');
+        size_t len = eol ? (size_t)(eol - line) : strlen(line);
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%.*s", (int)len, line);
+        line += len + (eol != NULL);
+        char *semi = strchr(buf, ';');
+        if (semi) *semi = '\0';
+        char *t = masm_trim(buf);
+        size_t n = strlen(t);
+        if (!n) continue;
+        if (t[n - 1] == ':') {
+            if (label_count == label_cap) labels = realloc(labels, sizeof(MasmLabel) * (label_cap *= 2));
+            t[n - 1] = '\0';
+            snprintf(labels[label_count].name, sizeof(labels[0].name), "%s", t);
+            labels[label_count++].value = (uint32_t)count;
+            continue;
+        }
+        if (!strncmp(t, ".byte", 5)) {
+            // the data label before it names the bytes
+            labels[label_count - 1].value = data;
+            for (char *p = t + 5; *p;) {
+                mem[data++] = (uint8_t)strtol(p, &p, 0);
+                while (*p == ',' || *p == ' ') p++;
+            }
+            data = (data + 3) & ~3u;
+            continue;
+        }
+        if (count == code_cap) code = realloc(code, sizeof(MasmInst) * (code_cap *= 2));
+        MasmInst *in = &code[count++];
+        memset(in, 0, sizeof(*in));
+        char *args = t + strcspn(t, " ");
+        snprintf(in->op, sizeof(in->op), "%.*s", (int)(args - t), t);
+        char *comma = strchr(args, ',');
+        if (comma) {
+            *comma = '\0';
+            snprintf(in->arg[1], sizeof(in->arg[1]), "%s", masm_trim(comma + 1));
+        }
+        snprintf(in->arg[0], sizeof(in->arg[0]), "%s", masm_trim(args));
+    }
+
+    uint32_t regs[19] = {0};
+    regs[16] = MASM_MEM - 16;
+    uint32_t pc = masm_value(regs, labels, label_count, "__START__");
+    int flags = 0;
+    for (long steps = 0;; steps++) {
+        TEST_ASSERT_TRUE_MESSAGE(steps < 10000000, "masm ran too long");
+        TEST_ASSERT_TRUE(pc < (uint32_t)count);
+        const MasmInst *in = &code[pc++];
+        int d = masm_reg(in->arg[0]);
+        uint32_t v = in->arg[1][0] ? masm_value(regs, labels, label_count, in->arg[1]) : 0;
+        uint32_t target = masm_value(regs, labels, label_count, in->arg[0]);
+        const char *op = in->op;
+        if (!strcmp(op, "halt")) break;
+        if (!strcmp(op, "mov") && !strcmp(in->arg[0], "pc")) pc = v;
+        else if (!strcmp(op, "mov") || !strcmp(op, "movi")) regs[d] = v;
+        else if (!strcmp(op, "addis") || !strcmp(op, "add")) regs[d] += v;
+        else if (!strcmp(op, "sub")) regs[d] -= v;
+        else if (!strcmp(op, "and")) regs[d] &= v;
+        else if (!strcmp(op, "or")) regs[d] |= v;
+        else if (!strcmp(op, "xor")) regs[d] ^= v;
+        else if (!strcmp(op, "shl")) regs[d] <<= 1;
+        else if (!strcmp(op, "shr")) regs[d] >>= 1;
+        else if (!strcmp(op, "cmp")) flags = ((int32_t)target > (int32_t)v) - ((int32_t)target < (int32_t)v);
+        else if (!strcmp(op, "jz")) { if (flags == 0) pc = target; }
+        else if (!strcmp(op, "jnz")) { if (flags != 0) pc = target; }
+        else if (!strcmp(op, "jl")) { if (flags < 0) pc = target; }
+        else if (!strcmp(op, "jg")) { if (flags > 0) pc = target; }
+        else if (!strcmp(op, "jmp")) pc = target;
+        else if (!strcmp(op, "call")) { regs[18] = pc; pc = target; }
+        else {
+            uint32_t addr = !strcmp(op, "push") || !strcmp(op, "pop") ? regs[16] : !strncmp(op, "load", 4) ? v : target;
+            if (!strcmp(op, "push")) addr = regs[16] -= 4;
+            TEST_ASSERT_TRUE_MESSAGE(addr <= MASM_MEM - 4, op);
+            if (!strcmp(op, "push") || !strcmp(op, "store")) {
+                uint32_t value = !strcmp(op, "push") ? target : v;
+                memcpy(&mem[addr], &value, 4);
+            } else if (!strcmp(op, "storeb")) {
+                mem[addr] = (uint8_t)v;
+            } else if (!strcmp(op, "loadb")) {
+                regs[d] = mem[addr];
+            } else if (!strcmp(op, "load") || !strcmp(op, "pop")) {
+                memcpy(&regs[d], &mem[addr], 4);
+                if (!strcmp(op, "pop")) regs[16] += 4;
+            } else {
+                TEST_FAIL_MESSAGE(op);
+            }
+        }
+    }
+    free(code);
+    free(labels);
+    return (int32_t)regs[1];
+}
+
+static int32_t compile_and_run(const char *src) {
+    TokenStream tokens = lexer(src);
+    ASTNode *root = parse_program(&tokens);
+    char *masm = codegen(root);
+    int32_t result = run_masm(masm);
+    free(masm);
+    free_ast(root);
+    freeTokenStream(&tokens);
+    return result;
+}
+
+void test_codegen_offsets_leave_promoted_pointers_alone(void) {
+    // p + k and -> after a pointer variable is set: the offset is added
+    // to a copy, never folded into the instruction that set the variable.
+    TEST_ASSERT_EQUAL_INT(13, compile_and_run(
+        "int main() { int arr[3] = {1, 2, 3}; int *p = arr; int *q = p + 2; return *p * 10 + *q; }\n"));
+    TEST_ASSERT_EQUAL_INT(63, compile_and_run(
+        "typedef struct { int x; int y; } V;\n"
+        "int main() {\n"
+        "  V vs[3]; vs[0].y = 3; vs[2].y = 6;\n"
+        "  V *p = vs; int s = p->y; p = p + 2; s = s + p->y * 10;\n"
+        "  return s;\n"
+        "}\n"));
+    TEST_ASSERT_EQUAL_INT(43, compile_and_run(
+        "typedef struct { int a; int b; } S;\n"
+        "int get(S *s) { s++; int x = s->b; return x * 10 + (*s).a; }\n"
+        "int main() { S t[2]; t[1].a = 3; t[1].b = 4; return get(t); }\n"));
+}
+
+void test_codegen_folds_as_the_code_runs(void) {
+    // Each operator once on constants, which fold, and once on variables,
+    // which run: both must give C's answer.
+    static const struct { const char *type, *a, *op, *b; int32_t want; } cases[] = {
+        { "int", "-7", "+", "2", -5 },
+        { "int", "-7", "-", "2", -9 },
+        { "int", "-7", "*", "3", -21 },
+        { "int", "-7", "/", "2", -3 },
+        { "int", "7", "/", "-2", -3 },
+        { "int", "-7", "/", "-2", 3 },
+        { "int", "-2147483647", "/", "1000000000", -2 },
+        { "int", "-7", "%", "2", -1 },
+        { "int", "7", "%", "-2", 1 },
+        { "unsigned int", "4294967295u", "/", "4000000000u", 1 },
+        { "unsigned int", "4294967295u", "%", "4000000000u", 294967295 },
+        { "int", "-7", "&", "12", 8 },
+        { "int", "5", "|", "-8", -3 },
+        { "int", "-1", "^", "5", -6 },
+        { "int", "3", "<<", "4", 48 },
+        { "unsigned int", "4294967295u", ">>", "28u", 15 },
+        { "int", "-7", "==", "-7", 1 },
+        { "int", "-7", "!=", "-7", 0 },
+        { "int", "-7", "<", "2", 1 },
+        { "int", "-7", ">", "2", 0 },
+        { "int", "-7", "<=", "2", 1 },
+        { "int", "-7", ">=", "2", 0 },
+        { "unsigned int", "4294967295u", "<", "1u", 0 },
+        { "unsigned int", "4294967295u", ">", "1u", 1 },
+        { "unsigned int", "4294967295u", "<=", "1u", 0 },
+        { "unsigned int", "4294967295u", ">=", "1u", 1 },
+        { "int", "0", "&&", "5", 0 },
+        { "int", "-7", "||", "0", 1 },
+    };
+    char src[160];
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        snprintf(src, sizeof(src), "int main() { return %s %s %s; }\n", cases[i].a, cases[i].op, cases[i].b);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(cases[i].want, compile_and_run(src), src);
+        snprintf(src, sizeof(src), "int main() { %s a = %s; %s b = %s; return a %s b; }\n",
+                 cases[i].type, cases[i].a, cases[i].type, cases[i].b, cases[i].op);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(cases[i].want, compile_and_run(src), src);
+    }
+}
+
+void test_ir_builds_prints_and_verifies(void) {
+    // int sum(int n) { int s = 0; while (n > 0) { s = s + n; n = n - 1; } return s; }
+    IRFunc f;
+    ir_func_init(&f, "sum", 0);
+    VReg n = ir_param(&f, 0);
+    VReg s = ir_const(&f, 0);
+    int head = ir_new_block(&f), body = ir_new_block(&f), done = ir_new_block(&f);
+    ir_start_block(&f, head);
+    ir_br(&f, IR_GT, n, 0, 0, body, done);
+    ir_start_block(&f, body);
+    ir_copy(&f, s, ir_binop(&f, IR_ADD, s, n));
+    ir_copy(&f, n, ir_binop_imm(&f, IR_SUB, n, 1));
+    ir_jmp(&f, head);
+    ir_start_block(&f, done);
+    ir_ret(&f, s);
+    // Nothing reaches code after a return.
+    ir_ret(&f, n);
+    ir_finish(&f);
+
+    StringBuilder sb;
+    sb_init(&sb);
+    TEST_ASSERT_EQUAL_INT(0, ir_verify(&f, &sb));
+    ir_print(&f, &sb);
+    TEST_ASSERT_EQUAL_STRING(
+        "func f_sum\n"
+        "b0:\n"
+        "  v1 = param 0\n"
+        "  v2 = 0\n"
+        "  jmp b1\n"
+        "b1:  ; preds b0, b2\n"
+        "  br gt v1, 0, b2, b3\n"
+        "b2:  ; preds b1\n"
+        "  v3 = add v2, v1\n"
+        "  v2 = v3\n"
+        "  v4 = sub v1, 1\n"
+        "  v1 = v4\n"
+        "  jmp b1\n"
+        "b3:  ; preds b1\n"
+        "  ret v2\n", sb.buf);
+    ir_func_free(&f);
+
+    // A value defined on only one way into a block.
+    ir_func_init(&f, "half", 0);
+    VReg p = ir_param(&f, 0);
+    VReg v = ir_new_vreg(&f);
+    int then = ir_new_block(&f), join = ir_new_block(&f);
+    ir_br(&f, IR_NE, p, 0, 0, then, join);
+    ir_start_block(&f, then);
+    ir_copy(&f, v, p);
+    ir_start_block(&f, join);
+    ir_ret(&f, v);
+    ir_finish(&f);
+    StringBuilder errors;
+    sb_init(&errors);
+    TEST_ASSERT_EQUAL_INT(1, ir_verify(&f, &errors));
+    TEST_ASSERT_NOT_NULL(strstr(errors.buf, "f_half: b2: 0: v2 is used before it is defined on every path"));
+    ir_func_free(&f);
+    free(errors.buf);
+    free(sb.buf);
+}
+
+void test_parallel_parse_matches_serial(void) {
+    // a's body must not see the typedef that follows it.
+    const char *src =
+        "int a(int num) { num * num; return num; }\n"
+        "typedef int num;\n"
+        "int b(int x) { num y = x; while (y > 0) { y = y - 1; } return y; }\n"
+        "int c(int x) { if (x) { return a(x); } return b(x); }\n"
+        "int main() { return c(3); }\n";
+    TokenStream tokens = lexer(src);
+    char *serial = codegen(parse_program(&tokens));
+    ASTNode *root = parse_program_parallel(&tokens, 3);
+    TEST_ASSERT_EQUAL_INT(0, parser_error_count());
+    TEST_ASSERT_EQUAL_INT(5, root->block.count);
+    TEST_ASSERT_NOT_NULL(root->block.stmts[3]->fundef.body);
+    TEST_ASSERT_EQUAL_PTR(root->block.stmts[2], find_function(intern_cstr("b")));
+    TEST_ASSERT_TRUE(is_user_typename(intern_cstr("num")));
+    char *parallel = codegen(root);
+    TEST_ASSERT_EQUAL_STRING(serial, parallel);
+    free(serial);
+    free(parallel);
+    free_ast(root);
+    freeTokenStream(&tokens);
+
+    // A bad body makes it a serial parse, which reports the error.
+    tokens = lexer("int f() { return 1; }\nint g() { return 2 }\n");
+    free_ast(parse_program_parallel(&tokens, 2));
+    TEST_ASSERT_EQUAL_INT(1, parser_error_count());
+    TEST_ASSERT_EQUAL_INT(2, parser_errors()[0].line);
+    freeTokenStream(&tokens);
+}
+
+static char *compile_through(const char *path, const char *cache_dir) {
+    Preprocessor *pp = ppOpen(path, 1);
+    TEST_ASSERT_NOT_NULL(pp);
+    TokenReader r;
+    ppReaderInit(&r, pp);
+    ASTNode *root = parse_program_reader(&r);
+    tokenReaderFree(&r);
+    FlatAST flat;
+    flat_build(&flat, root);
+    TEST_ASSERT_EQUAL_INT(0, astcache_store(cache_dir, pp, &flat));
+    ppClose(pp);
+    char *out = codegen_flat(&flat);
+    flat_free(&flat);
+    free_ast(root);
+    return out;
+}
+
+void test_ast_cache_round_trips_and_rejects_stale_entries(void) {
+    char dir[] = "/tmp/mycc_cache_XXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    char main_c[64], header[64], cache[64], entry[512];
+    snprintf(main_c, sizeof(main_c), "%s/main.c", dir);
+    snprintf(header, sizeof(header), "%s/k.h", dir);
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    write_file(main_c, "#include \"k.h\"\nint twice(int x) { return x + x; }\n"
+                       "int main() { char *s = \"hi\"; return twice(K); }\n");
+    write_file(header, "#define K 21\n");
+
+    CachedAST hit;
+    TEST_ASSERT_EQUAL_INT(0, astcache_lookup(cache, main_c, &hit));
+    char *parsed = compile_through(main_c, cache);
+    TEST_ASSERT_EQUAL_INT(1, astcache_lookup(cache, main_c, &hit));
+    char *cached = codegen_flat(&hit.ast);
+    TEST_ASSERT_EQUAL_STRING(parsed, cached);
+    // Names come back as atoms.
+    int count;
+    const NodeRef *top = flat_list(&hit.ast, hit.ast.root, &count);
+    TEST_ASSERT_EQUAL_INT(2, count);
+    TEST_ASSERT_EQUAL_PTR(ATOM_MAIN, flat_name(&hit.ast, top[1]));
+    astcache_release(&hit);
+    free(cached);
+
+    // A flipped byte fails the checksum.
+    DIR *d = opendir(cache);
+    struct dirent *e;
+    while ((e = readdir(d)) && e->d_name[0] == '.') {}
+    snprintf(entry, sizeof(entry), "%s/%s", cache, e->d_name);
+    closedir(d);
+    FILE *f = fopen(entry, "r+b");
+    fseek(f, -3, SEEK_END);
+    int c = fgetc(f);
+    fseek(f, -3, SEEK_END);
+    fputc(c ^ 1, f);
+    fclose(f);
+    TEST_ASSERT_EQUAL_INT(0, astcache_lookup(cache, main_c, &hit));
+
+    // So does an entry whose header changed since.
+    free(compile_through(main_c, cache));
+    TEST_ASSERT_EQUAL_INT(1, astcache_lookup(cache, main_c, &hit));
+    astcache_release(&hit);
+    write_file(header, "#define K 22\n");
+    TEST_ASSERT_EQUAL_INT(0, astcache_lookup(cache, main_c, &hit));
+
+    free(parsed);
+    remove(entry);
+    rmdir(cache);
+    remove(main_c);
+    remove(header);
+    rmdir(dir);
+}
+
+void test_preprocessor_expands_macros_and_caches_headers(void) {
+    char dir[] = "/tmp/mycc_ppXXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+    char guarded[64], once[64], main_c[64];
+    snprintf(guarded, sizeof(guarded), "%s/guarded.h", dir);
+    snprintf(once, sizeof(once), "%s/once.h", dir);
+    snprintf(main_c, sizeof(main_c), "%s/main.c", dir);
+    write_file(guarded, "// comment\n#ifndef GUARDED_H\n#define GUARDED_H\n"
+                        "#define SQ(x) ((x) * (x))\nint g;\n#endif\n");
+    write_file(once, "#pragma once\nint o;\n");
+    write_file(main_c, "#include \"guarded.h\"\n#include \"guarded.h\"\n"
+                       "#include \"once.h\"\n#include \"once.h\"\n"
+                       "#define CAT(a, b) a ## b\n#define STR(x) #x\n"
+                       "#if defined(GUARDED_H) && SQ(2) == 4\nint CAT(x, 1) = SQ(1 + 2);\n"
+                       "#elif 1\nbad\n#else\nbad\n#endif\n"
+                       "#ifndef GUARDED_H\nbad\n#endif\nchar *s = STR(a \"b\");\n"
+                       "#define int long\n#define int long\n#undef int\nint y;\n");
+
+    const char *expected = "int g ; int o ; int x1 = ( ( 1 + 2 ) * ( 1 + 2 ) ) ; "
+                           "char * s = \"a \\\"b\\\"\" ; int y ;";
+    char text[256];
+    PPStats before = ppStats();
+    preprocess_to(main_c, text, sizeof(text));
+    TEST_ASSERT_EQUAL_STRING(expected, text);
+    preprocess_to(main_c, text, sizeof(text));
+    TEST_ASSERT_EQUAL_STRING(expected, text);
+
+    // Each file is read once, each header lexed once, and the second include
+    // in each unit is skipped.
+    PPStats after = ppStats();
+    TEST_ASSERT_EQUAL_INT(3, after.files_read - before.files_read);
+    TEST_ASSERT_EQUAL_INT(2, after.files_lexed - before.files_lexed);
+    TEST_ASSERT_EQUAL_INT(8, after.includes - before.includes);
+    TEST_ASSERT_EQUAL_INT(4, after.includes_skipped - before.includes_skipped);
+
+    unlink(guarded);
+    unlink(once);
+    unlink(main_c);
+    rmdir(dir);
 }
 
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test_codegen_from_simpleFunc);
+    RUN_TEST(test_lexer_longest_match_and_keywords);
+    RUN_TEST(test_lexer_decodes_numeric_literals);
+    RUN_TEST(test_lexer_tokens_are_source_slices);
+    RUN_TEST(test_lexer_scanners_agree_on_positions);
+    RUN_TEST(test_token_positions_from_line_index);
+    RUN_TEST(test_token_reader_pulls_same_tokens_as_lexer);
+    RUN_TEST(test_lexer_parallel_matches_serial);
+    RUN_TEST(test_intern_returns_one_pointer_per_spelling);
+    RUN_TEST(test_open_source_page_sized_file_has_sentinel);
+    RUN_TEST(test_preprocessor_expands_macros_and_caches_headers);
+    RUN_TEST(test_parser_child_lists_come_from_arena);
+    RUN_TEST(test_parser_registries_find_every_declaration);
+    RUN_TEST(test_parser_binds_operators_by_precedence);
+    RUN_TEST(test_parser_recovers_and_reports_every_error);
+    RUN_TEST(test_flat_ast_mirrors_the_tree);
+    RUN_TEST(test_ast_cache_round_trips_and_rejects_stale_entries);
+    RUN_TEST(test_parse_session_reparses_only_edited_functions);
+    RUN_TEST(test_parallel_parse_matches_serial);
+    RUN_TEST(test_codegen_binds_scoped_locals_to_their_own_slots);
+    RUN_TEST(test_codegen_reads_annotated_expression_types);
+    RUN_TEST(test_codegen_types_have_no_depth_limits);
+    RUN_TEST(test_codegen_packs_struct_members);
+    RUN_TEST(test_codegen_folds_constant_expressions);
+    RUN_TEST(test_ir_builds_prints_and_verifies);
+    RUN_TEST(test_codegen_keeps_locals_in_registers);
+    RUN_TEST(test_codegen_offsets_leave_promoted_pointers_alone);
+    RUN_TEST(test_codegen_folds_as_the_code_runs);
     return UNITY_END();
 }